@@ -19,10 +19,10 @@ namespace {
 template <typename Stream, typename Data>
 bool SerializeDB(Stream& stream, const Data& data)
 {
-    // Write and commit header, data
+    // Write and commit header, data, hashing them on the way so that data is
+    // serialized only once
     try {
-        CHashWriter hasher(SER_DISK, CLIENT_VERSION);
-        stream << Params().MessageStart() << data;
+        CHashedSourceWriter<Stream> hasher(&stream);
         hasher << Params().MessageStart() << data;
         stream << hasher.GetHash();
     } catch (const std::exception& e) {
@@ -251,7 +251,7 @@ void CAddrMan::Good_(const CService& addr, bool test_before_evict, int64_t nTime
     }
 }
 
-bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimePenalty)
+bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimePenalty, int nUBucket, int nUBucketPos)
 {
     if (!addr.IsRoutable())
         return false;
@@ -300,8 +300,11 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         fNew = true;
     }
 
-    int nUBucket = pinfo->GetNewBucket(nKey, source);
-    int nUBucketPos = pinfo->GetBucketPosition(nKey, true, nUBucket);
+    // The bucket position depends on the port, which may differ from an existing entry's
+    if (nUBucket == -1 || static_cast<const CService&>(*pinfo) != addr) {
+        nUBucket = pinfo->GetNewBucket(nKey, source);
+        nUBucketPos = pinfo->GetBucketPosition(nKey, true, nUBucket);
+    }
     if (vvNew[nUBucket][nUBucketPos] != nId) {
         bool fInsert = vvNew[nUBucket][nUBucketPos] == -1;
         if (!fInsert) {
@@ -250,8 +250,8 @@ protected:
     //! Mark an entry "good", possibly moving it from "new" to "tried".
     void Good_(const CService &addr, bool test_before_evict, int64_t time);
 
-    //! Add an entry to the "new" table.
-    bool Add_(const CAddress &addr, const CNetAddr& source, int64_t nTimePenalty);
+    //! Add an entry to the "new" table, at the given position if it was computed in advance.
+    bool Add_(const CAddress &addr, const CNetAddr& source, int64_t nTimePenalty, int nUBucket = -1, int nUBucketPos = -1);
 
     //! Mark an entry as attempted to connect.
     void Attempt_(const CService &addr, bool fCountFailure, int64_t nTime);
@@ -536,14 +536,34 @@ public:
         return fRet;
     }
 
-    //! Add multiple addresses.
+    //! Add multiple addresses. Their new table positions are hashed before taking the lock.
     bool Add(const std::vector<CAddress> &vAddr, const CNetAddr& source, int64_t nTimePenalty = 0)
     {
+        uint256 nKeyBatch;
+        {
+            LOCK(cs);
+            nKeyBatch = nKey;
+        }
+        std::vector<std::pair<int, int>> vPos;
+        vPos.reserve(vAddr.size());
+        for (const CAddress& addr : vAddr) {
+            CAddrInfo info(addr, source);
+            int nUBucket = info.GetNewBucket(nKeyBatch, source);
+            vPos.emplace_back(nUBucket, info.GetBucketPosition(nKeyBatch, true, nUBucket));
+        }
+
         LOCK(cs);
         int nAdd = 0;
         Check();
-        for (std::vector<CAddress>::const_iterator it = vAddr.begin(); it != vAddr.end(); it++)
-            nAdd += Add_(*it, source, nTimePenalty) ? 1 : 0;
+        // Positions are stale if the key changed (Clear() or a reload) in the meantime
+        bool fKeyChanged = nKey != nKeyBatch;
+        for (size_t i = 0; i < vAddr.size(); i++) {
+            if (fKeyChanged) {
+                nAdd += Add_(vAddr[i], source, nTimePenalty) ? 1 : 0;
+            } else {
+                nAdd += Add_(vAddr[i], source, nTimePenalty, vPos[i].first, vPos[i].second) ? 1 : 0;
+            }
+        }
         Check();
         if (nAdd) {
             LogPrint(BCLog::ADDRMAN, "Added %i addresses from %s: %i tried, %i new\n", nAdd, source.ToString(), nTried, nNew);
@@ -102,5 +102,66 @@ static void BnBExhaustion(benchmark::State& state)
     }
 }
 
+static const int LARGE_POOL_UTXOS = 100000;
+
+// Pool of LARGE_POOL_UTXOS coins of varied value, like a wallet that collects
+// many payouts, and a target that an exact match can be found for
+static CAmount make_large_pool(std::vector<OutputGroup>& utxo_pool)
+{
+    utxo_pool.clear();
+    FastRandomContext rand(true);
+    for (int i = 0; i < LARGE_POOL_UTXOS; ++i) {
+        CMutableTransaction tx;
+        tx.nLockTime = i; // so all transactions get different hashes
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1000 + rand.randrange(100 * COIN);
+        std::unique_ptr<CWalletTx> wtx(new CWalletTx(&testWallet, MakeTransactionRef(std::move(tx))));
+        utxo_pool.emplace_back(COutput(wtx.get(), 0, 6 * 24, true, true, true).GetInputCoin(), 6 * 24, false, 0, 0);
+        wtxn.emplace_back(std::move(wtx));
+    }
+    return 1234 * COIN + 567;
+}
+
+// Branch and Bound on a large pool that is already sorted, as each pass of
+// SelectCoins() sees it
+static void BnBLargePool(benchmark::State& state)
+{
+    std::vector<OutputGroup> utxo_pool;
+    const CAmount target = make_large_pool(utxo_pool);
+    const EffectiveValueIndex index(utxo_pool, CFeeRate(0), CFeeRate(0));
+    const CoinEligibilityFilter filter_standard(0, 0, 0);
+
+    while (state.KeepRunning()) {
+        CoinSet selection;
+        CAmount value_ret = 0;
+        bool success = SelectCoinsBnB(index.GetEligible(filter_standard), target, 100, selection, value_ret, 0);
+        assert(success);
+        assert(value_ret >= target && value_ret <= target + 100);
+    }
+}
+
+// Full wallet coin selection on a large pool, including computing the
+// effective values and sorting the pool
+static void CoinSelectionLargePool(benchmark::State& state)
+{
+    LOCK(testWallet.cs_wallet);
+
+    std::vector<OutputGroup> utxo_pool;
+    const CAmount target = make_large_pool(utxo_pool);
+    const CoinEligibilityFilter filter_standard(0, 0, 0);
+    const CoinSelectionParams coin_selection_params(true, 34, 148, CFeeRate(0), 0);
+
+    while (state.KeepRunning()) {
+        CoinSet selection;
+        CAmount value_ret;
+        bool bnb_used;
+        bool success = testWallet.SelectCoinsMinConf(target, filter_standard, utxo_pool, selection, value_ret, coin_selection_params, bnb_used);
+        assert(success);
+        assert(bnb_used);
+    }
+}
+
 BENCHMARK(CoinSelection, 650);
 BENCHMARK(BnBExhaustion, 650);
+BENCHMARK(BnBLargePool, 250);
+BENCHMARK(CoinSelectionLargePool, 20);
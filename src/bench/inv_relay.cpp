@@ -0,0 +1,63 @@
+// Copyright (c) 2018 The XPChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <policy/policy.h>
+#include <txmempool.h>
+#include <txrelay.h>
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+// Number of transactions queued for announcement to every peer
+static const int QUEUED_TXS = 2000;
+// Transactions announced to a peer per trickle (INVENTORY_BROADCAST_MAX)
+static const int ANNOUNCED_TXS = 35;
+
+static void InvRelay(benchmark::State& state, int nPeers)
+{
+    CTxMemPool pool;
+    std::set<uint256> setToSend;
+    {
+        LOCK(pool.cs);
+        for (int i = 0; i < QUEUED_TXS; i++) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].scriptSig = CScript() << i;
+            tx.vout.resize(1);
+            tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+            tx.vout[0].nValue = 10 * COIN;
+            CTransactionRef ptx = MakeTransactionRef(tx);
+            LockPoints lp;
+            pool.addUnchecked(ptx->GetHash(), CTxMemPoolEntry(ptx, 1000 + (i * 7919) % 10000, 0, 1, false, 4, lp));
+            setToSend.insert(ptx->GetHash());
+        }
+    }
+    std::vector<std::set<uint256>> vPeerQueues(nPeers, setToSend);
+
+    TxRelayOrder order(pool);
+    std::vector<TxRelayOrder::RankedTx> vRanked;
+    auto compare = [](const TxRelayOrder::RankedTx& a, const TxRelayOrder::RankedTx& b) { return b.first < a.first; };
+    while (state.KeepRunning()) {
+        // One broadcast interval: the mempool changed, and every peer trickles once.
+        pool.AddTransactionsUpdated(1);
+        for (std::set<uint256>& queue : vPeerQueues) {
+            order.Rank(queue, vRanked);
+            std::make_heap(vRanked.begin(), vRanked.end(), compare);
+            for (int i = 0; i < ANNOUNCED_TXS && !vRanked.empty(); i++) {
+                std::pop_heap(vRanked.begin(), vRanked.end(), compare);
+                vRanked.pop_back();
+            }
+        }
+    }
+}
+
+static void InvRelay8Peers(benchmark::State& state) { InvRelay(state, 8); }
+static void InvRelay32Peers(benchmark::State& state) { InvRelay(state, 32); }
+static void InvRelay125Peers(benchmark::State& state) { InvRelay(state, 125); }
+
+BENCHMARK(InvRelay8Peers, 430);
+BENCHMARK(InvRelay32Peers, 120);
+BENCHMARK(InvRelay125Peers, 38);
@@ -5,6 +5,7 @@
 #include <bench/bench.h>
 #include <policy/policy.h>
 #include <txmempool.h>
+#include <validation.h>
 
 #include <list>
 #include <vector>
@@ -132,3 +133,45 @@ static void MempoolEviction(benchmark::State& state)
 }
 
 BENCHMARK(MempoolEviction, 41000);
+
+// Build chains of 25 transactions, each spending the previous one, the way
+// ATMP adds them: calculating the ancestors under the default limits first.
+// Then evict them again.
+static void MempoolEvictionChain(benchmark::State& state)
+{
+    const int nChains = 10;
+    const int nChainLength = DEFAULT_ANCESTOR_LIMIT;
+    std::vector<CTransactionRef> chains;
+    for (int i = 0; i < nChains; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << i;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx.vout[0].nValue = 10 * COIN;
+        for (int j = 0; j < nChainLength; j++) {
+            chains.push_back(MakeTransactionRef(tx));
+            tx.vin[0].prevout = COutPoint(chains.back()->GetHash(), 0);
+            tx.vin[0].scriptSig = CScript() << OP_1;
+        }
+    }
+
+    CTxMemPool pool;
+    LOCK(pool.cs);
+    const uint64_t limitAncestorSize = DEFAULT_ANCESTOR_SIZE_LIMIT * 1000;
+    const uint64_t limitDescendantSize = DEFAULT_DESCENDANT_SIZE_LIMIT * 1000;
+    LockPoints lp;
+    while (state.KeepRunning()) {
+        for (const CTransactionRef& tx : chains) {
+            CTxMemPoolEntry entry(tx, 1000, 0, 1, false, 4, lp);
+            CTxMemPool::setEntries setAncestors;
+            std::string errString;
+            bool ok = pool.CalculateMemPoolAncestors(entry, setAncestors, DEFAULT_ANCESTOR_LIMIT, limitAncestorSize, DEFAULT_DESCENDANT_LIMIT, limitDescendantSize, errString);
+            assert(ok);
+            pool.addUnchecked(tx->GetHash(), entry, setAncestors);
+        }
+        pool.TrimToSize(0);
+    }
+}
+
+BENCHMARK(MempoolEvictionChain, 100);
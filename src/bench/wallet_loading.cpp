@@ -0,0 +1,66 @@
+// Copyright (c) 2018 The XPChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <key.h>
+#include <random.h>
+#include <script/standard.h>
+#include <util.h>
+#include <utiltime.h>
+#include <wallet/wallet.h>
+#include <wallet/walletdb.h>
+
+#include <vector>
+
+static const int NUM_WALLET_KEYS = 2000;
+static const int NUM_WALLET_TXS = 50000;
+
+//! Write a wallet with NUM_WALLET_KEYS keys and NUM_WALLET_TXS transactions paying to them.
+static void CreateSyntheticWallet(const fs::path& wallet_path)
+{
+    CWallet wallet("bench", WalletDatabase::Create(wallet_path));
+    bool first_run;
+    wallet.LoadWallet(first_run);
+    WalletBatch batch(wallet.GetDBHandle());
+
+    std::vector<CScript> scripts;
+    for (int i = 0; i < NUM_WALLET_KEYS; ++i) {
+        CKey key;
+        key.MakeNewKey(true);
+        const CPubKey pubkey = key.GetPubKey();
+        batch.WriteKey(pubkey, key.GetPrivKey(), CKeyMetadata(GetTime()));
+        scripts.push_back(GetScriptForDestination(pubkey.GetID()));
+    }
+
+    for (int i = 0; i < NUM_WALLET_TXS; ++i) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vout.emplace_back(COIN, scripts[i % scripts.size()]);
+        tx.vout.emplace_back(2 * COIN, scripts[(i + 1) % scripts.size()]);
+        CWalletTx wtx(&wallet, MakeTransactionRef(std::move(tx)));
+        wtx.nTimeReceived = GetTime();
+        wtx.nOrderPos = i;
+        batch.WriteTx(wtx);
+    }
+}
+
+// Loads a synthetic wallet with many keys and transactions from disk, which
+// is dominated by deserializing and checking the transaction and key records.
+static void WalletLoading(benchmark::State& state)
+{
+    const fs::path wallet_path = GetDataDir() / "wallet_loading";
+    CreateSyntheticWallet(wallet_path);
+
+    while (state.KeepRunning()) {
+        CWallet wallet("bench", WalletDatabase::Create(wallet_path));
+        bool first_run;
+        DBErrors ret = wallet.LoadWallet(first_run);
+        assert(ret == DBErrors::LOAD_OK);
+        LOCK(wallet.cs_wallet);
+        assert(wallet.mapWallet.size() == (size_t)NUM_WALLET_TXS);
+    }
+}
+
+BENCHMARK(WalletLoading, 1);
@@ -15,15 +15,21 @@
 
 #include <unordered_map>
 
-CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block, bool fUseWTXID) :
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block, bool fUseWTXID, bool fPrefillCoinStake) :
         nonce(GetRand(std::numeric_limits<uint64_t>::max())),
-        shorttxids(block.vtx.size() - 1), prefilledtxn(1), header(block) {
+        header(block) {
     FillShortTxIDSelector();
-    //TODO: Use our mempool prior to block acceptance to predictively fill more than just the coinbase
-    prefilledtxn[0] = {0, block.vtx[0]};
-    for (size_t i = 1; i < block.vtx.size(); i++) {
+    //TODO: Use our mempool prior to block acceptance to predictively fill more than just the coinbase (and coinstake)
+    const size_t nPrefilled = (fPrefillCoinStake && block.vtx.size() > 1) ? 2 : 1;
+    shorttxids.resize(block.vtx.size() - nPrefilled);
+    prefilledtxn.resize(nPrefilled);
+    for (size_t i = 0; i < nPrefilled; i++) {
+        // Indexes are differentially encoded, and the prefilled transactions are consecutive
+        prefilledtxn[i] = {0, block.vtx[i]};
+    }
+    for (size_t i = nPrefilled; i < block.vtx.size(); i++) {
         const CTransaction& tx = *block.vtx[i];
-        shorttxids[i - 1] = GetShortID(fUseWTXID ? tx.GetWitnessHash() : tx.GetHash());
+        shorttxids[i - nPrefilled] = GetShortID(fUseWTXID ? tx.GetWitnessHash() : tx.GetHash());
     }
 }
 
@@ -148,7 +148,9 @@ public:
     // Dummy for deserialization
     CBlockHeaderAndShortTxIDs() {}
 
-    CBlockHeaderAndShortTxIDs(const CBlock& block, bool fUseWTXID);
+    // fPrefillCoinStake also prefills vtx[1], for proof-of-stake blocks whose coinstake
+    // can never be in the receiver's mempool
+    CBlockHeaderAndShortTxIDs(const CBlock& block, bool fUseWTXID, bool fPrefillCoinStake = false);
 
     uint64_t GetShortID(const uint256& txhash) const;
 
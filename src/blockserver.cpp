@@ -0,0 +1,129 @@
+// Copyright (c) 2018 The XPChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockserver.h>
+
+#include <chainparams.h>
+#include <netmessagemaker.h>
+#include <primitives/block.h>
+#include <util.h>
+#include <validation.h>
+
+#include <functional>
+
+BlockServer::BlockServer(CConnman* connman, int nThreads) : m_connman(connman), m_stop(false)
+{
+    for (int i = 0; i < nThreads; i++) {
+        m_threads.emplace_back(&TraceThread<std::function<void()> >, "blksrv", std::function<void()>(std::bind(&BlockServer::ThreadServeBlocks, this)));
+    }
+}
+
+BlockServer::~BlockServer()
+{
+    Stop();
+}
+
+bool BlockServer::Serve(CNode* pnode, const CInv& inv, const CDiskBlockPos& pos, bool fProofOfStake, const uint256& hashContinue)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_stop || m_threads.empty()) {
+        return false;
+    }
+    assert(!m_busy.count(pnode->GetId()));
+    m_busy.insert(pnode->GetId());
+    m_queue.push_back(Request{pnode->AddRef(), inv, pos, fProofOfStake, hashContinue});
+    m_cond.notify_one();
+    return true;
+}
+
+bool BlockServer::IsBusy(NodeId nodeid) const
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_busy.count(nodeid);
+}
+
+void BlockServer::Stop()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    for (std::thread& thread : m_threads) {
+        if (thread.joinable()) thread.join();
+    }
+    m_threads.clear();
+
+    std::deque<Request> queue;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        queue.swap(m_queue);
+    }
+    for (const Request& req : queue) {
+        Finish(req);
+    }
+}
+
+void BlockServer::ThreadServeBlocks()
+{
+    while (true) {
+        Request req;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+            if (m_stop) return;
+            req = m_queue.front();
+            m_queue.pop_front();
+        }
+        ServeRequest(req);
+        Finish(req);
+    }
+}
+
+void BlockServer::ServeRequest(const Request& req)
+{
+    CNode* pnode = req.pnode;
+    if (pnode->fDisconnect) return;
+
+    const CChainParams& chainparams = Params();
+    const CNetMsgMaker msgMaker(pnode->GetSendVersion());
+    if (req.inv.type == MSG_WITNESS_BLOCK) {
+        // The network format matches the format on disk, so send the block as it is stored
+        std::vector<uint8_t> block_data;
+        if (!ReadRawBlockFromDisk(block_data, req.pos, chainparams.MessageStart())) {
+            // The block file may have been pruned since the request was queued.
+            // Disconnect rather than leave the peer waiting for its timeout.
+            LogPrint(BCLog::NET, "%s: cannot load block %s from disk, disconnecting peer=%d\n", __func__, req.inv.hash.ToString(), pnode->GetId());
+            pnode->fDisconnect = true;
+            return;
+        }
+        m_connman->PushMessage(pnode, msgMaker.Make(NetMsgType::BLOCK, MakeSpan(block_data)));
+    } else {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, req.pos, chainparams.GetConsensus(), req.fProofOfStake)) {
+            LogPrint(BCLog::NET, "%s: cannot load block %s from disk, disconnecting peer=%d\n", __func__, req.inv.hash.ToString(), pnode->GetId());
+            pnode->fDisconnect = true;
+            return;
+        }
+        m_connman->PushMessage(pnode, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block));
+    }
+
+    // Trigger the peer node to send a getblocks request for the next batch of inventory
+    if (!req.hashContinue.IsNull()) {
+        std::vector<CInv> vInv;
+        vInv.push_back(CInv(MSG_BLOCK, req.hashContinue));
+        m_connman->PushMessage(pnode, msgMaker.Make(NetMsgType::INV, vInv));
+    }
+}
+
+void BlockServer::Finish(const Request& req)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_busy.erase(req.pnode->GetId());
+    }
+    req.pnode->Release();
+    // Let the message handler continue with this peer's requests
+    m_connman->WakeMessageHandler();
+}
@@ -0,0 +1,77 @@
+// Copyright (c) 2018 The XPChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKSERVER_H
+#define BITCOIN_BLOCKSERVER_H
+
+#include <chain.h>
+#include <net.h>
+#include <protocol.h>
+#include <uint256.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+/** Default for -blockservethreads, number of threads serving historical blocks to peers */
+static const int DEFAULT_BLOCK_SERVING_THREADS = 2;
+/** Maximum number of block serving threads */
+static const int MAX_BLOCK_SERVING_THREADS = 8;
+
+/**
+ * Serves getdata requests for blocks from disk on a dedicated pool of threads,
+ * so that a peer syncing from us does not hold up the message handler thread
+ * (and with it every other peer) on block file I/O.
+ *
+ * Each peer has at most one block being served at a time. While it has, the
+ * message handler does not process anything else from that peer, which keeps
+ * responses in request order and bounds the send buffer exactly like serving
+ * the block inline: a block is only taken from the getdata queue while the
+ * peer's send buffer is not full.
+ */
+class BlockServer
+{
+public:
+    BlockServer(CConnman* connman, int nThreads);
+    ~BlockServer();
+
+    /**
+     * Queue the block at pos for sending to pnode. If hashContinue is not null, an
+     * inv for it is sent right after the block. Returns false if the request was
+     * not queued (no threads, or stopped), in which case the caller serves it.
+     */
+    bool Serve(CNode* pnode, const CInv& inv, const CDiskBlockPos& pos, bool fProofOfStake, const uint256& hashContinue);
+
+    /** Whether a block is being served to the given peer. */
+    bool IsBusy(NodeId nodeid) const;
+
+    /** Stop and join all threads, dropping requests that are still queued. */
+    void Stop();
+
+private:
+    struct Request {
+        CNode* pnode;
+        CInv inv;
+        CDiskBlockPos pos;
+        bool fProofOfStake;
+        uint256 hashContinue;
+    };
+
+    void ThreadServeBlocks();
+    void ServeRequest(const Request& req);
+    void Finish(const Request& req);
+
+    CConnman* const m_connman;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<Request> m_queue;
+    std::set<NodeId> m_busy;
+    bool m_stop;
+    std::vector<std::thread> m_threads;
+};
+
+#endif // BITCOIN_BLOCKSERVER_H
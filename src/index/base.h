@@ -69,6 +69,10 @@ protected:
     /// Write update index entries for a newly connected block.
     virtual bool WriteBlock(const CBlock& block, const CBlockIndex* pindex) { return true; }
 
+    /// Whether an empty index starts by writing the genesis block, rather
+    /// than treating it as already indexed and starting at height 1.
+    virtual bool IndexesGenesisBlock() const { return false; }
+
     virtual DB& GetDB() const = 0;
 
     /// Get the name of the index for display in logs.
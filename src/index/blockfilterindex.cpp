@@ -0,0 +1,137 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Copyright (c) 2018 The XPChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <index/blockfilterindex.h>
+#include <util.h>
+#include <validation.h>
+
+/* The index database stores one entry per block, keyed by block hash:
+ *
+ * 'f' + block hash -> (filter hash, filter header, encoded filter)
+ *
+ * Looking up a filter header never needs the active chain: a block's header
+ * commits to its own filter and its parent's header only.
+ */
+constexpr char DB_FILTER = 'f';
+
+std::unique_ptr<BlockFilterIndex> g_blockfilterindex;
+
+namespace {
+
+struct DBVal {
+    uint256 hash;
+    uint256 header;
+    std::vector<unsigned char> filter;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(hash);
+        READWRITE(header);
+        READWRITE(filter);
+    }
+};
+
+} // namespace
+
+/**
+ * Access to the blockfilter database (indexes/blockfilter/<type>/)
+ */
+class BlockFilterIndex::DB : public BaseIndex::DB
+{
+public:
+    explicit DB(const fs::path& path, size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+
+    /// Read the entry of the block with the given hash. Returns false if the block is not indexed.
+    bool ReadFilter(const uint256& block_hash, DBVal& value) const;
+
+    /// Write the entry of the block with the given hash.
+    bool WriteFilter(const uint256& block_hash, const DBVal& value);
+};
+
+BlockFilterIndex::DB::DB(const fs::path& path, size_t n_cache_size, bool f_memory, bool f_wipe) :
+    BaseIndex::DB(path, n_cache_size, f_memory, f_wipe)
+{}
+
+bool BlockFilterIndex::DB::ReadFilter(const uint256& block_hash, DBVal& value) const
+{
+    return Read(std::make_pair(DB_FILTER, block_hash), value);
+}
+
+bool BlockFilterIndex::DB::WriteFilter(const uint256& block_hash, const DBVal& value)
+{
+    return Write(std::make_pair(DB_FILTER, block_hash), value);
+}
+
+BlockFilterIndex::BlockFilterIndex(BlockFilterType filter_type,
+                                   size_t n_cache_size, bool f_memory, bool f_wipe)
+    : m_filter_type(filter_type)
+{
+    const std::string& filter_name = BlockFilterTypeName(filter_type);
+    if (filter_name.empty()) throw std::invalid_argument("unknown filter_type");
+
+    m_name = filter_name + " block filter index";
+    m_db = MakeUnique<BlockFilterIndex::DB>(GetDataDir() / "indexes" / "blockfilter" / filter_name,
+                                            n_cache_size, f_memory, f_wipe);
+}
+
+BlockFilterIndex::~BlockFilterIndex() {}
+
+bool BlockFilterIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    CBlockUndo block_undo;
+    uint256 prev_header;
+
+    if (pindex->nHeight > 0) {
+        if (!UndoReadFromDisk(block_undo, pindex)) {
+            return false;
+        }
+
+        DBVal prev;
+        if (!m_db->ReadFilter(pindex->pprev->GetBlockHash(), prev)) {
+            return error("%s: previous block %s is not indexed", __func__,
+                         pindex->pprev->GetBlockHash().ToString());
+        }
+        prev_header = prev.header;
+    }
+
+    BlockFilter filter(m_filter_type, block, block_undo);
+
+    DBVal value;
+    value.hash = filter.GetHash();
+    value.header = filter.ComputeHeader(prev_header);
+    value.filter = filter.GetEncodedFilter();
+    return m_db->WriteFilter(pindex->GetBlockHash(), value);
+}
+
+BaseIndex::DB& BlockFilterIndex::GetDB() const { return *m_db; }
+
+bool BlockFilterIndex::LookupFilter(const CBlockIndex* block_index, BlockFilter& filter_out) const
+{
+    DBVal value;
+    if (!m_db->ReadFilter(block_index->GetBlockHash(), value)) {
+        return false;
+    }
+
+    try {
+        filter_out = BlockFilter(m_filter_type, block_index->GetBlockHash(), std::move(value.filter));
+    } catch (const std::exception& e) {
+        return error("%s: Failed to decode filter of block %s: %s", __func__,
+                     block_index->GetBlockHash().ToString(), e.what());
+    }
+    return true;
+}
+
+bool BlockFilterIndex::LookupFilterHeader(const CBlockIndex* block_index, uint256& header_out) const
+{
+    DBVal value;
+    if (!m_db->ReadFilter(block_index->GetBlockHash(), value)) {
+        return false;
+    }
+
+    header_out = value.header;
+    return true;
+}
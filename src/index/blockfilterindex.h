@@ -0,0 +1,60 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Copyright (c) 2018 The XPChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEX_BLOCKFILTERINDEX_H
+#define BITCOIN_INDEX_BLOCKFILTERINDEX_H
+
+#include <blockfilter.h>
+#include <chain.h>
+#include <index/base.h>
+
+/**
+ * BlockFilterIndex is used to store and retrieve BIP 158 block filters and
+ * their BIP 157 filter headers. An index is constructed for each supported
+ * filter type with its own database (indexes/blockfilter/<type>/).
+ *
+ * Filters are keyed by block hash, so entries for blocks that were
+ * disconnected stay valid and a reorg only needs the new branch indexed.
+ */
+class BlockFilterIndex final : public BaseIndex
+{
+protected:
+    class DB;
+private:
+    BlockFilterType m_filter_type;
+    std::string m_name;
+    std::unique_ptr<DB> m_db;
+
+protected:
+    bool WriteBlock(const CBlock& block, const CBlockIndex* pindex) override;
+
+    /// The filter header chain starts at the genesis block's filter.
+    bool IndexesGenesisBlock() const override { return true; }
+
+    BaseIndex::DB& GetDB() const override;
+
+    const char* GetName() const override { return m_name.c_str(); }
+
+public:
+    /** Constructs the index, which becomes available to be queried. */
+    explicit BlockFilterIndex(BlockFilterType filter_type,
+                              size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+
+    // Destructor is declared because this class contains a unique_ptr to an incomplete type.
+    virtual ~BlockFilterIndex() override;
+
+    BlockFilterType GetFilterType() const { return m_filter_type; }
+
+    /** Get a single filter by block. */
+    bool LookupFilter(const CBlockIndex* block_index, BlockFilter& filter_out) const;
+
+    /** Get a single filter header by block. */
+    bool LookupFilterHeader(const CBlockIndex* block_index, uint256& header_out) const;
+};
+
+/// The global basic block filter index. May be null.
+extern std::unique_ptr<BlockFilterIndex> g_blockfilterindex;
+
+#endif // BITCOIN_INDEX_BLOCKFILTERINDEX_H
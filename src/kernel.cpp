@@ -41,7 +41,7 @@ bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned
     return CheckStakeKernelHash(nBits, blockFrom.GetBlockTime(), nTxPrevOffset, txOutPrev.nValue, prevout.n, nTimeTx, hashProofOfStake);
 }
 
-bool CheckProofOfStake(const CTransactionRef& tx, unsigned int nBits, uint256& hashProofOfStake, unsigned int nBlockTime)
+bool CheckProofOfStake(const CTransactionRef& tx, unsigned int nBits, uint256& hashProofOfStake, unsigned int nBlockTime, unsigned int flags, bool cacheStore, PrecomputedTransactionData* txdata)
 {
     const CTxIn& txin = tx->vin[0];
 
@@ -61,8 +61,12 @@ bool CheckProofOfStake(const CTransactionRef& tx, unsigned int nBits, uint256& h
     }
 
     // Verify signature
-    PrecomputedTransactionData txdata(*tx);
-    if (!CScriptCheck(txTmp->vout[tx->vin[0].prevout.n], *tx, 0, 0, true, &txdata)()) {
+    std::unique_ptr<PrecomputedTransactionData> txdataOwned;
+    if (!txdata) {
+        txdataOwned = MakeUnique<PrecomputedTransactionData>(*tx);
+        txdata = txdataOwned.get();
+    }
+    if (!CheckCoinStakeScripts(*tx, txTmp->vout[tx->vin[0].prevout.n], flags, cacheStore, *txdata)) {
         return error("%s: VerifySignature failed on coinstake %s\n", __func__, tx->GetHash().ToString());
     }
     // Get transaction index for the previous transaction
@@ -3,6 +3,7 @@
 
 #include <primitives/transaction.h>
 #include <amount.h>
+#include <script/interpreter.h>
 
 class CValidationState;
 class uint256;
@@ -12,5 +13,8 @@ class COutPoint;
 
 bool CheckStakeKernelHash(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTxOut& txOutPrev, const COutPoint& prevout, uint32_t nTimeTx, uint256& hashProofOfStake);
 bool CheckStakeKernelHash(unsigned int nBits, uint32_t nTimeBlockFrom, unsigned int nTxPrevOffset, CAmount nAmount, uint64_t n, uint32_t nTimeTx, uint256& hashProofOfStake);
-bool CheckProofOfStake(const CTransactionRef& tx, unsigned int nBits, uint256& hashProofOfStake, unsigned int nBlockTime);
+/** Check the kernel and the signature of a coinstake. The signature is checked with
+ *  the given script flags, using txdata if provided, and if cacheStore is set the
+ *  result is shared with CheckInputs through the script execution cache. */
+bool CheckProofOfStake(const CTransactionRef& tx, unsigned int nBits, uint256& hashProofOfStake, unsigned int nBlockTime, unsigned int flags = SCRIPT_VERIFY_NONE, bool cacheStore = false, PrecomputedTransactionData* txdata = nullptr);
 #endif // BITCOIN_KERNEL_H
\ No newline at end of file
@@ -47,6 +47,24 @@
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockWeight = 0;
 
+//! Seconds a selection for the next proof-of-stake block is kept while the mempool changes
+static const int64_t NEXT_BLOCK_TXS_MAX_AGE = 30;
+
+/** Transactions selected for the next proof-of-stake block, in block order */
+struct NextBlockTxs
+{
+    uint256 hashPrevBlock;
+    unsigned int nTransactionsUpdated = 0;
+    int64_t nTime = 0;
+    unsigned int nBlockMaxWeight = 0;
+    CFeeRate blockMinFeeRate;
+    bool fIncludeWitness = false;
+    std::vector<uint256> vHash;
+};
+
+static CCriticalSection cs_next_block_txs;
+static NextBlockTxs next_block_txs GUARDED_BY(cs_next_block_txs);
+
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
     int64_t nOldTime = pblock->nTime;
@@ -226,7 +244,9 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
 
     int nPackagesSelected = 0;
     int nDescendantsUpdated = 0;
-    addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+    if (!fPoSHeight || !addNextBlockTxs(pindexPrev)) {
+        addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+    }
 
     int64_t nTime1 = GetTimeMicros();
 
@@ -378,6 +398,98 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     return std::move(pblocktemplate);
 }
 
+bool BlockAssembler::UpdateNextBlockTxs()
+{
+    // Check for a change first, without holding the locks for a selection.
+    // A new tip calls for a new selection at once; a changed mempool only
+    // once the selection has aged, since a kernel hit can take a slightly
+    // stale one.
+    {
+        LOCK(cs_main);
+        const CBlockIndex* pindexPrev = chainActive.Tip();
+        assert(pindexPrev != nullptr);
+        const bool fWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus());
+        const unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+        LOCK(cs_next_block_txs);
+        if (next_block_txs.hashPrevBlock == pindexPrev->GetBlockHash() &&
+                (next_block_txs.nTransactionsUpdated == nTransactionsUpdated || GetTime() - next_block_txs.nTime < NEXT_BLOCK_TXS_MAX_AGE) &&
+                next_block_txs.nBlockMaxWeight == nBlockMaxWeight &&
+                next_block_txs.blockMinFeeRate == blockMinFeeRate &&
+                next_block_txs.fIncludeWitness == fWitness) {
+            return false;
+        }
+    }
+
+    LOCK2(cs_main, mempool.cs);
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    assert(pindexPrev != nullptr);
+
+    resetBlock();
+    fIncludeWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus());
+
+    int64_t nTimeStart = GetTimeMicros();
+
+    pblocktemplate.reset(new CBlockTemplate());
+    pblock = &pblocktemplate->block;
+    nHeight = pindexPrev->nHeight + 1;
+    nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                       ? pindexPrev->GetMedianTimePast()
+                       : GetAdjustedTime();
+
+    int nPackagesSelected = 0;
+    int nDescendantsUpdated = 0;
+    addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+
+    LOCK(cs_next_block_txs);
+    next_block_txs.hashPrevBlock = pindexPrev->GetBlockHash();
+    next_block_txs.nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    next_block_txs.nTime = GetTime();
+    next_block_txs.nBlockMaxWeight = nBlockMaxWeight;
+    next_block_txs.blockMinFeeRate = blockMinFeeRate;
+    next_block_txs.fIncludeWitness = fIncludeWitness;
+    next_block_txs.vHash.clear();
+    for (const CTransactionRef& tx : pblock->vtx) {
+        next_block_txs.vHash.push_back(tx->GetHash());
+    }
+
+    LogPrint(BCLog::BENCH, "UpdateNextBlockTxs() packages: %.2fms (%d packages, %d updated descendants)\n", 0.001 * (GetTimeMicros() - nTimeStart), nPackagesSelected, nDescendantsUpdated);
+    return true;
+}
+
+bool BlockAssembler::addNextBlockTxs(const CBlockIndex* pindexPrev)
+{
+    LOCK(cs_next_block_txs);
+    // A selection made before the mempool last changed leaves out what
+    // arrived since, which is taken for the sake of a fast block. One made
+    // for another tip or other options is of no use.
+    if (next_block_txs.hashPrevBlock != pindexPrev->GetBlockHash() ||
+            next_block_txs.nBlockMaxWeight != nBlockMaxWeight ||
+            next_block_txs.blockMinFeeRate != blockMinFeeRate ||
+            next_block_txs.fIncludeWitness != fIncludeWitness) {
+        return false;
+    }
+
+    // Transactions that left the mempool since the selection are skipped. Their
+    // descendants left with them, but check that every in-mempool parent is in
+    // the block anyway so the block stays valid whatever the reason.
+    for (const uint256& hash : next_block_txs.vHash) {
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end())
+            continue;
+        bool fParentsInBlock = true;
+        for (CTxMemPool::txiter parent : mempool.GetMemPoolParents(it)) {
+            if (!inBlock.count(parent)) {
+                fParentsInBlock = false;
+                break;
+            }
+        }
+        if (fParentsInBlock && TestPackage(it->GetTxSize(), it->GetSigOpCost())) {
+            AddToBlock(it);
+        }
+    }
+    return true;
+}
+
 void BlockAssembler::onlyUnconfirmed(CTxMemPool::setEntries& testSet)
 {
     for (CTxMemPool::setEntries::iterator iit = testSet.begin(); iit != testSet.end(); ) {
@@ -648,7 +760,7 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
 }
 #ifdef ENABLE_WALLET
 
-static unsigned int GetnBits(const CBlockIndex* pIndexLast, Consensus::Params params)
+unsigned int GetnBits(const CBlockIndex* pIndexLast, const Consensus::Params& params)
 {
     assert(pIndexLast);
     assert(pIndexLast->pprev);
@@ -716,6 +828,12 @@ void BitcoinMinter(const std::shared_ptr<CWallet>& wallet)
                 wallet->AvailableCoins(vCoins);
             }
 
+            // Keep the transactions for our next block selected while searching
+            // for a kernel, if there is anything to stake
+            if (!vCoins.empty()) {
+                BlockAssembler(Params()).UpdateNextBlockTxs();
+            }
+
             for (COutput coin : vCoins) {
                 CBlockIndex* pprevIndex;
                 if(!GetPrevBlockIndex(coin, &pprevIndex)){
@@ -166,6 +166,13 @@ public:
     std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet, uint32_t nTime, unsigned int nBits, CTransactionRef txCoinStake, CAmount nFees, CBlockIndex* pIndexLast, bool fMineWitnessTx = true);
     std::unique_ptr<CBlockTemplate> CreateNewBlock(const CScript& scriptPubKeyIn, uint32_t nTime, unsigned int nBits, CTransactionRef txCoinStake, CAmount nFees, CBlockIndex* pindexLast, bool fMineWitnessTx = true);
 
+    /** Select the transactions for the next proof-of-stake block ahead of time, if the
+      * tip changed since the last selection, or the mempool did and the selection is
+      * older than NEXT_BLOCK_TXS_MAX_AGE seconds, and return whether it did. For the
+      * same tip, CreateNewBlock() at a proof-of-stake height takes that selection,
+      * less the transactions that left the mempool, instead of selecting again. */
+    bool UpdateNextBlockTxs();
+
 private:
     // utility functions
     /** Clear the block's state and prepare for assembling a new block */
@@ -178,6 +185,9 @@ private:
       * Increments nPackagesSelected / nDescendantsUpdated with corresponding
       * statistics from the package selection (for logging statistics). */
     void addPackageTxs(int &nPackagesSelected, int &nDescendantsUpdated) EXCLUSIVE_LOCKS_REQUIRED(mempool.cs);
+    /** Add the transactions selected by UpdateNextBlockTxs() that are still in the mempool.
+      * Returns false if there is no selection for this tip and these options. */
+    bool addNextBlockTxs(const CBlockIndex* pindexPrev) EXCLUSIVE_LOCKS_REQUIRED(mempool.cs);
 
     // helper functions for addPackageTxs()
     /** Remove confirmed (inBlock) entries from given set */
@@ -204,6 +214,8 @@ private:
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
 
+/** Return the nBits a proof-of-stake block on top of pIndexLast has to meet. */
+unsigned int GetnBits(const CBlockIndex* pIndexLast, const Consensus::Params& params);
 void MintStake(boost::thread_group& threadGroup, const std::shared_ptr<CWallet>& wallet);
 bool CreateTxSig(const CWallet& wallet, uint32_t nTime, CTransactionRef txCoinStake, const std::vector<std::pair<CScript, CAmount>>& vValues, CScript& script);
 #endif // BITCOIN_MINER_H
@@ -8,6 +8,7 @@
 #include <addrman.h>
 #include <arith_uint256.h>
 #include <blockencodings.h>
+#include <blockserver.h>
 #include <chainparams.h>
 #include <consensus/validation.h>
 #include <hash.h>
@@ -24,6 +25,7 @@
 #include <scheduler.h>
 #include <tinyformat.h>
 #include <txmempool.h>
+#include <txrelay.h>
 #include <ui_interface.h>
 #include <util.h>
 #include <utilmoneystr.h>
@@ -39,6 +41,8 @@
 static constexpr int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
 /** Minimum time between orphan transactions expire time checks in seconds */
 static constexpr int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** Maximum number of transactions kept after paying too little fee, waiting for a child to pay for them */
+static constexpr unsigned int MAX_LOW_FEE_PARENTS = 25;
 /** Headers download timeout expressed in microseconds
  *  Timeout = base + per_header * (expected number of headers) */
 static constexpr int64_t HEADERS_DOWNLOAD_TIMEOUT_BASE = 15 * 60 * 1000000; // 15 minutes
@@ -72,6 +76,7 @@ struct COrphanTx {
 };
 static CCriticalSection g_cs_orphans;
 std::map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(g_cs_orphans);
+std::map<uint256, COrphanTx> mapLowFeeParents GUARDED_BY(g_cs_orphans);
 
 void EraseOrphansFor(NodeId peer);
 
@@ -134,9 +139,13 @@ namespace {
         const CBlockIndex* pindex;                               //!< Optional.
         bool fValidatedHeaders;                                  //!< Whether this block has validated headers at the time of request.
         std::unique_ptr<PartiallyDownloadedBlock> partialBlock;  //!< Optional, used for CMPCTBLOCK downloads
+        int64_t nTimeRequested;                                  //!< When the block was requested (in microseconds).
     };
     std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> > mapBlocksInFlight GUARDED_BY(cs_main);
 
+    /** Current size of the block download window, between BLOCK_DOWNLOAD_WINDOW and MAX_BLOCK_DOWNLOAD_WINDOW. */
+    BlockDownloadWindow blockDownloadWindow GUARDED_BY(cs_main);
+
     /** Stack of nodes which we have set to announce using compact blocks */
     std::list<NodeId> lNodesAnnouncingHeaderAndIDs GUARDED_BY(cs_main);
 
@@ -160,6 +169,9 @@ namespace {
 
     std::atomic<int64_t> nTimeBestReceived(0); // Used only to inform the wallet of when we last received a block
 
+    /** Announcement order of queued transactions, shared by all peers. */
+    TxRelayOrder txRelayOrder GUARDED_BY(cs_main){mempool};
+
     struct IteratorComparator
     {
         template<typename I>
@@ -221,6 +233,10 @@ struct CNodeState {
     int64_t nDownloadingSince;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! Moving average of the time (in microseconds) this peer needs to deliver one requested block, or 0 if unknown.
+    int64_t nBlockDeliveryTime;
+    //! When this peer last delivered a block we requested from it (in microseconds), or 0.
+    int64_t nLastBlockDelivery;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
@@ -288,6 +304,8 @@ struct CNodeState {
         nDownloadingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nBlockDeliveryTime = 0;
+        nLastBlockDelivery = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
         fPreferHeaderAndIDs = false;
@@ -385,7 +403,7 @@ static bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const CBlock
     MarkBlockAsReceived(hash);
 
     std::list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(),
-            {hash, pindex, pindex != nullptr, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : nullptr)});
+            {hash, pindex, pindex != nullptr, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : nullptr), GetTimeMicros()});
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += it->fValidatedHeaders;
     if (state->nBlocksInFlight == 1) {
@@ -401,6 +419,50 @@ static bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const CBlock
     return true;
 }
 
+/** Update the block delivery time estimate of a peer that just delivered a block we requested from it.
+ *  Must be called before MarkBlockAsReceived. */
+static void UpdateBlockDeliveryTime(NodeId nodeid, const uint256& hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main) {
+    std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != nodeid) {
+        return;
+    }
+    CNodeState *state = State(nodeid);
+    assert(state != nullptr);
+    // Only count the time the peer was actually busy with this block: requests queue behind each other.
+    int64_t nNow = GetTimeMicros();
+    int64_t nDelivery = nNow - std::max(itInFlight->second.second->nTimeRequested, state->nLastBlockDelivery);
+    if (nDelivery < 0) nDelivery = 0;
+    if (state->nBlockDeliveryTime == 0) {
+        state->nBlockDeliveryTime = std::max<int64_t>(nDelivery, 1);
+    } else {
+        // Exponential moving average with a weight of 1/8 for the new sample.
+        state->nBlockDeliveryTime = std::max<int64_t>((state->nBlockDeliveryTime * 7 + nDelivery) / 8, 1);
+    }
+    state->nLastBlockDelivery = nNow;
+}
+
+/** Number of blocks we are willing to have in flight from a peer, based on its measured delivery time
+ *  and round trip time: fast peers get a deeper queue, slow peers a shallower one. */
+static int GetBlockDownloadQuota(const CNodeState& state, const CNode* pnode) EXCLUSIVE_LOCKS_REQUIRED(cs_main) {
+    if (state.nBlockDeliveryTime == 0) {
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    }
+    int64_t nPingUsec = pnode->nMinPingUsecTime;
+    if (nPingUsec == std::numeric_limits<int64_t>::max()) {
+        nPingUsec = 0;
+    }
+    int64_t nQuota = (BLOCK_DOWNLOAD_QUEUE_TARGET + nPingUsec) / state.nBlockDeliveryTime;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE, nQuota));
+}
+
+/** Adapt the block download window to how far validation is behind the download. */
+static void UpdateBlockDownloadWindow(const CNodeState& state, bool fStalled, int64_t nNow) EXCLUSIVE_LOCKS_REQUIRED(cs_main) {
+    if (state.pindexLastCommonBlock == nullptr) {
+        return;
+    }
+    blockDownloadWindow.Update(state.pindexLastCommonBlock->nHeight - chainActive.Height(), fStalled, nNow);
+}
+
 /** Check whether the last unknown block a peer advertised is not yet known. */
 static void ProcessBlockAvailability(NodeId nodeid) EXCLUSIVE_LOCKS_REQUIRED(cs_main) {
     CNodeState *state = State(nodeid);
@@ -502,8 +564,9 @@ static bool PeerHasHeader(CNodeState *state, const CBlockIndex *pindex) EXCLUSIV
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const Consensus::Params& consensusParams) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+ *  at most count entries. If the download window is blocked, nodeStaller and pindexStalled are set to
+ *  the peer and the block we are waiting for. */
+static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const CBlockIndex*& pindexStalled, const Consensus::Params& consensusParams) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     if (count == 0)
         return;
@@ -534,12 +597,13 @@ static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vec
 
     std::vector<const CBlockIndex*> vToFetch;
     const CBlockIndex *pindexWalk = state->pindexLastCommonBlock;
-    // Never fetch further than the best block we know the peer has, or more than BLOCK_DOWNLOAD_WINDOW + 1 beyond the last
+    // Never fetch further than the best block we know the peer has, or more than nBlockDownloadWindow + 1 beyond the last
     // linked block we have in common with this peer. The +1 is so we can detect stalling, namely if we would be able to
     // download that next block if the window were 1 larger.
-    int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
+    int nWindowEnd = state->pindexLastCommonBlock->nHeight + blockDownloadWindow.Size();
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    const CBlockIndex* pindexWaitingFor = nullptr;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -575,6 +639,7 @@ static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vec
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStalled = pindexWaitingFor;
                     }
                     return;
                 }
@@ -585,6 +650,7 @@ static void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vec
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -655,6 +721,26 @@ void PeerLogicValidation::FinalizeNode(NodeId nodeid, bool& fUpdateConnectionTim
     LogPrint(BCLog::NET, "Cleared nodestate for peer=%d\n", nodeid);
 }
 
+BlockDownloadWindow::BlockDownloadWindow() : m_size(BLOCK_DOWNLOAD_WINDOW) {}
+
+void BlockDownloadWindow::Update(int nBacklog, bool fStalled, int64_t nNow)
+{
+    if (nNow - m_last_update < BLOCK_STALLING_TIMEOUT * 1000000) {
+        return;
+    }
+    if (nBacklog > m_size / 2) {
+        // Validation (or disk) falls behind the download; shrink back.
+        if (m_size == (int)BLOCK_DOWNLOAD_WINDOW) return;
+        m_size = std::max<int>(m_size / 2, BLOCK_DOWNLOAD_WINDOW);
+    } else if (fStalled && m_size < (int)MAX_BLOCK_DOWNLOAD_WINDOW) {
+        m_size = std::min<int>(m_size * 2, MAX_BLOCK_DOWNLOAD_WINDOW);
+        LogPrint(BCLog::NET, "Block download window widened to %d\n", m_size);
+    } else {
+        return;
+    }
+    m_last_update = nNow;
+}
+
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     LOCK(cs_main);
     CNodeState *state = State(nodeid);
@@ -737,10 +823,54 @@ int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans)
     return 1;
 }
 
+/**
+ * Keep a transaction rejected only for paying less than the minimum relay or
+ * mempool fee, so that a child arriving later can pay for it in
+ * AcceptOrphanParentsPackage. Transactions spending outputs already spent in
+ * the mempool are not kept, as a package does not replace anything.
+ */
+bool AddLowFeeParentTx(const CTransactionRef& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans)
+{
+    const uint256& hash = tx->GetHash();
+    if (mapLowFeeParents.count(hash) || GetTransactionWeight(*tx) > MAX_STANDARD_TX_WEIGHT)
+        return false;
+    for (const CTxIn& txin : tx->vin) {
+        if (mempool.isSpent(txin.prevout))
+            return false;
+    }
+
+    int64_t nNow = GetTime();
+    for (auto it = mapLowFeeParents.begin(); it != mapLowFeeParents.end();) {
+        if (it->second.nTimeExpire <= nNow) {
+            it = mapLowFeeParents.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (mapLowFeeParents.size() >= MAX_LOW_FEE_PARENTS) {
+        // Make room by evicting the oldest entry
+        mapLowFeeParents.erase(std::min_element(mapLowFeeParents.begin(), mapLowFeeParents.end(),
+            [](const std::pair<const uint256, COrphanTx>& a, const std::pair<const uint256, COrphanTx>& b) {
+                return a.second.nTimeExpire < b.second.nTimeExpire;
+            }));
+    }
+    mapLowFeeParents.emplace(hash, COrphanTx{tx, peer, nNow + ORPHAN_TX_EXPIRE_TIME});
+
+    LogPrint(BCLog::MEMPOOL, "stored low fee tx %s (mapsz %u)\n", hash.ToString(), mapLowFeeParents.size());
+    return true;
+}
+
 void EraseOrphansFor(NodeId peer)
 {
     LOCK(g_cs_orphans);
     int nErased = 0;
+    for (auto it = mapLowFeeParents.begin(); it != mapLowFeeParents.end();) {
+        if (it->second.fromPeer == peer) {
+            it = mapLowFeeParents.erase(it);
+        } else {
+            ++it;
+        }
+    }
     std::map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
     while (iter != mapOrphanTransactions.end())
     {
@@ -840,9 +970,13 @@ static bool BlockRequestAllowed(const CBlockIndex* pindex, const Consensus::Para
         (GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, consensusParams) < STALE_RELAY_AGE_LIMIT);
 }
 
-PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn, CScheduler &scheduler, bool enable_bip61)
+PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn, CScheduler &scheduler, bool enable_bip61, int nBlockServingThreads)
     : connman(connmanIn), m_stale_tip_check_time(0), m_enable_bip61(enable_bip61) {
 
+    if (nBlockServingThreads > 0) {
+        m_block_server.reset(new BlockServer(connman, nBlockServingThreads));
+    }
+
     // Initialize global variables that cannot be constructed at startup.
     recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
 
@@ -855,6 +989,16 @@ PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn, CScheduler &schedu
     scheduler.scheduleEvery(std::bind(&PeerLogicValidation::CheckForStaleTipAndEvictPeers, this, consensusParams), EXTRA_PEER_CHECK_INTERVAL * 1000);
 }
 
+PeerLogicValidation::~PeerLogicValidation()
+{
+    StopBlockServing();
+}
+
+void PeerLogicValidation::StopBlockServing()
+{
+    if (m_block_server) m_block_server->Stop();
+}
+
 /**
  * Evict orphan txn pool entries (EraseOrphanTx) based on a newly connected
  * block. Also save the time of the last tip update.
@@ -903,7 +1047,7 @@ static bool fWitnessesPresentInMostRecentCompactBlock GUARDED_BY(cs_most_recent_
  * to compatible peers.
  */
 void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& pblock) {
-    std::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblock = std::make_shared<const CBlockHeaderAndShortTxIDs> (*pblock, true);
+    std::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblock = std::make_shared<const CBlockHeaderAndShortTxIDs> (*pblock, true, IsPoSHeight(pindex->nHeight, Params().GetConsensus()));
     const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
 
     LOCK(cs_main);
@@ -1044,7 +1188,7 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 
             {
                 LOCK(g_cs_orphans);
-                if (mapOrphanTransactions.count(inv.hash)) return true;
+                if (mapOrphanTransactions.count(inv.hash) || mapLowFeeParents.count(inv.hash)) return true;
             }
 
             return recentRejects->contains(inv.hash) ||
@@ -1105,7 +1249,94 @@ static void RelayAddress(const CAddress& addr, bool fReachable, CConnman* connma
     connman->ForEachNodeThen(std::move(sortfunc), std::move(pushfunc));
 }
 
-void static ProcessGetBlockData(CNode* pfrom, const CChainParams& chainparams, const CInv& inv, CConnman* connman)
+/**
+ * Accept ptx as a package with orphans. On success the orphans are relayed and
+ * erased, and their outputs are queued for the orphans that depend on them in turn.
+ */
+static bool AcceptPackageWithOrphans(const CTransactionRef& ptx, const std::vector<CTransactionRef>& package, CConnman* connman, std::deque<COutPoint>& vWorkQueue) EXCLUSIVE_LOCKS_REQUIRED(cs_main, g_cs_orphans)
+{
+    const uint256& hash = ptx->GetHash();
+    CValidationState state;
+    bool fMissingInputs = false;
+    if (!AcceptPackageToMemoryPool(mempool, state, package, &fMissingInputs, 0 /* nAbsurdFee */)) {
+        LogPrint(BCLog::MEMPOOL, "   package of %s with %u orphans not accepted: %s\n", hash.ToString(), package.size() - 1,
+            fMissingInputs ? "missing-inputs" : FormatStateMessage(state));
+        return false;
+    }
+
+    for (const CTransactionRef& porphanTx : package) {
+        const CTransaction& orphanTx = *porphanTx;
+        const uint256 orphanHash = orphanTx.GetHash();
+        if (orphanHash == hash) continue;
+        LogPrint(BCLog::MEMPOOL, "   accepted orphan tx %s in package of %s\n", orphanHash.ToString(), hash.ToString());
+        RelayTransaction(orphanTx, connman);
+        for (unsigned int j = 0; j < orphanTx.vout.size(); j++) {
+            vWorkQueue.emplace_back(orphanHash, j);
+        }
+        EraseOrphanTx(orphanHash);
+        mapLowFeeParents.erase(orphanHash);
+    }
+    return true;
+}
+
+/**
+ * Try to accept a transaction that was rejected for paying too little fee as a
+ * package together with the orphans waiting for it, so that they can pay for
+ * their parent.
+ */
+bool AcceptOrphanPackage(const CTransactionRef& ptx, CConnman* connman, std::deque<COutPoint>& vWorkQueue) EXCLUSIVE_LOCKS_REQUIRED(cs_main, g_cs_orphans)
+{
+    const uint256& hash = ptx->GetHash();
+    std::vector<CTransactionRef> package{ptx};
+    std::set<uint256> setChildren;
+    for (uint32_t i = 0; i < ptx->vout.size() && package.size() < MAX_PACKAGE_COUNT; i++) {
+        auto itByPrev = mapOrphanTransactionsByPrev.find(COutPoint(hash, i));
+        if (itByPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        for (auto mi : itByPrev->second) {
+            const CTransactionRef& porphanTx = mi->second.tx;
+            if (package.size() < MAX_PACKAGE_COUNT && setChildren.insert(porphanTx->GetHash()).second) {
+                package.push_back(porphanTx);
+            }
+        }
+    }
+    // Orphans that also spend another of the orphans are left for the orphan
+    // processing after the package, which keeps the package sorted
+    package.erase(std::remove_if(package.begin() + 1, package.end(), [&](const CTransactionRef& porphanTx) {
+        for (const CTxIn& txin : porphanTx->vin) {
+            if (setChildren.count(txin.prevout.hash)) return true;
+        }
+        return false;
+    }), package.end());
+    if (package.size() == 1)
+        return false;
+
+    return AcceptPackageWithOrphans(ptx, package, connman, vWorkQueue);
+}
+
+/**
+ * Try to accept a transaction with missing inputs as a package together with
+ * the parents kept by AddLowFeeParentTx because they paid too little fee on
+ * their own, for the case where the parents came first.
+ */
+bool AcceptOrphanParentsPackage(const CTransactionRef& ptx, CConnman* connman, std::deque<COutPoint>& vWorkQueue) EXCLUSIVE_LOCKS_REQUIRED(cs_main, g_cs_orphans)
+{
+    std::vector<CTransactionRef> package;
+    std::set<uint256> setParents;
+    for (const CTxIn& txin : ptx->vin) {
+        auto it = mapLowFeeParents.find(txin.prevout.hash);
+        if (it != mapLowFeeParents.end() && package.size() + 1 < MAX_PACKAGE_COUNT && setParents.insert(it->first).second) {
+            package.push_back(it->second.tx);
+        }
+    }
+    if (package.empty())
+        return false;
+    package.push_back(ptx);
+
+    return AcceptPackageWithOrphans(ptx, package, connman, vWorkQueue);
+}
+
+void static ProcessGetBlockData(CNode* pfrom, const CChainParams& chainparams, const CInv& inv, CConnman* connman, BlockServer* block_server)
 {
     bool send = false;
     std::shared_ptr<const CBlock> a_recent_block;
@@ -1178,6 +1409,22 @@ void static ProcessGetBlockData(CNode* pfrom, const CChainParams& chainparams, c
         std::shared_ptr<const CBlock> pblock;
         if (a_recent_block && a_recent_block->GetHash() == pindex->GetBlockHash()) {
             pblock = a_recent_block;
+        } else if (block_server && (inv.type == MSG_BLOCK || inv.type == MSG_WITNESS_BLOCK)) {
+            // Hand the disk read off to the block serving threads, which also send
+            // the hashContinue inv (see below) right after the block.
+            uint256 hashContinue;
+            if (inv.hash == pfrom->hashContinue) {
+                hashContinue = chainActive.Tip()->GetBlockHash();
+            }
+            if (block_server->Serve(pfrom, inv, pindex->GetBlockPos(), IsPoSHeight(pindex->nHeight, consensusParams), hashContinue)) {
+                if (!hashContinue.IsNull()) {
+                    pfrom->hashContinue.SetNull();
+                }
+                return;
+            }
+        }
+        if (pblock) {
+            // Sent from a_recent_block below
         } else if (inv.type == MSG_WITNESS_BLOCK) {
             // Fast-path: in this case it is possible to serve the block directly from disk,
             // as the network format matches the format on disk
@@ -1237,7 +1484,7 @@ void static ProcessGetBlockData(CNode* pfrom, const CChainParams& chainparams, c
                     if ((fPeerWantsWitness || !fWitnessesPresentInARecentCompactBlock) && a_recent_compact_block && a_recent_compact_block->header.GetHash() == pindex->GetBlockHash()) {
                         connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *a_recent_compact_block));
                     } else {
-                        CBlockHeaderAndShortTxIDs cmpctblock(*pblock, fPeerWantsWitness);
+                        CBlockHeaderAndShortTxIDs cmpctblock(*pblock, fPeerWantsWitness, IsPoSHeight(pindex->nHeight, consensusParams));
                         connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
                     }
                 } else {
@@ -1260,7 +1507,7 @@ void static ProcessGetBlockData(CNode* pfrom, const CChainParams& chainparams, c
     }
 }
 
-void static ProcessGetData(CNode* pfrom, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
+void static ProcessGetData(CNode* pfrom, const CChainParams& chainparams, CConnman* connman, BlockServer* block_server, const std::atomic<bool>& interruptMsgProc)
 {
     AssertLockNotHeld(cs_main);
 
@@ -1306,7 +1553,7 @@ void static ProcessGetData(CNode* pfrom, const CChainParams& chainparams, CConnm
         const CInv &inv = *it;
         if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK || inv.type == MSG_WITNESS_BLOCK) {
             it++;
-            ProcessGetBlockData(pfrom, chainparams, inv, connman);
+            ProcessGetBlockData(pfrom, chainparams, inv, connman, block_server);
         }
     }
 
@@ -1569,7 +1816,7 @@ bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::ve
     return true;
 }
 
-bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc, bool enable_bip61)
+bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, BlockServer* block_server, const std::atomic<bool>& interruptMsgProc, bool enable_bip61)
 {
     LogPrint(BCLog::NET, "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->GetId());
     if (gArgs.IsArgSet("-dropmessagestest") && GetRand(gArgs.GetArg("-dropmessagestest", 0)) == 0)
@@ -2008,7 +2255,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         }
 
         pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
-        ProcessGetData(pfrom, chainparams, connman, interruptMsgProc);
+        ProcessGetData(pfrom, chainparams, connman, block_server, interruptMsgProc);
     }
 
 
@@ -2218,6 +2465,19 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
+        // Verify the scripts before taking cs_main, so that acceptance below
+        // does not hold up the other threads waiting for the lock to do it.
+        // This thread still waits for the checks, so transactions from all
+        // peers are relayed one after another as before; only cs_main is
+        // freed up while their scripts run.
+        bool fAlreadyHave;
+        {
+            LOCK(cs_main);
+            fAlreadyHave = AlreadyHave(inv);
+        }
+        CValidationState statePrecheck;
+        const ScriptPrecheck precheck = fAlreadyHave ? ScriptPrecheck::SKIPPED : PrecheckTransactionScripts(ptx, statePrecheck);
+
         LOCK2(cs_main, g_cs_orphans);
 
         bool fMissingInputs = false;
@@ -2228,8 +2488,26 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
 
         std::list<CTransactionRef> lRemovedTxn;
 
-        if (!AlreadyHave(inv) &&
-            AcceptToMemoryPool(mempool, state, ptx, &fMissingInputs, &lRemovedTxn, false /* bypass_limits */, 0 /* nAbsurdFee */)) {
+        bool fAccepted = false;
+        if (!AlreadyHave(inv)) {
+            if (precheck == ScriptPrecheck::INVALID) {
+                // Rejected without running the scripts again
+                state = statePrecheck;
+            } else {
+                fAccepted = AcceptToMemoryPool(mempool, state, ptx, &fMissingInputs, &lRemovedTxn, false /* bypass_limits */, 0 /* nAbsurdFee */);
+            }
+        }
+        if (!fAccepted && state.GetRejectCode() == REJECT_INSUFFICIENTFEE && AcceptOrphanPackage(ptx, connman, vWorkQueue)) {
+            // Accepted with orphans that pay for it
+            fAccepted = true;
+            state = CValidationState();
+        }
+        if (!fAccepted && fMissingInputs && AcceptOrphanParentsPackage(ptx, connman, vWorkQueue)) {
+            // Accepted paying for orphans it spends
+            fAccepted = true;
+            fMissingInputs = false;
+        }
+        if (fAccepted) {
             mempool.check(pcoinsTip.get());
             RelayTransaction(tx, connman);
             for (unsigned int i = 0; i < tx.vout.size(); i++) {
@@ -2335,6 +2613,12 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 recentRejects->insert(tx.GetHash());
             }
         } else {
+            // A transaction paying less than the minimum fee may yet be paid
+            // for by a child: keep it aside for AcceptOrphanParentsPackage
+            if (state.GetRejectCode() == REJECT_INSUFFICIENTFEE &&
+                (state.GetRejectReason() == "min relay fee not met" || state.GetRejectReason() == "mempool min fee not met")) {
+                AddLowFeeParentTx(ptx, pfrom->GetId());
+            }
             if (!tx.HasWitness() && !state.CorruptionPossible()) {
                 // Do not use rejection cache for witness transactions or
                 // witness-stripped transactions, as they can have been malleated.
@@ -2561,7 +2845,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         } // cs_main
 
         if (fProcessBLOCKTXN)
-            return ProcessMessage(pfrom, NetMsgType::BLOCKTXN, blockTxnMsg, nTimeReceived, chainparams, connman, interruptMsgProc, enable_bip61);
+            return ProcessMessage(pfrom, NetMsgType::BLOCKTXN, blockTxnMsg, nTimeReceived, chainparams, connman, block_server, interruptMsgProc, enable_bip61);
 
         if (fRevertToHeaderProcessing) {
             // Headers received from HB compact block peers are permitted to be
@@ -2654,6 +2938,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 // though the block was successfully read, and rely on the
                 // handling in ProcessNewBlock to ensure the block index is
                 // updated, reject messages go out, etc.
+                UpdateBlockDeliveryTime(pfrom->GetId(), resp.blockhash);
                 MarkBlockAsReceived(resp.blockhash); // it is now an empty pointer
                 fBlockRead = true;
                 // mapBlockSource is only used for sending reject messages and DoS scores,
@@ -2719,6 +3004,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         const uint256 hash(pblock->GetHash());
         {
             LOCK(cs_main);
+            UpdateBlockDeliveryTime(pfrom->GetId(), hash);
             // Also always process if we requested the block explicitly, as we may
             // need it even though it is not a candidate for a new best tip.
             forceProcessing |= MarkBlockAsReceived(hash);
@@ -2992,8 +3278,13 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
     //
     bool fMoreWork = false;
 
+    // A block is being served to this peer; the block serving thread wakes us
+    // when it is done, and everything else waits to maintain the order of responses
+    if (m_block_server && m_block_server->IsBusy(pfrom->GetId()))
+        return false;
+
     if (!pfrom->vRecvGetData.empty())
-        ProcessGetData(pfrom, chainparams, connman, interruptMsgProc);
+        ProcessGetData(pfrom, chainparams, connman, m_block_server.get(), interruptMsgProc);
 
     if (pfrom->fDisconnect)
         return false;
@@ -3001,6 +3292,11 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return true;
 
+    // The last block requested went to the block serving threads, so don't
+    // take another getdata from this peer before it has been sent
+    if (m_block_server && m_block_server->IsBusy(pfrom->GetId()))
+        return false;
+
     // Don't bother if send buffer is too full to respond anyway
     if (pfrom->fPauseSend)
         return false;
@@ -3054,7 +3350,7 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
     bool fRet = false;
     try
     {
-        fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, chainparams, connman, interruptMsgProc, m_enable_bip61);
+        fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, chainparams, connman, m_block_server.get(), interruptMsgProc, m_enable_bip61);
         if (interruptMsgProc)
             return false;
         if (!pfrom->vRecvGetData.empty())
@@ -3236,20 +3532,13 @@ void PeerLogicValidation::CheckForStaleTipAndEvictPeers(const Consensus::Params
 }
 
 namespace {
-class CompareInvMempoolOrder
+struct CompareRelayRank
 {
-    CTxMemPool *mp;
-public:
-    explicit CompareInvMempoolOrder(CTxMemPool *_mempool)
-    {
-        mp = _mempool;
-    }
-
-    bool operator()(std::set<uint256>::iterator a, std::set<uint256>::iterator b)
+    bool operator()(const TxRelayOrder::RankedTx& a, const TxRelayOrder::RankedTx& b) const
     {
         /* As std::make_heap produces a max-heap, we want the entries with the
-         * fewest ancestors/highest fee to sort later. */
-        return mp->CompareDepthAndScore(*b, *a);
+         * lowest rank to sort later. */
+        return b.first < a.first;
     }
 };
 }
@@ -3453,7 +3742,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
                             if (state.fWantsCmpctWitness || !fWitnessesPresentInMostRecentCompactBlock)
                                 connman->PushMessage(pto, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *most_recent_compact_block));
                             else {
-                                CBlockHeaderAndShortTxIDs cmpctblock(*most_recent_block, state.fWantsCmpctWitness);
+                                CBlockHeaderAndShortTxIDs cmpctblock(*most_recent_block, state.fWantsCmpctWitness, IsPoSHeight(pBestIndex->nHeight, consensusParams));
                                 connman->PushMessage(pto, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
                             }
                             fGotBlockFromCache = true;
@@ -3463,7 +3752,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
                         CBlock block;
                         bool ret = ReadBlockFromDisk(block, pBestIndex, consensusParams);
                         assert(ret);
-                        CBlockHeaderAndShortTxIDs cmpctblock(block, state.fWantsCmpctWitness);
+                        CBlockHeaderAndShortTxIDs cmpctblock(block, state.fWantsCmpctWitness, IsPoSHeight(pBestIndex->nHeight, consensusParams));
                         connman->PushMessage(pto, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
                     }
                     state.pindexBestHeaderSent = pBestIndex;
@@ -3581,29 +3870,27 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
 
             // Determine transactions to relay
             if (fSendTrickle) {
+                // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
+                // The ranks are looked up once for all peers at each mempool state.
                 // Produce a vector with all candidates for sending
-                std::vector<std::set<uint256>::iterator> vInvTx;
-                vInvTx.reserve(pto->setInventoryTxToSend.size());
-                for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); it++) {
-                    vInvTx.push_back(it);
-                }
+                std::vector<TxRelayOrder::RankedTx> vInvTx;
+                txRelayOrder.Rank(pto->setInventoryTxToSend, vInvTx);
                 CAmount filterrate = 0;
                 {
                     LOCK(pto->cs_feeFilter);
                     filterrate = pto->minFeeFilter;
                 }
-                // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
                 // A heap is used so that not all items need sorting if only a few are being sent.
-                CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
-                std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
+                CompareRelayRank compareRelayRank;
+                std::make_heap(vInvTx.begin(), vInvTx.end(), compareRelayRank);
                 // No reason to drain out at many times the network's capacity,
                 // especially since we have many peers and some will draw much shorter delays.
                 unsigned int nRelayedTransactions = 0;
                 LOCK(pto->cs_filter);
                 while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
                     // Fetch the top element from the heap
-                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
-                    std::set<uint256>::iterator it = vInvTx.back();
+                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareRelayRank);
+                    std::set<uint256>::iterator it = vInvTx.back().second;
                     vInvTx.pop_back();
                     uint256 hash = *it;
                     // Remove it from the to-be-sent set
@@ -3713,10 +4000,13 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
         // Message: getdata (blocks)
         //
         std::vector<CInv> vGetData;
-        if (!pto->fClient && ((fFetch && !pto->m_limited_node) || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        const int nBlockQuota = GetBlockDownloadQuota(state, pto);
+        if (!pto->fClient && ((fFetch && !pto->m_limited_node) || !IsInitialBlockDownload()) && state.nBlocksInFlight < nBlockQuota) {
             std::vector<const CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller, consensusParams);
+            const CBlockIndex* pindexStalled = nullptr;
+            FindNextBlocksToDownload(pto->GetId(), nBlockQuota - state.nBlocksInFlight, vToDownload, staller, pindexStalled, consensusParams);
+            UpdateBlockDownloadWindow(state, staller != -1, nNow);
             for (const CBlockIndex *pindex : vToDownload) {
                 uint32_t nFetchFlags = GetFetchFlags(pto);
                 vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindex->GetBlockHash()));
@@ -3725,8 +4015,21 @@ bool PeerLogicValidation::SendMessages(CNode* pto)
                     pindex->nHeight, pto->GetId());
             }
             if (state.nBlocksInFlight == 0 && staller != -1) {
-                if (State(staller)->nStallingSince == 0) {
-                    State(staller)->nStallingSince = nNow;
+                CNodeState* stallerState = State(staller);
+                auto itStalled = pindexStalled ? mapBlocksInFlight.find(pindexStalled->GetBlockHash()) : mapBlocksInFlight.end();
+                if (itStalled != mapBlocksInFlight.end() && itStalled->second.first == staller &&
+                        state.nBlockDeliveryTime != 0 &&
+                        (stallerState->nBlockDeliveryTime == 0 || state.nBlockDeliveryTime < stallerState->nBlockDeliveryTime) &&
+                        nNow - itStalled->second.second->nTimeRequested > std::max<int64_t>(2 * state.nBlockDeliveryTime, 1000000 * BLOCK_STALLING_TIMEOUT / 2)) {
+                    // We are idle and faster than the peer holding up the window: take the block over
+                    // instead of waiting for the staller to time out and get disconnected.
+                    uint32_t nFetchFlags = GetFetchFlags(pto);
+                    vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindexStalled->GetBlockHash()));
+                    MarkBlockAsInFlight(pto->GetId(), pindexStalled->GetBlockHash(), pindexStalled);
+                    LogPrint(BCLog::NET, "Re-requesting stalled block %s (%d) peer=%d, was peer=%d\n", pindexStalled->GetBlockHash().ToString(),
+                        pindexStalled->nHeight, pto->GetId(), staller);
+                } else if (stallerState->nStallingSince == 0) {
+                    stallerState->nStallingSince = nNow;
                     LogPrint(BCLog::NET, "Stall started peer=%d\n", staller);
                 }
             }
@@ -3795,5 +4098,6 @@ public:
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        mapLowFeeParents.clear();
     }
 } instance_of_cnetprocessingcleanup;
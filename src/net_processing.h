@@ -10,6 +10,10 @@
 #include <validationinterface.h>
 #include <consensus/params.h>
 
+#include <memory>
+
+class BlockServer;
+
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
 /** Default number of orphan+recently-replaced txn to keep around for block reconstruction */
@@ -22,7 +26,9 @@ private:
     CConnman* const connman;
 
 public:
-    explicit PeerLogicValidation(CConnman* connman, CScheduler &scheduler, bool enable_bip61);
+    /** nBlockServingThreads threads serve historical blocks from disk; with 0 they are served inline */
+    PeerLogicValidation(CConnman* connman, CScheduler &scheduler, bool enable_bip61, int nBlockServingThreads = 0);
+    ~PeerLogicValidation();
 
     /**
      * Overridden from CValidationInterface.
@@ -67,11 +73,35 @@ public:
     /** If we have extra outbound peers, try to disconnect the one with the oldest block announcement */
     void EvictExtraOutboundPeers(int64_t time_in_seconds);
 
+    /** Stop serving blocks from the block serving threads. Must be called before the peers are deleted. */
+    void StopBlockServing();
+
 private:
     int64_t m_stale_tip_check_time; //! Next time to check for stale tip
 
     /** Enable BIP61 (sending reject messages) */
     const bool m_enable_bip61;
+
+    /** Serves getdata requests for historical blocks off the message handler thread */
+    std::unique_ptr<BlockServer> m_block_server;
+};
+
+/** The block download window, which is widened when a stalling peer blocks it while validation keeps up
+ *  with the download, and shrunk when validation falls behind. It changes at most once per stalling timeout,
+ *  so a stall that lasts over many SendMessages passes widens it only once. */
+class BlockDownloadWindow
+{
+public:
+    BlockDownloadWindow();
+
+    int Size() const { return m_size; }
+
+    /** nBacklog is the number of downloaded blocks validation has yet to connect; nNow is in microseconds. */
+    void Update(int nBacklog, bool fStalled, int64_t nNow);
+
+private:
+    int m_size;
+    int64_t m_last_update{0};
 };
 
 struct CNodeStateStats {
@@ -14,6 +14,9 @@
 
 static constexpr double INF_FEERATE = 1e99;
 
+/** Version required to read fee estimates files with the flat array (compact) format */
+static constexpr int FEE_ESTIMATES_COMPACT_VERSION = 170003;
+
 std::string StringForFeeEstimateHorizon(FeeEstimateHorizon horizon) {
     static const std::map<FeeEstimateHorizon, std::string> horizon_strings = {
         {FeeEstimateHorizon::SHORT_HALFLIFE, "short"},
@@ -68,6 +71,9 @@ bool FeeModeFromString(const std::string& mode_string, FeeEstimateMode& fee_esti
  *
  * The tracking of unconfirmed (mempool) transactions is completely independent of the
  * historical tracking of transactions that have been confirmed in a block.
+ *
+ * The per period and bucket counters are kept in flat arrays indexed by
+ * period * numBuckets + bucket, so that a row for one period is contiguous.
  */
 class TxConfirmStats
 {
@@ -76,6 +82,20 @@ private:
     const std::vector<double>& buckets;              // The upper-bound of the range for the bucket (inclusive)
     const std::map<double, unsigned int>& bucketMap; // Map of bucket upper-bound to index into all vectors by bucket
 
+    // Number of buckets in the arrays below. This is kept separately from
+    // buckets, which is not updated yet while reading a file.
+    size_t numBuckets;
+
+    // Number of periods of confirmations tracked
+    size_t numPeriods;
+
+    // The historical moving averages are decayed lazily: the stored values
+    // have to be multiplied by decayFactor, the product of the decays of all
+    // blocks since the last renormalization, to get the actual averages.
+    // Decaying for a new block then only updates decayFactor, and new data
+    // points are recorded divided by it.
+    double decayFactor;
+
     // For each bucket X:
     // Count the total # of txs in each bucket
     // Track the historical moving average of this total over blocks
@@ -83,11 +103,11 @@ private:
 
     // Count the total # of txs confirmed within Y blocks in each bucket
     // Track the historical moving average of theses totals over blocks
-    std::vector<std::vector<double>> confAvg; // confAvg[Y][X]
+    std::vector<double> confAvg; // confAvg[Y * numBuckets + X]
 
     // Track moving avg of txs which have been evicted from the mempool
     // after failing to be confirmed within Y blocks
-    std::vector<std::vector<double>> failAvg; // failAvg[Y][X]
+    std::vector<double> failAvg; // failAvg[Y * numBuckets + X]
 
     // Sum the total feerate of all tx's in each bucket
     // Track the historical moving average of this total over blocks
@@ -104,12 +124,15 @@ private:
     // Mempool counts of outstanding transactions
     // For each bucket X, track the number of transactions in the mempool
     // that are unconfirmed for each possible confirmation value Y
-    std::vector<std::vector<int> > unconfTxs;  //unconfTxs[Y][X]
+    std::vector<int> unconfTxs;  //unconfTxs[Y * numBuckets + X]
     // transactions still unconfirmed after GetMaxConfirms for each bucket
     std::vector<int> oldUnconfTxs;
 
     void resizeInMemoryCounters(size_t newbuckets);
 
+    /** Apply decayFactor to the stored averages and reset it to 1 */
+    void Renormalize();
+
 public:
     /**
      * Create new TxConfirmStats. This is called by BlockPolicyEstimator's
@@ -159,7 +182,7 @@ public:
                              EstimationResult *result = nullptr) const;
 
     /** Return the max number of confirms we're tracking */
-    unsigned int GetMaxConfirms() const { return scale * confAvg.size(); }
+    unsigned int GetMaxConfirms() const { return scale * numPeriods; }
 
     /** Write state of estimation data to a file*/
     void Write(CAutoFile& fileout) const;
@@ -167,49 +190,44 @@ public:
     /**
      * Read saved state of estimation data from a file and replace all internal data structures and
      * variables with this state.
+     * @param nFileVersion the version required to read the file, which selects its format
      */
     void Read(CAutoFile& filein, int nFileVersion, size_t numBuckets);
 };
 
+/** Renormalize the lazily decayed averages once decayFactor drops below this */
+static constexpr double MIN_DECAY_FACTOR = 1e-100;
 
 TxConfirmStats::TxConfirmStats(const std::vector<double>& defaultBuckets,
                                 const std::map<double, unsigned int>& defaultBucketMap,
                                unsigned int maxPeriods, double _decay, unsigned int _scale)
-    : buckets(defaultBuckets), bucketMap(defaultBucketMap)
+    : buckets(defaultBuckets), bucketMap(defaultBucketMap), numBuckets(defaultBuckets.size()), numPeriods(maxPeriods), decayFactor(1)
 {
     decay = _decay;
     assert(_scale != 0 && "_scale must be non-zero");
     scale = _scale;
-    confAvg.resize(maxPeriods);
-    for (unsigned int i = 0; i < maxPeriods; i++) {
-        confAvg[i].resize(buckets.size());
-    }
-    failAvg.resize(maxPeriods);
-    for (unsigned int i = 0; i < maxPeriods; i++) {
-        failAvg[i].resize(buckets.size());
-    }
+    confAvg.resize(numPeriods * numBuckets);
+    failAvg.resize(numPeriods * numBuckets);
 
-    txCtAvg.resize(buckets.size());
-    avg.resize(buckets.size());
+    txCtAvg.resize(numBuckets);
+    avg.resize(numBuckets);
 
-    resizeInMemoryCounters(buckets.size());
+    resizeInMemoryCounters(numBuckets);
 }
 
 void TxConfirmStats::resizeInMemoryCounters(size_t newbuckets) {
     // newbuckets must be passed in because the buckets referred to during Read have not been updated yet.
-    unconfTxs.resize(GetMaxConfirms());
-    for (unsigned int i = 0; i < unconfTxs.size(); i++) {
-        unconfTxs[i].resize(newbuckets);
-    }
-    oldUnconfTxs.resize(newbuckets);
+    unconfTxs.assign(GetMaxConfirms() * newbuckets, 0);
+    oldUnconfTxs.assign(newbuckets, 0);
 }
 
 // Roll the unconfirmed txs circular buffer
 void TxConfirmStats::ClearCurrent(unsigned int nBlockHeight)
 {
-    for (unsigned int j = 0; j < buckets.size(); j++) {
-        oldUnconfTxs[j] += unconfTxs[nBlockHeight%unconfTxs.size()][j];
-        unconfTxs[nBlockHeight%unconfTxs.size()][j] = 0;
+    int* current = &unconfTxs[(nBlockHeight % GetMaxConfirms()) * numBuckets];
+    for (unsigned int j = 0; j < numBuckets; j++) {
+        oldUnconfTxs[j] += current[j];
+        current[j] = 0;
     }
 }
 
@@ -221,22 +239,28 @@ void TxConfirmStats::Record(int blocksToConfirm, double val)
         return;
     int periodsToConfirm = (blocksToConfirm + scale - 1)/scale;
     unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    for (size_t i = periodsToConfirm; i <= confAvg.size(); i++) {
-        confAvg[i - 1][bucketindex]++;
+    const double weight = 1 / decayFactor;
+    for (size_t i = periodsToConfirm; i <= numPeriods; i++) {
+        confAvg[(i - 1) * numBuckets + bucketindex] += weight;
     }
-    txCtAvg[bucketindex]++;
-    avg[bucketindex] += val;
+    txCtAvg[bucketindex] += weight;
+    avg[bucketindex] += val * weight;
+}
+
+void TxConfirmStats::Renormalize()
+{
+    for (double& val : confAvg) val *= decayFactor;
+    for (double& val : failAvg) val *= decayFactor;
+    for (double& val : avg) val *= decayFactor;
+    for (double& val : txCtAvg) val *= decayFactor;
+    decayFactor = 1;
 }
 
 void TxConfirmStats::UpdateMovingAverages()
 {
-    for (unsigned int j = 0; j < buckets.size(); j++) {
-        for (unsigned int i = 0; i < confAvg.size(); i++)
-            confAvg[i][j] = confAvg[i][j] * decay;
-        for (unsigned int i = 0; i < failAvg.size(); i++)
-            failAvg[i][j] = failAvg[i][j] * decay;
-        avg[j] = avg[j] * decay;
-        txCtAvg[j] = txCtAvg[j] * decay;
+    decayFactor *= decay;
+    if (decayFactor < MIN_DECAY_FACTOR) {
+        Renormalize();
     }
 }
 
@@ -272,12 +296,15 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     unsigned int bestFarBucket = startbucket;
 
     bool foundAnswer = false;
-    unsigned int bins = unconfTxs.size();
+    unsigned int bins = GetMaxConfirms();
     bool newBucketRange = true;
     bool passing = true;
     EstimatorBucket passBucket;
     EstimatorBucket failBucket;
 
+    const double* confRow = &confAvg[(periodTarget - 1) * numBuckets];
+    const double* failRow = &failAvg[(periodTarget - 1) * numBuckets];
+
     // Start counting from highest(default) or lowest feerate transactions
     for (int bucket = startbucket; bucket >= 0 && bucket <= maxbucketindex; bucket += step) {
         if (newBucketRange) {
@@ -285,11 +312,11 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
             newBucketRange = false;
         }
         curFarBucket = bucket;
-        nConf += confAvg[periodTarget - 1][bucket];
-        totalNum += txCtAvg[bucket];
-        failNum += failAvg[periodTarget - 1][bucket];
-        for (unsigned int confct = confTarget; confct < GetMaxConfirms(); confct++)
-            extraNum += unconfTxs[(nBlockHeight - confct)%bins][bucket];
+        nConf += confRow[bucket] * decayFactor;
+        totalNum += txCtAvg[bucket] * decayFactor;
+        failNum += failRow[bucket] * decayFactor;
+        for (unsigned int confct = confTarget; confct < bins; confct++)
+            extraNum += unconfTxs[((nBlockHeight - confct)%bins) * numBuckets + bucket];
         extraNum += oldUnconfTxs[bucket];
         // If we have enough transaction data points in this range of buckets,
         // we can test for success
@@ -342,6 +369,7 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     // Find the bucket with the median transaction and then report the average feerate from that bucket
     // This is a compromise between finding the median which we can't since we don't save all tx's
     // and reporting the average which is less accurate
+    // (The decay factor is common to all buckets, so the stored values can be compared directly)
     unsigned int minBucket = std::min(bestNearBucket, bestFarBucket);
     unsigned int maxBucket = std::max(bestNearBucket, bestFarBucket);
     for (unsigned int j = minBucket; j <= maxBucket; j++) {
@@ -393,17 +421,28 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     return median;
 }
 
+/** Multiply each of values by factor, for writing the lazily decayed averages */
+static std::vector<double> ScaledValues(const std::vector<double>& values, double factor)
+{
+    std::vector<double> result(values);
+    for (double& val : result) val *= factor;
+    return result;
+}
+
 void TxConfirmStats::Write(CAutoFile& fileout) const
 {
+    // Compact format: the period counters are written as single flat arrays
+    // so that they can be read back without per period allocations
     fileout << decay;
     fileout << scale;
-    fileout << avg;
-    fileout << txCtAvg;
-    fileout << confAvg;
-    fileout << failAvg;
+    fileout << (uint32_t)numPeriods;
+    fileout << ScaledValues(avg, decayFactor);
+    fileout << ScaledValues(txCtAvg, decayFactor);
+    fileout << ScaledValues(confAvg, decayFactor);
+    fileout << ScaledValues(failAvg, decayFactor);
 }
 
-void TxConfirmStats::Read(CAutoFile& filein, int nFileVersion, size_t numBuckets)
+void TxConfirmStats::Read(CAutoFile& filein, int nFileVersion, size_t numBucketsIn)
 {
     // Read data file and do some very basic sanity checking
     // buckets and bucketMap are not updated yet, so don't access them
@@ -420,37 +459,74 @@ void TxConfirmStats::Read(CAutoFile& filein, int nFileVersion, size_t numBuckets
         throw std::runtime_error("Corrupt estimates file. Scale must be non-zero");
     }
 
+    if (nFileVersion >= FEE_ESTIMATES_COMPACT_VERSION) {
+        uint32_t filePeriods;
+        filein >> filePeriods;
+        maxPeriods = filePeriods;
+    }
+
     filein >> avg;
-    if (avg.size() != numBuckets) {
+    if (avg.size() != numBucketsIn) {
         throw std::runtime_error("Corrupt estimates file. Mismatch in feerate average bucket count");
     }
     filein >> txCtAvg;
-    if (txCtAvg.size() != numBuckets) {
+    if (txCtAvg.size() != numBucketsIn) {
         throw std::runtime_error("Corrupt estimates file. Mismatch in tx count bucket count");
     }
-    filein >> confAvg;
-    maxPeriods = confAvg.size();
-    maxConfirms = scale * maxPeriods;
 
-    if (maxConfirms <= 0 || maxConfirms > 6 * 24 * 7) { // one week
-        throw std::runtime_error("Corrupt estimates file.  Must maintain estimates for between 1 and 1008 (one week) confirms");
-    }
-    for (unsigned int i = 0; i < maxPeriods; i++) {
-        if (confAvg[i].size() != numBuckets) {
+    if (nFileVersion >= FEE_ESTIMATES_COMPACT_VERSION) {
+        maxConfirms = scale * maxPeriods;
+        if (maxConfirms <= 0 || maxConfirms > 6 * 24 * 7) { // one week
+            throw std::runtime_error("Corrupt estimates file.  Must maintain estimates for between 1 and 1008 (one week) confirms");
+        }
+        filein >> confAvg;
+        if (confAvg.size() != maxPeriods * numBucketsIn) {
             throw std::runtime_error("Corrupt estimates file. Mismatch in feerate conf average bucket count");
         }
-    }
-
-    filein >> failAvg;
-    if (maxPeriods != failAvg.size()) {
-        throw std::runtime_error("Corrupt estimates file. Mismatch in confirms tracked for failures");
-    }
-    for (unsigned int i = 0; i < maxPeriods; i++) {
-        if (failAvg[i].size() != numBuckets) {
+        filein >> failAvg;
+        if (failAvg.size() != maxPeriods * numBucketsIn) {
             throw std::runtime_error("Corrupt estimates file. Mismatch in one of failure average bucket counts");
         }
+    } else {
+        // Format written before FEE_ESTIMATES_COMPACT_VERSION, with a vector per period
+        std::vector<std::vector<double>> fileConfAvg, fileFailAvg;
+        filein >> fileConfAvg;
+        maxPeriods = fileConfAvg.size();
+        maxConfirms = scale * maxPeriods;
+
+        if (maxConfirms <= 0 || maxConfirms > 6 * 24 * 7) { // one week
+            throw std::runtime_error("Corrupt estimates file.  Must maintain estimates for between 1 and 1008 (one week) confirms");
+        }
+        for (unsigned int i = 0; i < maxPeriods; i++) {
+            if (fileConfAvg[i].size() != numBucketsIn) {
+                throw std::runtime_error("Corrupt estimates file. Mismatch in feerate conf average bucket count");
+            }
+        }
+
+        filein >> fileFailAvg;
+        if (maxPeriods != fileFailAvg.size()) {
+            throw std::runtime_error("Corrupt estimates file. Mismatch in confirms tracked for failures");
+        }
+        for (unsigned int i = 0; i < maxPeriods; i++) {
+            if (fileFailAvg[i].size() != numBucketsIn) {
+                throw std::runtime_error("Corrupt estimates file. Mismatch in one of failure average bucket counts");
+            }
+        }
+
+        confAvg.clear();
+        failAvg.clear();
+        confAvg.reserve(maxPeriods * numBucketsIn);
+        failAvg.reserve(maxPeriods * numBucketsIn);
+        for (unsigned int i = 0; i < maxPeriods; i++) {
+            confAvg.insert(confAvg.end(), fileConfAvg[i].begin(), fileConfAvg[i].end());
+            failAvg.insert(failAvg.end(), fileFailAvg[i].begin(), fileFailAvg[i].end());
+        }
     }
 
+    numBuckets = numBucketsIn;
+    numPeriods = maxPeriods;
+    decayFactor = 1;
+
     // Resize the current block variables which aren't stored in the data file
     // to match the number of confirms and buckets
     resizeInMemoryCounters(numBuckets);
@@ -462,8 +538,8 @@ void TxConfirmStats::Read(CAutoFile& filein, int nFileVersion, size_t numBuckets
 unsigned int TxConfirmStats::NewTx(unsigned int nBlockHeight, double val)
 {
     unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    unsigned int blockIndex = nBlockHeight % unconfTxs.size();
-    unconfTxs[blockIndex][bucketindex]++;
+    unsigned int blockIndex = nBlockHeight % GetMaxConfirms();
+    unconfTxs[blockIndex * numBuckets + bucketindex]++;
     return bucketindex;
 }
 
@@ -478,7 +554,7 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
         return;  //This can't happen because we call this with our best seen height, no entries can have higher
     }
 
-    if (blocksAgo >= (int)unconfTxs.size()) {
+    if (blocksAgo >= (int)GetMaxConfirms()) {
         if (oldUnconfTxs[bucketindex] > 0) {
             oldUnconfTxs[bucketindex]--;
         } else {
@@ -487,9 +563,9 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
         }
     }
     else {
-        unsigned int blockIndex = entryHeight % unconfTxs.size();
-        if (unconfTxs[blockIndex][bucketindex] > 0) {
-            unconfTxs[blockIndex][bucketindex]--;
+        unsigned int blockIndex = entryHeight % GetMaxConfirms();
+        if (unconfTxs[blockIndex * numBuckets + bucketindex] > 0) {
+            unconfTxs[blockIndex * numBuckets + bucketindex]--;
         } else {
             LogPrint(BCLog::ESTIMATEFEE, "Blockpolicy error, mempool tx removed from blockIndex=%u,bucketIndex=%u already\n",
                      blockIndex, bucketindex);
@@ -498,8 +574,8 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
     if (!inBlock && (unsigned int)blocksAgo >= scale) { // Only counts as a failure if not confirmed for entire period
         assert(scale != 0);
         unsigned int periodsAgo = blocksAgo / scale;
-        for (size_t i = 0; i < periodsAgo && i < failAvg.size(); i++) {
-            failAvg[i][bucketindex]++;
+        for (size_t i = 0; i < periodsAgo && i < numPeriods; i++) {
+            failAvg[i * numBuckets + bucketindex] += 1 / decayFactor;
         }
     }
 }
@@ -630,12 +706,15 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
     // of unconfirmed txs to remove from tracking.
     nBestSeenHeight = nBlockHeight;
 
+    // Estimates are cached until the next block
+    m_smart_fee_cache.clear();
+
     // Update unconfirmed circular buffer
     feeStats->ClearCurrent(nBlockHeight);
     shortStats->ClearCurrent(nBlockHeight);
     longStats->ClearCurrent(nBlockHeight);
 
-    // Decay all exponential averages
+    // Decay all exponential averages (lazily, see TxConfirmStats)
     feeStats->UpdateMovingAverages();
     shortStats->UpdateMovingAverages();
     longStats->UpdateMovingAverages();
@@ -821,6 +900,26 @@ CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, FeeCalculation
 {
     LOCK(cs_feeEstimator);
 
+    // Only targets that can be tracked are cached, which bounds the cache size
+    if (confTarget <= 0 || (unsigned int)confTarget > longStats->GetMaxConfirms()) {
+        return estimateSmartFeeUncached(confTarget, feeCalc, conservative);
+    }
+
+    const std::pair<int, bool> key(confTarget, conservative);
+    auto it = m_smart_fee_cache.find(key);
+    if (it == m_smart_fee_cache.end()) {
+        FeeCalculation calc;
+        CFeeRate feerate = estimateSmartFeeUncached(confTarget, &calc, conservative);
+        it = m_smart_fee_cache.emplace(key, std::make_pair(feerate, calc)).first;
+    }
+    if (feeCalc) *feeCalc = it->second.second;
+    return it->second.first;
+}
+
+CFeeRate CBlockPolicyEstimator::estimateSmartFeeUncached(int confTarget, FeeCalculation *feeCalc, bool conservative) const
+{
+    AssertLockHeld(cs_feeEstimator);
+
     if (feeCalc) {
         feeCalc->desiredTarget = confTarget;
         feeCalc->returnedTarget = confTarget;
@@ -900,7 +999,8 @@ bool CBlockPolicyEstimator::Write(CAutoFile& fileout) const
 {
     try {
         LOCK(cs_feeEstimator);
-        fileout << 149900; // version required to read: 0.14.99 or later
+        static_assert(FEE_ESTIMATES_COMPACT_VERSION <= CLIENT_VERSION, "fee estimates file must be readable by this version");
+        fileout << FEE_ESTIMATES_COMPACT_VERSION; // version required to read
         fileout << CLIENT_VERSION; // version that wrote the file
         fileout << nBestSeenHeight;
         if (BlockSpan() > HistoricalBlockSpan()/2) {
@@ -952,9 +1052,9 @@ bool CBlockPolicyEstimator::Read(CAutoFile& filein)
             std::unique_ptr<TxConfirmStats> fileFeeStats(new TxConfirmStats(buckets, bucketMap, MED_BLOCK_PERIODS, MED_DECAY, MED_SCALE));
             std::unique_ptr<TxConfirmStats> fileShortStats(new TxConfirmStats(buckets, bucketMap, SHORT_BLOCK_PERIODS, SHORT_DECAY, SHORT_SCALE));
             std::unique_ptr<TxConfirmStats> fileLongStats(new TxConfirmStats(buckets, bucketMap, LONG_BLOCK_PERIODS, LONG_DECAY, LONG_SCALE));
-            fileFeeStats->Read(filein, nVersionThatWrote, numBuckets);
-            fileShortStats->Read(filein, nVersionThatWrote, numBuckets);
-            fileLongStats->Read(filein, nVersionThatWrote, numBuckets);
+            fileFeeStats->Read(filein, nVersionRequired, numBuckets);
+            fileShortStats->Read(filein, nVersionRequired, numBuckets);
+            fileLongStats->Read(filein, nVersionRequired, numBuckets);
 
             // Fee estimates file parsed correctly
             // Copy buckets from file and refresh our bucketmap
@@ -972,6 +1072,7 @@ bool CBlockPolicyEstimator::Read(CAutoFile& filein)
             nBestSeenHeight = nFileBestSeenHeight;
             historicalFirst = nFileHistoricalFirst;
             historicalBest = nFileHistoricalBest;
+            m_smart_fee_cache.clear();
         }
     }
     catch (const std::exception& e) {
@@ -990,6 +1091,7 @@ void CBlockPolicyEstimator::FlushUnconfirmed() {
         auto mi = mapMemPoolTxs.begin();
         removeTx(mi->first, false); // this calls erase() on mapMemPoolTxs
     }
+    m_smart_fee_cache.clear();
     int64_t endclear = GetTimeMicros();
     LogPrint(BCLog::ESTIMATEFEE, "Recorded %u unconfirmed txs from mempool in %gs\n", num_entries, (endclear - startclear)*0.000001);
 }
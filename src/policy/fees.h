@@ -208,6 +208,7 @@ public:
      *  blocks. If no answer can be given at confTarget, return an estimate at
      *  the closest target where one can be given.  'conservative' estimates are
      *  valid over longer time horizons also.
+     *  Results are cached per target and mode until the next block.
      */
     CFeeRate estimateSmartFee(int confTarget, FeeCalculation *feeCalc, bool conservative) const;
 
@@ -258,9 +259,14 @@ private:
 
     mutable CCriticalSection cs_feeEstimator;
 
+    /** estimateSmartFee results by (confTarget, conservative), valid until the next block is processed */
+    mutable std::map<std::pair<int, bool>, std::pair<CFeeRate, FeeCalculation>> m_smart_fee_cache GUARDED_BY(cs_feeEstimator);
+
     /** Process a transaction confirmed in a block*/
     bool processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry* entry);
 
+    /** Helper for estimateSmartFee, computing an estimate that is not in the cache */
+    CFeeRate estimateSmartFeeUncached(int confTarget, FeeCalculation *feeCalc, bool conservative) const EXCLUSIVE_LOCKS_REQUIRED(cs_feeEstimator);
     /** Helper for estimateSmartFee */
     double estimateCombinedFee(unsigned int confTarget, double successThreshold, bool checkShorterHorizon, EstimationResult *result) const;
     /** Helper for estimateSmartFee */
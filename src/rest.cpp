@@ -6,6 +6,7 @@
 #include <chain.h>
 #include <chainparams.h>
 #include <core_io.h>
+#include <index/blockfilterindex.h>
 #include <index/txindex.h>
 #include <primitives/block.h>
 #include <primitives/transaction.h>
@@ -326,16 +327,111 @@ static bool rest_mempool_contents(HTTPRequest* req, const std::string& strURIPar
     const RetFormat rf = ParseDataFormat(param, strURIPart);
 
     switch (rf) {
+    case RetFormat::BINARY: {
+        CDataStream ssMempool(SER_NETWORK, PROTOCOL_VERSION);
+        ssMempool << MempoolSnapshot();
+
+        std::string binaryMempool = ssMempool.str();
+        req->WriteHeader("Content-Type", "application/octet-stream");
+        req->WriteReply(HTTP_OK, binaryMempool);
+        return true;
+    }
+
+    case RetFormat::HEX: {
+        CDataStream ssMempool(SER_NETWORK, PROTOCOL_VERSION);
+        ssMempool << MempoolSnapshot();
+
+        std::string strHex = HexStr(ssMempool.begin(), ssMempool.end()) + "\n";
+        req->WriteHeader("Content-Type", "text/plain");
+        req->WriteReply(HTTP_OK, strHex);
+        return true;
+    }
+
     case RetFormat::JSON: {
-        UniValue mempoolObject = mempoolToJSON(true);
+        std::string strJSON;
+        MempoolSnapshotToJSON(MempoolSnapshot(), strJSON);
+        strJSON += "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
+    }
+    }
+}
+
+static bool rest_block_filter(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+    std::vector<std::string> path;
+    boost::split(path, param, boost::is_any_of("/"));
 
-        std::string strJSON = mempoolObject.write() + "\n";
+    if (path.size() != 2)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/blockfilter/<filtertype>/<blockhash>.<ext>");
+
+    BlockFilterType filtertype;
+    if (!BlockFilterTypeByName(path[0], filtertype))
+        return RESTERR(req, HTTP_BAD_REQUEST, "Unknown filtertype " + path[0]);
+
+    uint256 hash;
+    if (!ParseHashStr(path[1], hash))
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + path[1]);
+
+    if (!g_blockfilterindex || g_blockfilterindex->GetFilterType() != filtertype)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Index is not enabled for filtertype " + path[0]);
+
+    const CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+        pblockindex = LookupBlockIndex(hash);
+        if (!pblockindex)
+            return RESTERR(req, HTTP_NOT_FOUND, path[1] + " not found");
+    }
+
+    g_blockfilterindex->BlockUntilSyncedToCurrentChain();
+
+    BlockFilter filter;
+    uint256 filter_header;
+    if (!g_blockfilterindex->LookupFilter(pblockindex, filter) ||
+        !g_blockfilterindex->LookupFilterHeader(pblockindex, filter_header))
+        return RESTERR(req, HTTP_NOT_FOUND, "Filter not found for block " + path[1]);
+
+    switch (rf) {
+    case RetFormat::BINARY: {
+        CDataStream ssFilter(SER_NETWORK, PROTOCOL_VERSION);
+        ssFilter << filter << filter_header;
+
+        std::string binaryFilter = ssFilter.str();
+        req->WriteHeader("Content-Type", "application/octet-stream");
+        req->WriteReply(HTTP_OK, binaryFilter);
+        return true;
+    }
+
+    case RetFormat::HEX: {
+        CDataStream ssFilter(SER_NETWORK, PROTOCOL_VERSION);
+        ssFilter << filter << filter_header;
+
+        std::string strHex = HexStr(ssFilter.begin(), ssFilter.end()) + "\n";
+        req->WriteHeader("Content-Type", "text/plain");
+        req->WriteReply(HTTP_OK, strHex);
+        return true;
+    }
+
+    case RetFormat::JSON: {
+        UniValue ret(UniValue::VOBJ);
+        ret.pushKV("filter", HexStr(filter.GetEncodedFilter()));
+        ret.pushKV("header", filter_header.GetHex());
+        std::string strJSON = ret.write() + "\n";
         req->WriteHeader("Content-Type", "application/json");
         req->WriteReply(HTTP_OK, strJSON);
         return true;
     }
     default: {
-        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: json)");
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: " + AvailableDataFormatsString() + ")");
     }
     }
 }
@@ -588,6 +684,7 @@ static const struct {
       {"/rest/mempool/info", rest_mempool_info},
       {"/rest/mempool/contents", rest_mempool_contents},
       {"/rest/headers/", rest_headers},
+      {"/rest/blockfilter/", rest_block_filter},
       {"/rest/getutxos", rest_getutxos},
 };
 
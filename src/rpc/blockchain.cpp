@@ -14,6 +14,7 @@
 #include <consensus/validation.h>
 #include <validation.h>
 #include <core_io.h>
+#include <index/blockfilterindex.h>
 #include <index/txindex.h>
 #include <key_io.h>
 #include <policy/feerate.h>
@@ -382,67 +383,175 @@ static std::string EntryDescriptionString()
            "       ... ]\n";
 }
 
-static void entryToJSON(UniValue &info, const CTxMemPoolEntry &e) EXCLUSIVE_LOCKS_REQUIRED(::mempool.cs)
+/** Orders hashes like their hex strings, which start with the last byte */
+static bool CompareHashByHex(const uint256& a, const uint256& b)
+{
+    return std::lexicographical_compare(std::reverse_iterator<const unsigned char*>(a.end()), std::reverse_iterator<const unsigned char*>(a.begin()),
+                                        std::reverse_iterator<const unsigned char*>(b.end()), std::reverse_iterator<const unsigned char*>(b.begin()));
+}
+
+static MempoolEntrySnapshot SnapshotEntry(CTxMemPool::txiter it) EXCLUSIVE_LOCKS_REQUIRED(::mempool.cs)
 {
     AssertLockHeld(mempool.cs);
 
+    const CTxMemPoolEntry& e = *it;
+    MempoolEntrySnapshot snapshot;
+    snapshot.txid = e.GetTx().GetHash();
+    snapshot.wtxid = mempool.vTxHashes[e.vTxHashesIdx].first;
+    snapshot.size = e.GetTxSize();
+    snapshot.fee = e.GetFee();
+    snapshot.modifiedfee = e.GetModifiedFee();
+    snapshot.time = e.GetTime();
+    snapshot.height = e.GetHeight();
+    snapshot.descendantcount = e.GetCountWithDescendants();
+    snapshot.descendantsize = e.GetSizeWithDescendants();
+    snapshot.descendantfees = e.GetModFeesWithDescendants();
+    snapshot.ancestorcount = e.GetCountWithAncestors();
+    snapshot.ancestorsize = e.GetSizeWithAncestors();
+    snapshot.ancestorfees = e.GetModFeesWithAncestors();
+
+    // The in-mempool parents are exactly the transactions spent by e
+    const CTxMemPool::setEntries& setParents = mempool.GetMemPoolParents(it);
+    snapshot.depends.reserve(setParents.size());
+    for (const CTxMemPool::txiter& parentiter : setParents) {
+        snapshot.depends.push_back(parentiter->GetTx().GetHash());
+    }
+    std::sort(snapshot.depends.begin(), snapshot.depends.end(), CompareHashByHex);
+
+    const CTxMemPool::setEntries& setChildren = mempool.GetMemPoolChildren(it);
+    snapshot.spentby.reserve(setChildren.size());
+    for (const CTxMemPool::txiter& childiter : setChildren) {
+        snapshot.spentby.push_back(childiter->GetTx().GetHash());
+    }
+    return snapshot;
+}
+
+static void entryToJSON(UniValue &info, const MempoolEntrySnapshot &e)
+{
     UniValue fees(UniValue::VOBJ);
-    fees.pushKV("base", ValueFromAmount(e.GetFee()));
-    fees.pushKV("modified", ValueFromAmount(e.GetModifiedFee()));
-    fees.pushKV("ancestor", ValueFromAmount(e.GetModFeesWithAncestors()));
-    fees.pushKV("descendant", ValueFromAmount(e.GetModFeesWithDescendants()));
+    fees.pushKV("base", ValueFromAmount(e.fee));
+    fees.pushKV("modified", ValueFromAmount(e.modifiedfee));
+    fees.pushKV("ancestor", ValueFromAmount(e.ancestorfees));
+    fees.pushKV("descendant", ValueFromAmount(e.descendantfees));
     info.pushKV("fees", fees);
 
-    info.pushKV("size", (int)e.GetTxSize());
-    info.pushKV("fee", ValueFromAmount(e.GetFee()));
-    info.pushKV("modifiedfee", ValueFromAmount(e.GetModifiedFee()));
-    info.pushKV("time", e.GetTime());
-    info.pushKV("height", (int)e.GetHeight());
-    info.pushKV("descendantcount", e.GetCountWithDescendants());
-    info.pushKV("descendantsize", e.GetSizeWithDescendants());
-    info.pushKV("descendantfees", e.GetModFeesWithDescendants());
-    info.pushKV("ancestorcount", e.GetCountWithAncestors());
-    info.pushKV("ancestorsize", e.GetSizeWithAncestors());
-    info.pushKV("ancestorfees", e.GetModFeesWithAncestors());
-    info.pushKV("wtxid", mempool.vTxHashes[e.vTxHashesIdx].first.ToString());
-    const CTransaction& tx = e.GetTx();
-    std::set<std::string> setDepends;
-    for (const CTxIn& txin : tx.vin)
-    {
-        if (mempool.exists(txin.prevout.hash))
-            setDepends.insert(txin.prevout.hash.ToString());
-    }
+    info.pushKV("size", (int)e.size);
+    info.pushKV("fee", ValueFromAmount(e.fee));
+    info.pushKV("modifiedfee", ValueFromAmount(e.modifiedfee));
+    info.pushKV("time", e.time);
+    info.pushKV("height", (int)e.height);
+    info.pushKV("descendantcount", e.descendantcount);
+    info.pushKV("descendantsize", e.descendantsize);
+    info.pushKV("descendantfees", e.descendantfees);
+    info.pushKV("ancestorcount", e.ancestorcount);
+    info.pushKV("ancestorsize", e.ancestorsize);
+    info.pushKV("ancestorfees", e.ancestorfees);
+    info.pushKV("wtxid", e.wtxid.ToString());
 
     UniValue depends(UniValue::VARR);
-    for (const std::string& dep : setDepends)
+    for (const uint256& dep : e.depends)
     {
-        depends.push_back(dep);
+        depends.push_back(dep.ToString());
     }
 
     info.pushKV("depends", depends);
 
     UniValue spent(UniValue::VARR);
-    const CTxMemPool::txiter &it = mempool.mapTx.find(tx.GetHash());
-    const CTxMemPool::setEntries &setChildren = mempool.GetMemPoolChildren(it);
-    for (const CTxMemPool::txiter &childiter : setChildren) {
-        spent.push_back(childiter->GetTx().GetHash().ToString());
+    for (const uint256& child : e.spentby) {
+        spent.push_back(child.ToString());
     }
 
     info.pushKV("spentby", spent);
 }
 
+static void entryToJSON(UniValue &info, const CTxMemPoolEntry &e) EXCLUSIVE_LOCKS_REQUIRED(::mempool.cs)
+{
+    AssertLockHeld(mempool.cs);
+    entryToJSON(info, SnapshotEntry(mempool.mapTx.find(e.GetTx().GetHash())));
+}
+
+std::vector<MempoolEntrySnapshot> MempoolSnapshot()
+{
+    LOCK(mempool.cs);
+    std::vector<MempoolEntrySnapshot> snapshot;
+    snapshot.reserve(mempool.mapTx.size());
+    for (CTxMemPool::txiter it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it) {
+        snapshot.push_back(SnapshotEntry(it));
+    }
+    return snapshot;
+}
+
+void MempoolSnapshotToJSON(const std::vector<MempoolEntrySnapshot>& snapshot, std::string& out)
+{
+    // Writes what mempoolToJSON(true).write() would, key for key
+    auto amount = [&out](const char* key, CAmount value) {
+        out += key;
+        out += ValueFromAmount(value).getValStr();
+    };
+    auto number = [&out](const char* key, int64_t value) {
+        out += key;
+        out += std::to_string(value);
+    };
+    auto hashes = [&out](const char* key, const std::vector<uint256>& values) {
+        out += key;
+        out += '[';
+        for (size_t i = 0; i < values.size(); i++) {
+            if (i > 0) out += ',';
+            out += '"';
+            out += values[i].ToString();
+            out += '"';
+        }
+        out += ']';
+    };
+
+    // An entry without dependencies takes about 550 characters
+    out.reserve(out.size() + snapshot.size() * 600 + 2);
+    out += '{';
+    for (size_t i = 0; i < snapshot.size(); i++) {
+        const MempoolEntrySnapshot& e = snapshot[i];
+        if (i > 0) out += ',';
+        out += '"';
+        out += e.txid.ToString();
+        out += "\":{";
+        amount("\"fees\":{\"base\":", e.fee);
+        amount(",\"modified\":", e.modifiedfee);
+        amount(",\"ancestor\":", e.ancestorfees);
+        amount(",\"descendant\":", e.descendantfees);
+        out += '}';
+        number(",\"size\":", e.size);
+        amount(",\"fee\":", e.fee);
+        amount(",\"modifiedfee\":", e.modifiedfee);
+        number(",\"time\":", e.time);
+        number(",\"height\":", e.height);
+        number(",\"descendantcount\":", e.descendantcount);
+        number(",\"descendantsize\":", e.descendantsize);
+        number(",\"descendantfees\":", e.descendantfees);
+        number(",\"ancestorcount\":", e.ancestorcount);
+        number(",\"ancestorsize\":", e.ancestorsize);
+        number(",\"ancestorfees\":", e.ancestorfees);
+        out += ",\"wtxid\":\"";
+        out += e.wtxid.ToString();
+        out += '"';
+        hashes(",\"depends\":", e.depends);
+        hashes(",\"spentby\":", e.spentby);
+        out += '}';
+    }
+    out += '}';
+}
+
 UniValue mempoolToJSON(bool fVerbose)
 {
     if (fVerbose)
     {
-        LOCK(mempool.cs);
+        // Only copying the entries needs the lock, not formatting them
+        const std::vector<MempoolEntrySnapshot> snapshot = MempoolSnapshot();
         UniValue o(UniValue::VOBJ);
-        for (const CTxMemPoolEntry& e : mempool.mapTx)
+        for (const MempoolEntrySnapshot& e : snapshot)
         {
-            const uint256& hash = e.GetTx().GetHash();
             UniValue info(UniValue::VOBJ);
             entryToJSON(info, e);
-            o.pushKV(hash.ToString(), info);
+            // txids are unique, so skip the linear key lookup of pushKV
+            o.__pushKV(e.txid.ToString(), info);
         }
         return o;
     }
@@ -1408,6 +1517,10 @@ UniValue mempoolInfoToJSON()
     ret.pushKV("maxmempool", (int64_t) maxmempool);
     ret.pushKV("mempoolminfee", ValueFromAmount(std::max(mempool.GetMinFee(maxmempool), ::minRelayTxFee).GetFeePerK()));
     ret.pushKV("minrelaytxfee", ValueFromAmount(::minRelayTxFee.GetFeePerK()));
+    const MempoolEvictionStats eviction_stats = mempool.GetEvictionStats();
+    ret.pushKV("evictions", (int64_t) eviction_stats.events);
+    ret.pushKV("evictedtxs", (int64_t) eviction_stats.txs);
+    ret.pushKV("evictiontime", eviction_stats.time * 0.000001);
 
     return ret;
 }
@@ -1426,6 +1539,9 @@ static UniValue getmempoolinfo(const JSONRPCRequest& request)
             "  \"maxmempool\": xxxxx,         (numeric) Maximum memory usage for the mempool\n"
             "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee rate in " + CURRENCY_UNIT + "/kB for tx to be accepted. Is the maximum of minrelaytxfee and minimum mempool fee\n"
             "  \"minrelaytxfee\": xxxxx       (numeric) Current minimum relay fee for transactions\n"
+            "  \"evictions\": xxxxx           (numeric) Number of times transactions were removed for the size limit or expiry since startup\n"
+            "  \"evictedtxs\": xxxxx          (numeric) Number of transactions removed by those evictions\n"
+            "  \"evictiontime\": xxxxx        (numeric) Total time spent on those evictions in seconds\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
@@ -2179,6 +2295,81 @@ UniValue scantxoutset(const JSONRPCRequest& request)
     return result;
 }
 
+static UniValue getblockfilter(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw std::runtime_error(
+            "getblockfilter \"blockhash\" ( \"filtertype\" )\n"
+            "\nRetrieve a BIP 157 content filter for a particular block.\n"
+            "Requires -blockfilterindex.\n"
+            "\nArguments:\n"
+            "1. \"blockhash\"   (string, required) The hash of the block\n"
+            "2. \"filtertype\"  (string, optional, default=basic) The type name of the filter\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"filter\" : (string) the hex-encoded filter data\n"
+            "  \"header\" : (string) the hex-encoded filter header\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\" \"basic\"")
+            + HelpExampleRpc("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\", \"basic\"")
+        );
+
+    uint256 block_hash = ParseHashV(request.params[0], "blockhash");
+    std::string filtertype_name = "basic";
+    if (!request.params[1].isNull()) {
+        filtertype_name = request.params[1].get_str();
+    }
+
+    BlockFilterType filtertype;
+    if (!BlockFilterTypeByName(filtertype_name, filtertype)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown filtertype");
+    }
+
+    if (!g_blockfilterindex || g_blockfilterindex->GetFilterType() != filtertype) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Index is not enabled for filtertype " + filtertype_name);
+    }
+
+    const CBlockIndex* block_index;
+    bool block_was_connected;
+    {
+        LOCK(cs_main);
+        block_index = LookupBlockIndex(block_hash);
+        if (!block_index) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        }
+        block_was_connected = block_index->IsValid(BLOCK_VALID_SCRIPTS);
+    }
+
+    bool index_ready = g_blockfilterindex->BlockUntilSyncedToCurrentChain();
+
+    BlockFilter filter;
+    uint256 filter_header;
+    if (!g_blockfilterindex->LookupFilter(block_index, filter) ||
+        !g_blockfilterindex->LookupFilterHeader(block_index, filter_header)) {
+        int err_code;
+        std::string errmsg = "Filter not found.";
+
+        if (!block_was_connected) {
+            err_code = RPC_INVALID_ADDRESS_OR_KEY;
+            errmsg += " Block was not connected to active chain.";
+        } else if (!index_ready) {
+            err_code = RPC_MISC_ERROR;
+            errmsg += " Block filters are still in the process of being indexed.";
+        } else {
+            err_code = RPC_INTERNAL_ERROR;
+            errmsg += " This error is unexpected and indicates index corruption.";
+        }
+
+        throw JSONRPCError(err_code, errmsg);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.pushKV("filter", HexStr(filter.GetEncodedFilter()));
+    ret.pushKV("header", filter_header.GetHex());
+    return ret;
+}
+
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         argNames
   //  --------------------- ------------------------  -----------------------  ----------
@@ -2205,6 +2396,7 @@ static const CRPCCommand commands[] =
 
     { "blockchain",         "preciousblock",          &preciousblock,          {"blockhash"} },
     { "blockchain",         "scantxoutset",           &scantxoutset,           {"action", "scanobjects"} },
+    { "blockchain",         "getblockfilter",         &getblockfilter,         {"blockhash", "filtertype"} },
 
     /* Not shown in help */
     { "hidden",             "invalidateblock",        &invalidateblock,        {"blockhash"} },
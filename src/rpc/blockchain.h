@@ -5,9 +5,12 @@
 #ifndef BITCOIN_RPC_BLOCKCHAIN_H
 #define BITCOIN_RPC_BLOCKCHAIN_H
 
+#include <string>
 #include <vector>
 #include <stdint.h>
 #include <amount.h>
+#include <serialize.h>
+#include <uint256.h>
 
 class CBlock;
 class CBlockIndex;
@@ -36,6 +39,54 @@ UniValue mempoolInfoToJSON();
 /** Mempool to JSON */
 UniValue mempoolToJSON(bool fVerbose = false);
 
+/** Copy of the data getrawmempool reports for a mempool entry */
+struct MempoolEntrySnapshot
+{
+    uint256 txid;
+    uint256 wtxid;
+    uint32_t size = 0;
+    CAmount fee = 0;
+    CAmount modifiedfee = 0;
+    int64_t time = 0;
+    uint32_t height = 0;
+    uint64_t descendantcount = 0;
+    uint64_t descendantsize = 0;
+    CAmount descendantfees = 0;
+    uint64_t ancestorcount = 0;
+    uint64_t ancestorsize = 0;
+    CAmount ancestorfees = 0;
+    std::vector<uint256> depends; //!< in the order of their hex strings
+    std::vector<uint256> spentby;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(txid);
+        READWRITE(wtxid);
+        READWRITE(VARINT(size));
+        READWRITE(fee);
+        READWRITE(modifiedfee);
+        READWRITE(time);
+        READWRITE(VARINT(height));
+        READWRITE(VARINT(descendantcount));
+        READWRITE(VARINT(descendantsize));
+        READWRITE(descendantfees);
+        READWRITE(VARINT(ancestorcount));
+        READWRITE(VARINT(ancestorsize));
+        READWRITE(ancestorfees);
+        READWRITE(depends);
+        READWRITE(spentby);
+    }
+};
+
+/** Copy all mempool entries, holding mempool.cs only while copying */
+std::vector<MempoolEntrySnapshot> MempoolSnapshot();
+
+/** Append the getrawmempool verbose JSON of a snapshot to out, without
+ *  building a UniValue per entry */
+void MempoolSnapshotToJSON(const std::vector<MempoolEntrySnapshot>& snapshot, std::string& out);
+
 /** Block header to JSON */
 UniValue blockheaderToJSON(const CBlockIndex* blockindex);
 
@@ -78,6 +78,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "sendmany", 4, "subtractfeefrom" },
     { "sendmany", 5 , "replaceable" },
     { "sendmany", 6 , "conf_target" },
+    { "sendpayouts", 0, "payouts" },
+    { "sendpayouts", 1, "options" },
     { "scantxoutset", 1, "scanobjects" },
     { "addmultisigaddress", 0, "nrequired" },
     { "addmultisigaddress", 1, "keys" },
@@ -178,6 +180,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "listmintings", 3, "addresses" },
     { "listmintings", 4, "include_unsafe" },
     { "listmintings", 5, "query_options" },
+    { "planstakeoutputs", 0, "execute" },
+    { "planstakeoutputs", 1, "options" },
 };
 
 class CRPCConvertTable
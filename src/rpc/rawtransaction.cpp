@@ -1181,20 +1181,23 @@ static UniValue testmempoolaccept(const JSONRPCRequest& request)
         throw std::runtime_error(
             // clang-format off
             "testmempoolaccept [\"rawtxs\"] ( allowhighfees )\n"
-            "\nReturns if raw transaction (serialized, hex-encoded) would be accepted by mempool.\n"
-            "\nThis checks if the transaction violates the consensus or policy rules.\n"
+            "\nReturns if raw transactions (serialized, hex-encoded) would be accepted by mempool.\n"
+            "\nThis checks if the transactions violate the consensus or policy rules.\n"
+            "More than one transaction is tested as a package, which is accepted or rejected as a whole.\n"
+            "Parents must come before their children in a package, and the fee rate is that of the\n"
+            "package, so that children can pay for their parents.\n"
             "\nSee sendrawtransaction call.\n"
             "\nArguments:\n"
             "1. [\"rawtxs\"]       (array, required) An array of hex strings of raw transactions.\n"
-            "                                        Length must be one for now.\n"
+            "                                        At most " + std::to_string(MAX_PACKAGE_COUNT) + " transactions.\n"
             "2. allowhighfees    (boolean, optional, default=false) Allow high fees\n"
             "\nResult:\n"
             "[                   (array) The result of the mempool acceptance test for each raw transaction in the input array.\n"
-            "                            Length is exactly one for now.\n"
             " {\n"
             "  \"txid\"           (string) The transaction hash in hex\n"
             "  \"allowed\"        (boolean) If the mempool allows this tx to be inserted\n"
-            "  \"reject-reason\"  (string) Rejection string (only present when 'allowed' is false)\n"
+            "  \"reject-reason\"  (string) Rejection string (only present when 'allowed' is false). For a package,\n"
+            "                   the other transactions are rejected with \"package-rejected\".\n"
             " }\n"
             "]\n"
             "\nExamples:\n"
@@ -1211,46 +1214,58 @@ static UniValue testmempoolaccept(const JSONRPCRequest& request)
     }
 
     RPCTypeCheck(request.params, {UniValue::VARR, UniValue::VBOOL});
-    if (request.params[0].get_array().size() != 1) {
-        throw JSONRPCError(RPC_INVALID_PARAMETER, "Array must contain exactly one raw transaction for now");
+    const UniValue& rawtxs = request.params[0].get_array();
+    if (rawtxs.size() < 1 || rawtxs.size() > MAX_PACKAGE_COUNT) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Array must contain between 1 and %u raw transactions", MAX_PACKAGE_COUNT));
     }
 
-    CMutableTransaction mtx;
-    if (!DecodeHexTx(mtx, request.params[0].get_array()[0].get_str())) {
-        throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "TX decode failed");
+    std::vector<CTransactionRef> txns;
+    for (unsigned int i = 0; i < rawtxs.size(); i++) {
+        CMutableTransaction mtx;
+        if (!DecodeHexTx(mtx, rawtxs[i].get_str())) {
+            throw JSONRPCError(RPC_DESERIALIZATION_ERROR, "TX decode failed");
+        }
+        txns.push_back(MakeTransactionRef(std::move(mtx)));
     }
-    CTransactionRef tx(MakeTransactionRef(std::move(mtx)));
-    const uint256& tx_hash = tx->GetHash();
 
     CAmount max_raw_tx_fee = ::maxTxFee;
     if (!request.params[1].isNull() && request.params[1].get_bool()) {
         max_raw_tx_fee = 0;
     }
 
-    UniValue result(UniValue::VARR);
-    UniValue result_0(UniValue::VOBJ);
-    result_0.pushKV("txid", tx_hash.GetHex());
-
     CValidationState state;
     bool missing_inputs;
     bool test_accept_res;
+    uint256 failed_tx;
     {
         LOCK(cs_main);
-        test_accept_res = AcceptToMemoryPool(mempool, state, std::move(tx), &missing_inputs,
-            nullptr /* plTxnReplaced */, false /* bypass_limits */, max_raw_tx_fee, /* test_accept */ true);
-    }
-    result_0.pushKV("allowed", test_accept_res);
-    if (!test_accept_res) {
-        if (state.IsInvalid()) {
-            result_0.pushKV("reject-reason", strprintf("%i: %s", state.GetRejectCode(), state.GetRejectReason()));
-        } else if (missing_inputs) {
-            result_0.pushKV("reject-reason", "missing-inputs");
+        if (txns.size() == 1) {
+            test_accept_res = AcceptToMemoryPool(mempool, state, txns[0], &missing_inputs,
+                nullptr /* plTxnReplaced */, false /* bypass_limits */, max_raw_tx_fee, /* test_accept */ true);
+            failed_tx = txns[0]->GetHash();
         } else {
-            result_0.pushKV("reject-reason", state.GetRejectReason());
+            test_accept_res = AcceptPackageToMemoryPool(mempool, state, txns, &missing_inputs, max_raw_tx_fee, /* test_accept */ true, &failed_tx);
         }
     }
 
-    result.push_back(std::move(result_0));
+    UniValue result(UniValue::VARR);
+    for (const CTransactionRef& tx : txns) {
+        UniValue result_tx(UniValue::VOBJ);
+        result_tx.pushKV("txid", tx->GetHash().GetHex());
+        result_tx.pushKV("allowed", test_accept_res);
+        if (!test_accept_res) {
+            if (!failed_tx.IsNull() && tx->GetHash() != failed_tx) {
+                result_tx.pushKV("reject-reason", "package-rejected");
+            } else if (state.IsInvalid()) {
+                result_tx.pushKV("reject-reason", strprintf("%i: %s", state.GetRejectCode(), state.GetRejectReason()));
+            } else if (missing_inputs) {
+                result_tx.pushKV("reject-reason", "missing-inputs");
+            } else {
+                result_tx.pushKV("reject-reason", state.GetRejectReason());
+            }
+        }
+        result.push_back(std::move(result_tx));
+    }
     return result;
 }
 
@@ -124,8 +124,9 @@ struct PrecomputedTransactionData
     uint256 hashPrevouts, hashSequence, hashOutputs;
     bool ready = false;
 
+    //! force computes the hashes for a transaction that has no witness yet, such as one about to be signed
     template <class T>
-    explicit PrecomputedTransactionData(const T& tx);
+    explicit PrecomputedTransactionData(const T& tx, bool force = false);
 };
 
 enum class SigVersion
@@ -686,5 +686,34 @@ BOOST_AUTO_TEST_CASE(addrman_evictionworks)
     BOOST_CHECK(addrman.SelectTriedCollision().ToString() == "[::]:0");
 }
 
+BOOST_AUTO_TEST_CASE(addrman_batch_add)
+{
+    CAddrManTest addrman_batch;
+    CAddrManTest addrman_single;
+
+    CNetAddr source = ResolveIP("252.2.2.2");
+
+    // Addresses from many groups, some of them announced again with another port or a later time.
+    std::vector<CAddress> vAddr;
+    for (int i = 0; i < 400; i++) {
+        CAddress addr(ResolveService(strprintf("%i.%i.1.%i", 250 - i % 7, i % 200, i % 3), 8000 + i % 5), NODE_NONE);
+        addr.nTime = GetAdjustedTime() - 60 * 60 * (i % 11);
+        vAddr.push_back(addr);
+    }
+
+    BOOST_CHECK(addrman_batch.Add(vAddr, source));
+    for (const CAddress& addr : vAddr) {
+        addrman_single.Add(addr, source);
+    }
+
+    // Placing the addresses at precomputed positions must not change where they end up.
+    BOOST_CHECK_EQUAL(addrman_batch.size(), addrman_single.size());
+    CDataStream ss_batch(SER_DISK, CLIENT_VERSION);
+    CDataStream ss_single(SER_DISK, CLIENT_VERSION);
+    ss_batch << addrman_batch;
+    ss_single << addrman_single;
+    BOOST_CHECK(ss_batch.str() == ss_single.str());
+}
+
 
 BOOST_AUTO_TEST_SUITE_END()
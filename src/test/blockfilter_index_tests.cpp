@@ -0,0 +1,108 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Copyright (c) 2018 The XPChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockfilter.h>
+#include <chainparams.h>
+#include <index/blockfilterindex.h>
+#include <script/standard.h>
+#include <test/test_bitcoin.h>
+#include <undo.h>
+#include <util.h>
+#include <utiltime.h>
+#include <validation.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockfilter_index_tests)
+
+static bool CheckFilterLookups(BlockFilterIndex& filter_index, const CBlockIndex* block_index,
+                               uint256& last_header)
+{
+    BlockFilter expected_filter;
+    {
+        CBlock block;
+        CBlockUndo block_undo;
+        if (!ReadBlockFromDisk(block, block_index, Params().GetConsensus())) return false;
+        if (block_index->nHeight > 0 && !UndoReadFromDisk(block_undo, block_index)) return false;
+        expected_filter = BlockFilter(BlockFilterType::BASIC, block, block_undo);
+    }
+
+    BlockFilter filter;
+    uint256 filter_header;
+    BOOST_CHECK(filter_index.LookupFilter(block_index, filter));
+    BOOST_CHECK(filter_index.LookupFilterHeader(block_index, filter_header));
+
+    BOOST_CHECK(filter.GetBlockHash() == block_index->GetBlockHash());
+    BOOST_CHECK(filter.GetEncodedFilter() == expected_filter.GetEncodedFilter());
+    BOOST_CHECK(filter_header == expected_filter.ComputeHeader(last_header));
+
+    last_header = filter_header;
+    return true;
+}
+
+BOOST_FIXTURE_TEST_CASE(blockfilter_index_initial_sync, TestChain100Setup)
+{
+    BlockFilterIndex filter_index(BlockFilterType::BASIC, 1 << 20, true);
+
+    BlockFilter filter;
+    uint256 filter_header;
+    const CBlockIndex* tip;
+    {
+        LOCK(cs_main);
+        tip = chainActive.Tip();
+    }
+
+    // Filters should not be found in the index before it is started.
+    BOOST_CHECK(!filter_index.LookupFilter(tip, filter));
+    BOOST_CHECK(!filter_index.LookupFilterHeader(tip, filter_header));
+
+    // BlockUntilSyncedToCurrentChain should return false before the index is started.
+    BOOST_CHECK(!filter_index.BlockUntilSyncedToCurrentChain());
+
+    filter_index.Start();
+
+    // Allow filter index to catch up with the block index.
+    constexpr int64_t timeout_ms = 10 * 1000;
+    int64_t time_start = GetTimeMillis();
+    while (!filter_index.BlockUntilSyncedToCurrentChain()) {
+        BOOST_REQUIRE(time_start + timeout_ms > GetTimeMillis());
+        MilliSleep(100);
+    }
+
+    // Check that the filters and the filter header chain of all blocks that
+    // were in the chain before the index started are indexed.
+    uint256 last_header;
+    for (int height = 0; height <= tip->nHeight; ++height) {
+        const CBlockIndex* block_index;
+        {
+            LOCK(cs_main);
+            block_index = chainActive[height];
+        }
+        BOOST_CHECK(CheckFilterLookups(filter_index, block_index, last_header));
+    }
+
+    // Check that filters of new blocks make it into the index and match the
+    // script their coinbase pays to.
+    CScript coinbase_script_pub_key = GetScriptForDestination(coinbaseKey.GetPubKey().GetID());
+    for (int i = 0; i < 10; i++) {
+        std::vector<CMutableTransaction> no_txns;
+        CreateAndProcessBlock(no_txns, coinbase_script_pub_key);
+
+        BOOST_CHECK(filter_index.BlockUntilSyncedToCurrentChain());
+        const CBlockIndex* block_index;
+        {
+            LOCK(cs_main);
+            block_index = chainActive.Tip();
+        }
+        BOOST_CHECK(CheckFilterLookups(filter_index, block_index, last_header));
+
+        BOOST_CHECK(filter_index.LookupFilter(block_index, filter));
+        BOOST_CHECK(filter.GetFilter().Match(GCSFilter::Element(coinbase_script_pub_key.begin(), coinbase_script_pub_key.end())));
+    }
+
+    filter_index.Stop(); // Stop thread before calling destructor
+}
+
+BOOST_AUTO_TEST_SUITE_END()
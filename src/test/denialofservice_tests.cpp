@@ -321,6 +321,45 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     peerLogic->FinalizeNode(dummyNode.GetId(), dummy);
 }
 
+BOOST_AUTO_TEST_CASE(block_download_window)
+{
+    const int64_t nTimeout = BLOCK_STALLING_TIMEOUT * 1000000;
+    int64_t nNow = 100 * nTimeout;
+    BlockDownloadWindow window;
+    BOOST_CHECK_EQUAL(window.Size(), (int)BLOCK_DOWNLOAD_WINDOW);
+
+    // A stall widens the window once, however often it is seen within a stalling timeout
+    window.Update(0, true, nNow);
+    BOOST_CHECK_EQUAL(window.Size(), 2 * (int)BLOCK_DOWNLOAD_WINDOW);
+    for (int i = 0; i < 100; ++i) {
+        window.Update(0, true, nNow + i * 1000);
+    }
+    BOOST_CHECK_EQUAL(window.Size(), 2 * (int)BLOCK_DOWNLOAD_WINDOW);
+
+    // Stalls in later intervals widen it up to the maximum
+    for (int i = 1; i < 10; ++i) {
+        window.Update(0, true, nNow + i * nTimeout);
+    }
+    BOOST_CHECK_EQUAL(window.Size(), (int)MAX_BLOCK_DOWNLOAD_WINDOW);
+
+    // A backlog shrinks it back, also once per interval, but not below the initial size
+    nNow += 10 * nTimeout;
+    window.Update(MAX_BLOCK_DOWNLOAD_WINDOW, false, nNow);
+    BOOST_CHECK_EQUAL(window.Size(), (int)MAX_BLOCK_DOWNLOAD_WINDOW / 2);
+    window.Update(MAX_BLOCK_DOWNLOAD_WINDOW, false, nNow + 1);
+    BOOST_CHECK_EQUAL(window.Size(), (int)MAX_BLOCK_DOWNLOAD_WINDOW / 2);
+    for (int i = 1; i < 10; ++i) {
+        window.Update(MAX_BLOCK_DOWNLOAD_WINDOW, false, nNow + i * nTimeout);
+    }
+    BOOST_CHECK_EQUAL(window.Size(), (int)BLOCK_DOWNLOAD_WINDOW);
+
+    // An unchanged window does not hold back the next change
+    nNow += 10 * nTimeout;
+    window.Update(0, false, nNow);
+    window.Update(0, true, nNow + 1);
+    BOOST_CHECK_EQUAL(window.Size(), 2 * (int)BLOCK_DOWNLOAD_WINDOW);
+}
+
 static CTransactionRef RandomOrphan()
 {
     std::map<uint256, COrphanTx>::iterator it;
@@ -0,0 +1,91 @@
+// Copyright (c) 2018 The XPChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <consensus/validation.h>
+#include <key.h>
+#include <pubkey.h>
+#include <script/interpreter.h>
+#include <txmempool.h>
+#include <validation.h>
+
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(mempool_persist_tests, TestChain100Setup)
+
+static CTransactionRef Spend(const CTransactionRef& prev, CAmount nValue, const CKey& key)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction tx;
+    tx.nVersion = 1;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(prev->GetHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL, 0, SigVersion::BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return MakeTransactionRef(tx);
+}
+
+static void ToMemPool(const CTransactionRef& tx)
+{
+    LOCK(cs_main);
+    CValidationState state;
+    BOOST_CHECK(AcceptToMemoryPool(mempool, state, tx, nullptr /* pfMissingInputs */,
+                                   nullptr /* plTxnReplaced */, true /* bypass_limits */, 0 /* nAbsurdFee */));
+}
+
+static CAmount GetFeeDelta(const uint256& hash)
+{
+    LOCK(mempool.cs);
+    CTxMemPool::txiter it = mempool.mapTx.find(hash);
+    BOOST_REQUIRE(it != mempool.mapTx.end());
+    return it->GetModifiedFee() - it->GetFee();
+}
+
+BOOST_AUTO_TEST_CASE(mempool_journal_deltas)
+{
+    // Fee deltas written to mempool.dat and its journal are applied once on load
+    const CTransactionRef tx1 = Spend(m_coinbase_txns[0], 11 * CENT, coinbaseKey);
+    const CTransactionRef tx2 = Spend(tx1, 10 * CENT, coinbaseKey);
+    const uint256 hashMissing = InsecureRand256();
+
+    ToMemPool(tx1);
+    mempool.PrioritiseTransaction(tx1->GetHash(), 1000);
+    mempool.PrioritiseTransaction(hashMissing, 500);
+    BOOST_CHECK(StartMempoolJournal());
+
+    // Changes after the snapshot go to the journal
+    ToMemPool(tx2);
+    mempool.PrioritiseTransaction(tx2->GetHash(), 2000);
+    mempool.PrioritiseTransaction(tx1->GetHash(), 300);
+    BOOST_CHECK(FlushMempoolJournal());
+    // A prioritisation alone is flushed too
+    mempool.PrioritiseTransaction(tx2->GetHash(), 40);
+    BOOST_CHECK(FlushMempoolJournal());
+    StopMempoolJournal();
+
+    mempool.clear();
+    mempool.ClearPrioritisation(tx1->GetHash());
+    mempool.ClearPrioritisation(tx2->GetHash());
+    mempool.ClearPrioritisation(hashMissing);
+
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 2U);
+    BOOST_CHECK_EQUAL(GetFeeDelta(tx1->GetHash()), 1300);
+    BOOST_CHECK_EQUAL(GetFeeDelta(tx2->GetHash()), 2040);
+    LOCK(mempool.cs);
+    BOOST_CHECK_EQUAL(mempool.mapDeltas.size(), 3U);
+    BOOST_CHECK_EQUAL(mempool.mapDeltas[tx1->GetHash()], 1300);
+    BOOST_CHECK_EQUAL(mempool.mapDeltas[tx2->GetHash()], 2040);
+    BOOST_CHECK_EQUAL(mempool.mapDeltas[hashMissing], 500);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@
 
 #include <policy/policy.h>
 #include <txmempool.h>
+#include <txrelay.h>
 #include <util.h>
 
 #include <test/test_bitcoin.h>
@@ -573,6 +574,54 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolTrimBatchTest)
+{
+    // Trimming removes the same transactions as evicting the package with the
+    // lowest descendant score one at a time
+    CTxMemPool pool, poolSequential;
+    LOCK2(pool.cs, poolSequential.cs);
+    TestMemPoolEntryHelper entry;
+
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 200; i++) {
+        CMutableTransaction tx;
+        int nInputs = outpoints.empty() ? 0 : InsecureRandRange(3);
+        for (int j = 0; j < nInputs && !outpoints.empty(); j++) {
+            size_t idx = InsecureRandRange(outpoints.size());
+            tx.vin.emplace_back(outpoints[idx]);
+            outpoints.erase(outpoints.begin() + idx);
+        }
+        if (tx.vin.empty()) {
+            tx.vin.resize(1);
+            tx.vin[0].scriptSig = CScript() << i;
+        }
+        tx.vout.resize(1 + InsecureRandRange(3));
+        for (size_t j = 0; j < tx.vout.size(); j++) {
+            tx.vout[j].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+            tx.vout[j].nValue = COIN;
+            outpoints.emplace_back(tx.GetHash(), j);
+        }
+        entry.Fee(1000 + i * 7 + InsecureRandRange(5000)).Time(i);
+        pool.addUnchecked(tx.GetHash(), entry.FromTx(tx));
+        poolSequential.addUnchecked(tx.GetHash(), entry.FromTx(tx));
+    }
+
+    const size_t limit = pool.DynamicMemoryUsage() / 3;
+    pool.TrimToSize(limit);
+    while (poolSequential.DynamicMemoryUsage() > limit) {
+        poolSequential.removeRecursive(poolSequential.mapTx.get<descendant_score>().begin()->GetTx());
+    }
+    BOOST_CHECK(pool.DynamicMemoryUsage() <= limit);
+    BOOST_CHECK_EQUAL(pool.size(), poolSequential.size());
+    for (const CTxMemPoolEntry& e : poolSequential.mapTx) {
+        BOOST_CHECK(pool.exists(e.GetTx().GetHash()));
+    }
+
+    MempoolEvictionStats stats = pool.GetEvictionStats();
+    BOOST_CHECK_EQUAL(stats.events, 1U);
+    BOOST_CHECK_EQUAL(stats.txs, 200 - pool.size());
+}
+
 inline CTransactionRef make_tx(std::vector<CAmount>&& output_values, std::vector<CTransactionRef>&& inputs=std::vector<CTransactionRef>(), std::vector<uint32_t>&& input_indices=std::vector<uint32_t>())
 {
     CMutableTransaction tx = CMutableTransaction();
@@ -749,4 +798,153 @@ BOOST_AUTO_TEST_CASE(MempoolAncestryTests)
     BOOST_CHECK_EQUAL(descendants, 6ULL);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorChainLimits)
+{
+    CTxMemPool pool;
+    LOCK(pool.cs);
+    TestMemPoolEntryHelper entry;
+    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+
+    // Two chains of 24 transactions
+    std::vector<CTransactionRef> chains[2];
+    for (int i = 0; i < 2; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << i;
+        tx.vout.resize(2);
+        tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[0].nValue = 10 * COIN;
+        tx.vout[1] = tx.vout[0];
+        for (int j = 0; j < 24; j++) {
+            chains[i].push_back(MakeTransactionRef(tx));
+            pool.addUnchecked(tx.GetHash(), entry.FromTx(tx));
+            tx.vin[0].prevout = COutPoint(tx.GetHash(), 0);
+        }
+    }
+
+    // A transaction spending the tip of one chain has 24 ancestors
+    CMutableTransaction child;
+    child.vin.resize(1);
+    child.vin[0].prevout = COutPoint(chains[0].back()->GetHash(), 0);
+    child.vout.resize(1);
+    child.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    child.vout[0].nValue = 10 * COIN;
+    CTxMemPool::setEntries setAncestors;
+    std::string errString;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry.FromTx(child), setAncestors, 25, nNoLimit, 25, nNoLimit, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 24U);
+
+    // Spending the tips of both chains exceeds the ancestor limit, but not the descendant limit
+    child.vin.resize(2);
+    child.vin[1].prevout = COutPoint(chains[1].back()->GetHash(), 0);
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry.FromTx(child), setAncestors, 25, nNoLimit, 25, nNoLimit, errString));
+    BOOST_CHECK_EQUAL(errString, "too many unconfirmed ancestors [limit: 25]");
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry.FromTx(child), setAncestors, 49, nNoLimit, 25, nNoLimit, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 48U);
+    pool.addUnchecked(child.GetHash(), entry.FromTx(child), setAncestors);
+
+    // The roots of the chains now have 25 descendants each
+    CMutableTransaction sibling;
+    sibling.vin.resize(1);
+    sibling.vin[0].prevout = COutPoint(chains[0].front()->GetHash(), 1);
+    sibling.vout = child.vout;
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry.FromTx(sibling), setAncestors, 25, nNoLimit, 25, nNoLimit, errString));
+    BOOST_CHECK_EQUAL(errString, strprintf("too many descendants for tx %s [limit: 25]", chains[0].front()->GetHash().ToString()));
+
+    // A parent and its two children form one cluster, which is not split when
+    // the parent is mined, so it overestimates the descendants of either
+    // child and the limits are checked exactly instead
+    CMutableTransaction parent;
+    parent.vin.resize(1);
+    parent.vin[0].scriptSig = CScript() << 2;
+    parent.vout = chains[0].front()->vout;
+    pool.addUnchecked(parent.GetHash(), entry.FromTx(parent));
+    CMutableTransaction children[2];
+    for (int i = 0; i < 2; i++) {
+        children[i].vin.resize(1);
+        children[i].vin[0].prevout = COutPoint(parent.GetHash(), i);
+        children[i].vout = child.vout;
+        pool.addUnchecked(children[i].GetHash(), entry.FromTx(children[i]));
+    }
+    pool.removeForBlock({MakeTransactionRef(parent)}, 1);
+    CMutableTransaction grandchild;
+    grandchild.vin.resize(1);
+    grandchild.vin[0].prevout = COutPoint(children[0].GetHash(), 0);
+    grandchild.vout = child.vout;
+    setAncestors.clear();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry.FromTx(grandchild), setAncestors, 2, nNoLimit, 2, nNoLimit, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(TxRelayOrderTest)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+
+    // [tx1] <- [tx2], and an unrelated [tx3] paying the highest fee
+    CTransactionRef tx1 = make_tx(/* output_values */ {10 * COIN});
+    CTransactionRef tx2 = make_tx(/* output_values */ {5 * COIN}, /* inputs */ {tx1});
+    CTransactionRef tx3 = make_tx(/* output_values */ {10 * COIN, 1 * COIN});
+    CTransactionRef tx4 = make_tx(/* output_values */ {1 * COIN});
+    {
+        LOCK(pool.cs);
+        pool.addUnchecked(tx1->GetHash(), entry.Fee(1000LL).FromTx(tx1));
+        pool.addUnchecked(tx2->GetHash(), entry.Fee(100000LL).FromTx(tx2));
+        pool.addUnchecked(tx3->GetHash(), entry.Fee(20000LL).FromTx(tx3));
+    }
+
+    TxRelayOrder order(pool);
+    std::set<uint256> setToSend = {tx1->GetHash(), tx2->GetHash(), tx3->GetHash(), tx4->GetHash()};
+    std::vector<TxRelayOrder::RankedTx> vRanked;
+    order.Rank(setToSend, vRanked);
+
+    // tx4 is not in the mempool and is dropped from the queue
+    BOOST_CHECK_EQUAL(setToSend.size(), 3U);
+    BOOST_CHECK_EQUAL(vRanked.size(), 3U);
+    BOOST_CHECK_EQUAL(order.size(), 3U);
+    std::sort(vRanked.begin(), vRanked.end(), [](const TxRelayOrder::RankedTx& a, const TxRelayOrder::RankedTx& b) { return a.first < b.first; });
+    BOOST_CHECK(*vRanked[0].second == tx3->GetHash());
+    BOOST_CHECK(*vRanked[1].second == tx1->GetHash());
+    BOOST_CHECK(*vRanked[2].second == tx2->GetHash());
+
+    // A parent queued after its child was ranked is still announced first
+    std::set<uint256> setChild = {tx2->GetHash()};
+    order.Rank(setChild, vRanked);
+    std::set<uint256> setFamily = {tx1->GetHash(), tx2->GetHash()};
+    order.Rank(setFamily, vRanked);
+    BOOST_CHECK_EQUAL(vRanked.size(), 2U);
+    std::sort(vRanked.begin(), vRanked.end(), [](const TxRelayOrder::RankedTx& a, const TxRelayOrder::RankedTx& b) { return a.first < b.first; });
+    BOOST_CHECK(*vRanked[0].second == tx1->GetHash());
+    BOOST_CHECK(*vRanked[1].second == tx2->GetHash());
+
+    // Another peer's queue, ranked after the mempool changed, is sorted by fee
+    // rate against the transactions ranked before
+    {
+        LOCK(pool.cs);
+        pool.addUnchecked(tx4->GetHash(), entry.Fee(50000LL).FromTx(tx4));
+    }
+    std::set<uint256> setToSend2 = {tx4->GetHash(), tx2->GetHash(), tx3->GetHash()};
+    order.Rank(setToSend2, vRanked);
+    BOOST_CHECK_EQUAL(vRanked.size(), 3U);
+    std::sort(vRanked.begin(), vRanked.end(), [](const TxRelayOrder::RankedTx& a, const TxRelayOrder::RankedTx& b) { return a.first < b.first; });
+    BOOST_CHECK(*vRanked[0].second == tx4->GetHash());
+    BOOST_CHECK(*vRanked[1].second == tx3->GetHash());
+    BOOST_CHECK(*vRanked[2].second == tx2->GetHash());
+
+    // The child of a parent that left the mempool in a block is ranked as one
+    // without ancestors
+    {
+        LOCK(pool.cs);
+        pool.removeForBlock({tx1}, 1);
+    }
+    setToSend2 = {tx2->GetHash(), tx3->GetHash()};
+    order.Rank(setToSend2, vRanked);
+    std::sort(vRanked.begin(), vRanked.end(), [](const TxRelayOrder::RankedTx& a, const TxRelayOrder::RankedTx& b) { return a.first < b.first; });
+    BOOST_CHECK(*vRanked[0].second == tx2->GetHash());
+    BOOST_CHECK(*vRanked[1].second == tx3->GetHash());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -522,4 +522,40 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+BOOST_FIXTURE_TEST_CASE(next_block_txs_refresh, TestChain100Setup)
+{
+    const CChainParams& chainparams = Params();
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    // Nothing changed since the first selection: keep it
+    const int64_t nTime = GetTime();
+    SetMockTime(nTime);
+    AssemblerForTest(chainparams).UpdateNextBlockTxs();
+    BOOST_CHECK(!AssemblerForTest(chainparams).UpdateNextBlockTxs());
+
+    // A mempool change makes the selection stale, but it is kept for a while
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(m_coinbase_txns[0]->GetHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1000;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    TestMemPoolEntryHelper entry;
+    {
+        LOCK(mempool.cs);
+        mempool.addUnchecked(tx.GetHash(), entry.Fee(10000).FromTx(tx));
+    }
+    BOOST_CHECK(!AssemblerForTest(chainparams).UpdateNextBlockTxs());
+    SetMockTime(nTime + 30);
+    BOOST_CHECK(AssemblerForTest(chainparams).UpdateNextBlockTxs());
+    BOOST_CHECK(!AssemblerForTest(chainparams).UpdateNextBlockTxs());
+
+    // A new tip does at once
+    mempool.clear();
+    CreateAndProcessBlock({}, scriptPubKey);
+    BOOST_CHECK(AssemblerForTest(chainparams).UpdateNextBlockTxs());
+    BOOST_CHECK(!AssemblerForTest(chainparams).UpdateNextBlockTxs());
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,8 +2,10 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <clientversion.h>
 #include <policy/policy.h>
 #include <policy/fees.h>
+#include <streams.h>
 #include <txmempool.h>
 #include <uint256.h>
 #include <util.h>
@@ -180,4 +182,69 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     }
 }
 
+BOOST_AUTO_TEST_CASE(BlockPolicyEstimatesWriteRead)
+{
+    CBlockPolicyEstimator feeEst;
+    CTxMemPool mpool(&feeEst);
+    LOCK(mpool.cs);
+    TestMemPoolEntryHelper entry;
+    CAmount basefee(2000);
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue=0LL;
+
+    // Confirm the higher feerates in the next block and the lower ones a block
+    // later, over enough blocks for the lazily decayed averages of every
+    // horizon to differ from their stored values
+    std::vector<CTransactionRef> block, nextBlock;
+    int blocknum = 0;
+    while (blocknum < 300) {
+        block.swap(nextBlock);
+        for (int j = 0; j < 10; j++) {
+            for (int k = 0; k < 4; k++) {
+                tx.vin[0].prevout.n = 10000*blocknum+100*j+k;
+                mpool.addUnchecked(tx.GetHash(), entry.Fee(basefee * (j+1)).Time(GetTime()).Height(blocknum).FromTx(tx));
+                (j >= 5 ? block : nextBlock).push_back(mpool.get(tx.GetHash()));
+            }
+        }
+        mpool.removeForBlock(block, ++blocknum);
+        block.clear();
+    }
+    // Unconfirmed transactions are not written, so record them as on shutdown
+    feeEst.FlushUnconfirmed();
+
+    const fs::path path = SetDataDir("fee_estimates") / "fee_estimates.dat";
+    {
+        CAutoFile fileout(fsbridge::fopen(path, "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(feeEst.Write(fileout));
+    }
+    CBlockPolicyEstimator feeEstRead;
+    {
+        CAutoFile filein(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(feeEstRead.Read(filein));
+    }
+
+    // Estimates read back match the ones that were written, up to rounding
+    for (FeeEstimateHorizon horizon : {FeeEstimateHorizon::SHORT_HALFLIFE, FeeEstimateHorizon::MED_HALFLIFE, FeeEstimateHorizon::LONG_HALFLIFE}) {
+        for (unsigned int target = 1; target <= feeEst.HighestTargetTracked(horizon); target++) {
+            CAmount written = feeEst.estimateRawFee(target, 0.85, horizon).GetFeePerK();
+            CAmount read = feeEstRead.estimateRawFee(target, 0.85, horizon).GetFeePerK();
+            BOOST_CHECK(std::abs(written - read) <= 1);
+        }
+    }
+
+    // estimateSmartFee returns the cached result until the next block
+    FeeCalculation feeCalc;
+    CFeeRate smartFee = feeEst.estimateSmartFee(4, &feeCalc, false);
+    BOOST_CHECK(smartFee.GetFeePerK() > 0);
+    FeeCalculation cachedCalc;
+    BOOST_CHECK(feeEst.estimateSmartFee(4, &cachedCalc, false) == smartFee);
+    BOOST_CHECK(cachedCalc.reason == feeCalc.reason);
+    BOOST_CHECK_EQUAL(cachedCalc.returnedTarget, feeCalc.returnedTarget);
+    BOOST_CHECK(feeEst.estimateSmartFee(4, nullptr, true) == feeEst.estimateSmartFee(4, nullptr, true));
+    BOOST_CHECK(std::abs(feeEstRead.estimateSmartFee(4, nullptr, false).GetFeePerK() - smartFee.GetFeePerK()) <= 1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
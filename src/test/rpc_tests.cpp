@@ -8,6 +8,9 @@
 #include <core_io.h>
 #include <key_io.h>
 #include <netbase.h>
+#include <streams.h>
+#include <txmempool.h>
+#include <validation.h>
 
 #include <test/test_bitcoin.h>
 
@@ -416,4 +419,70 @@ BOOST_AUTO_TEST_CASE(rpc_getblockstats_calculate_percentiles_by_weight)
     }
 }
 
+BOOST_AUTO_TEST_CASE(rpc_mempool_snapshot)
+{
+    // Two parents and a child spending both, one of the parents prioritised
+    // below zero
+    TestMemPoolEntryHelper entry;
+    CMutableTransaction txParents[2];
+    for (int i = 0; i < 2; i++) {
+        txParents[i].vin.resize(1);
+        txParents[i].vin[0].scriptSig = CScript() << i;
+        txParents[i].vout.resize(1);
+        txParents[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txParents[i].vout[0].nValue = 10 * COIN;
+    }
+    CMutableTransaction txChild;
+    txChild.vin.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txChild.vin[i].prevout = COutPoint(txParents[i].GetHash(), 0);
+    }
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 19 * COIN;
+    {
+        LOCK(mempool.cs);
+        mempool.addUnchecked(txParents[0].GetHash(), entry.Fee(1000).Time(1).Height(7).FromTx(txParents[0]));
+        mempool.addUnchecked(txParents[1].GetHash(), entry.Fee(2000).FromTx(txParents[1]));
+        mempool.addUnchecked(txChild.GetHash(), entry.Fee(12345).FromTx(txChild));
+    }
+    mempool.PrioritiseTransaction(txParents[1].GetHash(), -5000);
+
+    const std::vector<MempoolEntrySnapshot> snapshot = MempoolSnapshot();
+    BOOST_CHECK_EQUAL(snapshot.size(), 3U);
+    for (const MempoolEntrySnapshot& e : snapshot) {
+        if (e.txid == txChild.GetHash()) {
+            BOOST_CHECK_EQUAL(e.depends.size(), 2U);
+            BOOST_CHECK(e.depends[0].ToString() < e.depends[1].ToString());
+            BOOST_CHECK(e.spentby.empty());
+            BOOST_CHECK_EQUAL(e.ancestorcount, 3U);
+            BOOST_CHECK_EQUAL(e.ancestorfees, 1000 - 3000 + 12345);
+        } else {
+            BOOST_CHECK(e.depends.empty());
+            BOOST_CHECK(e.spentby == std::vector<uint256>{txChild.GetHash()});
+        }
+    }
+
+    // The streamed JSON is what getrawmempool returns
+    std::string strJSON;
+    MempoolSnapshotToJSON(snapshot, strJSON);
+    UniValue rawmempool = CallRPC("getrawmempool true");
+    BOOST_CHECK_EQUAL(strJSON, rawmempool.write());
+    const UniValue& child = find_value(rawmempool, txChild.GetHash().ToString());
+    BOOST_CHECK_EQUAL(find_value(child, "depends").size(), 2U);
+    BOOST_CHECK_EQUAL(find_value(find_value(rawmempool, txParents[1].GetHash().ToString()), "modifiedfee").getValStr(), "-0.3000");
+
+    // And survives the binary round trip
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << snapshot;
+    std::vector<MempoolEntrySnapshot> snapshotRead;
+    ss >> snapshotRead;
+    std::string strJSONRead;
+    MempoolSnapshotToJSON(snapshotRead, strJSONRead);
+    BOOST_CHECK_EQUAL(strJSON, strJSONRead);
+
+    mempool.ClearPrioritisation(txParents[1].GetHash());
+    mempool.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
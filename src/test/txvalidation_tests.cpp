@@ -6,12 +6,21 @@
 #include <txmempool.h>
 #include <amount.h>
 #include <consensus/validation.h>
+#include <net.h>
 #include <primitives/transaction.h>
+#include <script/interpreter.h>
 #include <script/script.h>
 #include <test/test_bitcoin.h>
 
 #include <boost/test/unit_test.hpp>
 
+#include <deque>
+
+extern bool AddOrphanTx(const CTransactionRef& tx, NodeId peer);
+extern bool AddLowFeeParentTx(const CTransactionRef& tx, NodeId peer);
+extern void EraseOrphansFor(NodeId peer);
+extern bool AcceptOrphanPackage(const CTransactionRef& ptx, CConnman* connman, std::deque<COutPoint>& vWorkQueue);
+extern bool AcceptOrphanParentsPackage(const CTransactionRef& ptx, CConnman* connman, std::deque<COutPoint>& vWorkQueue);
 
 BOOST_AUTO_TEST_SUITE(txvalidation_tests)
 
@@ -58,4 +67,109 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_reject_coinbase, TestChain100Setup)
     BOOST_CHECK_EQUAL(nDoS, 100);
 }
 
+static CMutableTransaction MakeSpend(const CTransactionRef& prev, CAmount fee, const CKey& key)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction tx;
+    tx.nVersion = 1;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(prev->GetHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = prev->vout[0].nValue - fee;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL, 0, SigVersion::BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return tx;
+}
+
+/**
+ * Ensure that a parent paying no fee is accepted together with a child
+ * paying for both, and only that way.
+ */
+BOOST_FIXTURE_TEST_CASE(tx_mempool_accept_package, TestChain100Setup)
+{
+    CTransactionRef parent = MakeTransactionRef(MakeSpend(m_coinbase_txns[0], 0, coinbaseKey));
+    CTransactionRef child = MakeTransactionRef(MakeSpend(parent, 10 * CENT, coinbaseKey));
+
+    LOCK(cs_main);
+    unsigned int initialPoolSize = mempool.size();
+
+    CValidationState state;
+    BOOST_CHECK(!AcceptToMemoryPool(mempool, state, parent, nullptr /* pfMissingInputs */,
+        nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "min relay fee not met");
+
+    // Children must come after their parents
+    uint256 failed_tx;
+    state = CValidationState();
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, {child, parent}, nullptr, 0, true /* test_accept */, &failed_tx));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package-not-sorted");
+    BOOST_CHECK(failed_tx.IsNull());
+
+    // Testing the package leaves the mempool as it was, without ever adding to it
+    const unsigned int nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    state = CValidationState();
+    BOOST_CHECK(AcceptPackageToMemoryPool(mempool, state, {parent, child}, nullptr, 0, true /* test_accept */));
+    BOOST_CHECK_EQUAL(mempool.size(), initialPoolSize);
+    BOOST_CHECK_EQUAL(mempool.GetTransactionsUpdated(), nTransactionsUpdated);
+
+    // The child alone doesn't pay enough for the package
+    CTransactionRef poor_child = MakeTransactionRef(MakeSpend(parent, 1, coinbaseKey));
+    state = CValidationState();
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, {parent, poor_child}, nullptr, 0));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "min relay fee not met");
+    BOOST_CHECK_EQUAL(mempool.size(), initialPoolSize);
+
+    state = CValidationState();
+    BOOST_CHECK(AcceptPackageToMemoryPool(mempool, state, {parent, child}, nullptr, 0));
+    BOOST_CHECK_EQUAL(mempool.size(), initialPoolSize + 2);
+    BOOST_CHECK(mempool.exists(parent->GetHash()));
+    BOOST_CHECK(mempool.exists(child->GetHash()));
+}
+
+/**
+ * Ensure that a parent paying no fee is accepted with an orphan child paying
+ * for it whichever of them comes first.
+ */
+BOOST_FIXTURE_TEST_CASE(tx_mempool_accept_orphan_package, TestChain100Setup)
+{
+    CTransactionRef parent = MakeTransactionRef(MakeSpend(m_coinbase_txns[0], 0, coinbaseKey));
+    CTransactionRef child = MakeTransactionRef(MakeSpend(parent, 10 * CENT, coinbaseKey));
+    std::deque<COutPoint> vWorkQueue;
+
+    LOCK(cs_main);
+    unsigned int initialPoolSize = mempool.size();
+
+    // The child first, waiting for its parent with the orphans
+    BOOST_CHECK(AddOrphanTx(child, 0));
+    BOOST_CHECK(!AcceptOrphanParentsPackage(parent, g_connman.get(), vWorkQueue));
+    BOOST_CHECK(AcceptOrphanPackage(parent, g_connman.get(), vWorkQueue));
+    BOOST_CHECK_EQUAL(mempool.size(), initialPoolSize + 2);
+    BOOST_CHECK_EQUAL(vWorkQueue.size(), child->vout.size());
+    mempool.removeRecursive(*parent);
+    vWorkQueue.clear();
+
+    // The parent first, kept aside after paying too little
+    BOOST_CHECK(AddLowFeeParentTx(parent, 0));
+    BOOST_CHECK(!AcceptOrphanPackage(child, g_connman.get(), vWorkQueue));
+    BOOST_CHECK(AcceptOrphanParentsPackage(child, g_connman.get(), vWorkQueue));
+    BOOST_CHECK_EQUAL(mempool.size(), initialPoolSize + 2);
+    BOOST_CHECK(mempool.exists(parent->GetHash()));
+    BOOST_CHECK(mempool.exists(child->GetHash()));
+    BOOST_CHECK_EQUAL(vWorkQueue.size(), parent->vout.size());
+
+    // Both were taken out of the orphans and low fee parents
+    BOOST_CHECK(!AcceptOrphanPackage(parent, g_connman.get(), vWorkQueue));
+    BOOST_CHECK(!AcceptOrphanParentsPackage(child, g_connman.get(), vWorkQueue));
+
+    // A transaction conflicting with the mempool is not kept for a child
+    CTransactionRef conflict = MakeTransactionRef(MakeSpend(m_coinbase_txns[0], CENT, coinbaseKey));
+    BOOST_CHECK(!AddLowFeeParentTx(conflict, 0));
+    EraseOrphansFor(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -368,4 +368,137 @@ BOOST_FIXTURE_TEST_CASE(checkinputs_test, TestChain100Setup)
     }
 }
 
+BOOST_FIXTURE_TEST_CASE(coinstake_script_cache, TestChain100Setup)
+{
+    // Test that a coinstake verified by CheckCoinStakeScripts is not verified
+    // again by CheckInputs with the same flags, but is with other flags or
+    // when the result was not stored.
+    {
+        LOCK(cs_main);
+        InitScriptExecutionCache();
+    }
+
+    CScript p2pk_scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    CMutableTransaction coinstake;
+    coinstake.nVersion = 1;
+    coinstake.vin.resize(1);
+    coinstake.vin[0].prevout.hash = m_coinbase_txns[1]->GetHash();
+    coinstake.vin[0].prevout.n = 0;
+    coinstake.vout.resize(1);
+    coinstake.vout[0].nValue = m_coinbase_txns[1]->vout[0].nValue;
+    coinstake.vout[0].scriptPubKey = p2pk_scriptPubKey;
+
+    // Sign, with a non-DER signature
+    {
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(p2pk_scriptPubKey, coinstake, 0, SIGHASH_ALL, 0, SigVersion::BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char) 0); // padding byte makes this non-DER
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        coinstake.vin[0].scriptSig << vchSig;
+    }
+
+    LOCK(cs_main);
+    const CTransaction tx(coinstake);
+    const CTxOut& txOutPrev = pcoinsTip->AccessCoin(tx.vin[0].prevout).out;
+    PrecomputedTransactionData txdata(tx);
+    CValidationState state;
+
+    BOOST_CHECK(CheckCoinStakeScripts(tx, txOutPrev, SCRIPT_VERIFY_P2SH, true, txdata));
+    std::vector<CScriptCheck> scriptchecks;
+    BOOST_CHECK(CheckInputs(tx, state, pcoinsTip.get(), true, SCRIPT_VERIFY_P2SH, true, false, txdata, &scriptchecks));
+    BOOST_CHECK(scriptchecks.empty());
+
+    // Nothing is cached without cacheStore
+    const unsigned int cltv_flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+    BOOST_CHECK(CheckCoinStakeScripts(tx, txOutPrev, cltv_flags, false, txdata));
+    BOOST_CHECK(CheckInputs(tx, state, pcoinsTip.get(), true, cltv_flags, true, false, txdata, &scriptchecks));
+    BOOST_CHECK_EQUAL(scriptchecks.size(), 1U);
+    scriptchecks.clear();
+
+    // Failures are not cached
+    BOOST_CHECK(!CheckCoinStakeScripts(tx, txOutPrev, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG, true, txdata));
+    BOOST_CHECK(CheckInputs(tx, state, pcoinsTip.get(), true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG, true, false, txdata, &scriptchecks));
+    BOOST_CHECK_EQUAL(scriptchecks.size(), 1U);
+}
+
+static CMutableTransaction SpendWithSig(const CTransactionRef& prev, CAmount nValue, const CKey& key, bool fDER, bool fValidSig)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction tx;
+    tx.nVersion = 1;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(prev->GetHash(), 0);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL, 0, SigVersion::BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    if (!fDER) vchSig.push_back((unsigned char) 0); // padding byte makes this non-DER
+    if (!fValidSig) vchSig[vchSig.size() / 2] ^= 1;
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return tx;
+}
+
+BOOST_FIXTURE_TEST_CASE(precheck_transaction_scripts, TestChain100Setup)
+{
+    // Test that the scripts of a transaction are only prechecked once it
+    // passes the cheaper checks, and that AcceptToMemoryPool reuses the result.
+    {
+        LOCK(cs_main);
+        InitScriptExecutionCache();
+    }
+    const CTransactionRef& coinbase = m_coinbase_txns[0];
+    std::vector<CScriptCheck> scriptchecks;
+
+    auto CheckScriptsCached = [&](const CMutableTransaction& mtx) {
+        LOCK(cs_main);
+        const CTransaction tx(mtx);
+        PrecomputedTransactionData txdata(tx);
+        CValidationState state;
+        scriptchecks.clear();
+        BOOST_CHECK(CheckInputs(tx, state, pcoinsTip.get(), true, STANDARD_SCRIPT_VERIFY_FLAGS, true, false, txdata, &scriptchecks));
+        return scriptchecks.empty();
+    };
+
+    // Valid: AcceptToMemoryPool finds it in the script execution cache
+    CMutableTransaction valid = SpendWithSig(coinbase, 11 * CENT, coinbaseKey, true, true);
+    CValidationState state;
+    BOOST_CHECK(PrecheckTransactionScripts(MakeTransactionRef(valid), state) == ScriptPrecheck::VALID);
+    BOOST_CHECK(state.IsValid());
+    BOOST_CHECK(CheckScriptsCached(valid));
+
+    // Paying no fee, it is left to AcceptToMemoryPool without running the scripts
+    CMutableTransaction nofee = SpendWithSig(coinbase, coinbase->vout[0].nValue, coinbaseKey, true, true);
+    BOOST_CHECK(PrecheckTransactionScripts(MakeTransactionRef(nofee), state) == ScriptPrecheck::SKIPPED);
+    BOOST_CHECK(!CheckScriptsCached(nofee));
+
+    // So is one with missing inputs
+    CMutableTransaction orphan = SpendWithSig(MakeTransactionRef(valid), 10 * CENT, coinbaseKey, true, true);
+    BOOST_CHECK(PrecheckTransactionScripts(MakeTransactionRef(orphan), state) == ScriptPrecheck::SKIPPED);
+    BOOST_CHECK(state.IsValid());
+
+    // Invalid scripts are rejected as AcceptToMemoryPool would
+    int nDoS = 0;
+    CMutableTransaction nonstandard = SpendWithSig(coinbase, 11 * CENT, coinbaseKey, false, true);
+    BOOST_CHECK(PrecheckTransactionScripts(MakeTransactionRef(nonstandard), state) == ScriptPrecheck::INVALID);
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 0);
+    BOOST_CHECK_EQUAL(state.GetRejectCode(), REJECT_NONSTANDARD);
+
+    state = CValidationState();
+    CMutableTransaction badsig = SpendWithSig(coinbase, 11 * CENT, coinbaseKey, true, false);
+    BOOST_CHECK(PrecheckTransactionScripts(MakeTransactionRef(badsig), state) == ScriptPrecheck::INVALID);
+    BOOST_CHECK(state.IsInvalid(nDoS) && nDoS == 100);
+    BOOST_CHECK(state.GetRejectReason().find("mandatory-script-verify-flag-failed") == 0);
+
+    // Once the transaction is in the mempool, there is nothing to check
+    BOOST_CHECK(ToMemPool(valid));
+    state = CValidationState();
+    BOOST_CHECK(PrecheckTransactionScripts(MakeTransactionRef(valid), state) == ScriptPrecheck::SKIPPED);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -18,6 +18,86 @@
 #include <utilmoneystr.h>
 #include <utiltime.h>
 
+/**
+ * A set of mempool entries that are connected through their links. Clusters
+ * are merged when a transaction links two of them, but never split when the
+ * entries connecting them leave, so count and size are an upper bound for
+ * the ancestors and descendants of any member.
+ */
+struct TxMemPoolCluster
+{
+    uint64_t count;
+    uint64_t size;
+    //! The cluster this one was merged into, if any
+    std::shared_ptr<TxMemPoolCluster> merged_into;
+
+    TxMemPoolCluster(uint64_t _count, uint64_t _size) : count(_count), size(_size) {}
+};
+
+/** Direct in-mempool parents and children of a mempool entry */
+struct TxMemPoolLinks
+{
+    CTxMemPool::setEntries parents;
+    CTxMemPool::setEntries children;
+    std::shared_ptr<TxMemPoolCluster> cluster;
+};
+
+/** Memory used by an entry in mapTx besides its transaction and its sets of
+ *  links: the mapTx node, the links and the cluster allocated for it. */
+static size_t MemPoolEntryUsage()
+{
+    // Estimate the overhead of mapTx to be 12 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) +
+           memusage::MallocUsage(sizeof(TxMemPoolLinks)) +
+           memusage::MallocUsage(sizeof(TxMemPoolCluster)) + memusage::MallocUsage(sizeof(memusage::stl_shared_counter));
+}
+
+/** Return the cluster of a mempool entry, shortening the path to it for later lookups */
+static TxMemPoolCluster& GetCluster(CTxMemPool::txiter it)
+{
+    std::shared_ptr<TxMemPoolCluster>& cluster = it->links->cluster;
+    std::shared_ptr<TxMemPoolCluster> root = cluster;
+    while (root->merged_into) {
+        root = root->merged_into;
+    }
+    while (cluster != root) {
+        std::shared_ptr<TxMemPoolCluster> next = cluster->merged_into;
+        cluster->merged_into = root;
+        cluster = next;
+    }
+    return *root;
+}
+
+namespace {
+/** Marks entries visited by a traversal of the mempool graph in
+ *  CTxMemPool::m_traversal_marks, and clears the marks when it goes out of scope. */
+class TraversalMarks
+{
+public:
+    TraversalMarks(std::vector<bool>& bits, size_t size) : m_bits(bits)
+    {
+        if (m_bits.size() < size) m_bits.resize(size);
+    }
+    ~TraversalMarks()
+    {
+        for (size_t idx : m_marked) m_bits[idx] = false;
+    }
+
+    /** Mark an entry, returning whether it was not marked yet */
+    bool Mark(CTxMemPool::txiter it)
+    {
+        if (m_bits[it->vTxHashesIdx]) return false;
+        m_bits[it->vTxHashesIdx] = true;
+        m_marked.push_back(it->vTxHashesIdx);
+        return true;
+    }
+
+private:
+    std::vector<bool>& m_bits;
+    std::vector<size_t> m_marked;
+};
+} // namespace
+
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                                  int64_t _nTime, unsigned int _entryHeight,
                                  bool _spendsCoinbase, int64_t _sigOpsCost, LockPoints lp):
@@ -39,6 +119,19 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFe
     nSigOpCostWithAncestors = sigOpCost;
 }
 
+CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other) :
+    tx(other.tx), nFee(other.nFee), nTxWeight(other.nTxWeight), nUsageSize(other.nUsageSize),
+    nTime(other.nTime), entryHeight(other.entryHeight), spendsCoinbase(other.spendsCoinbase),
+    sigOpCost(other.sigOpCost), feeDelta(other.feeDelta), lockPoints(other.lockPoints),
+    nCountWithDescendants(other.nCountWithDescendants), nSizeWithDescendants(other.nSizeWithDescendants),
+    nModFeesWithDescendants(other.nModFeesWithDescendants), nCountWithAncestors(other.nCountWithAncestors),
+    nSizeWithAncestors(other.nSizeWithAncestors), nModFeesWithAncestors(other.nModFeesWithAncestors),
+    nSigOpCostWithAncestors(other.nSigOpCostWithAncestors), vTxHashesIdx(other.vTxHashesIdx)
+{
+}
+
+CTxMemPoolEntry::~CTxMemPoolEntry() {}
+
 void CTxMemPoolEntry::UpdateFeeDelta(int64_t newFeeDelta)
 {
     nModFeesWithDescendants += newFeeDelta - feeDelta;
@@ -151,7 +244,8 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
 
 bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
 {
-    setEntries parentHashes;
+    TraversalMarks marks(m_traversal_marks, vTxHashes.size());
+    std::vector<txiter> ancestors;
     const CTransaction &tx = entry.GetTx();
 
     if (fSearchForParents) {
@@ -160,9 +254,9 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // iterate mapTx to find parents.
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             txiter piter = mapTx.find(tx.vin[i].prevout.hash);
-            if (piter != mapTx.end()) {
-                parentHashes.insert(piter);
-                if (parentHashes.size() + 1 > limitAncestorCount) {
+            if (piter != mapTx.end() && marks.Mark(piter)) {
+                ancestors.push_back(piter);
+                if (ancestors.size() + 1 > limitAncestorCount) {
                     errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
                     return false;
                 }
@@ -172,11 +266,91 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        for (txiter piter : GetMemPoolParents(it)) {
+            marks.Mark(piter);
+            ancestors.push_back(piter);
+        }
     }
 
+    // Every ancestor, and every descendant of an ancestor, is in one of the
+    // clusters of the parents. If those are small enough, no limit can be hit.
+    uint64_t clusterCount = 0;
+    uint64_t clusterSize = 0;
+    std::vector<const TxMemPoolCluster*> clusters;
+    for (txiter piter : ancestors) {
+        const TxMemPoolCluster& cluster = GetCluster(piter);
+        if (std::find(clusters.begin(), clusters.end(), &cluster) == clusters.end()) {
+            clusters.push_back(&cluster);
+            clusterCount += cluster.count;
+            clusterSize += cluster.size;
+        }
+    }
+    const bool fCheckLimits = clusterCount + 1 > std::min(limitAncestorCount, limitDescendantCount) ||
+                              clusterSize + entry.GetTxSize() > std::min(limitAncestorSize, limitDescendantSize);
+
     size_t totalSizeWithAncestors = entry.GetTxSize();
 
+    for (size_t i = 0; i < ancestors.size(); i++) {
+        txiter stageit = ancestors[i];
+        totalSizeWithAncestors += stageit->GetTxSize();
+
+        if (fCheckLimits) {
+            if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
+                errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]", stageit->GetTx().GetHash().ToString(), limitDescendantSize);
+                return false;
+            } else if (stageit->GetCountWithDescendants() + 1 > limitDescendantCount) {
+                errString = strprintf("too many descendants for tx %s [limit: %u]", stageit->GetTx().GetHash().ToString(), limitDescendantCount);
+                return false;
+            } else if (totalSizeWithAncestors > limitAncestorSize) {
+                errString = strprintf("exceeds ancestor size limit [limit: %u]", limitAncestorSize);
+                return false;
+            }
+        }
+
+        for (const txiter &phash : GetMemPoolParents(stageit)) {
+            // If this is a new ancestor, add it.
+            if (marks.Mark(phash)) {
+                ancestors.push_back(phash);
+            }
+            if (fCheckLimits && ancestors.size() + 1 > limitAncestorCount) {
+                errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
+                return false;
+            }
+        }
+    }
+
+    setAncestors.insert(ancestors.begin(), ancestors.end());
+    return true;
+}
+
+bool CTxMemPool::CheckPackageLimits(const std::vector<CTransactionRef>& package, uint64_t packageSize, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString) const
+{
+    const uint64_t packageCount = package.size();
+    if (packageCount > limitAncestorCount || packageCount > limitDescendantCount) {
+        errString = strprintf("package count %u exceeds limit [limit: %u]", packageCount, std::min(limitAncestorCount, limitDescendantCount));
+        return false;
+    } else if (packageSize > limitAncestorSize || packageSize > limitDescendantSize) {
+        errString = strprintf("package size %u exceeds limit [limit: %u]", packageSize, std::min(limitAncestorSize, limitDescendantSize));
+        return false;
+    }
+
+    setEntries parentHashes;
+    for (const CTransactionRef& ptx : package) {
+        for (const CTxIn& txin : ptx->vin) {
+            txiter piter = mapTx.find(txin.prevout.hash);
+            if (piter != mapTx.end()) {
+                parentHashes.insert(piter);
+            }
+        }
+    }
+    if (parentHashes.size() + packageCount > limitAncestorCount) {
+        errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
+        return false;
+    }
+
+    setEntries setAncestors;
+    uint64_t totalSizeWithAncestors = packageSize;
+
     while (!parentHashes.empty()) {
         txiter stageit = *parentHashes.begin();
 
@@ -184,10 +358,10 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         parentHashes.erase(stageit);
         totalSizeWithAncestors += stageit->GetTxSize();
 
-        if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
+        if (stageit->GetSizeWithDescendants() + packageSize > limitDescendantSize) {
             errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]", stageit->GetTx().GetHash().ToString(), limitDescendantSize);
             return false;
-        } else if (stageit->GetCountWithDescendants() + 1 > limitDescendantCount) {
+        } else if (stageit->GetCountWithDescendants() + packageCount > limitDescendantCount) {
             errString = strprintf("too many descendants for tx %s [limit: %u]", stageit->GetTx().GetHash().ToString(), limitDescendantCount);
             return false;
         } else if (totalSizeWithAncestors > limitAncestorSize) {
@@ -195,13 +369,11 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
             return false;
         }
 
-        const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
-        for (const txiter &phash : setMemPoolParents) {
-            // If this is a new ancestor, add it.
+        for (const txiter &phash : GetMemPoolParents(stageit)) {
             if (setAncestors.count(phash) == 0) {
                 parentHashes.insert(phash);
             }
-            if (parentHashes.size() + setAncestors.size() + 1 > limitAncestorCount) {
+            if (parentHashes.size() + setAncestors.size() + packageCount > limitAncestorCount) {
                 errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
                 return false;
             }
@@ -257,7 +429,7 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
         // updateDescendants should be true whenever we're not recursively
         // removing a tx and all its descendants, eg when a transaction is
         // confirmed in a block.
-        // Here we only update statistics and not data in mapLinks (which
+        // Here we only update statistics and not data in the links (which
         // we need to preserve until we're finished with all operations that
         // need to traverse the mempool).
         for (txiter removeIt : entriesToRemove) {
@@ -282,16 +454,16 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries &entriesToRemove, b
         // should be a bit faster.
         // However, if we happen to be in the middle of processing a reorg, then
         // the mempool can be in an inconsistent state.  In this case, the set
-        // of ancestors reachable via mapLinks will be the same as the set of
+        // of ancestors reachable via the links will be the same as the set of
         // ancestors whose packages include this transaction, because when we
         // add a new transaction to the mempool in addUnchecked(), we assume it
         // has no children, and in the case of a reorg where that assumption is
         // false, the in-mempool children aren't linked to the in-block tx's
         // until UpdateTransactionsFromBlock() is called.
         // So if we're being called during a reorg, ie before
-        // UpdateTransactionsFromBlock() has been called, then mapLinks[] will
+        // UpdateTransactionsFromBlock() has been called, then the links will
         // differ from the set of mempool parents we'd calculate by searching,
-        // and it's important that we use the mapLinks[] notion of ancestor
+        // and it's important that we use the links' notion of ancestor
         // transactions as the set of things to update for removal.
         CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
         // Note that UpdateAncestorsOf severs the child links that point to
@@ -337,6 +509,7 @@ CTxMemPool::CTxMemPool(CBlockPolicyEstimator* estimator) :
     nCheckFrequency = 0;
 }
 
+
 bool CTxMemPool::isSpent(const COutPoint& outpoint) const
 {
     LOCK(cs);
@@ -362,7 +535,8 @@ void CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     // Used by AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     indexed_transaction_set::iterator newit = mapTx.insert(entry).first;
-    mapLinks.insert(make_pair(newit, TxLinks()));
+    newit->links = MakeUnique<TxMemPoolLinks>();
+    newit->links->cluster = std::make_shared<TxMemPoolCluster>(1, newit->GetTxSize());
 
     // Update transaction for any feeDelta created by PrioritiseTransaction
     // TODO: refactor so that the fee delta is calculated before inserting
@@ -427,10 +601,13 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
     } else
         vTxHashes.clear();
 
+    TxMemPoolCluster& cluster = GetCluster(it);
+    cluster.count--;
+    cluster.size -= it->GetTxSize();
+
     totalTxSize -= it->GetTxSize();
     cachedInnerUsage -= it->DynamicMemoryUsage();
-    cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
-    mapLinks.erase(it);
+    cachedInnerUsage -= memusage::DynamicUsage(it->links->parents) + memusage::DynamicUsage(it->links->children);
     mapTx.erase(it);
     nTransactionsUpdated++;
     if (minerPolicyEstimator) {minerPolicyEstimator->removeTx(hash, false);}
@@ -585,9 +762,9 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
 
 void CTxMemPool::_clear()
 {
-    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
+    vTxHashes.clear();
     totalTxSize = 0;
     cachedInnerUsage = 0;
     lastRollingFeeUpdate = GetTime();
@@ -629,14 +806,14 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     const int64_t spendheight = GetSpendHeight(mempoolDuplicate);
 
     std::list<const CTxMemPoolEntry*> waitingOnDependants;
+    std::map<const TxMemPoolCluster*, std::pair<uint64_t, uint64_t>> clusterCheck;
     for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
         checkTotal += it->GetTxSize();
         innerUsage += it->DynamicMemoryUsage();
         const CTransaction& tx = it->GetTx();
-        txlinksMap::const_iterator linksiter = mapLinks.find(it);
-        assert(linksiter != mapLinks.end());
-        const TxLinks &links = linksiter->second;
+        assert(it->links);
+        const TxMemPoolLinks &links = *it->links;
         innerUsage += memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
         bool fDependsWait = false;
         setEntries setParentCheck;
@@ -664,6 +841,13 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             i++;
         }
         assert(setParentCheck == GetMemPoolParents(it));
+        // Verify that the entry is in the cluster of its parents.
+        const TxMemPoolCluster* cluster = &GetCluster(it);
+        for (txiter parentIt : setParentCheck) {
+            assert(&GetCluster(parentIt) == cluster);
+        }
+        clusterCheck[cluster].first++;
+        clusterCheck[cluster].second += it->GetTxSize();
         // Verify ancestor state is correct.
         setEntries setAncestors;
         uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -728,6 +912,11 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
         assert(&tx == it->second);
     }
 
+    for (const auto& cluster : clusterCheck) {
+        assert(cluster.first->count == cluster.second.first);
+        assert(cluster.first->size == cluster.second.second);
+    }
+
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
 }
@@ -895,13 +1084,24 @@ bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, Coin &coin) const {
             return false;
         }
     }
+    auto it = m_temp_added.find(outpoint);
+    if (it != m_temp_added.end()) {
+        coin = it->second;
+        return true;
+    }
     return base->GetCoin(outpoint, coin);
 }
 
+void CCoinsViewMemPool::PackageAddTransaction(const CTransactionRef& tx)
+{
+    for (uint32_t n = 0; n < tx->vout.size(); ++n) {
+        m_temp_added.emplace(COutPoint(tx->GetHash(), n), Coin(tx->vout[n], MEMPOOL_HEIGHT, false));
+    }
+}
+
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
-    // Estimate the overhead of mapTx to be 12 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    return MemPoolEntryUsage() * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
 }
 
 void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants, MemPoolRemovalReason reason) {
@@ -914,6 +1114,7 @@ void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants, MemPool
 
 int CTxMemPool::Expire(int64_t time) {
     LOCK(cs);
+    const int64_t nStart = GetTimeMicros();
     indexed_transaction_set::index<entry_time>::type::iterator it = mapTx.get<entry_time>().begin();
     setEntries toremove;
     while (it != mapTx.get<entry_time>().end() && it->GetTime() < time) {
@@ -925,6 +1126,9 @@ int CTxMemPool::Expire(int64_t time) {
         CalculateDescendants(removeit, stage);
     }
     RemoveStaged(stage, false, MemPoolRemovalReason::EXPIRY);
+    if (!stage.empty()) {
+        trackEviction(stage.size(), nStart);
+    }
     return stage.size();
 }
 
@@ -940,9 +1144,9 @@ void CTxMemPool::addUnchecked(const uint256&hash, const CTxMemPoolEntry &entry,
 void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
 {
     setEntries s;
-    if (add && mapLinks[entry].children.insert(child).second) {
+    if (add && entry->links->children.insert(child).second) {
         cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].children.erase(child)) {
+    } else if (!add && entry->links->children.erase(child)) {
         cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
     }
 }
@@ -950,27 +1154,40 @@ void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
 void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
 {
     setEntries s;
-    if (add && mapLinks[entry].parents.insert(parent).second) {
+    if (add && entry->links->parents.insert(parent).second) {
         cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].parents.erase(parent)) {
+        MergeClusters(entry, parent);
+    } else if (!add && entry->links->parents.erase(parent)) {
         cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
     }
 }
 
+void CTxMemPool::MergeClusters(txiter a, txiter b)
+{
+    TxMemPoolCluster* large = &GetCluster(a);
+    TxMemPoolCluster* small = &GetCluster(b);
+    if (large == small) return;
+    // GetCluster left both links pointing at the roots
+    std::shared_ptr<TxMemPoolCluster> largeRef = a->links->cluster;
+    if (large->count < small->count) {
+        std::swap(large, small);
+        largeRef = b->links->cluster;
+    }
+    large->count += small->count;
+    large->size += small->size;
+    small->merged_into = largeRef;
+}
+
 const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
 {
     assert (entry != mapTx.end());
-    txlinksMap::const_iterator it = mapLinks.find(entry);
-    assert(it != mapLinks.end());
-    return it->second.parents;
+    return entry->links->parents;
 }
 
 const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) const
 {
     assert (entry != mapTx.end());
-    txlinksMap::const_iterator it = mapLinks.find(entry);
-    assert(it != mapLinks.end());
-    return it->second.children;
+    return entry->links->children;
 }
 
 CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const {
@@ -1005,37 +1222,209 @@ void CTxMemPool::trackPackageRemoved(const CFeeRate& rate) {
     }
 }
 
-void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining) {
-    LOCK(cs);
+namespace {
+/** The descendant score of a mempool entry, with the given state of its
+ *  descendants, ordered like CompareTxMemPoolEntryByDescendantScore. */
+struct EvictionScore
+{
+    double mod_fee;
+    double size;
+    int64_t time;
+    uint256 hash;
 
-    unsigned nTxnRemoved = 0;
-    CFeeRate maxFeeRateRemoved(0);
-    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
-        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+    EvictionScore(const CTxMemPoolEntry& entry, CAmount modFeesWithDescendants, uint64_t sizeWithDescendants)
+        : time(entry.GetTime()), hash(entry.GetTx().GetHash())
+    {
+        double f1 = (double)entry.GetModifiedFee() * sizeWithDescendants;
+        double f2 = (double)modFeesWithDescendants * entry.GetTxSize();
+        if (f2 > f1) {
+            mod_fee = modFeesWithDescendants;
+            size = sizeWithDescendants;
+        } else {
+            mod_fee = entry.GetModifiedFee();
+            size = entry.GetTxSize();
+        }
+    }
+
+    bool operator<(const EvictionScore& other) const
+    {
+        double f1 = mod_fee * other.size;
+        double f2 = size * other.mod_fee;
+        if (f1 != f2) return f1 < f2;
+        if (time != other.time) return time > other.time;
+        return hash < other.hash;
+    }
+};
+} // namespace
+
+void CTxMemPool::CalculateEvictionSet(size_t sizelimit, setEntries& stage, descendantUpdateMap& ancestorUpdates, CFeeRate& maxFeeRateRemoved)
+{
+    AssertLockHeld(cs);
+    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+
+    // Memory freed by removing an entry, as accounted in DynamicMemoryUsage
+    const size_t entryUsage = MemPoolEntryUsage();
+    const size_t linkUsage = memusage::IncrementalDynamicUsage(setEntries());
+    const size_t nextTxUsage = memusage::IncrementalDynamicUsage(mapNextTx);
+    // vTxHashes is shrunk as entries are removed from it, follow its capacity
+    size_t hashesSize = vTxHashes.size();
+    size_t hashesCapacity = vTxHashes.capacity();
+    size_t usage = DynamicMemoryUsage() - memusage::DynamicUsage(vTxHashes);
+    auto projectedUsage = [&]() {
+        return usage + memusage::MallocUsage(sizeof(vTxHashes[0]) * hashesCapacity);
+    };
+
+    // Entries with staged descendants, in ancestorUpdates, ordered by their
+    // score once the stage is removed
+    std::map<EvictionScore, txiter> adjustedByScore;
+    auto adjustedScore = [](txiter it, const DescendantStateUpdate& update) {
+        return EvictionScore(*it, it->GetModFeesWithDescendants() + update.modifyFee, it->GetSizeWithDescendants() + update.modifySize);
+    };
+
+    auto scoreIt = mapTx.get<descendant_score>().begin();
+    while (projectedUsage() > sizelimit) {
+        // The next package is the one with the lowest score among the entries
+        // that are not affected by the stage, in index order, and the others.
+        while (scoreIt != mapTx.get<descendant_score>().end() && (stage.count(mapTx.project<0>(scoreIt)) || ancestorUpdates.count(mapTx.project<0>(scoreIt)))) {
+            ++scoreIt;
+        }
+        txiter it;
+        CAmount modFeesWithDescendants;
+        uint64_t sizeWithDescendants;
+        if (!adjustedByScore.empty() && (scoreIt == mapTx.get<descendant_score>().end() ||
+                adjustedByScore.begin()->first < EvictionScore(*scoreIt, scoreIt->GetModFeesWithDescendants(), scoreIt->GetSizeWithDescendants()))) {
+            it = adjustedByScore.begin()->second;
+            modFeesWithDescendants = it->GetModFeesWithDescendants() + ancestorUpdates[it].modifyFee;
+            sizeWithDescendants = it->GetSizeWithDescendants() + ancestorUpdates[it].modifySize;
+        } else if (scoreIt != mapTx.get<descendant_score>().end()) {
+            it = mapTx.project<0>(scoreIt);
+            modFeesWithDescendants = it->GetModFeesWithDescendants();
+            sizeWithDescendants = it->GetSizeWithDescendants();
+        } else {
+            break;
+        }
 
         // We set the new mempool min fee to the feerate of the removed set, plus the
         // "minimum reasonable fee rate" (ie some value under which we consider txn
         // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
         // equal to txn which were removed with no block in between.
-        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+        CFeeRate removed(modFeesWithDescendants, sizeWithDescendants);
         removed += incrementalRelayFee;
         trackPackageRemoved(removed);
         maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
 
+        // Stage the entry and its descendants that are not staged yet
+        std::vector<txiter> package(1, it);
+        stage.insert(it);
+        for (size_t i = 0; i < package.size(); i++) {
+            for (txiter childIt : GetMemPoolChildren(package[i])) {
+                if (stage.insert(childIt).second) {
+                    package.push_back(childIt);
+                }
+            }
+        }
+
+        descendantUpdateMap packageUpdates;
+        for (txiter removeIt : package) {
+            auto updateIt = ancestorUpdates.find(removeIt);
+            if (updateIt != ancestorUpdates.end()) {
+                adjustedByScore.erase(adjustedScore(removeIt, updateIt->second));
+                ancestorUpdates.erase(updateIt);
+            }
+
+            usage -= entryUsage + removeIt->DynamicMemoryUsage() + nextTxUsage * removeIt->GetTx().vin.size();
+            usage -= linkUsage * (GetMemPoolParents(removeIt).size() + GetMemPoolChildren(removeIt).size());
+            for (txiter parentIt : GetMemPoolParents(removeIt)) {
+                if (!stage.count(parentIt)) usage -= linkUsage;
+            }
+            if (hashesSize > 1) {
+                hashesSize--;
+                if (hashesSize * 2 < hashesCapacity) hashesCapacity = hashesSize;
+            } else {
+                hashesSize = 0;
+            }
+
+            setEntries setAncestors;
+            CalculateMemPoolAncestors(*removeIt, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+            for (txiter ancestorIt : setAncestors) {
+                if (stage.count(ancestorIt)) continue;
+                DescendantStateUpdate& update = packageUpdates[ancestorIt];
+                update.modifySize -= removeIt->GetTxSize();
+                update.modifyFee -= removeIt->GetModifiedFee();
+                update.modifyCount--;
+            }
+        }
+
+        // Update the remaining ancestors of the package for its removal
+        for (const auto& packageUpdate : packageUpdates) {
+            txiter ancestorIt = packageUpdate.first;
+            auto inserted = ancestorUpdates.emplace(ancestorIt, DescendantStateUpdate());
+            DescendantStateUpdate& update = inserted.first->second;
+            if (!inserted.second) {
+                adjustedByScore.erase(adjustedScore(ancestorIt, update));
+            }
+            update.modifySize += packageUpdate.second.modifySize;
+            update.modifyFee += packageUpdate.second.modifyFee;
+            update.modifyCount += packageUpdate.second.modifyCount;
+            adjustedByScore.emplace(adjustedScore(ancestorIt, update), ancestorIt);
+        }
+    }
+}
+
+void CTxMemPool::trackEviction(size_t nRemoved, int64_t nStartMicros) {
+    AssertLockHeld(cs);
+    m_eviction_stats.events++;
+    m_eviction_stats.txs += nRemoved;
+    m_eviction_stats.time += GetTimeMicros() - nStartMicros;
+}
+
+MempoolEvictionStats CTxMemPool::GetEvictionStats() const {
+    LOCK(cs);
+    return m_eviction_stats;
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining) {
+    LOCK(cs);
+
+    const int64_t nStart = GetTimeMicros();
+    unsigned nTxnRemoved = 0;
+    CFeeRate maxFeeRateRemoved(0);
+    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
+        // Select everything to remove for this overflow first, so that the
+        // ancestor state of the remaining entries is updated only once.
+        // This normally takes a single round; another one only follows if
+        // the memory usage was not projected exactly.
         setEntries stage;
-        CalculateDescendants(mapTx.project<0>(it), stage);
+        descendantUpdateMap ancestorUpdates;
+        CalculateEvictionSet(sizelimit, stage, ancestorUpdates, maxFeeRateRemoved);
+        if (stage.empty()) break;
         nTxnRemoved += stage.size();
 
-        std::vector<CTransaction> txn;
+        std::vector<CTransactionRef> txn;
         if (pvNoSpendsRemaining) {
             txn.reserve(stage.size());
             for (txiter iter : stage)
-                txn.push_back(iter->GetTx());
+                txn.push_back(iter->GetSharedTx());
+        }
+        // The descendant state of the remaining ancestors is already known, so
+        // instead of RemoveStaged, which walks the ancestors of every removed
+        // entry, apply it and sever the links from the remaining parents.
+        // Staged entries only have staged children.
+        for (const auto& update : ancestorUpdates) {
+            mapTx.modify(update.first, update_descendant_state(update.second.modifySize, update.second.modifyFee, update.second.modifyCount));
+        }
+        for (txiter it : stage) {
+            for (txiter parentIt : GetMemPoolParents(it)) {
+                if (!stage.count(parentIt)) UpdateChild(parentIt, it, false);
+            }
+        }
+        for (txiter it : stage) {
+            removeUnchecked(it, MemPoolRemovalReason::SIZELIMIT);
         }
-        RemoveStaged(stage, false, MemPoolRemovalReason::SIZELIMIT);
         if (pvNoSpendsRemaining) {
-            for (const CTransaction& tx : txn) {
-                for (const CTxIn& txin : tx.vin) {
+            for (const CTransactionRef& tx : txn) {
+                for (const CTxIn& txin : tx->vin) {
                     if (exists(txin.prevout.hash)) continue;
                     pvNoSpendsRemaining->push_back(txin.prevout);
                 }
@@ -1043,8 +1432,9 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpends
         }
     }
 
-    if (maxFeeRateRemoved > CFeeRate(0)) {
-        LogPrint(BCLog::MEMPOOL, "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
+    if (nTxnRemoved > 0) {
+        trackEviction(nTxnRemoved, nStart);
+        LogPrint(BCLog::MEMPOOL, "Removed %u txn in %.2fms, rolling minimum fee bumped to %s\n", nTxnRemoved, (GetTimeMicros() - nStart) * 0.001, maxFeeRateRemoved.ToString());
     }
 }
 
@@ -28,6 +28,7 @@
 #include <boost/signals2/signal.hpp>
 
 class CBlockIndex;
+struct TxMemPoolLinks;
 
 /** Fake height value used in Coin to signify they are only in the memory pool (since 0.8) */
 static const uint32_t MEMPOOL_HEIGHT = 0x7FFFFFFF;
@@ -93,6 +94,9 @@ public:
                     int64_t _nTime, unsigned int _entryHeight,
                     bool spendsCoinbase,
                     int64_t nSigOpsCost, LockPoints lp);
+    //! Copies start without links, those belong to the entry in the mempool
+    CTxMemPoolEntry(const CTxMemPoolEntry& other);
+    ~CTxMemPoolEntry();
 
     const CTransaction& GetTx() const { return *this->tx; }
     CTransactionRef GetSharedTx() const { return this->tx; }
@@ -128,6 +132,7 @@ public:
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
     mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable std::unique_ptr<TxMemPoolLinks> links; //!< In-mempool parents and children, set while in mapTx
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -338,6 +343,20 @@ struct TxMempoolInfo
     int64_t nFeeDelta;
 };
 
+/**
+ * Cost of removing transactions from the mempool to keep it within its size
+ * limit (TrimToSize) or for expiry.
+ */
+struct MempoolEvictionStats
+{
+    /** Number of times transactions were removed */
+    uint64_t events = 0;
+    /** Number of transactions removed */
+    uint64_t txs = 0;
+    /** Total time spent selecting and removing them, in microseconds */
+    int64_t time = 0;
+};
+
 /** Reason why a transaction was removed from the mempool,
  * this is passed to the notification signal.
  */
@@ -392,7 +411,7 @@ public:
  *
  * In order for the feerate sort to remain correct, we must update transactions
  * in the mempool when new descendants arrive.  To facilitate this, we track
- * the set of in-mempool direct parents and direct children in mapLinks.  Within
+ * the set of in-mempool direct parents and direct children in each entry's links.  Within
  * each CTxMemPoolEntry, we track the size and fees of all descendants.
  *
  * Usually when a new transaction is added to the mempool, it has no in-mempool
@@ -425,7 +444,7 @@ public:
  * state, to account for in-mempool, out-of-block descendants for all the
  * in-block transactions by calling UpdateTransactionsFromBlock().  Note that
  * until this is called, the mempool state is not consistent, and in particular
- * mapLinks may not be correct (and therefore functions like
+ * the links may not be correct (and therefore functions like
  * CalculateMemPoolAncestors() and CalculateDescendants() that rely
  * on them to walk the mempool are not generally safe to use).
  *
@@ -451,7 +470,11 @@ private:
     mutable bool blockSinceLastRollingFeeBump;
     mutable double rollingMinimumFeeRate; //!< minimum fee to get into the pool, decreases exponentially
 
+    MempoolEvictionStats m_eviction_stats GUARDED_BY(cs);
+
     void trackPackageRemoved(const CFeeRate& rate) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    /** Account for nRemoved transactions removed by an eviction that started at nStartMicros */
+    void trackEviction(size_t nRemoved, int64_t nStartMicros) EXCLUSIVE_LOCKS_REQUIRED(cs);
 
 public:
 
@@ -502,15 +525,21 @@ public:
 private:
     typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
 
-    struct TxLinks {
-        setEntries parents;
-        setEntries children;
+    /** Change to the descendant state of an entry, as in update_descendant_state */
+    struct DescendantStateUpdate {
+        int64_t modifySize = 0;
+        CAmount modifyFee = 0;
+        int64_t modifyCount = 0;
     };
-
-    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
-    txlinksMap mapLinks;
+    typedef std::map<txiter, DescendantStateUpdate, CompareIteratorByHash> descendantUpdateMap;
 
     void UpdateParent(txiter entry, txiter parent, bool add);
+    /** Put two entries that have been linked into the same cluster */
+    void MergeClusters(txiter a, txiter b);
+
+    /** Bitset indexed by vTxHashesIdx for marking entries during a traversal of
+     *  the mempool graph. All bits are clear outside of a traversal. */
+    mutable std::vector<bool> m_traversal_marks GUARDED_BY(cs);
     void UpdateChild(txiter entry, txiter child, bool add);
 
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const EXCLUSIVE_LOCKS_REQUIRED(cs);
@@ -594,10 +623,21 @@ public:
      *  limitDescendantSize = max size of descendants any ancestor can have
      *  errString = populated with error reason if any limits are hit
      *  fSearchForParents = whether to search a tx's vin for in-mempool parents, or
-     *    look up parents from mapLinks. Must be true for entries not in the mempool
+     *    look up parents from the entry's links. Must be true for entries not in the mempool
+     *  The limits are not checked per ancestor if the clusters of the parents
+     *  are small enough that none of them can be hit.
      */
     bool CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString, bool fSearchForParents = true) const EXCLUSIVE_LOCKS_REQUIRED(cs);
 
+    /** Check the ancestor and descendant limits for a package of transactions
+     *  that are not in the mempool, treating the package as a single
+     *  transaction of packageSize that spends the in-mempool parents of all
+     *  of them. This is conservative: every in-mempool ancestor is counted
+     *  as an ancestor of each package transaction.
+     *  Limits and errString are as for CalculateMemPoolAncestors.
+     */
+    bool CheckPackageLimits(const std::vector<CTransactionRef>& package, uint64_t packageSize, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString) const EXCLUSIVE_LOCKS_REQUIRED(cs);
+
     /** Populate setDescendants with all in-mempool descendants of hash.
      *  Assumes that setDescendants includes all in-mempool descendants of anything
      *  already in it.  */
@@ -614,12 +654,16 @@ public:
     /** Remove transactions from the mempool until its dynamic size is <= sizelimit.
       *  pvNoSpendsRemaining, if set, will be populated with the list of outpoints
       *  which are not in mempool which no longer have any spends in this mempool.
+      *  The transactions to remove are selected up front and removed at once.
       */
     void TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining=nullptr);
 
     /** Expire all transaction (and their dependencies) in the mempool older than time. Return the number of removed transactions. */
     int Expire(int64_t time);
 
+    /** Return the cost of the evictions done by TrimToSize and Expire so far */
+    MempoolEvictionStats GetEvictionStats() const;
+
     /**
      * Calculate the ancestor and descendant count for the given transaction.
      * The counts include the transaction itself.
@@ -678,6 +722,12 @@ private:
       * If updateDescendants is true, then also update in-mempool descendants'
       * ancestor state. */
     void UpdateForRemoveFromMempool(const setEntries &entriesToRemove, bool updateDescendants) EXCLUSIVE_LOCKS_REQUIRED(cs);
+    /** Select the packages TrimToSize evicts to get the dynamic size to
+     *  sizelimit, lowest descendant score first, as if each package was removed
+     *  before selecting the next one. The selected entries are added to stage,
+     *  and the changes to the descendant state of their remaining ancestors
+     *  to ancestorUpdates. */
+    void CalculateEvictionSet(size_t sizelimit, setEntries& stage, descendantUpdateMap& ancestorUpdates, CFeeRate& maxFeeRateRemoved) EXCLUSIVE_LOCKS_REQUIRED(cs);
     /** Sever link between specified transaction and direct children. */
     void UpdateChildrenForRemoval(txiter entry) EXCLUSIVE_LOCKS_REQUIRED(cs);
 
@@ -707,10 +757,14 @@ class CCoinsViewMemPool : public CCoinsViewBacked
 {
 protected:
     const CTxMemPool& mempool;
+    /** Outputs of the transactions of a package that are being checked without adding them to the mempool */
+    std::unordered_map<COutPoint, Coin, SaltedOutpointHasher> m_temp_added;
 
 public:
     CCoinsViewMemPool(CCoinsView* baseIn, const CTxMemPool& mempoolIn);
     bool GetCoin(const COutPoint &outpoint, Coin &coin) const override;
+    /** Make the outputs of a transaction of a package available, as if it was in the mempool */
+    void PackageAddTransaction(const CTransactionRef& tx);
 };
 
 /**
@@ -0,0 +1,38 @@
+// Copyright (c) 2018 The XPChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <txrelay.h>
+
+TxRelayOrder::TxRelayOrder(const CTxMemPool& pool) : m_pool(pool), m_pool_updated(0)
+{
+}
+
+void TxRelayOrder::Rank(std::set<uint256>& setToSend, std::vector<RankedTx>& vRanked)
+{
+    vRanked.clear();
+    vRanked.reserve(setToSend.size());
+
+    LOCK(m_pool.cs);
+    const unsigned int nPoolUpdated = m_pool.GetTransactionsUpdated();
+    if (nPoolUpdated != m_pool_updated) {
+        // Ancestor counts and fees may have changed: rank everything again.
+        m_rank.clear();
+        m_pool_updated = nPoolUpdated;
+    }
+
+    for (std::set<uint256>::iterator it = setToSend.begin(); it != setToSend.end();) {
+        auto itRank = m_rank.find(*it);
+        if (itRank == m_rank.end()) {
+            CTxMemPool::txiter itPool = m_pool.mapTx.find(*it);
+            if (itPool == m_pool.mapTx.end()) {
+                // Gone from the mempool: drop it from the queue.
+                it = setToSend.erase(it);
+                continue;
+            }
+            itRank = m_rank.emplace(*it, TxRelayRank{itPool->GetCountWithAncestors(), itPool->GetFee(), itPool->GetTxSize(), *it}).first;
+        }
+        vRanked.emplace_back(itRank->second, it);
+        it++;
+    }
+}
@@ -0,0 +1,78 @@
+// Copyright (c) 2018 The XPChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXRELAY_H
+#define BITCOIN_TXRELAY_H
+
+#include <amount.h>
+#include <txmempool.h>
+#include <uint256.h>
+
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/** What CTxMemPool::CompareDepthAndScore compares a transaction by, taken at one mempool state */
+struct TxRelayRank
+{
+    uint64_t nCountWithAncestors;
+    CAmount nFee;
+    size_t nTxSize;
+    uint256 hash;
+
+    /** Whether this transaction is announced before b */
+    bool operator<(const TxRelayRank& b) const
+    {
+        if (nCountWithAncestors != b.nCountWithAncestors) {
+            return nCountWithAncestors < b.nCountWithAncestors;
+        }
+        // As CompareTxMemPoolEntryByScore
+        double f1 = (double)nFee * b.nTxSize;
+        double f2 = (double)b.nFee * nTxSize;
+        if (f1 == f2) {
+            return b.hash < hash;
+        }
+        return f1 > f2;
+    }
+};
+
+/**
+ * Announcement order of transactions queued for relay, shared by all peers.
+ *
+ * Transaction invs are sent in mempool order (see CTxMemPool::CompareDepthAndScore)
+ * for privacy and priority reasons. Sorting every peer's queue with that comparator
+ * takes the mempool lock and two lookups per comparison, at every trickle of every
+ * peer. Instead, the ancestor count and fee rate of a transaction are looked up
+ * once per mempool state, the first time any peer is about to announce it, and
+ * every peer orders its queue by those.
+ *
+ * The ranks are forgotten whenever the mempool changes, so every trickle orders
+ * its queue by the current mempool state: a parent, having fewer ancestors, is
+ * always announced before its children, whenever either was first queued.
+ */
+class TxRelayOrder
+{
+public:
+    typedef std::pair<TxRelayRank, std::set<uint256>::iterator> RankedTx;
+
+    explicit TxRelayOrder(const CTxMemPool& pool);
+
+    /**
+     * Rank the transactions in setToSend, into vRanked. Transactions that are no
+     * longer in the mempool are removed from setToSend instead, as they would never
+     * be announced. Lower ranks are announced first.
+     */
+    void Rank(std::set<uint256>& setToSend, std::vector<RankedTx>& vRanked);
+
+    size_t size() const { return m_rank.size(); }
+
+private:
+    const CTxMemPool& m_pool;
+    //! CTxMemPool::GetTransactionsUpdated() when m_rank was filled
+    unsigned int m_pool_updated;
+    std::unordered_map<uint256, TxRelayRank, SaltedTxidHasher> m_rank;
+};
+
+#endif // BITCOIN_TXRELAY_H
@@ -367,7 +367,7 @@ bool TestLockPointValidity(const LockPoints* lp)
     return true;
 }
 
-bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool useExistingLockPoints)
+bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool useExistingLockPoints, const CCoinsView* coins_view)
 {
     AssertLockHeld(cs_main);
     AssertLockHeld(mempool.cs);
@@ -394,12 +394,13 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
     else {
         // pcoinsTip contains the UTXO set for chainActive.Tip()
         CCoinsViewMemPool viewMemPool(pcoinsTip.get(), mempool);
+        if (!coins_view) coins_view = &viewMemPool;
         std::vector<int> prevheights;
         prevheights.resize(tx.vin.size());
         for (size_t txinIndex = 0; txinIndex < tx.vin.size(); txinIndex++) {
             const CTxIn& txin = tx.vin[txinIndex];
             Coin coin;
-            if (!viewMemPool.GetCoin(txin.prevout, coin)) {
+            if (!coins_view->GetCoin(txin.prevout, coin)) {
                 return error("%s: Missing input", __func__);
             }
             if (coin.nHeight == MEMPOOL_HEIGHT) {
@@ -530,7 +531,7 @@ static void UpdateMempoolForReorg(DisconnectedBlockTransactions &disconnectpool,
 // Used to avoid mempool polluting consensus critical paths if CCoinsViewMempool
 // were somehow broken and returning the wrong scriptPubKeys
 static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, const CTxMemPool& pool,
-                 unsigned int flags, bool cacheSigStore, PrecomputedTransactionData& txdata) {
+                 unsigned int flags, bool cacheSigStore, PrecomputedTransactionData& txdata, const CCoinsViewMemPool* package_view) {
     AssertLockHeld(cs_main);
 
     // pool.cs should be locked already, but go ahead and re-take the lock here
@@ -549,10 +550,14 @@ static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationSt
         if (coin.IsSpent()) return false;
 
         const CTransactionRef& txFrom = pool.get(txin.prevout.hash);
+        Coin coinFromPackage;
         if (txFrom) {
             assert(txFrom->GetHash() == txin.prevout.hash);
             assert(txFrom->vout.size() > txin.prevout.n);
             assert(txFrom->vout[txin.prevout.n] == coin.out);
+        } else if (package_view && package_view->GetCoin(txin.prevout, coinFromPackage)) {
+            // The outputs of earlier transactions of a package being checked
+            assert(coinFromPackage.out == coin.out);
         } else {
             const Coin& coinFromDisk = pcoinsTip->AccessCoin(txin.prevout);
             assert(!coinFromDisk.IsSpent());
@@ -565,7 +570,8 @@ static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationSt
 
 static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx,
                               bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
-                              bool bypass_limits, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache, bool test_accept)
+                              bool bypass_limits, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache, bool test_accept,
+                              CCoinsViewMemPool* package_view)
 {
     const CTransaction& tx = *ptx;
     const uint256 hash = tx.GetHash();
@@ -574,6 +580,8 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
     if (pfMissingInputs) {
         *pfMissingInputs = false;
     }
+    // A member of a package finds the outputs of the transactions before it in package_view
+    const bool package_member = package_view != nullptr;
 
     if (!CheckTransaction(tx, state))
         return false; // state filled in by CheckTransaction
@@ -653,7 +661,7 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
 
         LockPoints lp;
         CCoinsViewMemPool viewMemPool(pcoinsTip.get(), pool);
-        view.SetBackend(viewMemPool);
+        view.SetBackend(package_view ? *package_view : viewMemPool);
 
         // do all inputs exist?
         for (const CTxIn& txin : tx.vin) {
@@ -685,9 +693,7 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         // Only accept BIP68 sequence locked transactions that can be mined in the next
         // block; we don't want our mempool filled up with transactions that can't
         // be mined yet.
-        // Must keep pool.cs for this unless we change CheckSequenceLocks to take a
-        // CoinsViewCache instead of create its own
-        if (!CheckSequenceLocks(tx, STANDARD_LOCKTIME_VERIFY_FLAGS, &lp))
+        if (!CheckSequenceLocks(tx, STANDARD_LOCKTIME_VERIFY_FLAGS, &lp, false, &view))
             return state.DoS(0, false, REJECT_NONSTANDARD, "non-BIP68-final");
 
         CAmount nFees = 0;
@@ -733,13 +739,14 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
             return state.DoS(0, false, REJECT_NONSTANDARD, "bad-txns-too-many-sigops", false,
                 strprintf("%d", nSigOpsCost));
 
+        // The fee rate of a package member is checked for the package as a whole
         CAmount mempoolRejectFee = pool.GetMinFee(gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
-        if (!bypass_limits && mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
+        if (!bypass_limits && !package_member && mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool min fee not met", false, strprintf("%d < %d", nModifiedFees, mempoolRejectFee));
         }
 
         // No transactions are allowed below minRelayTxFee except from disconnected blocks
-        if (!bypass_limits && nModifiedFees < ::minRelayTxFee.GetFee(nSize)) {
+        if (!bypass_limits && !package_member && nModifiedFees < ::minRelayTxFee.GetFee(nSize)) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "min relay fee not met", false, strprintf("%d < %d", nModifiedFees, ::minRelayTxFee.GetFee(nSize)));
         }
 
@@ -748,12 +755,13 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
                 REJECT_HIGHFEE, "absurdly-high-fee",
                 strprintf("%d > %d", nFees, nAbsurdFee));
 
-        // Calculate in-mempool ancestors, up to a limit.
+        // Calculate in-mempool ancestors, up to a limit. The limits of a
+        // package member have been checked for the package as a whole.
         CTxMemPool::setEntries setAncestors;
-        size_t nLimitAncestors = gArgs.GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
-        size_t nLimitAncestorSize = gArgs.GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
-        size_t nLimitDescendants = gArgs.GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
-        size_t nLimitDescendantSize = gArgs.GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+        size_t nLimitAncestors = package_member ? std::numeric_limits<size_t>::max() : gArgs.GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = package_member ? std::numeric_limits<size_t>::max() : gArgs.GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+        size_t nLimitDescendants = package_member ? std::numeric_limits<size_t>::max() : gArgs.GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = package_member ? std::numeric_limits<size_t>::max() : gArgs.GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
         std::string errString;
         if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
             return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
@@ -934,7 +942,7 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         // invalid blocks (using TestBlockValidity), however allowing such
         // transactions into the mempool can be exploited as a DoS attack.
         unsigned int currentBlockScriptVerifyFlags = GetBlockScriptFlags(chainActive.Tip(), Params().GetConsensus());
-        if (!CheckInputsFromMempoolAndCache(tx, state, view, pool, currentBlockScriptVerifyFlags, true, txdata)) {
+        if (!CheckInputsFromMempoolAndCache(tx, state, view, pool, currentBlockScriptVerifyFlags, true, txdata, package_view)) {
             return error("%s: BUG! PLEASE REPORT THIS! CheckInputs failed against latest-block but not STANDARD flags %s, %s",
                     __func__, hash.ToString(), FormatStateMessage(state));
         }
@@ -962,20 +970,24 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         // - it's not being re-added during a reorg which bypasses typical mempool fee limits
         // - the node is not behind
         // - the transaction is not dependent on any other transactions in the mempool
-        bool validForFeeEstimation = !fReplacementTransaction && !bypass_limits && IsCurrentForFeeEstimation() && pool.HasNoInputsOf(tx);
+        // - it's not part of a package, whose members may be paid for by others
+        bool validForFeeEstimation = !fReplacementTransaction && !bypass_limits && !package_member && IsCurrentForFeeEstimation() && pool.HasNoInputsOf(tx);
 
         // Store transaction in memory
         pool.addUnchecked(hash, entry, setAncestors, validForFeeEstimation);
 
         // trim mempool and check if tx was trimmed
-        if (!bypass_limits) {
+        // (a package is trimmed once all of it has been added)
+        if (!bypass_limits && !package_member) {
             LimitMempoolSize(pool, gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
             if (!pool.exists(hash))
                 return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
         }
     }
 
-    GetMainSignals().TransactionAddedToMempool(ptx);
+    if (!package_member) {
+        GetMainSignals().TransactionAddedToMempool(ptx);
+    }
 
     return true;
 }
@@ -986,7 +998,7 @@ static bool AcceptToMemoryPoolWithTime(const CChainParams& chainparams, CTxMemPo
                         bool bypass_limits, const CAmount nAbsurdFee, bool test_accept)
 {
     std::vector<COutPoint> coins_to_uncache;
-    bool res = AcceptToMemoryPoolWorker(chainparams, pool, state, tx, pfMissingInputs, nAcceptTime, plTxnReplaced, bypass_limits, nAbsurdFee, coins_to_uncache, test_accept);
+    bool res = AcceptToMemoryPoolWorker(chainparams, pool, state, tx, pfMissingInputs, nAcceptTime, plTxnReplaced, bypass_limits, nAbsurdFee, coins_to_uncache, test_accept, nullptr /* package_view */);
     if (!res) {
         for (const COutPoint& hashTx : coins_to_uncache)
             pcoinsTip->Uncache(hashTx);
@@ -1005,6 +1017,166 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return AcceptToMemoryPoolWithTime(chainparams, pool, state, tx, pfMissingInputs, GetTime(), plTxnReplaced, bypass_limits, nAbsurdFee, test_accept);
 }
 
+/** Check that a package is within the size limits and sorted, and that its transactions don't conflict */
+static bool CheckPackage(const std::vector<CTransactionRef>& package, CValidationState& state)
+{
+    if (package.empty()) {
+        return state.Invalid(false, REJECT_INVALID, "package-empty");
+    }
+    if (package.size() > MAX_PACKAGE_COUNT) {
+        return state.DoS(0, false, REJECT_NONSTANDARD, "package-too-many-transactions");
+    }
+
+    int64_t nPackageSize = 0;
+    std::set<uint256> setLater;
+    for (const CTransactionRef& ptx : package) {
+        nPackageSize += GetVirtualTransactionSize(*ptx);
+        if (!setLater.insert(ptx->GetHash()).second) {
+            return state.Invalid(false, REJECT_INVALID, "package-contains-duplicates");
+        }
+    }
+    if (nPackageSize > MAX_PACKAGE_SIZE * 1000) {
+        return state.DoS(0, false, REJECT_NONSTANDARD, "package-too-large");
+    }
+
+    // Parents must come before their children, and no two transactions may
+    // spend the same output
+    std::set<COutPoint> setSpent;
+    for (const CTransactionRef& ptx : package) {
+        setLater.erase(ptx->GetHash());
+        for (const CTxIn& txin : ptx->vin) {
+            if (setLater.count(txin.prevout.hash)) {
+                return state.Invalid(false, REJECT_INVALID, "package-not-sorted");
+            }
+            if (!setSpent.insert(txin.prevout).second) {
+                return state.Invalid(false, REJECT_INVALID, "conflict-in-package");
+            }
+        }
+    }
+    return true;
+}
+
+bool AcceptPackageToMemoryPool(CTxMemPool& pool, CValidationState& state, const std::vector<CTransactionRef>& package,
+                               bool* pfMissingInputs, const CAmount nAbsurdFee, bool test_accept, uint256* failed_tx)
+{
+    const CChainParams& chainparams = Params();
+    AssertLockHeld(cs_main);
+    LOCK(pool.cs);
+    if (pfMissingInputs) {
+        *pfMissingInputs = false;
+    }
+    if (failed_tx) {
+        failed_tx->SetNull();
+    }
+
+    if (!CheckPackage(package, state)) {
+        return false;
+    }
+
+    // Skip transactions we already have, such as a parent that made it into
+    // the mempool on its own
+    std::vector<CTransactionRef> txns;
+    for (const CTransactionRef& ptx : package) {
+        if (!pool.exists(ptx->GetHash())) {
+            txns.push_back(ptx);
+        }
+    }
+    if (txns.empty()) {
+        return true;
+    }
+
+    // Replacing mempool transactions could not be undone if a later
+    // transaction of the package fails, so don't allow it
+    uint64_t nPackageSize = 0;
+    for (const CTransactionRef& ptx : txns) {
+        for (const CTxIn& txin : ptx->vin) {
+            if (pool.mapNextTx.count(txin.prevout)) {
+                if (failed_tx) *failed_tx = ptx->GetHash();
+                return state.Invalid(false, REJECT_DUPLICATE, "txn-mempool-conflict");
+            }
+        }
+        nPackageSize += GetVirtualTransactionSize(*ptx);
+    }
+
+    std::string errString;
+    if (!pool.CheckPackageLimits(txns, nPackageSize,
+            gArgs.GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT),
+            gArgs.GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000,
+            gArgs.GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT),
+            gArgs.GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000, errString)) {
+        return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
+    }
+
+    // Check the transactions one by one, each finding the outputs of those
+    // before it in package_view, without changing the mempool
+    std::vector<COutPoint> coins_to_uncache;
+    CCoinsViewMemPool package_view(pcoinsTip.get(), pool);
+    const int64_t nAcceptTime = GetTime();
+    bool res = true;
+    for (const CTransactionRef& ptx : txns) {
+        if (!AcceptToMemoryPoolWorker(chainparams, pool, state, ptx, pfMissingInputs, nAcceptTime, nullptr /* plTxnReplaced */,
+                false /* bypass_limits */, nAbsurdFee, coins_to_uncache, true /* test_accept */, &package_view)) {
+            if (failed_tx) *failed_tx = ptx->GetHash();
+            res = false;
+            break;
+        }
+        package_view.PackageAddTransaction(ptx);
+    }
+
+    if (res) {
+        CCoinsViewCache view(&package_view);
+        CAmount nModifiedFees = 0;
+        int64_t nSize = 0;
+        for (const CTransactionRef& ptx : txns) {
+            CAmount nFees = view.GetValueIn(*ptx) - ptx->GetValueOut();
+            pool.ApplyDelta(ptx->GetHash(), nFees);
+            nModifiedFees += nFees;
+            nSize += GetVirtualTransactionSize(*ptx, GetTransactionSigOpCost(*ptx, view, STANDARD_SCRIPT_VERIFY_FLAGS));
+        }
+        CAmount mempoolRejectFee = pool.GetMinFee(gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
+            res = state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool min fee not met", false, strprintf("%d < %d", nModifiedFees, mempoolRejectFee));
+        } else if (nModifiedFees < ::minRelayTxFee.GetFee(nSize)) {
+            res = state.DoS(0, false, REJECT_INSUFFICIENTFEE, "min relay fee not met", false, strprintf("%d < %d", nModifiedFees, ::minRelayTxFee.GetFee(nSize)));
+        }
+    }
+
+    if (res && !test_accept) {
+        // Add the transactions, each finding its parents in the mempool (their
+        // scripts are in the caches by now). The package passed as a whole,
+        // so this only fails if the mempool changed in between; whatever was
+        // added then stays, and is trimmed like any other low fee transaction.
+        std::vector<CTransactionRef> added;
+        for (const CTransactionRef& ptx : txns) {
+            if (!AcceptToMemoryPoolWorker(chainparams, pool, state, ptx, pfMissingInputs, nAcceptTime, nullptr /* plTxnReplaced */,
+                    false /* bypass_limits */, nAbsurdFee, coins_to_uncache, false /* test_accept */, &package_view)) {
+                if (failed_tx) *failed_tx = ptx->GetHash();
+                res = false;
+                break;
+            }
+            added.push_back(ptx);
+        }
+        // Trimming evicts the descendants of anything it evicts, so no child
+        // is left without its parent
+        LimitMempoolSize(pool, gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+        for (const CTransactionRef& ptx : added) {
+            if (!pool.exists(ptx->GetHash())) {
+                if (res) res = state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+                continue;
+            }
+            GetMainSignals().TransactionAddedToMempool(ptx);
+        }
+    }
+
+    if (!res) {
+        for (const COutPoint& hashTx : coins_to_uncache)
+            pcoinsTip->Uncache(hashTx);
+    }
+    CValidationState stateDummy;
+    FlushStateToDisk(chainparams, stateDummy, FlushStateMode::PERIODIC);
+    return res;
+}
+
 /**
  * Return transaction in txOut, and if it was found inside a block, its hash is placed in hashBlock.
  * If blockIndex is provided, the transaction is fetched from the corresponding block.
@@ -1421,6 +1593,35 @@ int GetSpendHeight(const CCoinsViewCache& inputs)
 static CuckooCache::cache<uint256, SignatureCacheHasher> scriptExecutionCache;
 static uint256 scriptExecutionCacheNonce(GetRandHash());
 
+/** The script execution cache entry for tx verified with flags */
+static uint256 GetScriptExecutionCacheEntry(const CTransaction& tx, unsigned int flags)
+{
+    uint256 hashCacheEntry;
+    // We only use the first 19 bytes of nonce to avoid a second SHA
+    // round - giving us 19 + 32 + 4 = 55 bytes (+ 8 + 1 = 64)
+    static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
+    CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+    return hashCacheEntry;
+}
+
+bool CheckCoinStakeScripts(const CTransaction& tx, const CTxOut& txOutPrev, unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata)
+{
+    // A cache entry stands for all inputs of the transaction
+    const bool fCacheable = tx.vin.size() == 1;
+    uint256 hashCacheEntry = GetScriptExecutionCacheEntry(tx, flags);
+    LOCK(cs_main); //TODO: Remove this requirement by making CuckooCache not require external locks
+    if (fCacheable && scriptExecutionCache.contains(hashCacheEntry, false)) {
+        return true;
+    }
+    if (!CScriptCheck(txOutPrev, tx, 0, flags, true, &txdata)()) {
+        return false;
+    }
+    if (fCacheable && cacheStore) {
+        scriptExecutionCache.insert(hashCacheEntry);
+    }
+    return true;
+}
+
 void InitScriptExecutionCache() {
     // nMaxCacheSize is unsigned. If -maxsigcachesize is set to zero,
     // setup_bytes creates the minimum possible cache (2 elements).
@@ -1466,11 +1667,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
             // correct (ie that the transaction hash which is in tx's prevouts
             // properly commits to the scriptPubKey in the inputs view of that
             // transaction).
-            uint256 hashCacheEntry;
-            // We only use the first 19 bytes of nonce to avoid a second SHA
-            // round - giving us 19 + 32 + 4 = 55 bytes (+ 8 + 1 = 64)
-            static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
-            CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+            uint256 hashCacheEntry = GetScriptExecutionCacheEntry(tx, flags);
             AssertLockHeld(cs_main); //TODO: Remove this requirement by making CuckooCache not require external locks
             if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore)) {
                 return true;
@@ -1556,7 +1753,9 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
     return true;
 }
 
-static bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
+} // namespace
+
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
 {
     CDiskBlockPos pos = pindex->GetUndoPos();
     if (pos.IsNull()) {
@@ -1587,6 +1786,8 @@ static bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
     return true;
 }
 
+namespace {
+
 /** Abort with a message */
 static bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
 {
@@ -1756,6 +1957,117 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CScriptCheck> mempoolscriptcheckqueue(128);
+
+void ThreadMempoolScriptCheck() {
+    RenameThread("xpchain-mpscrch");
+    mempoolscriptcheckqueue.Thread();
+}
+
+ScriptPrecheck PrecheckTransactionScripts(const CTransactionRef& ptx, CValidationState& state)
+{
+    const CTransaction& tx = *ptx;
+    const uint256 hash = tx.GetHash();
+
+    // The checks AcceptToMemoryPool does before verifying scripts come first,
+    // so that no script is run for a transaction it rejects without.
+    CValidationState stateDummy;
+    std::string reason;
+    if (tx.IsCoinBase() || !CheckTransaction(tx, stateDummy) || (fRequireStandard && !IsStandardTx(tx, reason)) ||
+            ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS) < MIN_STANDARD_TX_NONWITNESS_SIZE) {
+        return ScriptPrecheck::SKIPPED;
+    }
+
+    // Copy the spent outputs while holding the locks, so that the scripts can
+    // be verified against this snapshot without them.
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    CAmount nModifiedFees = -tx.GetValueOut();
+    CFeeRate minFeeRate;
+    {
+        LOCK2(cs_main, mempool.cs);
+        if (!CheckFinalTx(tx, STANDARD_LOCKTIME_VERIFY_FLAGS) || mempool.exists(hash)) {
+            return ScriptPrecheck::SKIPPED;
+        }
+        CCoinsViewMemPool view_mempool(pcoinsTip.get(), mempool);
+        for (const CTxIn& txin : tx.vin) {
+            // Replacements are left to AcceptToMemoryPool
+            if (mempool.mapNextTx.count(txin.prevout)) return ScriptPrecheck::SKIPPED;
+            // Leave the coins cache as AcceptToMemoryPool expects to find it, it
+            // uncaches what it fetched itself if the transaction is rejected
+            const bool fCached = pcoinsTip->HaveCoinInCache(txin.prevout);
+            Coin coin;
+            const bool fHaveCoin = view_mempool.GetCoin(txin.prevout, coin);
+            if (!fCached) pcoinsTip->Uncache(txin.prevout);
+            if (!fHaveCoin) return ScriptPrecheck::SKIPPED;
+            nModifiedFees += coin.out.nValue;
+            view.AddCoin(txin.prevout, std::move(coin), false);
+        }
+        mempool.ApplyDelta(hash, nModifiedFees);
+        minFeeRate = std::max(mempool.GetMinFee(gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000), ::minRelayTxFee);
+    }
+    if (fRequireStandard && (!AreInputsStandard(tx, view) || (tx.HasWitness() && !IsWitnessStandard(tx, view)))) {
+        return ScriptPrecheck::SKIPPED;
+    }
+    const int64_t nSigOpsCost = GetTransactionSigOpCost(tx, view, STANDARD_SCRIPT_VERIFY_FLAGS);
+    if (nSigOpsCost > MAX_STANDARD_TX_SIGOPS_COST || nModifiedFees < minFeeRate.GetFee(GetVirtualTransactionSize(tx, nSigOpsCost))) {
+        return ScriptPrecheck::SKIPPED;
+    }
+
+    PrecomputedTransactionData txdata(tx);
+    std::vector<CScriptCheck> vChecks;
+    vChecks.reserve(tx.vin.size());
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        vChecks.emplace_back(view.AccessCoin(tx.vin[i].prevout).out, tx, i, STANDARD_SCRIPT_VERIFY_FLAGS, true /* cacheStore */, &txdata);
+    }
+    bool fValid;
+    if (nScriptCheckThreads) {
+        CCheckQueueControl<CScriptCheck> control(&mempoolscriptcheckqueue);
+        control.Add(vChecks);
+        fValid = control.Wait();
+    } else {
+        fValid = std::all_of(vChecks.begin(), vChecks.end(), [](CScriptCheck& check) { return check(); });
+    }
+    if (fValid) {
+        LOCK(cs_main); //TODO: Remove this requirement by making CuckooCache not require external locks
+        scriptExecutionCache.insert(GetScriptExecutionCacheEntry(tx, STANDARD_SCRIPT_VERIFY_FLAGS));
+        return ScriptPrecheck::VALID;
+    }
+
+    // Reject the transaction as CheckInputs and AcceptToMemoryPool would, so
+    // that its scripts are not run again under cs_main
+    bool fInvalid = false;
+    for (unsigned int i = 0; i < tx.vin.size() && !fInvalid; i++) {
+        const CTxOut& txout = view.AccessCoin(tx.vin[i].prevout).out;
+        CScriptCheck check(txout, tx, i, STANDARD_SCRIPT_VERIFY_FLAGS, false, &txdata);
+        if (check()) continue;
+        fInvalid = true;
+        CScriptCheck check2(txout, tx, i, STANDARD_SCRIPT_VERIFY_FLAGS & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, false, &txdata);
+        if (check2()) {
+            state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
+        } else {
+            state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
+        }
+    }
+    if (!fInvalid) {
+        return ScriptPrecheck::SKIPPED;
+    }
+    if (!tx.HasWitness()) {
+        // Only the witness may be missing, see AcceptToMemoryPoolWorker
+        auto fAllValid = [&](unsigned int flags) {
+            for (unsigned int i = 0; i < tx.vin.size(); i++) {
+                if (!CScriptCheck(view.AccessCoin(tx.vin[i].prevout).out, tx, i, flags, false, &txdata)()) return false;
+            }
+            return true;
+        };
+        if (fAllValid(STANDARD_SCRIPT_VERIFY_FLAGS & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK)) &&
+                !fAllValid(STANDARD_SCRIPT_VERIFY_FLAGS & ~SCRIPT_VERIFY_CLEANSTACK)) {
+            state.SetCorruptionPossible();
+        }
+    }
+    return ScriptPrecheck::INVALID;
+}
+
 // Protected by cs_main
 VersionBitsCache versionbitscache;
 
@@ -1876,11 +2188,6 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
     assert(pindex);
     assert(*pindex->phashBlock == block.GetHash());
     int64_t nTimeStart = GetTimeMicros();
-    uint256 hashProofOfStake;
-    if(IsPoSHeight(pindex->nHeight, chainparams.GetConsensus()) && !CheckProofOfStake(block.vtx[1], block.nBits, hashProofOfStake, block.nTime))
-    {
-        return state.DoS(100, error("%s: CheckProofOfStake failed", __func__), REJECT_INVALID, "bad-blk");
-    }
 
     // Check it again in case a previous version let a bad block in
     // NOTE: We don't currently (re-)invoke ContextualCheckBlock() or
@@ -2046,6 +2353,22 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
     // Get the script flags for this block
     unsigned int flags = GetBlockScriptFlags(pindex, chainparams.GetConsensus());
 
+    std::vector<PrecomputedTransactionData> txdata;
+    txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
+
+    // The coinstake is verified with the block's script flags, so CheckInputs
+    // below finds it in the script execution cache, and its sighash data is
+    // computed once for both. A block that is only being checked leaves
+    // nothing in the cache.
+    if (IsPoSHeight(pindex->nHeight, chainparams.GetConsensus())) {
+        txdata.emplace_back(*block.vtx[0]);
+        txdata.emplace_back(*block.vtx[1]);
+        uint256 hashProofOfStake;
+        if (!CheckProofOfStake(block.vtx[1], block.nBits, hashProofOfStake, block.nTime, flags, !fJustCheck, &txdata[1])) {
+            return state.DoS(100, error("%s: CheckProofOfStake failed", __func__), REJECT_INVALID, "bad-blk");
+        }
+    }
+
     int64_t nTime2 = GetTimeMicros(); nTimeForks += nTime2 - nTime1;
     LogPrint(BCLog::BENCH, "    - Fork checks: %.2fms [%.2fs (%.2fms/blk)]\n", MILLI * (nTime2 - nTime1), nTimeForks * MICRO, nTimeForks * MILLI / nBlocksTotal);
 
@@ -2058,8 +2381,6 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
     int nInputs = 0;
     int64_t nSigOpsCost = 0;
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
-    std::vector<PrecomputedTransactionData> txdata;
-    txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = *(block.vtx[i]);
@@ -2101,7 +2422,9 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
             return state.DoS(100, error("ConnectBlock(): too many sigops"),
                              REJECT_INVALID, "bad-blk-sigops");
 
-        txdata.emplace_back(tx);
+        if (txdata.size() == i) {
+            txdata.emplace_back(tx);
+        }
         if (!tx.IsCoinBase())
         {
             std::vector<CScriptCheck> vChecks;
@@ -4966,18 +5289,179 @@ int VersionBitsTipStateSinceHeight(const Consensus::Params& params, Consensus::D
     return VersionBitsStateSinceHeight(chainActive.Tip(), params, pos, versionbitscache);
 }
 
-static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+static const uint64_t MEMPOOL_DUMP_VERSION = 2;
+static const uint64_t MEMPOOL_JOURNAL_VERSION = 1;
+/** Number of transactions loaded from mempool.dat per cs_main lock */
+static const int MEMPOOL_LOAD_BATCH_SIZE = 100;
 
-bool LoadMempool(void)
+/**
+ * mempool.dat holds a snapshot of the mempool, and mempool.journal the
+ * changes made to it since, appended in checksummed batches by
+ * FlushMempoolJournal. Both carry the id of the snapshot, so that a journal
+ * is never applied to another snapshot than its own.
+ */
+static CCriticalSection cs_mempool_files;
+static uint64_t g_mempool_snapshot_id GUARDED_BY(cs_mempool_files) = 0;
+static uint64_t g_mempool_snapshot_size GUARDED_BY(cs_mempool_files) = 0;
+static uint64_t g_mempool_journal_size GUARDED_BY(cs_mempool_files) = 0;
+/** The fee deltas as of the snapshot and the journal */
+static std::map<uint256, CAmount> g_mempool_files_deltas GUARDED_BY(cs_mempool_files);
+
+/** Transactions added to or removed from the mempool since the last snapshot or journal flush */
+static CCriticalSection cs_mempool_journal;
+static bool g_mempool_journal_active GUARDED_BY(cs_mempool_journal) = false;
+static std::vector<uint256> g_mempool_journal_txids GUARDED_BY(cs_mempool_journal);
+static boost::signals2::connection g_mempool_journal_added;
+static boost::signals2::connection g_mempool_journal_removed;
+
+static void MempoolJournalEntryChanged(const CTransactionRef& tx)
+{
+    LOCK(cs_mempool_journal);
+    if (g_mempool_journal_active) {
+        g_mempool_journal_txids.push_back(tx->GetHash());
+    }
+}
+
+namespace {
+/** A transaction of mempool.dat or its journal */
+struct MempoolFileEntry
+{
+    CTransactionRef tx;
+    int64_t nTime;
+    int64_t nFeeDelta;
+    /** Result of the script check done before loading it */
+    ScriptPrecheck precheck = ScriptPrecheck::SKIPPED;
+};
+}
+
+static uint64_t GetFileSize(const fs::path& path)
+{
+    boost::system::error_code ec;
+    uint64_t size = fs::file_size(path, ec);
+    return ec ? 0 : size;
+}
+
+/** Read mempool.dat, returning the snapshot id, or 0 for a file without a journal */
+static uint64_t ReadMempoolSnapshot(std::vector<MempoolFileEntry>& entries, std::map<uint256, CAmount>& mapDeltas)
 {
-    const CChainParams& chainparams = Params();
-    int64_t nExpiryTimeout = gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
     FILE* filestr = fsbridge::fopen(GetDataDir() / "mempool.dat", "rb");
     CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
     if (file.IsNull()) {
-        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
-        return false;
+        throw std::runtime_error("failed to open mempool file");
+    }
+
+    uint64_t version;
+    file >> version;
+    if (version == 1) {
+        // Written before the journal and checksum were added
+        uint64_t num;
+        file >> num;
+        while (num--) {
+            MempoolFileEntry entry;
+            file >> entry.tx >> entry.nTime >> entry.nFeeDelta;
+            entries.push_back(std::move(entry));
+        }
+        file >> mapDeltas;
+        return 0;
+    }
+    if (version != MEMPOOL_DUMP_VERSION) {
+        throw std::runtime_error(strprintf("unknown mempool file version %u", version));
+    }
+
+    CHashVerifier<CAutoFile> verifier(&file);
+    uint64_t snapshot_id;
+    uint64_t num;
+    verifier >> snapshot_id >> num;
+    while (num--) {
+        MempoolFileEntry entry;
+        verifier >> entry.tx >> entry.nTime >> entry.nFeeDelta;
+        entries.push_back(std::move(entry));
+    }
+    verifier >> mapDeltas;
+    uint256 hashTmp;
+    file >> hashTmp;
+    if (hashTmp != verifier.GetHash()) {
+        throw std::runtime_error("checksum mismatch, data corrupted");
+    }
+    return snapshot_id;
+}
+
+/** Apply the batches of mempool.journal that belong to snapshot_id, up to the first incomplete one */
+static int ReadMempoolJournal(uint64_t snapshot_id, std::vector<MempoolFileEntry>& entries, std::map<uint256, CAmount>& mapDeltas)
+{
+    FILE* filestr = fsbridge::fopen(GetDataDir() / "mempool.journal", "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        return 0;
+    }
+
+    std::map<uint256, size_t> mapIndex;
+    for (size_t i = 0; i < entries.size(); i++) {
+        mapIndex[entries[i].tx->GetHash()] = i;
+    }
+
+    int nBatches = 0;
+    try {
+        uint64_t version;
+        uint64_t journal_snapshot_id;
+        file >> version >> journal_snapshot_id;
+        if (version != MEMPOOL_JOURNAL_VERSION || journal_snapshot_id != snapshot_id) {
+            LogPrintf("Ignoring mempool journal that does not belong to mempool.dat\n");
+            return 0;
+        }
+        while (true) {
+            // The end of the file is only flagged after reading past it
+            int c = fgetc(file.Get());
+            if (c == EOF) break;
+            ungetc(c, file.Get());
+
+            std::vector<unsigned char> data;
+            uint256 hashTmp;
+            file >> data >> hashTmp;
+            if (hashTmp != Hash(data.begin(), data.end())) {
+                throw std::runtime_error("checksum mismatch");
+            }
+
+            CDataStream batch(data, SER_DISK, CLIENT_VERSION);
+            std::vector<uint256> vRemoved;
+            uint64_t num;
+            batch >> vRemoved >> num;
+            for (const uint256& hash : vRemoved) {
+                auto it = mapIndex.find(hash);
+                if (it != mapIndex.end()) {
+                    entries[it->second].tx = nullptr;
+                    mapIndex.erase(it);
+                }
+            }
+            while (num--) {
+                MempoolFileEntry entry;
+                batch >> entry.tx >> entry.nTime >> entry.nFeeDelta;
+                auto it = mapIndex.find(entry.tx->GetHash());
+                if (it != mapIndex.end()) {
+                    // Keep the place of a transaction we already have, ahead
+                    // of its children, with its latest fee delta
+                    entries[it->second] = std::move(entry);
+                } else {
+                    mapIndex[entry.tx->GetHash()] = entries.size();
+                    entries.push_back(std::move(entry));
+                }
+            }
+            // The deltas of transactions that were not in the mempool
+            mapDeltas.clear();
+            batch >> mapDeltas;
+            ++nBatches;
+        }
+    } catch (const std::exception& e) {
+        // The node may have stopped while a batch was being written
+        LogPrintf("Mempool journal ends in an incomplete batch (%s), ignoring it\n", e.what());
     }
+    return nBatches;
+}
+
+bool LoadMempool(void)
+{
+    const CChainParams& chainparams = Params();
+    int64_t nExpiryTimeout = gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
 
     int64_t count = 0;
     int64_t expired = 0;
@@ -4985,30 +5469,52 @@ bool LoadMempool(void)
     int64_t already_there = 0;
     int64_t nNow = GetTime();
 
+    std::vector<MempoolFileEntry> entries;
+    std::map<uint256, CAmount> mapDeltas;
+    int nBatches = 0;
     try {
-        uint64_t version;
-        file >> version;
-        if (version != MEMPOOL_DUMP_VERSION) {
-            return false;
+        uint64_t snapshot_id = ReadMempoolSnapshot(entries, mapDeltas);
+        if (snapshot_id) {
+            nBatches = ReadMempoolJournal(snapshot_id, entries, mapDeltas);
         }
-        uint64_t num;
-        file >> num;
-        while (num--) {
-            CTransactionRef tx;
-            int64_t nTime;
-            int64_t nFeeDelta;
-            file >> tx;
-            file >> nTime;
-            file >> nFeeDelta;
-
-            CAmount amountdelta = nFeeDelta;
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    auto it = entries.begin();
+    while (it != entries.end()) {
+        auto batch_end = it;
+        for (int n = 0; n < MEMPOOL_LOAD_BATCH_SIZE && batch_end != entries.end(); ++batch_end) {
+            if (batch_end->tx) ++n;
+        }
+
+        // The scripts are checked on the mempool script check threads first
+        // (which works for transactions whose parents are loaded)
+        for (auto jt = it; jt != batch_end; ++jt) {
+            if (jt->tx && jt->nTime + nExpiryTimeout > nNow) {
+                CValidationState state;
+                jt->precheck = PrecheckTransactionScripts(jt->tx, state);
+            }
+        }
+
+        LOCK(cs_main);
+        for (; it != batch_end; ++it) {
+            if (!it->tx) {
+                // Removed in the journal
+                continue;
+            }
+            const CTransactionRef& tx = it->tx;
+
+            CAmount amountdelta = it->nFeeDelta;
             if (amountdelta) {
                 mempool.PrioritiseTransaction(tx->GetHash(), amountdelta);
             }
             CValidationState state;
-            if (nTime + nExpiryTimeout > nNow) {
-                LOCK(cs_main);
-                AcceptToMemoryPoolWithTime(chainparams, mempool, state, tx, nullptr /* pfMissingInputs */, nTime,
+            if (it->precheck == ScriptPrecheck::INVALID) {
+                ++failed;
+            } else if (it->nTime + nExpiryTimeout > nNow) {
+                AcceptToMemoryPoolWithTime(chainparams, mempool, state, tx, nullptr /* pfMissingInputs */, it->nTime,
                                            nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */,
                                            false /* test_accept */);
                 if (state.IsValid()) {
@@ -5027,21 +5533,16 @@ bool LoadMempool(void)
             } else {
                 ++expired;
             }
-            if (ShutdownRequested())
-                return false;
         }
-        std::map<uint256, CAmount> mapDeltas;
-        file >> mapDeltas;
+        if (ShutdownRequested())
+            return false;
+    }
 
-        for (const auto& i : mapDeltas) {
-            mempool.PrioritiseTransaction(i.first, i.second);
-        }
-    } catch (const std::exception& e) {
-        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
-        return false;
+    for (const auto& i : mapDeltas) {
+        mempool.PrioritiseTransaction(i.first, i.second);
     }
 
-    LogPrintf("Imported mempool transactions from disk: %i succeeded, %i failed, %i expired, %i already there\n", count, failed, expired, already_there);
+    LogPrintf("Imported mempool transactions from disk: %i succeeded, %i failed, %i expired, %i already there (%i journal batches)\n", count, failed, expired, already_there, nBatches);
     return true;
 }
 
@@ -5049,6 +5550,8 @@ bool DumpMempool(void)
 {
     int64_t start = GetTimeMicros();
 
+    LOCK(cs_mempool_files);
+
     std::map<uint256, CAmount> mapDeltas;
     std::vector<TxMempoolInfo> vinfo;
 
@@ -5058,10 +5561,19 @@ bool DumpMempool(void)
             mapDeltas[i.first] = i.second;
         }
         vinfo = mempool.infoAll();
+        g_mempool_files_deltas = mempool.mapDeltas;
+
+        // The snapshot covers all changes so far
+        LOCK(cs_mempool_journal);
+        g_mempool_journal_txids.clear();
     }
 
     int64_t mid = GetTimeMicros();
 
+    // Until a new snapshot has been written, the next flush of the journal
+    // has to write one instead
+    g_mempool_snapshot_size = 0;
+
     try {
         FILE* filestr = fsbridge::fopen(GetDataDir() / "mempool.dat.new", "wb");
         if (!filestr) {
@@ -5073,19 +5585,37 @@ bool DumpMempool(void)
         uint64_t version = MEMPOOL_DUMP_VERSION;
         file << version;
 
-        file << (uint64_t)vinfo.size();
+        const uint64_t snapshot_id = GetRand(std::numeric_limits<uint64_t>::max() - 1) + 1;
+        CHashedSourceWriter<CAutoFile> hasher(&file);
+        hasher << snapshot_id;
+        hasher << (uint64_t)vinfo.size();
         for (const auto& i : vinfo) {
-            file << *(i.tx);
-            file << (int64_t)i.nTime;
-            file << (int64_t)i.nFeeDelta;
+            hasher << *(i.tx);
+            hasher << (int64_t)i.nTime;
+            hasher << (int64_t)i.nFeeDelta;
             mapDeltas.erase(i.tx->GetHash());
         }
 
-        file << mapDeltas;
+        hasher << mapDeltas;
+        file << hasher.GetHash();
         if (!FileCommit(file.Get()))
             throw std::runtime_error("FileCommit failed");
         file.fclose();
         RenameOver(GetDataDir() / "mempool.dat.new", GetDataDir() / "mempool.dat");
+
+        // Start an empty journal for the new snapshot
+        CAutoFile journal(fsbridge::fopen(GetDataDir() / "mempool.journal.new", "wb"), SER_DISK, CLIENT_VERSION);
+        if (journal.IsNull())
+            throw std::runtime_error("failed to open mempool journal");
+        journal << MEMPOOL_JOURNAL_VERSION << snapshot_id;
+        if (!FileCommit(journal.Get()))
+            throw std::runtime_error("FileCommit failed");
+        journal.fclose();
+        RenameOver(GetDataDir() / "mempool.journal.new", GetDataDir() / "mempool.journal");
+
+        g_mempool_snapshot_id = snapshot_id;
+        g_mempool_snapshot_size = GetFileSize(GetDataDir() / "mempool.dat");
+        g_mempool_journal_size = GetFileSize(GetDataDir() / "mempool.journal");
         int64_t last = GetTimeMicros();
         LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (mid-start)*MICRO, (last-mid)*MICRO);
     } catch (const std::exception& e) {
@@ -5095,6 +5625,119 @@ bool DumpMempool(void)
     return true;
 }
 
+bool FlushMempoolJournal()
+{
+    LOCK(cs_mempool_files);
+    {
+        LOCK(cs_mempool_journal);
+        if (!g_mempool_journal_active) {
+            return true;
+        }
+    }
+
+    // Once the journal has grown larger than the snapshot, it is faster to
+    // load a new snapshot
+    if (g_mempool_journal_size >= g_mempool_snapshot_size) {
+        return DumpMempool();
+    }
+
+    int64_t start = GetTimeMicros();
+
+    std::vector<std::pair<uint64_t, TxMempoolInfo>> vAdded;
+    std::vector<uint256> vRemoved;
+    std::map<uint256, CAmount> mapDeltas;
+    {
+        LOCK(mempool.cs);
+        std::vector<uint256> vTxids;
+        {
+            LOCK(cs_mempool_journal);
+            vTxids.swap(g_mempool_journal_txids);
+        }
+        if (vTxids.empty() && mempool.mapDeltas == g_mempool_files_deltas) {
+            return true;
+        }
+        std::set<uint256> setSeen;
+        for (const uint256& hash : vTxids) {
+            if (!setSeen.insert(hash).second) continue;
+            CTxMemPool::txiter it = mempool.mapTx.find(hash);
+            if (it != mempool.mapTx.end()) {
+                vAdded.emplace_back(it->GetCountWithAncestors(), mempool.info(hash));
+            } else {
+                vRemoved.push_back(hash);
+            }
+        }
+        // As in mempool.dat, the deltas of transactions in the mempool are
+        // written with them: those prioritised since they were written are
+        // written again.
+        for (const auto &i : mempool.mapDeltas) {
+            CTxMemPool::txiter it = mempool.mapTx.find(i.first);
+            if (it == mempool.mapTx.end()) {
+                mapDeltas[i.first] = i.second;
+            } else if (!setSeen.count(i.first)) {
+                auto jt = g_mempool_files_deltas.find(i.first);
+                if (jt == g_mempool_files_deltas.end() || jt->second != i.second) {
+                    vAdded.emplace_back(it->GetCountWithAncestors(), mempool.info(i.first));
+                }
+            }
+        }
+        g_mempool_files_deltas = mempool.mapDeltas;
+    }
+    // Parents have fewer ancestors than their children, and must be loaded first
+    std::stable_sort(vAdded.begin(), vAdded.end(), [](const std::pair<uint64_t, TxMempoolInfo>& a, const std::pair<uint64_t, TxMempoolInfo>& b) {
+        return a.first < b.first;
+    });
+
+    CDataStream batch(SER_DISK, CLIENT_VERSION);
+    batch << vRemoved << (uint64_t)vAdded.size();
+    for (const auto& i : vAdded) {
+        batch << *(i.second.tx) << (int64_t)i.second.nTime << (int64_t)i.second.nFeeDelta;
+    }
+    batch << mapDeltas;
+    std::vector<unsigned char> data(batch.begin(), batch.end());
+
+    try {
+        CAutoFile journal(fsbridge::fopen(GetDataDir() / "mempool.journal", "ab"), SER_DISK, CLIENT_VERSION);
+        if (journal.IsNull())
+            throw std::runtime_error("failed to open mempool journal");
+        journal << data << Hash(data.begin(), data.end());
+        if (!FileCommit(journal.Get()))
+            throw std::runtime_error("FileCommit failed");
+        journal.fclose();
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to append to mempool journal: %s. Continuing anyway.\n", e.what());
+        // Replace the journal, whatever state it was left in, with a new snapshot next time
+        g_mempool_snapshot_size = 0;
+        return false;
+    }
+    g_mempool_journal_size = GetFileSize(GetDataDir() / "mempool.journal");
+    LogPrint(BCLog::MEMPOOL, "Flushed mempool journal: %u added, %u removed, %gs\n", vAdded.size(), vRemoved.size(), (GetTimeMicros() - start)*MICRO);
+    return true;
+}
+
+bool StartMempoolJournal()
+{
+    {
+        LOCK(cs_mempool_journal);
+        if (g_mempool_journal_active) {
+            return true;
+        }
+        g_mempool_journal_active = true;
+    }
+    g_mempool_journal_added = mempool.NotifyEntryAdded.connect(&MempoolJournalEntryChanged);
+    g_mempool_journal_removed = mempool.NotifyEntryRemoved.connect(std::bind(&MempoolJournalEntryChanged, std::placeholders::_1));
+    // Changes are recorded relative to a snapshot of the mempool as loaded
+    return DumpMempool();
+}
+
+void StopMempoolJournal()
+{
+    g_mempool_journal_added.disconnect();
+    g_mempool_journal_removed.disconnect();
+    LOCK(cs_mempool_journal);
+    g_mempool_journal_active = false;
+    g_mempool_journal_txids.clear();
+}
+
 //! Guess how far we are in the verification process at the given block index
 //! require cs_main if pindex has not been validated yet (because nChainTx might be unset)
 double GuessVerificationProgress(const ChainTxData& data, const CBlockIndex *pindex) {
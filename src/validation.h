@@ -34,6 +34,7 @@
 #include <script/standard.h>
 
 class CBlockIndex;
+class CBlockUndo;
 class CBlockTreeDB;
 class CChainParams;
 class CCoinsViewDB;
@@ -83,8 +84,15 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Number of blocks that can be requested at any given time from a single peer whose
+ *  block download speed has not been measured yet. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds for the adaptive number of blocks in flight from a single measured peer. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER_ADAPTIVE = 64;
+/** Time (in microseconds) in which a peer is expected to deliver its whole block request queue. Used to size
+ *  the adaptive per-peer quota from the measured delivery time per block. */
+static const int64_t BLOCK_DOWNLOAD_QUEUE_TARGET = 2 * 1000000;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -95,11 +103,13 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
 static const int MAX_CMPCTBLOCK_DEPTH = 5;
 /** Maximum depth of blocks we're willing to respond to GETBLOCKTXN requests for. */
 static const int MAX_BLOCKTXN_DEPTH = 10;
-/** Size of the "block download window": how far ahead of our current height do we fetch?
+/** Initial size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
- *  degree of disordering of blocks on disk (which make reindexing and pruning harder). We'll probably
- *  want to make this a per-peer adaptive value at some point. */
+ *  degree of disordering of blocks on disk (which make reindexing and pruning harder). The window is
+ *  widened up to MAX_BLOCK_DOWNLOAD_WINDOW when a slow peer stalls it while validation keeps up. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum size the block download window may grow to while validation keeps up with the download. */
+static const unsigned int MAX_BLOCK_DOWNLOAD_WINDOW = 4096;
 /** Time to wait (in seconds) between writing blocks/block index to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
@@ -119,9 +129,14 @@ static const int64_t MAX_FEE_ESTIMATION_TIP_AGE = 3 * 60 * 60;
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
 static const bool DEFAULT_TXINDEX = false;
+static const bool DEFAULT_BLOCKFILTERINDEX = false;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 /** Default for -persistmempool */
 static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Maximum number of transactions in a package */
+static const unsigned int MAX_PACKAGE_COUNT = 25;
+/** Maximum total virtual size of the transactions in a package, in kilobytes */
+static const unsigned int MAX_PACKAGE_SIZE = 101;
 /** Default for -mempoolreplacement */
 static const bool DEFAULT_ENABLE_REPLACEMENT = true;
 /** Default for using fee filter */
@@ -264,6 +279,25 @@ bool LoadChainTip(const CChainParams& chainparams);
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the script checking thread for transactions relayed to the mempool */
+void ThreadMempoolScriptCheck();
+/** Result of PrecheckTransactionScripts */
+enum class ScriptPrecheck {
+    SKIPPED, //!< Not checked, AcceptToMemoryPool decides
+    VALID,   //!< Valid with the standard flags, AcceptToMemoryPool finds this in the script execution cache
+    INVALID, //!< Invalid, the reason is in the state as AcceptToMemoryPool would have set it
+};
+
+/**
+ * Verify the scripts of a transaction without holding cs_main, against a
+ * snapshot of the outputs it spends, using the mempool script checking threads.
+ * This is only done for transactions that pass the cheaper checks of
+ * AcceptToMemoryPool that come before its script checks (already known, missing
+ * inputs, conflicts, standardness, fees, sigops); the others are SKIPPED and left
+ * to it. A VALID result saves AcceptToMemoryPool the standard script checks under
+ * cs_main, an INVALID one takes the place of its rejection.
+ */
+ScriptPrecheck PrecheckTransactionScripts(const CTransactionRef& ptx, CValidationState& state) LOCKS_EXCLUDED(cs_main);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
@@ -307,6 +341,17 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                         bool* pfMissingInputs, std::list<CTransactionRef>* plTxnReplaced,
                         bool bypass_limits, const CAmount nAbsurdFee, bool test_accept=false);
 
+/** (try to) add a package of transactions to the memory pool, either all of them or none.
+ * Parents must come before their children, and the transactions must not conflict
+ * with each other or with the mempool. Transactions already in the mempool are
+ * skipped. The fee rate and ancestor limits apply to the package as a whole, so a
+ * parent that pays too little on its own can be accepted along with a child paying
+ * for it. The whole package is checked before any of it is added, and with test_accept
+ * nothing is. If failed_tx is given, it is set to the transaction that was rejected,
+ * or to null if the package as a whole was. **/
+bool AcceptPackageToMemoryPool(CTxMemPool& pool, CValidationState& state, const std::vector<CTransactionRef>& package,
+                               bool* pfMissingInputs, const CAmount nAbsurdFee, bool test_accept=false, uint256* failed_tx=nullptr);
+
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
 
@@ -347,10 +392,12 @@ bool TestLockPointValidity(const LockPoints* lp);
  * of the block needed for calculation or skips the calculation and uses the LockPoints
  * passed in for evaluation.
  * The LockPoints should not be considered valid if CheckSequenceLocks returns false.
+ * The heights of the spent coins are looked up in coins_view if given, or else
+ * in the mempool and the UTXO set.
  *
  * See consensus/consensus.h for flag definitions.
  */
-bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp = nullptr, bool useExistingLockPoints = false);
+bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp = nullptr, bool useExistingLockPoints = false, const CCoinsView* coins_view = nullptr);
 
 /**
  * Closure representing one script verification
@@ -390,10 +437,19 @@ public:
 /** Initializes the script-execution cache */
 void InitScriptExecutionCache();
 
+/**
+ * Verify the script of the single input of a coinstake, spending txOutPrev,
+ * with the given flags. If cacheStore is set, the result is kept in the script
+ * execution cache, so CheckInputs with the same flags (as in ConnectBlock) does
+ * not verify it again.
+ */
+bool CheckCoinStakeScripts(const CTransaction& tx, const CTxOut& txOutPrev, unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata);
+
 
 /** Functions for disk access for blocks */
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams, bool fProofOfStake);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex* pindex);
 bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& message_start);
 bool ReadRawBlockFromDisk(std::vector<uint8_t>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& message_start);
 
@@ -493,12 +549,28 @@ static const unsigned int REJECT_HIGHFEE = 0x100;
 /** Get block file info entry for one block file */
 CBlockFileInfo* GetBlockFileInfo(size_t n);
 
-/** Dump the mempool to disk. */
+/** Interval between two flushes of the mempool journal, in seconds */
+static const int MEMPOOL_JOURNAL_FLUSH_INTERVAL = 60;
+
+/** Dump the mempool to disk, starting a new, empty journal. */
 bool DumpMempool();
 
-/** Load the mempool from disk. */
+/** Load the mempool from disk, along with the changes in its journal. */
 bool LoadMempool();
 
+/** Record the changes to the mempool from now on, and write a snapshot for them to apply to. */
+bool StartMempoolJournal();
+
+/** Stop recording changes to the mempool. */
+void StopMempoolJournal();
+
+/**
+ * Append the changes to the mempool since the last flush to the journal, or
+ * write a new snapshot if the journal has grown larger than the current one.
+ * Does nothing unless the journal was started.
+ */
+bool FlushMempoolJournal();
+
 //! Check whether the block associated with this index entry is pruned or not.
 inline bool IsBlockPruned(const CBlockIndex* pblockindex)
 {
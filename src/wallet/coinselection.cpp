@@ -5,6 +5,7 @@
 #include <wallet/coinselection.h>
 #include <util.h>
 #include <utilmoneystr.h>
+#include <utiltime.h>
 
 // Descending order comparator
 struct {
@@ -39,6 +40,12 @@ struct {
  * to skip testing the inclusion of UTXOs that match the effective value and waste of an omitted
  * predecessor.
  *
+ * Large pools are handled with two more shortcuts. When including the next UTXO would exceed the
+ * target range, every UTXO at least as large is omitted at once by a binary search over the sorted
+ * pool. Backtracking pops the last included UTXO off a stack instead of walking back over all the
+ * omitted ones. The search also stops when its time budget runs out, returning the best solution
+ * found up to then.
+ *
  * The Branch and Bound algorithm is described in detail in Murch's Master Thesis:
  * https://murch.one/wp-content/uploads/2016/11/erhardt2016coinselection.pdf
  *
@@ -58,41 +65,68 @@ struct {
  */
 
 static const size_t TOTAL_TRIES = 100000;
+//! how many tries to run between checks of the search time budget
+static const size_t TRIES_PER_TIME_CHECK = 1000;
 
 bool SelectCoinsBnB(std::vector<OutputGroup>& utxo_pool, const CAmount& target_value, const CAmount& cost_of_change, std::set<CInputCoin>& out_set, CAmount& value_ret, CAmount not_input_fees)
+{
+    // Sort the utxo_pool
+    std::sort(utxo_pool.begin(), utxo_pool.end(), descending);
+
+    std::vector<const OutputGroup*> sorted_pool;
+    sorted_pool.reserve(utxo_pool.size());
+    for (const OutputGroup& utxo : utxo_pool) {
+        sorted_pool.push_back(&utxo);
+    }
+    return SelectCoinsBnB(sorted_pool, target_value, cost_of_change, out_set, value_ret, not_input_fees);
+}
+
+bool SelectCoinsBnB(const std::vector<const OutputGroup*>& utxo_pool, const CAmount& target_value, const CAmount& cost_of_change, std::set<CInputCoin>& out_set, CAmount& value_ret, CAmount not_input_fees,
+                    int64_t max_search_micros)
 {
     out_set.clear();
     CAmount curr_value = 0;
 
-    std::vector<bool> curr_selection; // select the utxo at this index
-    curr_selection.reserve(utxo_pool.size());
+    // Indices of the included utxos, in increasing order. Backtracking pops the
+    // last one instead of walking back over every omitted utxo after it.
+    std::vector<size_t> curr_selection;
     CAmount actual_target = not_input_fees + target_value;
+    CAmount upper_bound = actual_target + cost_of_change;
 
-    // Calculate curr_available_value
-    CAmount curr_available_value = 0;
-    for (const OutputGroup& utxo : utxo_pool) {
+    // remaining_value[i] is the total effective value of the utxos from i on, which
+    // gives the lookahead for any position without tracking it along the search
+    std::vector<CAmount> remaining_value(utxo_pool.size() + 1, 0);
+    for (size_t i = utxo_pool.size(); i > 0; --i) {
+        const OutputGroup& utxo = *utxo_pool[i - 1];
         // Assert that this utxo is not negative. It should never be negative, effective value calculation should have removed it
         assert(utxo.effective_value > 0);
-        curr_available_value += utxo.effective_value;
+        assert(i == utxo_pool.size() || utxo.effective_value >= utxo_pool[i]->effective_value);
+        remaining_value[i - 1] = remaining_value[i] + utxo.effective_value;
     }
-    if (curr_available_value < actual_target) {
+    if (remaining_value[0] < actual_target) {
         return false;
     }
 
-    // Sort the utxo_pool
-    std::sort(utxo_pool.begin(), utxo_pool.end(), descending);
+    const bool waste_increases = !utxo_pool.empty() && (utxo_pool[0]->fee - utxo_pool[0]->long_term_fee) > 0;
+    const int64_t deadline = GetTimeMicros() + max_search_micros;
 
     CAmount curr_waste = 0;
-    std::vector<bool> best_selection;
+    size_t next_utxo = 0; // the utxo whose inclusion is decided next
+    std::vector<size_t> best_selection;
     CAmount best_waste = MAX_MONEY;
 
     // Depth First search loop for choosing the UTXOs
     for (size_t i = 0; i < TOTAL_TRIES; ++i) {
+        if (i > 0 && i % TRIES_PER_TIME_CHECK == 0 && GetTimeMicros() > deadline) {
+            LogPrint(BCLog::SELECTCOINS, "SelectCoinsBnB(): search time exceeded after %u tries, %s\n", i, best_selection.empty() ? "no solution" : "using best solution so far");
+            break;
+        }
+
         // Conditions for starting a backtrack
         bool backtrack = false;
-        if (curr_value + curr_available_value < actual_target ||                // Cannot possibly reach target with the amount remaining in the curr_available_value.
-            curr_value > actual_target + cost_of_change ||    // Selected value is out of range, go back and try other branch
-            (curr_waste > best_waste && (utxo_pool.at(0).fee - utxo_pool.at(0).long_term_fee) > 0)) { // Don't select things which we know will be more wasteful if the waste is increasing
+        if (curr_value + remaining_value[next_utxo] < actual_target ||    // Cannot possibly reach target with the amount remaining in the utxos not yet decided.
+            curr_value > upper_bound ||                                   // Selected value is out of range, go back and try other branch
+            (curr_waste > best_waste && waste_increases)) {               // Don't select things which we know will be more wasteful if the waste is increasing
             backtrack = true;
         } else if (curr_value >= actual_target) {       // Selected value is within range
             curr_waste += (curr_value - actual_target); // This is the excess value which is added to the waste for the below comparison
@@ -102,7 +136,6 @@ bool SelectCoinsBnB(std::vector<OutputGroup>& utxo_pool, const CAmount& target_v
             // explore any more UTXOs to avoid burning money like that.
             if (curr_waste <= best_waste) {
                 best_selection = curr_selection;
-                best_selection.resize(utxo_pool.size());
                 best_waste = curr_waste;
             }
             curr_waste -= (curr_value - actual_target); // Remove the excess value as we will be selecting different coins now
@@ -111,38 +144,39 @@ bool SelectCoinsBnB(std::vector<OutputGroup>& utxo_pool, const CAmount& target_v
 
         // Backtracking, moving backwards
         if (backtrack) {
-            // Walk backwards to find the last included UTXO that still needs to have its omission branch traversed.
-            while (!curr_selection.empty() && !curr_selection.back()) {
-                curr_selection.pop_back();
-                curr_available_value += utxo_pool.at(curr_selection.size()).effective_value;
-            }
-
             if (curr_selection.empty()) { // We have walked back to the first utxo and no branch is untraversed. All solutions searched
                 break;
             }
 
-            // Output was included on previous iterations, try excluding now.
-            curr_selection.back() = false;
-            OutputGroup& utxo = utxo_pool.at(curr_selection.size() - 1);
+            // The last included UTXO still needs to have its omission branch traversed.
+            const size_t last = curr_selection.back();
+            curr_selection.pop_back();
+            const OutputGroup& utxo = *utxo_pool[last];
             curr_value -= utxo.effective_value;
             curr_waste -= utxo.fee - utxo.long_term_fee;
+            next_utxo = last + 1;
         } else { // Moving forwards, continuing down this branch
-            OutputGroup& utxo = utxo_pool.at(curr_selection.size());
-
-            // Remove this utxo from the curr_available_value utxo amount
-            curr_available_value -= utxo.effective_value;
-
-            // Avoid searching a branch if the previous UTXO has the same value and same waste and was excluded. Since the ratio of fee to
-            // long term fee is the same, we only need to check if one of those values match in order to know that the waste is the same.
-            if (!curr_selection.empty() && !curr_selection.back() &&
-                utxo.effective_value == utxo_pool.at(curr_selection.size() - 1).effective_value &&
-                utxo.fee == utxo_pool.at(curr_selection.size() - 1).fee) {
-                curr_selection.push_back(false);
+            const OutputGroup& utxo = *utxo_pool[next_utxo];
+            const bool prev_omitted = next_utxo > 0 && (curr_selection.empty() || curr_selection.back() != next_utxo - 1);
+
+            if (curr_value + utxo.effective_value > upper_bound) {
+                // Including this UTXO, or any other at least as large, goes out of range. Omit them
+                // all at once by skipping to the first UTXO that still fits below the upper bound.
+                const CAmount gap = upper_bound - curr_value;
+                next_utxo = std::upper_bound(utxo_pool.begin() + next_utxo, utxo_pool.end(), gap,
+                    [](CAmount value, const OutputGroup* group) { return value >= group->effective_value; }) - utxo_pool.begin();
+            } else if (prev_omitted &&
+                utxo.effective_value == utxo_pool[next_utxo - 1]->effective_value &&
+                utxo.fee == utxo_pool[next_utxo - 1]->fee) {
+                // Avoid searching a branch if the previous UTXO has the same value and same waste and was excluded. Since the ratio of fee to
+                // long term fee is the same, we only need to check if one of those values match in order to know that the waste is the same.
+                ++next_utxo;
             } else {
                 // Inclusion branch first (Largest First Exploration)
-                curr_selection.push_back(true);
+                curr_selection.push_back(next_utxo);
                 curr_value += utxo.effective_value;
                 curr_waste += utxo.fee - utxo.long_term_fee;
+                ++next_utxo;
             }
         }
     }
@@ -154,11 +188,9 @@ bool SelectCoinsBnB(std::vector<OutputGroup>& utxo_pool, const CAmount& target_v
 
     // Set output set
     value_ret = 0;
-    for (size_t i = 0; i < best_selection.size(); ++i) {
-        if (best_selection.at(i)) {
-            util::insert(out_set, utxo_pool.at(i).m_outputs);
-            value_ret += utxo_pool.at(i).m_value;
-        }
+    for (size_t index : best_selection) {
+        util::insert(out_set, utxo_pool[index]->m_outputs);
+        value_ret += utxo_pool[index]->m_value;
     }
 
     return true;
@@ -288,6 +320,47 @@ bool KnapsackSolver(const CAmount& nTargetValue, std::vector<OutputGroup>& group
     return true;
 }
 
+/******************************************************************************
+
+ EffectiveValueIndex
+
+ ******************************************************************************/
+
+EffectiveValueIndex::EffectiveValueIndex(std::vector<OutputGroup> groups, const CFeeRate& effective_feerate, const CFeeRate& long_term_feerate)
+{
+    m_groups.reserve(groups.size());
+    for (OutputGroup& group : groups) {
+        group.fee = 0;
+        group.long_term_fee = 0;
+        group.effective_value = 0;
+        for (auto it = group.m_outputs.begin(); it != group.m_outputs.end(); ) {
+            const CInputCoin& coin = *it;
+            CAmount effective_value = coin.txout.nValue - (coin.m_input_bytes < 0 ? 0 : effective_feerate.GetFee(coin.m_input_bytes));
+            // Only include outputs that are positive effective value (i.e. not dust)
+            if (effective_value > 0) {
+                group.fee += coin.m_input_bytes < 0 ? 0 : effective_feerate.GetFee(coin.m_input_bytes);
+                group.long_term_fee += coin.m_input_bytes < 0 ? 0 : long_term_feerate.GetFee(coin.m_input_bytes);
+                group.effective_value += effective_value;
+                ++it;
+            } else {
+                it = group.Discard(coin);
+            }
+        }
+        if (group.effective_value > 0) m_groups.push_back(std::move(group));
+    }
+    std::sort(m_groups.begin(), m_groups.end(), descending);
+}
+
+std::vector<const OutputGroup*> EffectiveValueIndex::GetEligible(const CoinEligibilityFilter& eligibility_filter) const
+{
+    std::vector<const OutputGroup*> eligible;
+    eligible.reserve(m_groups.size());
+    for (const OutputGroup& group : m_groups) {
+        if (group.EligibleForSpending(eligibility_filter)) eligible.push_back(&group);
+    }
+    return eligible;
+}
+
 /******************************************************************************
 
  OutputGroup
@@ -6,6 +6,7 @@
 #define BITCOIN_WALLET_COINSELECTION_H
 
 #include <amount.h>
+#include <policy/feerate.h>
 #include <primitives/transaction.h>
 #include <random.h>
 
@@ -13,6 +14,8 @@
 static const CAmount MIN_CHANGE = CENT;
 //! final minimum change amount after paying for fees
 static const CAmount MIN_FINAL_CHANGE = MIN_CHANGE/2;
+//! time budget for a Branch and Bound search before it settles for the best solution found so far
+static const int64_t BNB_MAX_SEARCH_MICROS = 100 * 1000;
 
 class CInputCoin {
 public:
@@ -93,8 +96,34 @@ struct OutputGroup
     bool EligibleForSpending(const CoinEligibilityFilter& eligibility_filter) const;
 };
 
+/**
+ * Output groups with a positive effective value at one fee rate, sorted by
+ * descending effective value.
+ *
+ * The effective values and the order only depend on the fee rates, so the
+ * index is built once per coin selection and each eligibility pass takes a
+ * filtered view of it, instead of copying and re-sorting the whole pool.
+ */
+class EffectiveValueIndex
+{
+public:
+    EffectiveValueIndex(std::vector<OutputGroup> groups, const CFeeRate& effective_feerate, const CFeeRate& long_term_feerate);
+
+    /** Return the groups passing the filter, still in descending effective value order. */
+    std::vector<const OutputGroup*> GetEligible(const CoinEligibilityFilter& eligibility_filter) const;
+
+    size_t size() const { return m_groups.size(); }
+
+private:
+    std::vector<OutputGroup> m_groups;
+};
+
 bool SelectCoinsBnB(std::vector<OutputGroup>& utxo_pool, const CAmount& target_value, const CAmount& cost_of_change, std::set<CInputCoin>& out_set, CAmount& value_ret, CAmount not_input_fees);
 
+/** Branch and Bound over a pool already sorted by descending effective value. Gives up after max_search_micros, keeping the best solution found. */
+bool SelectCoinsBnB(const std::vector<const OutputGroup*>& utxo_pool, const CAmount& target_value, const CAmount& cost_of_change, std::set<CInputCoin>& out_set, CAmount& value_ret, CAmount not_input_fees,
+                    int64_t max_search_micros = BNB_MAX_SEARCH_MICROS);
+
 // Original coin selection algorithm as a fallback
 bool KnapsackSolver(const CAmount& nTargetValue, std::vector<OutputGroup>& groups, std::set<CInputCoin>& setCoinsRet, CAmount& nValueRet);
 
@@ -54,6 +54,71 @@ void CheckUniqueFileid(const BerkeleyEnvironment& env, const std::string& filena
 
 CCriticalSection cs_db;
 std::map<std::string, BerkeleyEnvironment> g_dbenvs GUARDED_BY(cs_db); //!< Map from directory name to open db environment.
+
+LogDataBytes ToLogData(const CDataStream& ss)
+{
+    return LogDataBytes(ss.begin(), ss.end());
+}
+
+//! Salvage the records of a log database the way BerkeleyBatch::Recover does
+//! for BerkeleyDB files: the file is renamed to newFilename, and the last
+//! readable state is written to a fresh file, filtered by recoverKVcallback.
+bool RecoverLog(const fs::path& directory, const std::string& filename, void *callbackDataIn, bool (*recoverKVcallback)(void* callbackData, CDataStream ssKey, CDataStream ssValue), std::string& newFilename)
+{
+    const fs::path file_path = directory / filename;
+    std::vector<LogDatabaseOp> ops;
+    uint64_t discarded = 0;
+    bool fCorrupt = false;
+    std::string error;
+    if (!LogDatabase::ReadFile(file_path, ops, discarded, fCorrupt, error)) {
+        LogPrintf("%s\n", error);
+        return false;
+    }
+    if (discarded > 0) {
+        LogPrintf("Salvage skips the last %u bytes of %s%s\n", discarded, filename, fCorrupt ? ", which start with a damaged record" : "");
+    }
+
+    newFilename = strprintf("%s.%d.bak", filename, GetTime());
+    try {
+        fs::rename(file_path, directory / newFilename);
+        LogPrintf("Renamed %s to %s\n", filename, newFilename);
+    } catch (const fs::filesystem_error&) {
+        LogPrintf("Failed to rename %s to %s\n", filename, newFilename);
+        return false;
+    }
+
+    std::map<LogDataBytes, LogDataBytes> entries;
+    for (LogDatabaseOp& op : ops) {
+        if (op.fErase) {
+            entries.erase(op.key);
+        } else {
+            entries[op.key] = std::move(op.value);
+        }
+    }
+    if (entries.empty()) {
+        LogPrintf("Salvage found no records in %s.\n", newFilename);
+        return false;
+    }
+    LogPrintf("Salvage found %u records\n", entries.size());
+
+    std::vector<LogDatabaseOp> salvaged;
+    for (const auto& entry : entries) {
+        if (recoverKVcallback) {
+            CDataStream ssKey((const char*)entry.first.data(), (const char*)entry.first.data() + entry.first.size(), SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue((const char*)entry.second.data(), (const char*)entry.second.data() + entry.second.size(), SER_DISK, CLIENT_VERSION);
+            if (!(*recoverKVcallback)(callbackDataIn, ssKey, ssValue))
+                continue;
+        }
+        salvaged.emplace_back(false, entry.first, entry.second);
+    }
+
+    LogDatabase db(file_path);
+    if (!db.Open(true /* fCreate */, error)) {
+        LogPrintf("%s\n", error);
+        return false;
+    }
+    return db.Apply(salvaged) && db.Sync();
+}
 } // namespace
 
 BerkeleyEnvironment* GetWalletEnv(const fs::path& wallet_path, std::string& database_filename)
@@ -252,6 +317,10 @@ bool BerkeleyBatch::Recover(const fs::path& file_path, void *callbackDataIn, boo
     std::string filename;
     BerkeleyEnvironment* env = GetWalletEnv(file_path, filename);
 
+    if (LogDatabase::IsLogFile(env->Directory() / filename)) {
+        return RecoverLog(env->Directory(), filename, callbackDataIn, recoverKVcallback, newFilename);
+    }
+
     // Recovery procedure:
     // move wallet file to walletfilename.timestamp.bak
     // Call Salvage with fAggressive=true to
@@ -346,6 +415,28 @@ bool BerkeleyBatch::VerifyDatabaseFile(const fs::path& file_path, std::string& w
     BerkeleyEnvironment* env = GetWalletEnv(file_path, walletFile);
     fs::path walletDir = env->Directory();
 
+    if (LogDatabase::IsLogFile(walletDir / walletFile)) {
+        std::vector<LogDatabaseOp> ops;
+        uint64_t discarded = 0;
+        bool fCorrupt = false;
+        if (!LogDatabase::ReadFile(walletDir / walletFile, ops, discarded, fCorrupt, errorStr)) {
+            return false;
+        }
+        if (fCorrupt) {
+            errorStr = strprintf(_("Wallet file %s is corrupt %u bytes before its end; restart with -salvagewallet to recover"
+                                   " the records before that, or restore from a backup."),
+                                 walletFile, discarded);
+            return false;
+        }
+        if (discarded > 0) {
+            warningStr = strprintf(_("Warning: %u bytes at the end of wallet file %s are incomplete and will be discarded;"
+                                     " if your balance or transactions are incorrect you should"
+                                     " restore from a backup."),
+                                   discarded, walletFile);
+        }
+        return true;
+    }
+
     if (fs::exists(walletDir / walletFile))
     {
         std::string backup_filename;
@@ -368,6 +459,98 @@ bool BerkeleyBatch::VerifyDatabaseFile(const fs::path& file_path, std::string& w
     return true;
 }
 
+bool BerkeleyBatch::MigrateToLog(const fs::path& file_path, std::string& out_backup_filename, std::string& errorStr)
+{
+    std::string walletFile;
+    BerkeleyEnvironment* env = GetWalletEnv(file_path, walletFile);
+    const fs::path db_path = env->Directory() / walletFile;
+    if (!fs::exists(db_path) || LogDatabase::IsLogFile(db_path)) {
+        return true;
+    }
+
+    LogPrintf("Migrating wallet %s to a log database...\n", walletFile);
+    const int64_t nStart = GetTimeMillis();
+    fs::path tmp_path = db_path;
+    tmp_path += ".migrate";
+    fs::remove(tmp_path);
+
+    bool fSuccess = true;
+    size_t count = 0;
+    {
+        LogDatabase log(tmp_path);
+        BerkeleyDatabase database(file_path);
+        BerkeleyBatch batch(database, "r", false /* fFlushOnClose */);
+        fSuccess = log.Open(true /* fCreate */, errorStr) && batch.StartCursor();
+        std::vector<LogDatabaseOp> ops;
+        while (fSuccess) {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = batch.ReadAtCursor(ssKey, ssValue);
+            if (ret == DB_NOTFOUND) {
+                break;
+            } else if (ret != 0) {
+                fSuccess = false;
+                break;
+            }
+            ops.emplace_back(false, ToLogData(ssKey), ToLogData(ssValue));
+            if (ops.size() >= 1000 || ssValue.size() >= (1 << 20)) {
+                fSuccess = log.Apply(ops);
+                count += ops.size();
+                ops.clear();
+            }
+        }
+        fSuccess = fSuccess && log.Apply(ops) && log.Sync();
+        count += ops.size();
+        batch.Close();
+        log.Close();
+
+        LOCK(cs_db);
+        env->CloseDb(walletFile);
+        env->CheckpointLSN(walletFile);
+        env->mapFileUseCount.erase(walletFile);
+    }
+
+    if (fSuccess) {
+        out_backup_filename = strprintf("%s.%d.bak", walletFile, GetTime());
+        const fs::path backup_path = env->Directory() / out_backup_filename;
+        try {
+            fs::rename(db_path, backup_path);
+        } catch (const fs::filesystem_error& e) {
+            LogPrintf("Failed to rename %s to %s: %s\n", walletFile, out_backup_filename, e.what());
+            fSuccess = false;
+        }
+        if (fSuccess) {
+            try {
+                fs::rename(tmp_path, db_path);
+            } catch (const fs::filesystem_error& e) {
+                LogPrintf("Failed to replace %s with its log database: %s\n", walletFile, e.what());
+                fSuccess = false;
+                // Put the original back, and keep the migrated copy unless
+                // that worked, so that one of them is always left in place.
+                try {
+                    fs::rename(backup_path, db_path);
+                } catch (const fs::filesystem_error& restore_error) {
+                    errorStr = strprintf(_("Error migrating wallet %s to a log database. The original was saved as %s and the"
+                                           " migrated copy as %s; rename one of them to %s."),
+                                         walletFile, out_backup_filename, tmp_path.filename().string(), walletFile);
+                    LogPrintf("Failed to restore %s from %s: %s\n", walletFile, out_backup_filename, restore_error.what());
+                    return false;
+                }
+            }
+        }
+    }
+    if (!fSuccess) {
+        fs::remove(tmp_path);
+        if (errorStr.empty()) {
+            errorStr = strprintf(_("Error migrating wallet %s to a log database"), walletFile);
+        }
+        return false;
+    }
+    LogPrintf("Migrated %u records of wallet %s to a log database in %dms; the original was saved as %s\n",
+              count, walletFile, GetTimeMillis() - nStart, out_backup_filename);
+    return true;
+}
+
 /* End of headers, beginning of key/value data */
 static const char *HEADER_END = "HEADER=END";
 /* End of key/value data */
@@ -443,7 +626,8 @@ void BerkeleyEnvironment::CheckpointLSN(const std::string& strFile)
 }
 
 
-BerkeleyBatch::BerkeleyBatch(BerkeleyDatabase& database, const char* pszMode, bool fFlushOnCloseIn) : pdb(nullptr), activeTxn(nullptr)
+BerkeleyBatch::BerkeleyBatch(BerkeleyDatabase& database, const char* pszMode, bool fFlushOnCloseIn) :
+    pdb(nullptr), activeTxn(nullptr), m_cursor(nullptr), m_log(nullptr), m_log_txn_active(false), m_log_cursor_active(false), m_log_cursor_started(false)
 {
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
     fFlushOnClose = fFlushOnCloseIn;
@@ -454,6 +638,28 @@ BerkeleyBatch::BerkeleyBatch(BerkeleyDatabase& database, const char* pszMode, bo
     const std::string &strFilename = database.strFile;
 
     bool fCreate = strchr(pszMode, 'c') != nullptr;
+
+    if (database.m_log) {
+        {
+            LOCK(cs_db);
+            // The environment is only opened for its lock on the wallet directory.
+            if (!env->Open(false /* retry */))
+                throw std::runtime_error("BerkeleyBatch: Failed to open database environment.");
+        }
+        std::string error;
+        if (!database.m_log->Open(fCreate, error))
+            throw std::runtime_error(strprintf("BerkeleyBatch: %s", error));
+        m_log = database.m_log.get();
+        strFile = strFilename;
+        if (fCreate && !Exists(std::string("version"))) {
+            bool fTmp = fReadOnly;
+            fReadOnly = false;
+            WriteVersion(CLIENT_VERSION);
+            fReadOnly = fTmp;
+        }
+        return;
+    }
+
     unsigned int nFlags = DB_THREAD;
     if (fCreate)
         nFlags |= DB_CREATE;
@@ -522,9 +728,156 @@ BerkeleyBatch::BerkeleyBatch(BerkeleyDatabase& database, const char* pszMode, bo
     }
 }
 
+const LogDatabaseOp* BerkeleyBatch::FindLogTxnOp(const LogDataBytes& key) const
+{
+    auto it = m_log_txn_keys.find(key);
+    if (it == m_log_txn_keys.end())
+        return nullptr;
+    return &m_log_txn[it->second];
+}
+
+bool BerkeleyBatch::AddLogTxnOp(LogDatabaseOp op)
+{
+    if (!m_log_txn_active)
+        return m_log->Apply({op});
+    m_log_txn_keys[op.key] = m_log_txn.size();
+    m_log_txn.push_back(std::move(op));
+    return true;
+}
+
+bool BerkeleyBatch::ReadLog(const CDataStream& ssKey, CDataStream& ssValue)
+{
+    const LogDataBytes key = ToLogData(ssKey);
+    // The active transaction sees its own writes
+    if (const LogDatabaseOp* op = FindLogTxnOp(key)) {
+        if (op->fErase)
+            return false;
+        ssValue.write((const char*)op->value.data(), op->value.size());
+        return true;
+    }
+    LogDataBytes value;
+    if (!m_log->Read(key, value))
+        return false;
+    ssValue.write((const char*)value.data(), value.size());
+    return true;
+}
+
+bool BerkeleyBatch::WriteLog(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+{
+    if (!fOverwrite && ExistsLog(ssKey))
+        return false;
+    return AddLogTxnOp(LogDatabaseOp(false, ToLogData(ssKey), ToLogData(ssValue)));
+}
+
+bool BerkeleyBatch::EraseLog(const CDataStream& ssKey)
+{
+    return AddLogTxnOp(LogDatabaseOp(true, ToLogData(ssKey), LogDataBytes()));
+}
+
+bool BerkeleyBatch::ExistsLog(const CDataStream& ssKey)
+{
+    const LogDataBytes key = ToLogData(ssKey);
+    if (const LogDatabaseOp* op = FindLogTxnOp(key))
+        return !op->fErase;
+    return m_log->Exists(key);
+}
+
+bool BerkeleyBatch::StartCursor()
+{
+    CloseCursor();
+    if (m_log) {
+        m_log_cursor_active = true;
+        m_log_cursor_started = false;
+        return true;
+    }
+    if (!pdb)
+        return false;
+    int ret = pdb->cursor(nullptr, &m_cursor, 0);
+    if (ret != 0) {
+        m_cursor = nullptr;
+        return false;
+    }
+    return true;
+}
+
+int BerkeleyBatch::ReadAtCursor(CDataStream& ssKey, CDataStream& ssValue, bool setRange)
+{
+    if (m_log) {
+        if (!m_log_cursor_active)
+            return 99999;
+        LogDataBytes key, value;
+        bool fFound;
+        if (setRange) {
+            fFound = m_log->Next(ToLogData(ssKey), true /* fInclusive */, key, value);
+        } else if (m_log_cursor_started) {
+            fFound = m_log->Next(m_log_cursor_key, false /* fInclusive */, key, value);
+        } else {
+            fFound = m_log->First(key, value);
+        }
+        if (!fFound)
+            return DB_NOTFOUND;
+        m_log_cursor_started = true;
+        m_log_cursor_key = key;
+
+        ssKey.SetType(SER_DISK);
+        ssKey.clear();
+        ssKey.write((const char*)key.data(), key.size());
+        ssValue.SetType(SER_DISK);
+        ssValue.clear();
+        ssValue.write((const char*)value.data(), value.size());
+        return 0;
+    }
+
+    if (!m_cursor)
+        return 99999;
+
+    // Read at cursor
+    Dbt datKey;
+    unsigned int fFlags = DB_NEXT;
+    if (setRange) {
+        datKey.set_data(ssKey.data());
+        datKey.set_size(ssKey.size());
+        fFlags = DB_SET_RANGE;
+    }
+    Dbt datValue;
+    datKey.set_flags(DB_DBT_MALLOC);
+    datValue.set_flags(DB_DBT_MALLOC);
+    int ret = m_cursor->get(&datKey, &datValue, fFlags);
+    if (ret != 0)
+        return ret;
+    else if (datKey.get_data() == nullptr || datValue.get_data() == nullptr)
+        return 99999;
+
+    // Convert to streams
+    ssKey.SetType(SER_DISK);
+    ssKey.clear();
+    ssKey.write((char*)datKey.get_data(), datKey.get_size());
+    ssValue.SetType(SER_DISK);
+    ssValue.clear();
+    ssValue.write((char*)datValue.get_data(), datValue.get_size());
+
+    // Clear and free memory
+    memory_cleanse(datKey.get_data(), datKey.get_size());
+    memory_cleanse(datValue.get_data(), datValue.get_size());
+    free(datKey.get_data());
+    free(datValue.get_data());
+    return 0;
+}
+
+void BerkeleyBatch::CloseCursor()
+{
+    m_log_cursor_active = false;
+    m_log_cursor_started = false;
+    m_log_cursor_key.clear();
+    if (!m_cursor)
+        return;
+    m_cursor->close();
+    m_cursor = nullptr;
+}
+
 void BerkeleyBatch::Flush()
 {
-    if (activeTxn)
+    if (activeTxn || m_log)
         return;
 
     // Flush database activity from memory pool to disk log
@@ -542,6 +895,14 @@ void BerkeleyDatabase::IncrementUpdateCounter()
 
 void BerkeleyBatch::Close()
 {
+    CloseCursor();
+    if (m_log) {
+        m_log_txn.clear();
+        m_log_txn_keys.clear();
+        m_log_txn_active = false;
+        m_log = nullptr;
+        return;
+    }
     if (!pdb)
         return;
     if (activeTxn)
@@ -579,6 +940,18 @@ bool BerkeleyBatch::Rewrite(BerkeleyDatabase& database, const char* pszSkip)
     }
     BerkeleyEnvironment *env = database.env;
     const std::string& strFile = database.strFile;
+    if (database.m_log) {
+        LogPrintf("BerkeleyBatch::Rewrite: Rewriting %s...\n", strFile);
+        {
+            BerkeleyBatch db(database, "r+", false /* fFlushOnClose */);
+            if (!db.WriteVersion(CLIENT_VERSION))
+                return false;
+        }
+        bool fSuccess = database.m_log->Compact(pszSkip ? pszSkip : "");
+        if (!fSuccess)
+            LogPrintf("BerkeleyBatch::Rewrite: Failed to rewrite database file %s\n", strFile);
+        return fSuccess;
+    }
     while (true) {
         {
             LOCK(cs_db);
@@ -606,17 +979,16 @@ bool BerkeleyBatch::Rewrite(BerkeleyDatabase& database, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
-                    if (pcursor)
+                    if (db.StartCursor())
                         while (fSuccess) {
                             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
                             CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-                            int ret1 = db.ReadAtCursor(pcursor, ssKey, ssValue);
+                            int ret1 = db.ReadAtCursor(ssKey, ssValue);
                             if (ret1 == DB_NOTFOUND) {
-                                pcursor->close();
+                                db.CloseCursor();
                                 break;
                             } else if (ret1 != 0) {
-                                pcursor->close();
+                                db.CloseCursor();
                                 fSuccess = false;
                                 break;
                             }
@@ -711,6 +1083,17 @@ bool BerkeleyBatch::PeriodicFlush(BerkeleyDatabase& database)
     bool ret = false;
     BerkeleyEnvironment *env = database.env;
     const std::string& strFile = database.strFile;
+    if (database.m_log) {
+        // Appends are already in the file; sync them, and compact the log
+        // here rather than on the write path once it is mostly dead entries.
+        if (!database.m_log->IsOpen())
+            return false;
+        LogPrint(BCLog::DB, "Flushing %s\n", strFile);
+        ret = database.m_log->Sync();
+        if (ret && database.m_log->NeedsCompaction())
+            ret = database.m_log->Compact();
+        return ret;
+    }
     TRY_LOCK(cs_db, lockDb);
     if (lockDb)
     {
@@ -756,6 +1139,25 @@ bool BerkeleyDatabase::Backup(const std::string& strDest)
     if (IsDummy()) {
         return false;
     }
+    if (m_log) {
+        fs::path pathSrc = env->Directory() / strFile;
+        fs::path pathDest(strDest);
+        if (fs::is_directory(pathDest))
+            pathDest /= strFile;
+        try {
+            if (fs::equivalent(pathSrc, pathDest)) {
+                LogPrintf("cannot backup to wallet source file %s\n", pathDest.string());
+                return false;
+            }
+        } catch (const fs::filesystem_error& e) {
+            LogPrintf("error copying %s to %s - %s\n", strFile, pathDest.string(), e.what());
+            return false;
+        }
+        if (!m_log->IsOpen() || !m_log->Backup(pathDest))
+            return false;
+        LogPrintf("copied %s to %s\n", strFile, pathDest.string());
+        return true;
+    }
     while (true)
     {
         {
@@ -795,6 +1197,13 @@ bool BerkeleyDatabase::Backup(const std::string& strDest)
 void BerkeleyDatabase::Flush(bool shutdown)
 {
     if (!IsDummy()) {
+        if (m_log) {
+            if (shutdown) {
+                m_log->Close();
+            } else if (m_log->IsOpen()) {
+                m_log->Sync();
+            }
+        }
         env->Flush(shutdown);
         if (shutdown) env = nullptr;
     }
@@ -13,6 +13,7 @@
 #include <sync.h>
 #include <util.h>
 #include <version.h>
+#include <wallet/logdb.h>
 
 #include <atomic>
 #include <map>
@@ -90,7 +91,10 @@ public:
 BerkeleyEnvironment* GetWalletEnv(const fs::path& wallet_path, std::string& database_filename);
 
 /** An instance of this class represents one database.
- * For BerkeleyDB this is just a (env, strFile) tuple.
+ * For BerkeleyDB this is just a (env, strFile) tuple. A wallet file in the
+ * log-structured format (see LogDatabase), or a new one with -walletlogdb,
+ * is kept in a LogDatabase instead; the environment then only provides the
+ * directory lock.
  **/
 class BerkeleyDatabase
 {
@@ -110,6 +114,12 @@ public:
             env->Close();
             env->Reset();
             env->MakeMock();
+        } else {
+            const fs::path file_path = env->Directory() / strFile;
+            if (LogDatabase::IsLogFile(file_path) ||
+                (!fs::exists(file_path) && gArgs.GetBoolArg("-walletlogdb", DEFAULT_WALLET_LOGDB))) {
+                m_log = MakeUnique<LogDatabase>(file_path);
+            }
         }
     }
 
@@ -155,6 +165,9 @@ private:
     BerkeleyEnvironment *env;
     std::string strFile;
 
+    /** Set if the wallet file is a log database */
+    std::unique_ptr<LogDatabase> m_log;
+
     /** Return whether this database handle is a dummy for testing.
      * Only to be used at a low level, application should ideally not care
      * about this.
@@ -170,10 +183,28 @@ protected:
     Db* pdb;
     std::string strFile;
     DbTxn* activeTxn;
+    Dbc* m_cursor;
     bool fReadOnly;
     bool fFlushOnClose;
     BerkeleyEnvironment *env;
 
+    /** Log database state, used instead of the above if the wallet file is a log database */
+    LogDatabase* m_log;
+    //! Writes and erases of the active transaction, appended to the log as one record on commit
+    std::vector<LogDatabaseOp> m_log_txn;
+    //! Index in m_log_txn of the latest write or erase of each key
+    std::map<LogDataBytes, size_t> m_log_txn_keys;
+    bool m_log_txn_active;
+    //! Key of the last entry read at the cursor
+    LogDataBytes m_log_cursor_key;
+    bool m_log_cursor_active;
+    bool m_log_cursor_started;
+
+    bool ReadLog(const CDataStream& ssKey, CDataStream& ssValue);
+    bool WriteLog(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite);
+    bool EraseLog(const CDataStream& ssKey);
+    bool ExistsLog(const CDataStream& ssKey);
+
 public:
     explicit BerkeleyBatch(BerkeleyDatabase& database, const char* pszMode = "r+", bool fFlushOnCloseIn=true);
     ~BerkeleyBatch() { Close(); }
@@ -192,18 +223,32 @@ public:
     static bool VerifyEnvironment(const fs::path& file_path, std::string& errorStr);
     /* verifies the database file */
     static bool VerifyDatabaseFile(const fs::path& file_path, std::string& warningStr, std::string& errorStr, BerkeleyEnvironment::recoverFunc_type recoverFunc);
+    /* copies a BerkeleyDB wallet file into a log database that replaces it; the original is kept as out_backup_filename */
+    static bool MigrateToLog(const fs::path& file_path, std::string& out_backup_filename, std::string& errorStr);
 
 public:
     template <typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pdb && !m_log)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+
+        if (m_log) {
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            if (!ReadLog(ssKey, ssValue))
+                return false;
+            try {
+                ssValue >> value;
+            } catch (const std::exception&) {
+                return false;
+            }
+            return true;
+        }
         Dbt datKey(ssKey.data(), ssKey.size());
 
         // Read
@@ -232,7 +277,7 @@ public:
     template <typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite = true)
     {
-        if (!pdb)
+        if (!pdb && !m_log)
             return true;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
@@ -247,6 +292,8 @@ public:
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
+        if (m_log)
+            return WriteLog(ssKey, ssValue, fOverwrite);
         Dbt datValue(ssValue.data(), ssValue.size());
 
         // Write
@@ -261,7 +308,7 @@ public:
     template <typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !m_log)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
@@ -270,6 +317,8 @@ public:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (m_log)
+            return EraseLog(ssKey);
         Dbt datKey(ssKey.data(), ssKey.size());
 
         // Erase
@@ -283,13 +332,15 @@ public:
     template <typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pdb && !m_log)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
+        if (m_log)
+            return ExistsLog(ssKey);
         Dbt datKey(ssKey.data(), ssKey.size());
 
         // Exists
@@ -300,55 +351,24 @@ public:
         return (ret == 0);
     }
 
-    Dbc* GetCursor()
-    {
-        if (!pdb)
-            return nullptr;
-        Dbc* pcursor = nullptr;
-        int ret = pdb->cursor(nullptr, &pcursor, 0);
-        if (ret != 0)
-            return nullptr;
-        return pcursor;
-    }
-
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, bool setRange = false)
-    {
-        // Read at cursor
-        Dbt datKey;
-        unsigned int fFlags = DB_NEXT;
-        if (setRange) {
-            datKey.set_data(ssKey.data());
-            datKey.set_size(ssKey.size());
-            fFlags = DB_SET_RANGE;
-        }
-        Dbt datValue;
-        datKey.set_flags(DB_DBT_MALLOC);
-        datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
-        if (ret != 0)
-            return ret;
-        else if (datKey.get_data() == nullptr || datValue.get_data() == nullptr)
-            return 99999;
-
-        // Convert to streams
-        ssKey.SetType(SER_DISK);
-        ssKey.clear();
-        ssKey.write((char*)datKey.get_data(), datKey.get_size());
-        ssValue.SetType(SER_DISK);
-        ssValue.clear();
-        ssValue.write((char*)datValue.get_data(), datValue.get_size());
-
-        // Clear and free memory
-        memory_cleanse(datKey.get_data(), datKey.get_size());
-        memory_cleanse(datValue.get_data(), datValue.get_size());
-        free(datKey.get_data());
-        free(datValue.get_data());
-        return 0;
-    }
+    /** Start iterating over the database; the cursor is closed by CloseCursor() or Close(). */
+    bool StartCursor();
+    /** Read the next record, or with setRange the first record at or after ssKey. Returns DB_NOTFOUND at the end. */
+    int ReadAtCursor(CDataStream& ssKey, CDataStream& ssValue, bool setRange = false);
+    void CloseCursor();
+    //! Return the latest op on key in the active transaction, if any.
+    const LogDatabaseOp* FindLogTxnOp(const LogDataBytes& key) const;
+    bool AddLogTxnOp(LogDatabaseOp op);
 
 public:
     bool TxnBegin()
     {
+        if (m_log) {
+            if (m_log_txn_active)
+                return false;
+            m_log_txn_active = true;
+            return true;
+        }
         if (!pdb || activeTxn)
             return false;
         DbTxn* ptxn = env->TxnBegin();
@@ -360,6 +380,15 @@ public:
 
     bool TxnCommit()
     {
+        if (m_log) {
+            if (!m_log_txn_active)
+                return false;
+            m_log_txn_active = false;
+            bool ret = m_log->Apply(m_log_txn) && m_log->Sync();
+            m_log_txn.clear();
+            m_log_txn_keys.clear();
+            return ret;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->commit(0);
@@ -369,6 +398,14 @@ public:
 
     bool TxnAbort()
     {
+        if (m_log) {
+            if (!m_log_txn_active)
+                return false;
+            m_log_txn_active = false;
+            m_log_txn.clear();
+            m_log_txn_keys.clear();
+            return true;
+        }
         if (!pdb || !activeTxn)
             return false;
         int ret = activeTxn->abort();
@@ -0,0 +1,471 @@
+// Copyright (c) 2018 The XPChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <wallet/logdb.h>
+
+#include <clientversion.h>
+#include <crypto/common.h>
+#include <hash.h>
+#include <streams.h>
+#include <support/cleanse.h>
+#include <util.h>
+#include <version.h>
+
+#include <string.h>
+
+namespace {
+
+const unsigned char LOG_MAGIC[8] = {'x', 'p', 'c', 'w', 'l', 'o', 'g', 0};
+const uint32_t LOG_VERSION = 1;
+const size_t LOG_HEADER_SIZE = sizeof(LOG_MAGIC) + 4;
+const size_t RECORD_HEADER_SIZE = 8;
+
+//! Don't compact until at least this many bytes of the file are dead entries
+const uint64_t COMPACT_MIN_DEAD_SIZE = 1 << 20;
+//! Compaction writes the live entries in records of about this size
+const size_t COMPACT_RECORD_SIZE = 1 << 20;
+
+uint32_t Checksum(const unsigned char* data, size_t size)
+{
+    uint256 hash = Hash(data, data + size);
+    return ReadLE32(hash.begin());
+}
+
+//! The size an entry adds to the file when written on its own.
+uint64_t EntrySize(const LogDataBytes& key, const LogDataBytes& value)
+{
+    return GetSizeOfCompactSize(key.size()) + key.size() + GetSizeOfCompactSize(value.size()) + value.size() + 1;
+}
+
+bool ReadHeader(FILE* file)
+{
+    unsigned char header[LOG_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), file) != sizeof(header)) return false;
+    return memcmp(header, LOG_MAGIC, sizeof(LOG_MAGIC)) == 0 && ReadLE32(header + sizeof(LOG_MAGIC)) == LOG_VERSION;
+}
+
+bool WriteHeader(FILE* file)
+{
+    unsigned char header[LOG_HEADER_SIZE];
+    memcpy(header, LOG_MAGIC, sizeof(LOG_MAGIC));
+    WriteLE32(header + sizeof(LOG_MAGIC), LOG_VERSION);
+    return fwrite(header, 1, sizeof(header), file) == sizeof(header);
+}
+
+/**
+ * Read the records following the header, passing the ops of each to fn.
+ * Stops at the end of the file or at the first record that is truncated or
+ * fails its checksum. Returns the offset just past the last good record.
+ *
+ * fCorrupt is set if reading stopped at a record that lies within the file
+ * but can't be read. Only a record running past the end of the file is what
+ * a crash while appending leaves behind; anything else is damage to data
+ * that was already committed.
+ */
+template <typename Fn>
+uint64_t ReadRecords(FILE* file, uint64_t file_size, Fn fn, bool& fCorrupt)
+{
+    uint64_t pos = LOG_HEADER_SIZE;
+    std::vector<unsigned char> body;
+    std::vector<LogDatabaseOp> ops;
+    fCorrupt = false;
+    while (file_size - pos >= RECORD_HEADER_SIZE) {
+        unsigned char header[RECORD_HEADER_SIZE];
+        if (fread(header, 1, sizeof(header), file) != sizeof(header)) {
+            fCorrupt = true;
+            break;
+        }
+        const uint32_t body_size = ReadLE32(header);
+        if (body_size > file_size - pos - RECORD_HEADER_SIZE) break;
+        body.resize(body_size);
+        if (fread(body.data(), 1, body_size, file) != body_size ||
+            Checksum(body.data(), body.size()) != ReadLE32(header + 4)) {
+            fCorrupt = true;
+            break;
+        }
+        try {
+            CDataStream ss((const char*)body.data(), (const char*)body.data() + body.size(), SER_DISK, CLIENT_VERSION);
+            ss >> ops;
+        } catch (const std::exception&) {
+            fCorrupt = true;
+            break;
+        }
+        memory_cleanse(body.data(), body.size());
+        for (const LogDatabaseOp& op : ops) {
+            fn(op);
+        }
+        pos += RECORD_HEADER_SIZE + body_size;
+    }
+    memory_cleanse(body.data(), body.size());
+    return pos;
+}
+
+} // namespace
+
+LogDatabase::LogDatabase(const fs::path& path) : m_path(path), m_file(nullptr), m_file_size(0), m_live_size(0), m_failed(false)
+{
+}
+
+LogDatabase::~LogDatabase()
+{
+    Close();
+}
+
+bool LogDatabase::IsLogFile(const fs::path& path)
+{
+    if (!fs::is_regular_file(path)) return false;
+    FILE* file = fsbridge::fopen(path, "rb");
+    if (!file) return false;
+    bool ret = ReadHeader(file);
+    fclose(file);
+    return ret;
+}
+
+bool LogDatabase::ReadFile(const fs::path& path, std::vector<LogDatabaseOp>& ops_out, uint64_t& out_discarded, bool& out_corrupt, std::string& error)
+{
+    FILE* file = fsbridge::fopen(path, "rb");
+    if (!file) {
+        error = strprintf("Can't open %s", path.string());
+        return false;
+    }
+    if (!ReadHeader(file)) {
+        fclose(file);
+        error = strprintf("%s is not a log database", path.string());
+        return false;
+    }
+    const uint64_t file_size = fs::file_size(path);
+    const uint64_t end = ReadRecords(file, file_size, [&ops_out](const LogDatabaseOp& op) { ops_out.push_back(op); }, out_corrupt);
+    fclose(file);
+    out_discarded = file_size - end;
+    return true;
+}
+
+bool LogDatabase::Open(bool fCreate, std::string& error)
+{
+    LOCK(cs_log);
+    if (m_file) return true;
+
+    if (!fs::exists(m_path)) {
+        if (!fCreate) {
+            error = strprintf("Log database %s does not exist", m_path.string());
+            return false;
+        }
+        FILE* file = fsbridge::fopen(m_path, "wb");
+        if (!file || !WriteHeader(file) || !FileCommit(file)) {
+            if (file) fclose(file);
+            error = strprintf("Can't create log database %s", m_path.string());
+            return false;
+        }
+        fclose(file);
+    }
+
+    FILE* file = fsbridge::fopen(m_path, "rb+");
+    if (!file) {
+        error = strprintf("Can't open log database %s", m_path.string());
+        return false;
+    }
+    if (!ReadHeader(file)) {
+        fclose(file);
+        error = strprintf("%s is not a log database", m_path.string());
+        return false;
+    }
+
+    const int64_t nStart = GetTimeMillis();
+    m_index.clear();
+    m_live_size = 0;
+    const uint64_t file_size = fs::file_size(m_path);
+    bool fCorrupt;
+    const uint64_t end = ReadRecords(file, file_size, [this](const LogDatabaseOp& op) { ApplyToIndex(op); }, fCorrupt);
+    if (fCorrupt) {
+        // Cutting the file here would throw away every record after the bad
+        // one, so leave it for -salvagewallet to recover what it can.
+        fclose(file);
+        m_index.clear();
+        m_live_size = 0;
+        error = strprintf("Log database %s is corrupt at byte %u", m_path.string(), end);
+        return false;
+    }
+    if (end < file_size) {
+        // A crash while appending leaves a partial record at the end. Cut it
+        // off so that new records are not appended after garbage.
+        LogPrintf("LogDatabase: Discarding %u bytes after the last complete record of %s\n", file_size - end, m_path.string());
+        if (!TruncateFile(file, end)) {
+            fclose(file);
+            error = strprintf("Can't truncate log database %s", m_path.string());
+            return false;
+        }
+    }
+    if (fseek(file, end, SEEK_SET) != 0) {
+        fclose(file);
+        error = strprintf("Can't seek in log database %s", m_path.string());
+        return false;
+    }
+    m_file = file;
+    m_file_size = end;
+    m_failed = false;
+    LogPrint(BCLog::DB, "LogDatabase: Opened %s with %u entries (%u of %u bytes live) in %dms\n",
+             m_path.string(), m_index.size(), m_live_size, m_file_size, GetTimeMillis() - nStart);
+    return true;
+}
+
+void LogDatabase::Close()
+{
+    LOCK(cs_log);
+    if (!m_file) return;
+    FileCommit(m_file);
+    fclose(m_file);
+    m_file = nullptr;
+    m_index.clear();
+    m_file_size = 0;
+    m_live_size = 0;
+}
+
+bool LogDatabase::IsOpen() const
+{
+    LOCK(cs_log);
+    return m_file != nullptr;
+}
+
+bool LogDatabase::Read(const LogDataBytes& key, LogDataBytes& value) const
+{
+    LOCK(cs_log);
+    auto it = m_index.find(key);
+    if (it == m_index.end()) return false;
+    value = it->second;
+    return true;
+}
+
+bool LogDatabase::Exists(const LogDataBytes& key) const
+{
+    LOCK(cs_log);
+    return m_index.count(key) != 0;
+}
+
+bool LogDatabase::Next(const LogDataBytes& key, bool fInclusive, LogDataBytes& key_out, LogDataBytes& value_out) const
+{
+    LOCK(cs_log);
+    auto it = fInclusive ? m_index.lower_bound(key) : m_index.upper_bound(key);
+    if (it == m_index.end()) return false;
+    key_out = it->first;
+    value_out = it->second;
+    return true;
+}
+
+bool LogDatabase::First(LogDataBytes& key_out, LogDataBytes& value_out) const
+{
+    return Next(LogDataBytes(), true, key_out, value_out);
+}
+
+void LogDatabase::ApplyToIndex(const LogDatabaseOp& op)
+{
+    AssertLockHeld(cs_log);
+    auto it = m_index.find(op.key);
+    if (it != m_index.end()) {
+        m_live_size -= EntrySize(it->first, it->second);
+        if (op.fErase) {
+            m_index.erase(it);
+            return;
+        }
+        it->second = op.value;
+    } else {
+        if (op.fErase) return;
+        it = m_index.emplace(op.key, op.value).first;
+    }
+    m_live_size += EntrySize(it->first, it->second);
+}
+
+bool LogDatabase::Append(FILE* file, const std::vector<LogDatabaseOp>& ops, uint64_t& size)
+{
+    AssertLockHeld(cs_log);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss.reserve(RECORD_HEADER_SIZE + 1000);
+    ss << uint64_t(0); // placeholder for the record header
+    ss << ops;
+    const unsigned char* body = (const unsigned char*)ss.data() + RECORD_HEADER_SIZE;
+    const size_t body_size = ss.size() - RECORD_HEADER_SIZE;
+    WriteLE32((unsigned char*)ss.data(), body_size);
+    WriteLE32((unsigned char*)ss.data() + 4, Checksum(body, body_size));
+    if (fwrite(ss.data(), 1, ss.size(), file) != ss.size()) return false;
+    size += ss.size();
+    return true;
+}
+
+void LogDatabase::SetFailed()
+{
+    AssertLockHeld(cs_log);
+    LogPrintf("LogDatabase: Error appending to %s, refusing further writes\n", m_path.string());
+    m_failed = true;
+    // stdio may still buffer part of the record, so close the stream before
+    // cutting the file back to the last complete record.
+    fclose(m_file);
+    m_file = fsbridge::fopen(m_path, "rb+");
+    if (!m_file || !TruncateFile(m_file, m_file_size) || !FileCommit(m_file)) {
+        LogPrintf("LogDatabase: Can't truncate %s back to %u bytes\n", m_path.string(), m_file_size);
+    }
+}
+
+bool LogDatabase::Apply(const std::vector<LogDatabaseOp>& ops)
+{
+    if (ops.empty()) return true;
+    LOCK(cs_log);
+    if (!m_file || m_failed) return false;
+    uint64_t new_size = m_file_size;
+    if (!Append(m_file, ops, new_size) || fflush(m_file) != 0) {
+        SetFailed();
+        return false;
+    }
+    m_file_size = new_size;
+    for (const LogDatabaseOp& op : ops) {
+        ApplyToIndex(op);
+    }
+    return true;
+}
+
+bool LogDatabase::Sync()
+{
+    LOCK(cs_log);
+    if (!m_file || m_failed) return false;
+    return FileCommit(m_file);
+}
+
+bool LogDatabase::NeedsCompaction() const
+{
+    LOCK(cs_log);
+    if (!m_file) return false;
+    const uint64_t dead_size = m_file_size - LOG_HEADER_SIZE - std::min(m_live_size, m_file_size - LOG_HEADER_SIZE);
+    return dead_size >= COMPACT_MIN_DEAD_SIZE && dead_size >= m_live_size;
+}
+
+bool LogDatabase::Compact(const std::string& skip_prefix)
+{
+    LOCK(cs_compact);
+
+    const int64_t nStart = GetTimeMillis();
+    uint64_t old_size;
+    Index snapshot;
+    {
+        LOCK(cs_log);
+        if (!m_file || m_failed) return false;
+
+        if (!skip_prefix.empty()) {
+            // Log the erases first, so the skipped entries stay gone even if the
+            // compacted file can't be put in place.
+            std::vector<LogDatabaseOp> erases;
+            for (const auto& entry : m_index) {
+                if (entry.first.size() >= skip_prefix.size() &&
+                    memcmp(entry.first.data(), skip_prefix.data(), skip_prefix.size()) == 0) {
+                    erases.emplace_back(true, entry.first, LogDataBytes());
+                }
+            }
+            if (!erases.empty()) {
+                uint64_t new_size = m_file_size;
+                if (!Append(m_file, erases, new_size) || fflush(m_file) != 0) {
+                    SetFailed();
+                    return false;
+                }
+                m_file_size = new_size;
+                for (const LogDatabaseOp& op : erases) {
+                    ApplyToIndex(op);
+                }
+            }
+        }
+        old_size = m_file_size;
+        snapshot = m_index;
+    }
+
+    // Write the snapshot without holding cs_log, so that the wallet can keep
+    // reading and appending while the bulk of the file is rewritten.
+    fs::path tmp_path = m_path;
+    tmp_path += ".compact";
+    FILE* file = fsbridge::fopen(tmp_path, "wb");
+    bool fSuccess = file && WriteHeader(file);
+    uint64_t new_size = LOG_HEADER_SIZE;
+    std::vector<LogDatabaseOp> ops;
+    size_t ops_size = 0;
+    for (auto it = snapshot.begin(); fSuccess && it != snapshot.end(); ++it) {
+        ops.emplace_back(false, it->first, it->second);
+        ops_size += EntrySize(it->first, it->second);
+        if (ops_size >= COMPACT_RECORD_SIZE || std::next(it) == snapshot.end()) {
+            fSuccess = Append(file, ops, new_size);
+            ops.clear();
+            ops_size = 0;
+        }
+    }
+    snapshot.clear();
+
+    LOCK(cs_log);
+    if (!m_file || m_failed || m_file_size < old_size) {
+        // Closed or failed in the meantime
+        fSuccess = false;
+    }
+    if (fSuccess && m_file_size > old_size) {
+        // Records appended since the snapshot are complete and checksummed,
+        // so they are copied over as they are.
+        FILE* old_file = fsbridge::fopen(m_path, "rb");
+        fSuccess = old_file && fseek(old_file, old_size, SEEK_SET) == 0;
+        std::vector<unsigned char> buf(std::min<uint64_t>(m_file_size - old_size, COMPACT_RECORD_SIZE));
+        for (uint64_t remaining = m_file_size - old_size; fSuccess && remaining > 0;) {
+            const size_t n = std::min<uint64_t>(remaining, buf.size());
+            fSuccess = fread(buf.data(), 1, n, old_file) == n && fwrite(buf.data(), 1, n, file) == n;
+            remaining -= n;
+            new_size += n;
+        }
+        memory_cleanse(buf.data(), buf.size());
+        if (old_file) fclose(old_file);
+    }
+    if (file) {
+        fSuccess = FileCommit(file) && fSuccess;
+        fclose(file);
+    }
+    if (!fSuccess) {
+        LogPrintf("LogDatabase: Failed to write compacted %s\n", tmp_path.string());
+        fs::remove(tmp_path);
+        return false;
+    }
+
+    // The old file has to be closed before it can be renamed over on Windows.
+    FileCommit(m_file);
+    fclose(m_file);
+    m_file = nullptr;
+    if (!RenameOver(tmp_path, m_path)) {
+        LogPrintf("LogDatabase: Failed to rename %s to %s\n", tmp_path.string(), m_path.string());
+    }
+    m_file = fsbridge::fopen(m_path, "rb+");
+    if (!m_file || fseek(m_file, 0, SEEK_END) != 0) {
+        LogPrintf("LogDatabase: Failed to reopen %s\n", m_path.string());
+        if (m_file) fclose(m_file);
+        m_file = nullptr;
+        return false;
+    }
+    m_file_size = ftell(m_file);
+
+    LogPrint(BCLog::DB, "LogDatabase: Compacted %s from %u to %u bytes in %dms\n",
+             m_path.string(), old_size, m_file_size, GetTimeMillis() - nStart);
+    return m_file_size == new_size;
+}
+
+bool LogDatabase::Backup(const fs::path& dest)
+{
+    LOCK(cs_log);
+    if (!m_file || !FileCommit(m_file)) return false;
+    try {
+        fs::copy_file(m_path, dest, fs::copy_option::overwrite_if_exists);
+    } catch (const fs::filesystem_error& e) {
+        LogPrintf("LogDatabase: Error copying %s to %s - %s\n", m_path.string(), dest.string(), e.what());
+        return false;
+    }
+    return true;
+}
+
+uint64_t LogDatabase::GetFileSize() const
+{
+    LOCK(cs_log);
+    return m_file_size;
+}
+
+uint64_t LogDatabase::GetLiveSize() const
+{
+    LOCK(cs_log);
+    return m_live_size;
+}
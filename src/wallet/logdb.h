@@ -0,0 +1,144 @@
+// Copyright (c) 2018 The XPChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLET_LOGDB_H
+#define BITCOIN_WALLET_LOGDB_H
+
+#include <fs.h>
+#include <support/allocators/zeroafterfree.h>
+#include <serialize.h>
+#include <sync.h>
+
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+static const bool DEFAULT_WALLET_LOGDB = false;
+
+/** Key or value bytes of a log database record. Wiped when freed, as values may hold private keys. */
+typedef std::vector<unsigned char, zero_after_free_allocator<unsigned char> > LogDataBytes;
+
+/** One write or erase in a log database batch */
+struct LogDatabaseOp
+{
+    bool fErase;
+    LogDataBytes key;
+    LogDataBytes value;
+
+    LogDatabaseOp() : fErase(false) {}
+    LogDatabaseOp(bool fEraseIn, LogDataBytes keyIn, LogDataBytes valueIn) :
+        fErase(fEraseIn), key(std::move(keyIn)), value(std::move(valueIn)) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(fErase);
+        READWRITE(key);
+        if (!fErase) {
+            READWRITE(value);
+        }
+    }
+};
+
+/**
+ * Append-only, checksummed key/value store for wallet data.
+ *
+ * The file starts with a magic and version, followed by records of
+ *
+ *   uint32 body size, uint32 checksum (first 4 bytes of SHA256d(body)), body
+ *
+ * where the body is a vector of LogDatabaseOp that is applied atomically. All
+ * records are replayed into an ordered in-memory index on open; a torn record
+ * at the end of the file (from a crash mid-append) is discarded, while a bad
+ * record before the end makes Open fail so the file can be salvaged. A failed
+ * append is cut off again and makes the database refuse later writes. Overwritten
+ * and erased entries stay in the file until Compact() writes the live entries
+ * to a fresh file and renames it over the old one. Compaction writes a
+ * snapshot of the index without holding the lock, and only takes it again to
+ * copy the records appended meanwhile and swap the files.
+ *
+ * Keys are ordered by memcmp like BerkeleyDB's default btree comparison, so
+ * cursors see the same order as with a BerkeleyDB wallet.
+ */
+class LogDatabase
+{
+public:
+    explicit LogDatabase(const fs::path& path);
+    ~LogDatabase();
+
+    LogDatabase(const LogDatabase&) = delete;
+    LogDatabase& operator=(const LogDatabase&) = delete;
+
+    /** Return whether the file at path starts with the log database magic. */
+    static bool IsLogFile(const fs::path& path);
+
+    /**
+     * Read every record of the file at path that passes its checksum, without
+     * opening it for writing. out_discarded is set to the number of bytes
+     * after the last good record, and out_corrupt to whether they start with
+     * a damaged record rather than a torn one at the end. Returns false if
+     * the file can't be read.
+     */
+    static bool ReadFile(const fs::path& path, std::vector<LogDatabaseOp>& ops_out, uint64_t& out_discarded, bool& out_corrupt, std::string& error);
+
+    /**
+     * Open the file, creating it if fCreate, and replay it into the index.
+     * A torn record at the end is cut off; a damaged one elsewhere makes this
+     * fail. No-op if already open.
+     */
+    bool Open(bool fCreate, std::string& error);
+    /** Sync and close the file. */
+    void Close();
+    bool IsOpen() const;
+    const fs::path& GetPath() const { return m_path; }
+
+    bool Read(const LogDataBytes& key, LogDataBytes& value) const;
+    bool Exists(const LogDataBytes& key) const;
+    /** Return the first entry with a key after (or at, if fInclusive) the given key. */
+    bool Next(const LogDataBytes& key, bool fInclusive, LogDataBytes& key_out, LogDataBytes& value_out) const;
+    /** Return the first entry in key order. */
+    bool First(LogDataBytes& key_out, LogDataBytes& value_out) const;
+
+    /** Append ops as one record and apply them to the index. */
+    bool Apply(const std::vector<LogDatabaseOp>& ops);
+    /** Flush appended records to disk. */
+    bool Sync();
+
+    /** Whether enough of the file is dead entries for compaction to be worthwhile. */
+    bool NeedsCompaction() const;
+    /** Rewrite the file with only the live entries, dropping keys starting with skip_prefix if non-empty. */
+    bool Compact(const std::string& skip_prefix = std::string());
+    /** Copy a consistent, synced snapshot of the file to dest. */
+    bool Backup(const fs::path& dest);
+
+    uint64_t GetFileSize() const;
+    uint64_t GetLiveSize() const;
+
+private:
+    typedef std::map<LogDataBytes, LogDataBytes> Index;
+
+    const fs::path m_path;
+    //! Held for a whole Compact(), so that only one runs at a time. Taken before cs_log.
+    CCriticalSection cs_compact;
+    mutable CCriticalSection cs_log;
+    FILE* m_file GUARDED_BY(cs_log);
+    Index m_index GUARDED_BY(cs_log);
+    //! Bytes in the file, including the header
+    uint64_t m_file_size GUARDED_BY(cs_log);
+    //! Bytes the live entries would take if written out again
+    uint64_t m_live_size GUARDED_BY(cs_log);
+    //! Set when an append failed; no more records are written after that
+    bool m_failed GUARDED_BY(cs_log);
+
+    void ApplyToIndex(const LogDatabaseOp& op) EXCLUSIVE_LOCKS_REQUIRED(cs_log);
+    //! Cut a failed append off the file and refuse further writes.
+    void SetFailed() EXCLUSIVE_LOCKS_REQUIRED(cs_log);
+    bool Append(FILE* file, const std::vector<LogDatabaseOp>& ops, uint64_t& size) EXCLUSIVE_LOCKS_REQUIRED(cs_log);
+};
+
+#endif // BITCOIN_WALLET_LOGDB_H
@@ -10,6 +10,7 @@
 #include <httpserver.h>
 #include <validation.h>
 #include <key_io.h>
+#include <miner.h>
 #include <net.h>
 #include <outputtype.h>
 #include <policy/feerate.h>
@@ -29,6 +30,7 @@
 #include <wallet/coincontrol.h>
 #include <wallet/feebumper.h>
 #include <wallet/rpcwallet.h>
+#include <wallet/stakeplan.h>
 #include <wallet/wallet.h>
 #include <wallet/walletdb.h>
 #include <wallet/walletutil.h>
@@ -1312,6 +1314,181 @@ static UniValue sendmany(const JSONRPCRequest& request)
     return tx->GetHash().GetHex();
 }
 
+static UniValue sendpayouts(const JSONRPCRequest& request)
+{
+    std::shared_ptr<CWallet> const wallet = GetWalletForJSONRPCRequest(request);
+    CWallet* const pwallet = wallet.get();
+
+    if (!EnsureWalletIsAvailable(pwallet, request.fHelp)) {
+        return NullUniValue;
+    }
+
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw std::runtime_error(
+            "sendpayouts [{\"address\":\"address\",\"amount\":amount},...] ( options )\n"
+            "\nSend a batch of payouts in as few transactions as possible. Unlike sendmany, an address may be paid more than once,\n"
+            "each transaction is funded and sized in one pass instead of a fee loop, and its inputs are signed in parallel.\n"
+            "The fee is paid by the wallet on top of the payouts.\n"
+            + HelpRequiringPassphrase(pwallet) + "\n"
+            "\nArguments:\n"
+            "1. \"payouts\"             (array, required) A json array of payouts\n"
+            "    [\n"
+            "      {\n"
+            "        \"address\":\"address\", (string, required) The xpchain address to pay\n"
+            "        \"amount\":amount      (numeric or string, required) The amount in " + CURRENCY_UNIT + "\n"
+            "      }\n"
+            "      ,...\n"
+            "    ]\n"
+            "2. options                 (json, optional)\n"
+            "    {\n"
+            "      \"comment\"            (string, optional) A comment stored with each transaction\n"
+            "      \"replaceable\"        (boolean, optional) Allow the transactions to be replaced by transactions with higher fees via BIP 125\n"
+            "      \"conf_target\"        (numeric, optional) Confirmation target (in blocks)\n"
+            "      \"estimate_mode\"      (string, optional, default=UNSET) The fee estimate mode, must be one of:\n"
+            "         \"UNSET\"\n"
+            "         \"ECONOMICAL\"\n"
+            "         \"CONSERVATIVE\"\n"
+            "      \"maximumOutputs\"     (numeric, optional, default=" + std::to_string(DEFAULT_PAYOUT_BATCH_MAX_OUTPUTS) + ") Maximum number of payouts in one transaction\n"
+            "    }\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"txids\" : [ \"txid\",... ],  (array of string) The ids of the transactions sent, in the order of the payouts they pay\n"
+            "  \"fee\" : x.xxx,             (numeric) The total fee paid in " + CURRENCY_UNIT + "\n"
+            "  \"paid\" : n,                (numeric) The number of payouts sent\n"
+            "  \"error\" : \"text\"           (string) Why the remaining payouts were not sent, if some were\n"
+            "  \"unpaid\" : [ {...},... ]     (array of json objects) The payouts not sent, as given, if some were\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("sendpayouts", "\"[{\\\"address\\\":\\\"1D1ZrZNe3JUo7ZycKEYQQiQAWd9y54F4XX\\\",\\\"amount\\\":0.01},{\\\"address\\\":\\\"1D1ZrZNe3JUo7ZycKEYQQiQAWd9y54F4XX\\\",\\\"amount\\\":0.02}]\"")
+            + HelpExampleCli("sendpayouts", "\"[{\\\"address\\\":\\\"1D1ZrZNe3JUo7ZycKEYQQiQAWd9y54F4XX\\\",\\\"amount\\\":0.01}]\" '{\"comment\": \"payroll\", \"maximumOutputs\": 500}'")
+            + HelpExampleRpc("sendpayouts", "[{\"address\":\"1D1ZrZNe3JUo7ZycKEYQQiQAWd9y54F4XX\",\"amount\":0.01}], {\"comment\": \"payroll\"}")
+        );
+
+    // Make sure the results are valid at least up to the most recent block
+    // the user could have gotten from another RPC command prior to now
+    pwallet->BlockUntilSyncedToCurrentChain();
+
+    LOCK2(cs_main, pwallet->cs_wallet);
+
+    if (pwallet->GetBroadcastTransactions() && !g_connman) {
+        throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
+    }
+
+    const UniValue& payouts = request.params[0].get_array();
+    if (payouts.empty()) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, payouts must not be empty");
+    }
+
+    mapValue_t mapValue;
+    CCoinControl coin_control;
+    int nMaximumOutputs = DEFAULT_PAYOUT_BATCH_MAX_OUTPUTS;
+    if (!request.params[1].isNull()) {
+        const UniValue& options = request.params[1].get_obj();
+        RPCTypeCheckObj(options,
+            {
+                {"comment", UniValueType(UniValue::VSTR)},
+                {"replaceable", UniValueType(UniValue::VBOOL)},
+                {"conf_target", UniValueType(UniValue::VNUM)},
+                {"estimate_mode", UniValueType(UniValue::VSTR)},
+                {"maximumOutputs", UniValueType(UniValue::VNUM)},
+            },
+            true, true);
+
+        if (options.exists("comment") && !options["comment"].get_str().empty())
+            mapValue["comment"] = options["comment"].get_str();
+
+        if (options.exists("replaceable")) {
+            coin_control.m_signal_bip125_rbf = options["replaceable"].get_bool();
+        }
+        if (options.exists("conf_target")) {
+            coin_control.m_confirm_target = ParseConfirmTarget(options["conf_target"]);
+        }
+        if (options.exists("estimate_mode")) {
+            if (!FeeModeFromString(options["estimate_mode"].get_str(), coin_control.m_fee_mode)) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid estimate_mode parameter");
+            }
+        }
+        if (options.exists("maximumOutputs")) {
+            nMaximumOutputs = options["maximumOutputs"].get_int();
+            if (nMaximumOutputs < 1) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, maximumOutputs must be at least 1");
+            }
+        }
+    }
+
+    std::vector<CRecipient> vecSend;
+    CAmount totalAmount = 0;
+    for (size_t i = 0; i < payouts.size(); ++i) {
+        const UniValue& payout = payouts[i].get_obj();
+        RPCTypeCheckObj(payout,
+            {
+                {"address", UniValueType(UniValue::VSTR)},
+                {"amount", UniValueType()}, // will be checked below
+            });
+        CTxDestination dest = DecodeDestination(payout["address"].get_str());
+        if (!IsValidDestination(dest)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, std::string("Invalid XPChain address: ") + payout["address"].get_str());
+        }
+        CAmount nAmount = AmountFromValue(payout["amount"]);
+        if (nAmount <= 0)
+            throw JSONRPCError(RPC_TYPE_ERROR, "Invalid amount for send");
+        totalAmount += nAmount;
+
+        CRecipient recipient = {GetScriptForDestination(dest), nAmount, false};
+        vecSend.push_back(recipient);
+    }
+
+    EnsureWalletIsUnlocked(pwallet);
+
+    if (totalAmount > pwallet->GetAvailableBalance(&coin_control)) {
+        throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Wallet has insufficient funds");
+    }
+
+    UniValue txids(UniValue::VARR);
+    CAmount nTotalFee = 0;
+    size_t nPaid = 0;
+    std::string strFailReason;
+    while (nPaid < vecSend.size()) {
+        // Shuffle the recipients of each transaction
+        std::vector<CRecipient> vecBatch(vecSend.begin() + nPaid, vecSend.begin() + std::min(vecSend.size(), nPaid + nMaximumOutputs));
+        std::shuffle(vecBatch.begin(), vecBatch.end(), FastRandomContext());
+
+        CReserveKey keyChange(pwallet);
+        CAmount nFeeRequired = 0;
+        CTransactionRef tx;
+        if (!pwallet->CreateBatchTransaction(vecBatch, tx, keyChange, nFeeRequired, strFailReason, coin_control)) {
+            break;
+        }
+        CValidationState state;
+        if (!pwallet->CommitTransaction(tx, mapValue, {} /* orderForm */, "" /* account */, keyChange, g_connman.get(), state)) {
+            strFailReason = strprintf("Transaction commit failed:: %s", FormatStateMessage(state));
+            break;
+        }
+        txids.push_back(tx->GetHash().GetHex());
+        nTotalFee += nFeeRequired;
+        nPaid += vecBatch.size();
+    }
+    if (nPaid == 0) {
+        throw JSONRPCError(RPC_WALLET_ERROR, strFailReason);
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.pushKV("txids", txids);
+    result.pushKV("fee", ValueFromAmount(nTotalFee));
+    result.pushKV("paid", (uint64_t)nPaid);
+    if (nPaid < vecSend.size()) {
+        // Some transactions are already sent, so report what is left to pay
+        // rather than failing
+        UniValue unpaid(UniValue::VARR);
+        for (size_t i = nPaid; i < payouts.size(); ++i) {
+            unpaid.push_back(payouts[i]);
+        }
+        result.pushKV("error", strFailReason);
+        result.pushKV("unpaid", unpaid);
+    }
+    return result;
+}
+
 static UniValue addmultisigaddress(const JSONRPCRequest& request)
 {
     std::shared_ptr<CWallet> const wallet = GetWalletForJSONRPCRequest(request);
@@ -4950,6 +5127,199 @@ static UniValue listmintings(const JSONRPCRequest& request)
     return results;
 }
 
+//! Create and send one transaction of a stake plan, taking the fee from its outputs
+static bool SendStakePlanTx(CWallet* const pwallet, const StakePlanTx& plan_tx, CTransactionRef& tx, std::string& strFailReason)
+{
+    CCoinControl coin_control;
+    for (const COutPoint& input : plan_tx.inputs) {
+        coin_control.Select(input);
+    }
+
+    std::vector<CRecipient> vecSend;
+    for (unsigned int i = 0; i + 1 < plan_tx.num_outputs; ++i) {
+        CRecipient recipient = {plan_tx.script, plan_tx.output_amount, false};
+        vecSend.push_back(recipient);
+    }
+    // The last output takes the rest and pays the fee
+    CRecipient recipient = {plan_tx.script, plan_tx.amount - (plan_tx.num_outputs - 1) * plan_tx.output_amount, true /* fSubtractFeeFromAmount */};
+    vecSend.push_back(recipient);
+
+    CReserveKey reservekey(pwallet);
+    CAmount nFeeRequired = 0;
+    int nChangePosRet = -1;
+    if (!pwallet->CreateTransaction(vecSend, tx, reservekey, nFeeRequired, nChangePosRet, strFailReason, coin_control)) {
+        return false;
+    }
+    CValidationState state;
+    if (!pwallet->CommitTransaction(tx, {} /* mapValue */, {} /* orderForm */, "" /* account */, reservekey, g_connman.get(), state)) {
+        strFailReason = strprintf("Transaction commit failed:: %s", FormatStateMessage(state));
+        return false;
+    }
+    return true;
+}
+
+static UniValue planstakeoutputs(const JSONRPCRequest& request)
+{
+    std::shared_ptr<CWallet> const wallet = GetWalletForJSONRPCRequest(request);
+    CWallet* const pwallet = wallet.get();
+
+    if (!EnsureWalletIsAvailable(pwallet, request.fHelp)) {
+        return NullUniValue;
+    }
+
+    if (request.fHelp || request.params.size() > 2)
+        throw std::runtime_error(
+            "planstakeoutputs ( execute options )\n"
+            "\nPlans transactions that reshape the wallet's confirmed outputs for staking, and sends them if execute is true.\n"
+            "An output of the target amount is expected to find one kernel by the time it reaches full weight at the\n"
+            "difficulty of the next proof-of-stake block. Smaller outputs are merged with other outputs to the same address,\n"
+            "which also cuts the kernel checks the minter makes every second, and larger ones are split.\n"
+            "Fees are paid from the reshaped outputs, and these start aging from zero.\n"
+            "\nArguments:\n"
+            "1. execute          (bool, optional, default=false) Create and send the planned transactions\n"
+            "2. options          (json, optional) JSON with plan options\n"
+            "    {\n"
+            "      \"targetAmount\"     (numeric or string, optional) Amount to aim for in each output in " + CURRENCY_UNIT + ", instead of the one for the current difficulty\n"
+            "      \"minimumAmount\"    (numeric or string, default=targetAmount/2) Outputs below this are merged\n"
+            "      \"maximumAmount\"    (numeric or string, default=targetAmount*2) Outputs above this are split\n"
+            "      \"maximumInputs\"    (numeric, default=" + std::to_string(DEFAULT_STAKE_PLAN_MAX_INPUTS) + ") Maximum number of outputs one transaction merges\n"
+            "      \"maximumOutputs\"   (numeric, default=" + std::to_string(DEFAULT_STAKE_PLAN_MAX_OUTPUTS) + ") Maximum number of outputs one transaction splits into\n"
+            "    }\n"
+            "\nResult\n"
+            "{\n"
+            "  \"nbits\" : \"xxxxxxxx\",      (string) the difficulty target of the next proof-of-stake block\n"
+            "  \"targetamount\" : x.xxx,    (numeric) the amount aimed for in each output in " + CURRENCY_UNIT + "\n"
+            "  \"outputs\" : n,             (numeric) the number of outputs the plan looked at\n"
+            "  \"plannedoutputs\" : n,      (numeric) the number of those outputs left after the plan\n"
+            "  \"transactions\" : [         (array of json object)\n"
+            "    {\n"
+            "      \"type\" : \"merge|split\",  (string) whether the transaction merges outputs or splits one\n"
+            "      \"address\" : \"address\",   (string) the xpchain address the inputs and outputs pay to\n"
+            "      \"inputs\" : n,            (numeric) the number of outputs spent\n"
+            "      \"outputs\" : n,           (numeric) the number of outputs created\n"
+            "      \"amount\" : x.xxx,        (numeric) the amount spent before fees in " + CURRENCY_UNIT + "\n"
+            "      \"txid\" : \"txid\",         (string) the transaction id, if it was sent\n"
+            "      \"error\" : \"text\",        (string) why the transaction was not sent, if execute is true\n"
+            "    }\n"
+            "    ,...\n"
+            "  ]\n"
+            "}\n"
+
+            "\nExamples\n"
+            + HelpExampleCli("planstakeoutputs", "")
+            + HelpExampleCli("planstakeoutputs", "true '{ \"targetAmount\": 5000 }'")
+            + HelpExampleRpc("planstakeoutputs", "true, { \"targetAmount\": 5000 }")
+        );
+
+    bool execute = false;
+    if (!request.params[0].isNull()) {
+        RPCTypeCheckArgument(request.params[0], UniValue::VBOOL);
+        execute = request.params[0].get_bool();
+    }
+
+    // Make sure the results are valid at least up to the most recent block
+    // the user could have gotten from another RPC command prior to now
+    pwallet->BlockUntilSyncedToCurrentChain();
+
+    LOCK2(cs_main, pwallet->cs_wallet);
+
+    const Consensus::Params& consensusParams = Params().GetConsensus();
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (!pindexTip || !pindexTip->pprev || !IsPoSHeight(pindexTip->nHeight + 1, consensusParams)) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Proof-of-stake is not active for the next block");
+    }
+    const unsigned int nBits = GetnBits(pindexTip, consensusParams);
+
+    CAmount nTargetAmount = GetOptimalStakeAmount(nBits, consensusParams);
+    CAmount nMinimumAmount = -1;
+    CAmount nMaximumAmount = -1;
+    int nMaximumInputs = DEFAULT_STAKE_PLAN_MAX_INPUTS;
+    int nMaximumOutputs = DEFAULT_STAKE_PLAN_MAX_OUTPUTS;
+
+    if (!request.params[1].isNull()) {
+        const UniValue& options = request.params[1].get_obj();
+
+        if (options.exists("targetAmount"))
+            nTargetAmount = AmountFromValue(options["targetAmount"]);
+
+        if (options.exists("minimumAmount"))
+            nMinimumAmount = AmountFromValue(options["minimumAmount"]);
+
+        if (options.exists("maximumAmount"))
+            nMaximumAmount = AmountFromValue(options["maximumAmount"]);
+
+        if (options.exists("maximumInputs"))
+            nMaximumInputs = options["maximumInputs"].get_int();
+
+        if (options.exists("maximumOutputs"))
+            nMaximumOutputs = options["maximumOutputs"].get_int();
+    }
+
+    if (nMinimumAmount < 0) nMinimumAmount = nTargetAmount / 2;
+    if (nMaximumAmount < 0) nMaximumAmount = std::min(nTargetAmount * 2, MAX_MONEY);
+    if (nTargetAmount <= 0 || nMinimumAmount > nTargetAmount || nMaximumAmount < nTargetAmount) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, amounts must satisfy 0 < targetAmount and minimumAmount <= targetAmount <= maximumAmount");
+    }
+    if (nMaximumInputs < 2 || nMaximumOutputs < 2) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid parameter, maximumInputs and maximumOutputs must be at least 2");
+    }
+
+    if (execute) {
+        EnsureWalletIsUnlocked(pwallet);
+        if (pwallet->GetBroadcastTransactions() && !g_connman) {
+            throw JSONRPCError(RPC_CLIENT_P2P_DISABLED, "Error: Peer-to-peer functionality missing or disabled");
+        }
+    }
+
+    std::vector<COutput> vecOutputs;
+    pwallet->AvailableCoins(vecOutputs, true /* fOnlySafe */, nullptr, 1, MAX_MONEY, MAX_MONEY, 0, 1 /* nMinDepth */);
+
+    std::vector<StakePlanCoin> coins;
+    for (const COutput& out : vecOutputs) {
+        const CTxOut& txout = out.tx->tx->vout[out.i];
+        // Dust costs more to spend than it adds to a merged output
+        if (!out.fSpendable || IsDust(txout, ::dustRelayFee)) continue;
+        coins.emplace_back(COutPoint(out.tx->GetHash(), out.i), txout.scriptPubKey, txout.nValue);
+    }
+    const size_t nOutputs = coins.size();
+
+    std::vector<StakePlanTx> plan = PlanStakeOutputs(std::move(coins), nTargetAmount, nMinimumAmount, nMaximumAmount, nMaximumInputs, nMaximumOutputs);
+
+    size_t nPlannedOutputs = nOutputs;
+    UniValue transactions(UniValue::VARR);
+    for (const StakePlanTx& plan_tx : plan) {
+        nPlannedOutputs = nPlannedOutputs - plan_tx.inputs.size() + plan_tx.num_outputs;
+
+        UniValue entry(UniValue::VOBJ);
+        entry.pushKV("type", plan_tx.IsSplit() ? "split" : "merge");
+        CTxDestination address;
+        if (ExtractDestination(plan_tx.script, address)) {
+            entry.pushKV("address", EncodeDestination(address));
+        }
+        entry.pushKV("inputs", (uint64_t)plan_tx.inputs.size());
+        entry.pushKV("outputs", (uint64_t)plan_tx.num_outputs);
+        entry.pushKV("amount", ValueFromAmount(plan_tx.amount));
+        if (execute) {
+            CTransactionRef tx;
+            std::string strFailReason;
+            if (SendStakePlanTx(pwallet, plan_tx, tx, strFailReason)) {
+                entry.pushKV("txid", tx->GetHash().GetHex());
+            } else {
+                entry.pushKV("error", strFailReason);
+            }
+        }
+        transactions.push_back(entry);
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.pushKV("nbits", strprintf("%08x", nBits));
+    result.pushKV("targetamount", ValueFromAmount(nTargetAmount));
+    result.pushKV("outputs", (uint64_t)nOutputs);
+    result.pushKV("plannedoutputs", (uint64_t)nPlannedOutputs);
+    result.pushKV("transactions", transactions);
+    return result;
+}
+
 extern UniValue abortrescan(const JSONRPCRequest& request); // in rpcdump.cpp
 extern UniValue dumpprivkey(const JSONRPCRequest& request); // in rpcdump.cpp
 extern UniValue importprivkey(const JSONRPCRequest& request);
@@ -5004,6 +5374,7 @@ static const CRPCCommand commands[] =
     { "wallet",             "loadwallet",                       &loadwallet,                    {"filename"} },
     { "wallet",             "lockunspent",                      &lockunspent,                   {"unlock","transactions"} },
     { "wallet",             "sendmany",                         &sendmany,                      {"fromaccount|dummy","amounts","minconf","comment","subtractfeefrom","replaceable","conf_target","estimate_mode"} },
+    { "wallet",             "sendpayouts",                      &sendpayouts,                   {"payouts","options"} },
     { "wallet",             "sendtoaddress",                    &sendtoaddress,                 {"address","amount","comment","comment_to","subtractfeefromamount","replaceable","conf_target","estimate_mode"} },
     { "wallet",             "settxfee",                         &settxfee,                      {"amount"} },
     { "wallet",             "signmessage",                      &signmessage,                   {"address","message"} },
@@ -5036,6 +5407,7 @@ static const CRPCCommand commands[] =
 
     { "generating",         "generate",                         &generate,                      {"nblocks","maxtries"} },
     { "mining",             "listmintings",                     &listmintings,                   {"period", "minage","maxage","addresses","include_unsafe","query_options"} },
+    { "mining",             "planstakeoutputs",                 &planstakeoutputs,               {"execute","options"} },
 };
 
 void RegisterWalletRPCCommands(CRPCTable &t)
@@ -0,0 +1,80 @@
+// Copyright (c) 2018 The XPChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <wallet/stakeplan.h>
+
+#include <arith_uint256.h>
+#include <consensus/params.h>
+
+#include <algorithm>
+#include <assert.h>
+#include <map>
+#include <math.h>
+
+CAmount GetOptimalStakeAmount(unsigned int nBits, const Consensus::Params& params)
+{
+    arith_uint256 bnTarget;
+    bnTarget.SetCompact(nBits);
+    const double target = bnTarget.getdouble();
+    const double weight_span = params.nStakeMaxAge - params.nStakeMinAge;
+    if (target <= 0 || weight_span <= 0) return MAX_MONEY;
+
+    // The chance per try at weight w is amount * w / (COIN * 86400) * target / 2^256.
+    // Summed over the tries while w grows to weight_span, that is
+    // amount * target * weight_span^2 / (2 * COIN * 86400 * 2^256), which is
+    // one kernel for the amount below.
+    const double amount = 2.0 * COIN * 86400 * ldexp(1.0, 256) / (target * weight_span * weight_span);
+    if (amount >= (double)MAX_MONEY) return MAX_MONEY;
+    return std::max<CAmount>(1, (CAmount)amount);
+}
+
+std::vector<StakePlanTx> PlanStakeOutputs(std::vector<StakePlanCoin> coins, CAmount target_amount, CAmount min_amount, CAmount max_amount,
+                                          unsigned int max_inputs, unsigned int max_outputs)
+{
+    assert(target_amount > 0 && max_inputs > 1 && max_outputs > 1);
+
+    // Largest first, so merges reach the target with few inputs and the
+    // smallest outputs are swept up together at the end
+    std::sort(coins.begin(), coins.end(), [](const StakePlanCoin& a, const StakePlanCoin& b) {
+        return a.amount > b.amount;
+    });
+
+    std::vector<StakePlanTx> plan;
+    // The merge being filled for each script
+    std::map<CScript, StakePlanTx> merges;
+
+    for (const StakePlanCoin& coin : coins) {
+        if (coin.amount > max_amount) {
+            const CAmount num_targets = std::min<CAmount>(max_outputs, coin.amount / target_amount);
+            const CAmount rest = coin.amount - num_targets * target_amount;
+            const CAmount num_outputs = rest < min_amount ? num_targets : num_targets + 1;
+            if (num_outputs < 2) continue;
+            StakePlanTx split;
+            split.script = coin.script;
+            split.inputs.push_back(coin.outpoint);
+            split.amount = coin.amount;
+            split.num_outputs = num_outputs;
+            split.output_amount = target_amount;
+            plan.push_back(std::move(split));
+        } else if (coin.amount < min_amount) {
+            StakePlanTx& merge = merges[coin.script];
+            merge.script = coin.script;
+            merge.inputs.push_back(coin.outpoint);
+            merge.amount += coin.amount;
+            if (merge.amount >= target_amount || merge.inputs.size() >= max_inputs) {
+                plan.push_back(std::move(merge));
+                merges.erase(coin.script);
+            }
+        }
+    }
+
+    // Merge what is left for each script, unless it is a single output
+    for (auto& entry : merges) {
+        if (entry.second.inputs.size() > 1) {
+            plan.push_back(std::move(entry.second));
+        }
+    }
+
+    return plan;
+}
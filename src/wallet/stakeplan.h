@@ -0,0 +1,79 @@
+// Copyright (c) 2018 The XPChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLET_STAKEPLAN_H
+#define BITCOIN_WALLET_STAKEPLAN_H
+
+#include <amount.h>
+#include <primitives/transaction.h>
+#include <script/script.h>
+
+#include <vector>
+
+namespace Consensus {
+struct Params;
+}
+
+//! Default maximum number of inputs a consolidation transaction spends
+static const unsigned int DEFAULT_STAKE_PLAN_MAX_INPUTS = 200;
+//! Default maximum number of outputs a split transaction creates
+static const unsigned int DEFAULT_STAKE_PLAN_MAX_OUTPUTS = 50;
+
+/** A wallet output the stake planner may reshape */
+struct StakePlanCoin
+{
+    COutPoint outpoint;
+    CScript script;
+    CAmount amount;
+
+    StakePlanCoin(const COutPoint& outpointIn, const CScript& scriptIn, CAmount amountIn) :
+        outpoint(outpointIn), script(scriptIn), amount(amountIn) {}
+};
+
+/**
+ * A planned transaction that spends inputs paying to script and pays
+ * num_outputs outputs back to it: each of output_amount but the last, which
+ * takes the rest and pays the fee.
+ */
+struct StakePlanTx
+{
+    CScript script;
+    std::vector<COutPoint> inputs;
+    //! Sum of the inputs, before fees
+    CAmount amount{0};
+    unsigned int num_outputs{1};
+    CAmount output_amount{0};
+
+    bool IsSplit() const { return num_outputs > 1; }
+};
+
+/**
+ * Return the output value that is expected to find one kernel by the time its
+ * weight stops growing at nStakeMaxAge, at the difficulty nBits.
+ *
+ * The minter tries every output once a second. An output finds a kernel when
+ * the hash is below amount * weight * target, where the weight counts the
+ * seconds after nStakeMinAge. Smaller outputs are expected to sit at full
+ * weight before they stake, which earns no more reward, and they each cost a
+ * kernel check every second. Larger outputs stake before they reach full
+ * weight and then wait out nStakeMinAge again. Splitting them into outputs
+ * of this size keeps more of the value staking.
+ */
+CAmount GetOptimalStakeAmount(unsigned int nBits, const Consensus::Params& params);
+
+/**
+ * Plan transactions that bring the outputs close to target_amount.
+ *
+ * Outputs below min_amount are merged with other outputs paying to the same
+ * script, up to max_inputs at a time, until a merged output reaches
+ * target_amount. Outputs above max_amount are split into up to max_outputs
+ * outputs of target_amount and one output with the rest, unless the rest is
+ * below min_amount and goes to the last output of target_amount instead. A
+ * rest still above max_amount is split by a new plan. Outputs in between are
+ * left alone, so a new plan made after the transactions confirm is about empty.
+ */
+std::vector<StakePlanTx> PlanStakeOutputs(std::vector<StakePlanCoin> coins, CAmount target_amount, CAmount min_amount, CAmount max_amount,
+                                          unsigned int max_inputs, unsigned int max_outputs);
+
+#endif // BITCOIN_WALLET_STAKEPLAN_H
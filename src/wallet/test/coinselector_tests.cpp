@@ -254,6 +254,49 @@ BOOST_AUTO_TEST_CASE(bnb_search_test)
     BOOST_CHECK(!coin_selection_params_bnb.use_bnb);
 }
 
+BOOST_AUTO_TEST_CASE(bnb_large_pool_test)
+{
+    // Coins of many different values, too many for the search to visit every
+    // branch within its tries
+    std::vector<CInputCoin> utxo_pool;
+    FastRandomContext rand(true);
+    for (int i = 0; i < 100000; ++i) {
+        CMutableTransaction tx;
+        tx.nLockTime = i; // so all transactions get different hashes
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1000 + rand.randrange(100 * COIN);
+        utxo_pool.emplace_back(MakeTransactionRef(std::move(tx)), 0);
+    }
+
+    // The index keeps groups in descending effective value order and leaves
+    // out ineligible ones
+    std::vector<OutputGroup> groups;
+    for (size_t i = 0; i < utxo_pool.size(); ++i) {
+        groups.emplace_back(utxo_pool[i], i % 2 ? 6 : 0, false, 0, 0);
+    }
+    const EffectiveValueIndex index(groups, CFeeRate(0), CFeeRate(0));
+    BOOST_CHECK_EQUAL(index.size(), utxo_pool.size());
+    std::vector<const OutputGroup*> eligible = index.GetEligible(filter_standard);
+    BOOST_CHECK_EQUAL(eligible.size(), utxo_pool.size() / 2);
+    for (size_t i = 1; i < eligible.size(); ++i) {
+        BOOST_CHECK(eligible[i - 1]->effective_value >= eligible[i]->effective_value);
+        BOOST_CHECK_EQUAL(eligible[i]->m_depth, 6);
+    }
+
+    // A solution within the range is found among them
+    CoinSet selection;
+    CAmount value_ret = 0;
+    const CAmount target = 1234 * COIN + 567;
+    BOOST_CHECK(SelectCoinsBnB(eligible, target, 100, selection, value_ret, 0));
+    BOOST_CHECK(value_ret >= target && value_ret <= target + 100);
+
+    // Running out of time returns the best solution found until then
+    selection.clear();
+    value_ret = 0;
+    BOOST_CHECK(SelectCoinsBnB(eligible, target, 100, selection, value_ret, 0, -1000 * 1000));
+    BOOST_CHECK(value_ret >= target && value_ret <= target + 100);
+}
+
 BOOST_AUTO_TEST_CASE(knapsack_solver_test)
 {
     CoinSet setCoinsRet, setCoinsRet2;
@@ -0,0 +1,224 @@
+// Copyright (c) 2018 The XPChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <wallet/logdb.h>
+
+#include <test/test_bitcoin.h>
+#include <util.h>
+
+#include <string>
+#include <thread>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(logdb_tests, BasicTestingSetup)
+
+static LogDataBytes Bytes(const std::string& str)
+{
+    return LogDataBytes(str.begin(), str.end());
+}
+
+static std::string ReadString(LogDatabase& db, const std::string& key)
+{
+    LogDataBytes value;
+    if (!db.Read(Bytes(key), value)) return "<missing>";
+    return std::string(value.begin(), value.end());
+}
+
+BOOST_AUTO_TEST_CASE(logdb_write_erase_reopen)
+{
+    const fs::path path = SetDataDir("logdb_write_erase_reopen") / "wallet.dat";
+    std::string error;
+    {
+        LogDatabase db(path);
+        BOOST_CHECK(!db.Open(false /* fCreate */, error));
+        BOOST_CHECK(db.Open(true /* fCreate */, error));
+        BOOST_CHECK(LogDatabase::IsLogFile(path));
+
+        BOOST_CHECK(db.Apply({LogDatabaseOp(false, Bytes("a"), Bytes("1")), LogDatabaseOp(false, Bytes("b"), Bytes("2"))}));
+        BOOST_CHECK(db.Apply({LogDatabaseOp(false, Bytes("a"), Bytes("3"))}));
+        BOOST_CHECK(db.Apply({LogDatabaseOp(true, Bytes("b"), LogDataBytes())}));
+        BOOST_CHECK_EQUAL(ReadString(db, "a"), "3");
+        BOOST_CHECK(!db.Exists(Bytes("b")));
+    }
+
+    // The log is replayed on open.
+    LogDatabase db(path);
+    BOOST_CHECK(db.Open(false /* fCreate */, error));
+    BOOST_CHECK_EQUAL(ReadString(db, "a"), "3");
+    BOOST_CHECK_EQUAL(ReadString(db, "b"), "<missing>");
+}
+
+BOOST_AUTO_TEST_CASE(logdb_cursor_order)
+{
+    LogDatabase db(SetDataDir("logdb_cursor_order") / "wallet.dat");
+    std::string error;
+    BOOST_CHECK(db.Open(true /* fCreate */, error));
+    // Keys are ordered bytewise, with bytes >= 0x80 after ASCII ones.
+    BOOST_CHECK(db.Apply({LogDatabaseOp(false, Bytes("\x80"), Bytes("3")),
+                          LogDatabaseOp(false, Bytes("ab"), Bytes("2")),
+                          LogDatabaseOp(false, Bytes("a"), Bytes("1"))}));
+
+    LogDataBytes key, value;
+    BOOST_CHECK(db.First(key, value));
+    BOOST_CHECK(key == Bytes("a"));
+    BOOST_CHECK(db.Next(key, false /* fInclusive */, key, value));
+    BOOST_CHECK(key == Bytes("ab"));
+    BOOST_CHECK(db.Next(key, false /* fInclusive */, key, value));
+    BOOST_CHECK(key == Bytes("\x80"));
+    BOOST_CHECK(!db.Next(key, false /* fInclusive */, key, value));
+
+    BOOST_CHECK(db.Next(Bytes("aa"), true /* fInclusive */, key, value));
+    BOOST_CHECK(key == Bytes("ab"));
+    BOOST_CHECK(db.Next(Bytes("ab"), true /* fInclusive */, key, value));
+    BOOST_CHECK(key == Bytes("ab"));
+}
+
+BOOST_AUTO_TEST_CASE(logdb_torn_record)
+{
+    const fs::path path = SetDataDir("logdb_torn_record") / "wallet.dat";
+    std::string error;
+    uint64_t good_size;
+    {
+        LogDatabase db(path);
+        BOOST_CHECK(db.Open(true /* fCreate */, error));
+        BOOST_CHECK(db.Apply({LogDatabaseOp(false, Bytes("a"), Bytes("1"))}));
+        good_size = db.GetFileSize();
+        BOOST_CHECK(db.Apply({LogDatabaseOp(false, Bytes("b"), Bytes("2"))}));
+    }
+
+    // Cut the last record short, as a crash while appending would.
+    FILE* file = fsbridge::fopen(path, "rb+");
+    BOOST_REQUIRE(file);
+    BOOST_CHECK(TruncateFile(file, fs::file_size(path) - 1));
+    fclose(file);
+
+    std::vector<LogDatabaseOp> ops;
+    uint64_t discarded;
+    bool fCorrupt;
+    BOOST_CHECK(LogDatabase::ReadFile(path, ops, discarded, fCorrupt, error));
+    BOOST_CHECK_EQUAL(ops.size(), 1U);
+    BOOST_CHECK_EQUAL(discarded, fs::file_size(path) - good_size);
+    BOOST_CHECK(!fCorrupt);
+
+    // Opening drops the partial record, and later appends are readable.
+    {
+        LogDatabase db(path);
+        BOOST_CHECK(db.Open(false /* fCreate */, error));
+        BOOST_CHECK_EQUAL(db.GetFileSize(), good_size);
+        BOOST_CHECK_EQUAL(ReadString(db, "a"), "1");
+        BOOST_CHECK_EQUAL(ReadString(db, "b"), "<missing>");
+        BOOST_CHECK(db.Apply({LogDatabaseOp(false, Bytes("c"), Bytes("3"))}));
+    }
+    LogDatabase db(path);
+    BOOST_CHECK(db.Open(false /* fCreate */, error));
+    BOOST_CHECK_EQUAL(ReadString(db, "c"), "3");
+}
+
+BOOST_AUTO_TEST_CASE(logdb_corrupt_record)
+{
+    const fs::path path = SetDataDir("logdb_corrupt_record") / "wallet.dat";
+    std::string error;
+    uint64_t first_size;
+    {
+        LogDatabase db(path);
+        BOOST_CHECK(db.Open(true /* fCreate */, error));
+        BOOST_CHECK(db.Apply({LogDatabaseOp(false, Bytes("a"), Bytes("1"))}));
+        first_size = db.GetFileSize();
+        BOOST_CHECK(db.Apply({LogDatabaseOp(false, Bytes("b"), Bytes("2"))}));
+        BOOST_CHECK(db.Apply({LogDatabaseOp(false, Bytes("c"), Bytes("3"))}));
+    }
+    const uint64_t file_size = fs::file_size(path);
+
+    // Damage the first byte of the second record's body.
+    FILE* file = fsbridge::fopen(path, "rb+");
+    BOOST_REQUIRE(file);
+    BOOST_CHECK_EQUAL(fseek(file, first_size + 8, SEEK_SET), 0);
+    BOOST_CHECK_EQUAL(fputc('x', file), 'x');
+    fclose(file);
+
+    std::vector<LogDatabaseOp> ops;
+    uint64_t discarded;
+    bool fCorrupt;
+    BOOST_CHECK(LogDatabase::ReadFile(path, ops, discarded, fCorrupt, error));
+    BOOST_CHECK_EQUAL(ops.size(), 1U);
+    BOOST_CHECK_EQUAL(discarded, file_size - first_size);
+    BOOST_CHECK(fCorrupt);
+
+    // Opening refuses to cut off the records after the damaged one.
+    LogDatabase db(path);
+    BOOST_CHECK(!db.Open(false /* fCreate */, error));
+    BOOST_CHECK(!db.IsOpen());
+    BOOST_CHECK_EQUAL(fs::file_size(path), file_size);
+}
+
+BOOST_AUTO_TEST_CASE(logdb_compact)
+{
+    const fs::path path = SetDataDir("logdb_compact") / "wallet.dat";
+    std::string error;
+    LogDatabase db(path);
+    BOOST_CHECK(db.Open(true /* fCreate */, error));
+
+    // Overwrite the same entries until most of the file is dead.
+    const LogDataBytes value(1000, 'x');
+    for (int i = 0; i < 2000; ++i) {
+        BOOST_CHECK(db.Apply({LogDatabaseOp(false, Bytes(strprintf("key%d", i % 10)), value)}));
+    }
+    BOOST_CHECK(db.Apply({LogDatabaseOp(false, Bytes("\x04pool"), Bytes("1"))}));
+    BOOST_CHECK(db.NeedsCompaction());
+
+    const uint64_t old_size = db.GetFileSize();
+    BOOST_CHECK(db.Compact());
+    BOOST_CHECK(db.GetFileSize() < old_size / 100);
+    BOOST_CHECK(!db.NeedsCompaction());
+    BOOST_CHECK_EQUAL(fs::file_size(path), db.GetFileSize());
+    BOOST_CHECK(db.Exists(Bytes("key9")));
+
+    // Entries under the skipped prefix are dropped.
+    BOOST_CHECK(db.Compact("\x04pool"));
+    BOOST_CHECK(!db.Exists(Bytes("\x04pool")));
+    BOOST_CHECK(db.Apply({LogDatabaseOp(false, Bytes("new"), Bytes("1"))}));
+    db.Close();
+
+    BOOST_CHECK(db.Open(false /* fCreate */, error));
+    for (int i = 0; i < 10; ++i) {
+        LogDataBytes read;
+        BOOST_CHECK(db.Read(Bytes(strprintf("key%d", i)), read));
+        BOOST_CHECK(read == value);
+    }
+    BOOST_CHECK(!db.Exists(Bytes("\x04pool")));
+    BOOST_CHECK_EQUAL(ReadString(db, "new"), "1");
+}
+
+BOOST_AUTO_TEST_CASE(logdb_compact_concurrent_writes)
+{
+    const fs::path path = SetDataDir("logdb_compact_concurrent_writes") / "wallet.dat";
+    std::string error;
+    LogDatabase db(path);
+    BOOST_CHECK(db.Open(true /* fCreate */, error));
+
+    const LogDataBytes value(1000, 'x');
+    for (int i = 0; i < 5000; ++i) {
+        BOOST_CHECK(db.Apply({LogDatabaseOp(false, Bytes(strprintf("key%d", i % 1000)), value)}));
+    }
+
+    // Writes made while the compacted file is written are kept.
+    std::thread writer([&db] {
+        for (int i = 0; i < 1000; ++i) {
+            db.Apply({LogDatabaseOp(false, Bytes(strprintf("new%d", i)), Bytes("1"))});
+        }
+    });
+    BOOST_CHECK(db.Compact());
+    writer.join();
+    BOOST_CHECK_EQUAL(fs::file_size(path), db.GetFileSize());
+    db.Close();
+
+    BOOST_CHECK(db.Open(false /* fCreate */, error));
+    for (int i = 0; i < 1000; ++i) {
+        BOOST_CHECK(db.Exists(Bytes(strprintf("key%d", i))));
+        BOOST_CHECK_EQUAL(ReadString(db, strprintf("new%d", i)), "1");
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,108 @@
+// Copyright (c) 2018 The XPChain Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <wallet/stakeplan.h>
+
+#include <chainparams.h>
+#include <consensus/params.h>
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(stakeplan_tests, BasicTestingSetup)
+
+static std::vector<StakePlanCoin> coins;
+
+static void add_coin(CAmount nValue, const CScript& script)
+{
+    coins.emplace_back(COutPoint(InsecureRand256(), 0), script, nValue);
+}
+
+static size_t CountSplits(const std::vector<StakePlanTx>& plan)
+{
+    size_t splits = 0;
+    for (const StakePlanTx& plan_tx : plan) {
+        if (plan_tx.IsSplit()) ++splits;
+    }
+    return splits;
+}
+
+BOOST_AUTO_TEST_CASE(stakeplan_optimal_amount)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+
+    // A target twice as large finds kernels twice as often, so half the value does
+    const CAmount amount = GetOptimalStakeAmount(0x1c00ffff, params);
+    BOOST_CHECK(amount > 0 && amount < MAX_MONEY);
+    const CAmount half = GetOptimalStakeAmount(0x1c01fffe, params);
+    BOOST_CHECK(std::abs(2 * half - amount) <= 2);
+
+    // Tiny targets call for more value than there is
+    BOOST_CHECK_EQUAL(GetOptimalStakeAmount(0x03000001, params), MAX_MONEY);
+}
+
+BOOST_AUTO_TEST_CASE(stakeplan_merge_and_split)
+{
+    const CScript script_a = CScript() << OP_1;
+    const CScript script_b = CScript() << OP_2;
+    const CScript script_c = CScript() << OP_3;
+    coins.clear();
+    for (int i = 0; i < 10; ++i) {
+        add_coin(1 * COIN, script_a);
+    }
+    add_coin(1 * COIN, script_b);
+    add_coin(7 * COIN, script_b);
+    add_coin(23 * COIN, script_c);
+
+    // Small outputs are merged per script until they reach the target, and
+    // the large one is split into outputs of the target and one with the rest
+    std::vector<StakePlanTx> plan = PlanStakeOutputs(coins, 5 * COIN, 5 * COIN / 2, 10 * COIN, 200, 50);
+    BOOST_CHECK_EQUAL(plan.size(), 3U);
+    BOOST_CHECK_EQUAL(CountSplits(plan), 1U);
+    for (const StakePlanTx& plan_tx : plan) {
+        if (plan_tx.IsSplit()) {
+            BOOST_CHECK(plan_tx.script == script_c);
+            BOOST_CHECK_EQUAL(plan_tx.inputs.size(), 1U);
+            BOOST_CHECK_EQUAL(plan_tx.num_outputs, 5U);
+            BOOST_CHECK_EQUAL(plan_tx.output_amount, 5 * COIN);
+            BOOST_CHECK_EQUAL(plan_tx.amount, 23 * COIN);
+        } else {
+            // The single small output of script_b has nothing to merge with
+            BOOST_CHECK(plan_tx.script == script_a);
+            BOOST_CHECK_EQUAL(plan_tx.inputs.size(), 5U);
+            BOOST_CHECK_EQUAL(plan_tx.amount, 5 * COIN);
+        }
+    }
+
+    // Transactions are limited in inputs and outputs of the target, the rest
+    // of a split is left for a later plan, and a leftover output is not
+    // merged on its own
+    plan = PlanStakeOutputs(coins, 5 * COIN, 5 * COIN / 2, 10 * COIN, 3, 2);
+    BOOST_CHECK_EQUAL(plan.size(), 4U);
+    for (const StakePlanTx& plan_tx : plan) {
+        if (plan_tx.IsSplit()) {
+            BOOST_CHECK_EQUAL(plan_tx.num_outputs, 3U);
+            BOOST_CHECK_EQUAL(plan_tx.output_amount, 5 * COIN);
+            BOOST_CHECK_EQUAL(plan_tx.amount - 2 * plan_tx.output_amount, 13 * COIN);
+        } else {
+            BOOST_CHECK_EQUAL(plan_tx.inputs.size(), 3U);
+        }
+    }
+
+    // A rest below the minimum goes to the last output
+    coins.clear();
+    add_coin(21 * COIN, script_c);
+    plan = PlanStakeOutputs(coins, 5 * COIN, 5 * COIN / 2, 10 * COIN, 200, 50);
+    BOOST_CHECK_EQUAL(plan.size(), 1U);
+    BOOST_CHECK_EQUAL(plan[0].num_outputs, 4U);
+    BOOST_CHECK_EQUAL(plan[0].output_amount, 5 * COIN);
+
+    // Outputs already in range are left alone
+    coins.clear();
+    add_coin(4 * COIN, script_a);
+    add_coin(9 * COIN, script_a);
+    BOOST_CHECK(PlanStakeOutputs(coins, 5 * COIN, 5 * COIN / 2, 10 * COIN, 200, 50).empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,15 +4,20 @@
 
 #include <wallet/wallet.h>
 
+#include <limits>
 #include <memory>
 #include <set>
 #include <stdint.h>
 #include <utility>
 #include <vector>
 
+#include <chainparams.h>
 #include <consensus/validation.h>
+#include <index/blockfilterindex.h>
+#include <policy/policy.h>
 #include <rpc/server.h>
 #include <test/test_bitcoin.h>
+#include <utiltime.h>
 #include <validation.h>
 #include <wallet/coincontrol.h>
 #include <wallet/test/wallet_test_fixture.h>
@@ -109,6 +114,100 @@ BOOST_FIXTURE_TEST_CASE(rescan, TestChain100Setup)
     }
 }
 
+BOOST_FIXTURE_TEST_CASE(rescan_blockfilter_skip, TestChain100Setup)
+{
+    CBlockIndex* const nullBlock = nullptr;
+    CKey otherKey;
+    otherKey.MakeNewKey(true);
+    CreateAndProcessBlock({}, GetScriptForRawPubKey(otherKey.GetPubKey()));
+    CBlockIndex* const otherBlock = chainActive.Tip();
+    CreateAndProcessBlock({}, GetScriptForRawPubKey(coinbaseKey.GetPubKey()));
+
+    g_blockfilterindex = MakeUnique<BlockFilterIndex>(BlockFilterType::BASIC, 1 << 20, true);
+    g_blockfilterindex->Start();
+    const int64_t time_start = GetTimeMillis();
+    while (!g_blockfilterindex->BlockUntilSyncedToCurrentChain()) {
+        BOOST_REQUIRE(time_start + 10 * 1000 > GetTimeMillis());
+        MilliSleep(100);
+    }
+
+    // Point the block paying to otherKey at data that can't be read, so that
+    // a scan only gets past it if the block's filter lets it skip the read.
+    const unsigned int nDataPos = otherBlock->nDataPos;
+    otherBlock->nDataPos = std::numeric_limits<unsigned int>::max();
+
+    {
+        CWallet wallet("dummy", WalletDatabase::CreateDummy());
+        AddKey(wallet, coinbaseKey);
+        WalletRescanReserver reserver(&wallet);
+        reserver.reserve();
+        BOOST_CHECK_EQUAL(nullBlock, wallet.ScanForWalletTransactions(otherBlock, nullptr, reserver));
+        BOOST_CHECK_EQUAL(wallet.GetImmatureBalance(), 11000000 * COIN); // 1x Reward
+    }
+
+    // A wallet whose scripts match the filter has to read the block.
+    {
+        CWallet wallet("dummy", WalletDatabase::CreateDummy());
+        AddKey(wallet, otherKey);
+        WalletRescanReserver reserver(&wallet);
+        reserver.reserve();
+        BOOST_CHECK_EQUAL(otherBlock, wallet.ScanForWalletTransactions(otherBlock, nullptr, reserver));
+    }
+
+    g_blockfilterindex->Stop();
+    g_blockfilterindex.reset();
+
+    // Without the index every block is read.
+    {
+        CWallet wallet("dummy", WalletDatabase::CreateDummy());
+        AddKey(wallet, coinbaseKey);
+        WalletRescanReserver reserver(&wallet);
+        reserver.reserve();
+        BOOST_CHECK_EQUAL(otherBlock, wallet.ScanForWalletTransactions(otherBlock, nullptr, reserver));
+    }
+
+    otherBlock->nDataPos = nDataPos;
+}
+
+// A block matched before the keypool top-up triggered by an earlier block of
+// the same chunk has to be rechecked against the new keys when committed.
+BOOST_FIXTURE_TEST_CASE(rescan_keypool_recheck, TestChain100Setup)
+{
+    CBlockIndex* const nullBlock = nullptr;
+    gArgs.ForceSetArg("-keypool", "2");
+    CKey seed;
+    seed.MakeNewKey(true);
+
+    CWallet source("dummy", WalletDatabase::CreateDummy());
+    std::vector<CPubKey> keys;
+    {
+        LOCK(source.cs_wallet);
+        source.SetHDSeed(source.DeriveNewSeed(seed));
+        WalletBatch batch(source.GetDBHandle());
+        for (int i = 0; i < 4; i++) {
+            keys.push_back(source.GenerateNewKey(batch));
+        }
+    }
+    CreateAndProcessBlock({}, GetScriptForDestination(keys[1].GetID()));
+    CBlockIndex* const firstBlock = chainActive.Tip();
+    CreateAndProcessBlock({}, GetScriptForDestination(keys[3].GetID()));
+
+    CWallet wallet("dummy", WalletDatabase::CreateDummy());
+    {
+        LOCK(wallet.cs_wallet);
+        wallet.SetHDSeed(wallet.DeriveNewSeed(seed));
+        BOOST_CHECK(wallet.TopUpKeyPool());
+        BOOST_CHECK(!wallet.HaveKey(keys[3].GetID()));
+    }
+    WalletRescanReserver reserver(&wallet);
+    reserver.reserve();
+    BOOST_CHECK_EQUAL(nullBlock, wallet.ScanForWalletTransactions(firstBlock, nullptr, reserver));
+    BOOST_CHECK(wallet.HaveKey(keys[3].GetID()));
+    BOOST_CHECK_EQUAL(wallet.GetImmatureBalance(), 22000000 * COIN); // 2x Reward
+
+    gArgs.ForceSetArg("-keypool", std::to_string(DEFAULT_KEYPOOL_SIZE));
+}
+
 // Verify importwallet RPC starts rescan at earliest block with timestamp
 // greater or equal than key birthday. Previously there was a bug where
 // importwallet RPC would start the scan at the latest block with timestamp less
@@ -267,6 +366,52 @@ BOOST_AUTO_TEST_CASE(LoadReceiveRequests)
     BOOST_CHECK_EQUAL(values[1], "val_rr1");
 }
 
+BOOST_AUTO_TEST_CASE(ismine_script_pubkeys)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    const CTxOut p2pkh(1, GetScriptForDestination(key.GetPubKey().GetID()));
+    const CTxOut watched(1, CScript() << OP_RETURN << std::vector<unsigned char>(4, 1));
+
+    // Outputs are rejected before the keystore knows them and accepted as
+    // soon as it does, without the script set going stale.
+    LOCK(m_wallet.cs_wallet);
+    BOOST_CHECK_EQUAL(m_wallet.IsMine(p2pkh), ISMINE_NO);
+    BOOST_CHECK(m_wallet.AddKeyPubKey(key, key.GetPubKey()));
+    BOOST_CHECK_EQUAL(m_wallet.IsMine(p2pkh), ISMINE_SPENDABLE);
+    BOOST_CHECK(m_wallet.GetScriptPubKeys().count(p2pkh.scriptPubKey));
+
+    // The P2WPKH scripts the keystore learns along with the key are added too.
+    const CScript witness_script = GetScriptForDestination(WitnessV0KeyHash(key.GetPubKey().GetID()));
+    const CTxOut p2wpkh(1, witness_script);
+    const CTxOut p2sh_p2wpkh(1, GetScriptForDestination(CScriptID(witness_script)));
+    BOOST_CHECK_EQUAL(m_wallet.IsMine(p2wpkh), ISMINE_SPENDABLE);
+    BOOST_CHECK_EQUAL(m_wallet.IsMine(p2sh_p2wpkh), ISMINE_SPENDABLE);
+
+    // A snapshot is shared until the keystore changes.
+    uint64_t generation;
+    std::shared_ptr<const ScriptPubKeySet> snapshot = m_wallet.GetScriptPubKeySnapshot(generation);
+    uint64_t generation2;
+    BOOST_CHECK(m_wallet.GetScriptPubKeySnapshot(generation2) == snapshot);
+    BOOST_CHECK_EQUAL(generation2, generation);
+    BOOST_CHECK(snapshot->count(p2pkh.scriptPubKey));
+    BOOST_CHECK(!snapshot->count(watched.scriptPubKey));
+
+    BOOST_CHECK_EQUAL(m_wallet.IsMine(watched), ISMINE_NO);
+    BOOST_CHECK(m_wallet.AddWatchOnly(watched.scriptPubKey, 0));
+    BOOST_CHECK_EQUAL(m_wallet.IsMine(watched), ISMINE_WATCH_ONLY);
+    BOOST_CHECK(m_wallet.GetScriptPubKeySnapshot(generation2)->count(watched.scriptPubKey));
+    BOOST_CHECK(generation2 != generation);
+    BOOST_CHECK(!snapshot->count(watched.scriptPubKey));
+
+    // Removing a watch-only script rebuilds the set, keeping everything else.
+    BOOST_CHECK(m_wallet.RemoveWatchOnly(watched.scriptPubKey));
+    BOOST_CHECK_EQUAL(m_wallet.IsMine(watched), ISMINE_NO);
+    BOOST_CHECK_EQUAL(m_wallet.IsMine(p2pkh), ISMINE_SPENDABLE);
+    BOOST_CHECK_EQUAL(m_wallet.IsMine(p2sh_p2wpkh), ISMINE_SPENDABLE);
+    BOOST_CHECK(m_wallet.GetScriptPubKeySnapshot(generation)->size() == m_wallet.GetScriptPubKeys().size());
+}
+
 class ListCoinsTestingSetup : public TestChain100Setup
 {
 public:
@@ -365,6 +510,270 @@ BOOST_FIXTURE_TEST_CASE(ListCoins, ListCoinsTestingSetup)
     BOOST_CHECK_EQUAL(list.begin()->second.size(), 2U);
 }
 
+BOOST_FIXTURE_TEST_CASE(CreateBatchTransaction, ListCoinsTestingSetup)
+{
+    const CScript coinbaseScript = GetScriptForRawPubKey(coinbaseKey.GetPubKey());
+    for (int i = 0; i < 3; ++i) {
+        AddTx(CRecipient{coinbaseScript, 1000 * COIN, false /* subtract fee */});
+    }
+
+    // Only leave the three small coins spendable, so the batch needs all of them
+    {
+        LOCK2(cs_main, wallet->cs_wallet);
+        std::vector<COutput> available;
+        wallet->AvailableCoins(available);
+        for (const COutput& out : available) {
+            if (out.tx->tx->vout[out.i].nValue > 1000 * COIN) {
+                wallet->LockCoin(COutPoint(out.tx->GetHash(), out.i));
+            }
+        }
+    }
+
+    // The same recipient may be paid more than once
+    std::vector<CRecipient> vecSend(100, CRecipient{GetScriptForRawPubKey({}), 25 * COIN, false});
+    CTransactionRef tx;
+    CReserveKey reservekey(wallet.get());
+    CAmount fee;
+    std::string error;
+    CCoinControl dummy;
+    BOOST_CHECK(wallet->CreateBatchTransaction(vecSend, tx, reservekey, fee, error, dummy));
+    BOOST_CHECK_EQUAL(tx->vin.size(), 3U);
+    BOOST_CHECK_EQUAL(tx->vout.size(), 101U);
+
+    // Every input is signed and the fee is what is left over
+    CAmount nValueIn = 0;
+    {
+        LOCK(wallet->cs_wallet);
+        for (unsigned int i = 0; i < tx->vin.size(); ++i) {
+            const CTxOut& prevout = wallet->mapWallet.at(tx->vin[i].prevout.hash).tx->vout[tx->vin[i].prevout.n];
+            nValueIn += prevout.nValue;
+            BOOST_CHECK(VerifyScript(tx->vin[i].scriptSig, prevout.scriptPubKey, &tx->vin[i].scriptWitness, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(tx.get(), i, prevout.nValue)));
+        }
+    }
+    BOOST_CHECK_EQUAL(fee, nValueIn - tx->GetValueOut());
+    BOOST_CHECK(fee >= ::minRelayTxFee.GetFee(GetVirtualTransactionSize(*tx)));
+
+    // More than the spendable coins, and fees taken from the recipients, are refused
+    vecSend.push_back(CRecipient{coinbaseScript, 1000 * COIN, false});
+    BOOST_CHECK(!wallet->CreateBatchTransaction(vecSend, tx, reservekey, fee, error, dummy));
+    vecSend.pop_back();
+    vecSend[0].fSubtractFeeFromAmount = true;
+    BOOST_CHECK(!wallet->CreateBatchTransaction(vecSend, tx, reservekey, fee, error, dummy));
+}
+
+BOOST_FIXTURE_TEST_CASE(CreateBatchTransactionLargestFirst, ListCoinsTestingSetup)
+{
+    const CScript coinbaseScript = GetScriptForRawPubKey(coinbaseKey.GetPubKey());
+    for (CAmount nValue : {1000 * COIN, 600 * COIN, 300 * COIN}) {
+        AddTx(CRecipient{coinbaseScript, nValue, false /* subtract fee */});
+    }
+    {
+        LOCK2(cs_main, wallet->cs_wallet);
+        std::vector<COutput> available;
+        wallet->AvailableCoins(available);
+        for (const COutput& out : available) {
+            if (out.tx->tx->vout[out.i].nValue > 1000 * COIN) {
+                wallet->LockCoin(COutPoint(out.tx->GetHash(), out.i));
+            }
+        }
+    }
+
+    // No set of coins pays 1200 without change, so the largest coins are
+    // spent until they cover it
+    std::vector<CRecipient> vecSend(2, CRecipient{GetScriptForRawPubKey({}), 600 * COIN, false});
+    CTransactionRef tx;
+    CReserveKey reservekey(wallet.get());
+    CAmount fee;
+    std::string error;
+    CCoinControl dummy;
+    BOOST_CHECK(wallet->CreateBatchTransaction(vecSend, tx, reservekey, fee, error, dummy));
+    BOOST_CHECK_EQUAL(tx->vout.size(), 3U);
+    std::multiset<CAmount> values;
+    {
+        LOCK(wallet->cs_wallet);
+        for (const CTxIn& txin : tx->vin) {
+            values.insert(wallet->mapWallet.at(txin.prevout.hash).tx->vout[txin.prevout.n].nValue);
+        }
+    }
+    BOOST_CHECK(values == std::multiset<CAmount>({600 * COIN, 1000 * COIN}));
+    BOOST_CHECK_EQUAL(fee, 1600 * COIN - tx->GetValueOut());
+}
+
+// Compare the coins and balances of the UTXO index, as kept up to date, with
+// those of an index built from a full scan of the wallet.
+static void CheckUTXOIndex(CWallet& wallet)
+{
+    LOCK2(cs_main, wallet.cs_wallet);
+    std::vector<COutput> indexed;
+    wallet.AvailableCoins(indexed, false);
+    const CAmount balance = wallet.GetBalance();
+    const CAmount unconfirmed = wallet.GetUnconfirmedBalance();
+    const CAmount immature = wallet.GetImmatureBalance();
+
+    wallet.MarkDirty();
+    std::vector<COutput> scanned;
+    wallet.AvailableCoins(scanned, false);
+    BOOST_REQUIRE_EQUAL(indexed.size(), scanned.size());
+    for (size_t i = 0; i < indexed.size(); ++i) {
+        BOOST_CHECK(indexed[i].tx == scanned[i].tx);
+        BOOST_CHECK_EQUAL(indexed[i].i, scanned[i].i);
+        BOOST_CHECK_EQUAL(indexed[i].nDepth, scanned[i].nDepth);
+        BOOST_CHECK_EQUAL(indexed[i].fSpendable, scanned[i].fSpendable);
+        BOOST_CHECK_EQUAL(indexed[i].fSafe, scanned[i].fSafe);
+    }
+    BOOST_CHECK_EQUAL(balance, wallet.GetBalance());
+    BOOST_CHECK_EQUAL(unconfirmed, wallet.GetUnconfirmedBalance());
+    BOOST_CHECK_EQUAL(immature, wallet.GetImmatureBalance());
+}
+
+static bool IsAvailable(CWallet& wallet, const COutPoint& outpoint)
+{
+    LOCK2(cs_main, wallet.cs_wallet);
+    std::vector<COutput> available;
+    wallet.AvailableCoins(available, false);
+    for (const COutput& out : available) {
+        if (COutPoint(out.tx->GetHash(), out.i) == outpoint) return true;
+    }
+    return false;
+}
+
+BOOST_FIXTURE_TEST_CASE(utxo_index_disconnect, ListCoinsTestingSetup)
+{
+    // Mature two more coinbase outputs
+    for (int i = 0; i < 2; i++) {
+        CreateAndProcessBlock({}, GetScriptForRawPubKey(coinbaseKey.GetPubKey()));
+    }
+    CheckUTXOIndex(*wallet);
+
+    // A wallet transaction spending two coins
+    CTransactionRef tx;
+    CReserveKey reservekey(wallet.get());
+    CAmount fee;
+    int changePos = -1;
+    std::string error;
+    CCoinControl dummy;
+    BOOST_CHECK(wallet->CreateTransaction({CRecipient{GetScriptForRawPubKey({}), 15000000 * COIN, false}}, tx, reservekey, fee, changePos, error, dummy));
+    BOOST_REQUIRE_EQUAL(tx->vin.size(), 2U);
+    CValidationState state;
+    BOOST_CHECK(wallet->CommitTransaction(tx, {}, {}, {}, reservekey, nullptr, state));
+    const COutPoint released = tx->vin[1].prevout;
+    BOOST_CHECK(!IsAvailable(*wallet, released));
+    CheckUTXOIndex(*wallet);
+
+    // A block spending only its first input conflicts it, which releases the
+    // second input
+    CMutableTransaction conflict;
+    conflict.vin.resize(1);
+    conflict.vin[0].prevout = tx->vin[0].prevout;
+    conflict.vout.resize(1);
+    conflict.vout[0].nValue = 1000000 * COIN;
+    conflict.vout[0].scriptPubKey = GetScriptForRawPubKey(coinbaseKey.GetPubKey());
+    CScript prevScript;
+    {
+        LOCK(wallet->cs_wallet);
+        prevScript = wallet->mapWallet.at(conflict.vin[0].prevout.hash).tx->vout[conflict.vin[0].prevout.n].scriptPubKey;
+    }
+    std::vector<unsigned char> vchSig;
+    BOOST_CHECK(coinbaseKey.Sign(SignatureHash(prevScript, conflict, 0, SIGHASH_ALL, 0, SigVersion::BASE), vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    conflict.vin[0].scriptSig << vchSig;
+    const std::shared_ptr<const CBlock> block = std::make_shared<const CBlock>(CreateAndProcessBlock({conflict}, GetScriptForRawPubKey(coinbaseKey.GetPubKey())));
+    CBlockIndex* const pindex = chainActive.Tip();
+    BOOST_REQUIRE(pindex->GetBlockHash() == block->GetHash());
+    wallet->BlockConnected(block, pindex, {tx});
+    BOOST_CHECK(IsAvailable(*wallet, released));
+    CheckUTXOIndex(*wallet);
+
+    // Disconnecting the block takes the conflict back, and the wallet
+    // transaction spends the second input again
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(InvalidateBlock(state, Params(), pindex));
+    }
+    wallet->BlockDisconnected(block);
+    BOOST_CHECK(!IsAvailable(*wallet, released));
+    CheckUTXOIndex(*wallet);
+
+    // Abandoning it releases the input once more
+    BOOST_CHECK(wallet->AbandonTransaction(tx->GetHash()));
+    BOOST_CHECK(IsAvailable(*wallet, released));
+    CheckUTXOIndex(*wallet);
+}
+
+// Compare the balances kept by the UTXO index with the sums over mapWallet
+// that GetBalance and friends used to compute.
+static void CheckBalanceTotals(CWallet& wallet)
+{
+    LOCK2(cs_main, wallet.cs_wallet);
+    CAmount balance = 0;
+    CAmount unconfirmed = 0;
+    CAmount immature = 0;
+    for (const auto& entry : wallet.mapWallet) {
+        const CWalletTx& wtx = entry.second;
+        const bool trusted = wtx.IsTrusted();
+        if (trusted) {
+            balance += wtx.GetAvailableCredit(false);
+        } else if (wtx.GetDepthInMainChain() == 0 && wtx.InMempool()) {
+            unconfirmed += wtx.GetAvailableCredit(false);
+        }
+        immature += wtx.GetImmatureCredit(false);
+    }
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), balance);
+    BOOST_CHECK_EQUAL(wallet.GetUnconfirmedBalance(), unconfirmed);
+    BOOST_CHECK_EQUAL(wallet.GetImmatureBalance(), immature);
+}
+
+BOOST_FIXTURE_TEST_CASE(balance_totals_uncached, ListCoinsTestingSetup)
+{
+    // A block the wallet does not know of, so that disconnecting it below
+    // only changes the tip
+    CKey otherKey;
+    otherKey.MakeNewKey(true);
+    CreateAndProcessBlock({}, GetScriptForRawPubKey(otherKey.GetPubKey()));
+    CheckBalanceTotals(*wallet);
+
+    // A transaction committed while not broadcasting is untrusted until it
+    // is accepted to the mempool
+    CTransactionRef tx;
+    CReserveKey reservekey(wallet.get());
+    CAmount fee;
+    int changePos = -1;
+    std::string error;
+    CCoinControl dummy;
+    BOOST_CHECK(wallet->CreateTransaction({CRecipient{GetScriptForRawPubKey({}), 1000 * COIN, false}}, tx, reservekey, fee, changePos, error, dummy));
+    CValidationState state;
+    BOOST_CHECK(wallet->CommitTransaction(tx, {}, {}, {}, reservekey, nullptr, state));
+    CheckBalanceTotals(*wallet);
+    wallet->SetBroadcastTransactions(true);
+    wallet->ReacceptWalletTransactions();
+    {
+        LOCK(wallet->cs_wallet);
+        BOOST_CHECK(wallet->mapWallet.at(tx->GetHash()).InMempool());
+    }
+    CheckBalanceTotals(*wallet);
+
+    // A transaction locked to the tip height is final for the next block
+    // only as long as the tip stays
+    BOOST_CHECK(wallet->CreateTransaction({CRecipient{GetScriptForRawPubKey({}), 1000 * COIN, false}}, tx, reservekey, fee, changePos, error, dummy));
+    CMutableTransaction locked(*tx);
+    locked.nLockTime = chainActive.Height();
+    {
+        LOCK2(cs_main, wallet->cs_wallet);
+        BOOST_CHECK(wallet->SignTransaction(locked));
+    }
+    BOOST_CHECK(wallet->CommitTransaction(MakeTransactionRef(locked), {}, {}, {}, reservekey, nullptr, state));
+    CheckBalanceTotals(*wallet);
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(InvalidateBlock(state, Params(), chainActive.Tip()));
+    }
+    {
+        LOCK2(cs_main, wallet->cs_wallet);
+        BOOST_CHECK(!wallet->mapWallet.at(locked.GetHash()).IsTrusted());
+    }
+    CheckBalanceTotals(*wallet);
+}
+
 BOOST_FIXTURE_TEST_CASE(wallet_disableprivkeys, TestChain100Setup)
 {
     std::shared_ptr<CWallet> wallet = std::make_shared<CWallet>("dummy", WalletDatabase::CreateDummy());
@@ -14,6 +14,7 @@
 #include <key.h>
 #include <key_io.h>
 #include <keystore.h>
+#include <index/blockfilterindex.h>
 #include <validation.h>
 #include <net.h>
 #include <policy/fees.h>
@@ -32,7 +33,14 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <future>
+#include <limits>
+#include <mutex>
+#include <thread>
 
 #include <boost/algorithm/string/replace.hpp>
 
@@ -91,6 +99,13 @@ static void ReleaseWallet(CWallet* wallet)
     delete wallet;
 }
 
+SaltedScriptHasher::SaltedScriptHasher() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+size_t SaltedScriptHasher::operator()(const CScript& script) const
+{
+    return CSipHasher(k0, k1).Write(script.data(), script.size()).Finalize();
+}
+
 const uint32_t BIP32_HARDENED_KEY_LIMIT = 0x80000000;
 
 const uint256 CMerkleTx::ABANDON_HASH(uint256S("0000000000000000000000000000000000000000000000000000000000000001"));
@@ -274,6 +289,7 @@ bool CWallet::AddKeyPubKeyWithDB(WalletBatch &batch, const CKey& secret, const C
         return false;
     }
     if (needsDB) encrypted_batch = nullptr;
+    AddScriptPubKeysForKey(pubkey);
 
     // check if we need to remove from watch-only
     CScript script;
@@ -305,6 +321,7 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    AddScriptPubKeysForKey(vchPubKey);
     {
         LOCK(cs_wallet);
         if (encrypted_batch)
@@ -332,9 +349,20 @@ void CWallet::LoadScriptMetadata(const CScriptID& script_id, const CKeyMetadata
     m_script_metadata[script_id] = meta;
 }
 
+bool CWallet::LoadKey(const CKey& key, const CPubKey &pubkey)
+{
+    if (!CCryptoKeyStore::AddKeyPubKey(key, pubkey))
+        return false;
+    AddScriptPubKeysForKey(pubkey);
+    return true;
+}
+
 bool CWallet::LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
-    return CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret);
+    if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
+        return false;
+    AddScriptPubKeysForKey(vchPubKey);
+    return true;
 }
 
 /**
@@ -357,6 +385,7 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    AddScriptPubKeys({redeemScript, GetScriptForDestination(CScriptID(redeemScript))});
     return WalletBatch(*database).WriteCScript(Hash160(redeemScript), redeemScript);
 }
 
@@ -372,13 +401,17 @@ bool CWallet::LoadCScript(const CScript& redeemScript)
         return true;
     }
 
-    return CCryptoKeyStore::AddCScript(redeemScript);
+    if (!CCryptoKeyStore::AddCScript(redeemScript))
+        return false;
+    AddScriptPubKeys({redeemScript, GetScriptForDestination(CScriptID(redeemScript))});
+    return true;
 }
 
 bool CWallet::AddWatchOnly(const CScript& dest)
 {
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    AddScriptPubKeysForWatchOnly(dest);
     const CKeyMetadata& meta = m_script_metadata[CScriptID(dest)];
     UpdateTimeFirstKey(meta.nCreateTime);
     NotifyWatchonlyChanged(true);
@@ -396,6 +429,7 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
     AssertLockHeld(cs_wallet);
     if (!CCryptoKeyStore::RemoveWatchOnly(dest))
         return false;
+    RebuildScriptPubKeys();
     if (!HaveWatchOnly())
         NotifyWatchonlyChanged(false);
     if (!WalletBatch(*database).EraseWatchOnly(dest))
@@ -406,7 +440,10 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
 
 bool CWallet::LoadWatchOnly(const CScript &dest)
 {
-    return CCryptoKeyStore::AddWatchOnly(dest);
+    if (!CCryptoKeyStore::AddWatchOnly(dest))
+        return false;
+    AddScriptPubKeysForWatchOnly(dest);
+    return true;
 }
 
 bool CWallet::Unlock(const SecureString& strWalletPassphrase)
@@ -897,6 +934,7 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         for (std::pair<const uint256, CWalletTx>& item : mapWallet)
             item.second.MarkDirty();
+        m_utxo_index_rebuild = true;
     }
 }
 
@@ -996,6 +1034,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFlushOnClose)
 
     // Break debit/credit balance caches:
     wtx.MarkDirty();
+    m_utxo_index_pending.insert(hash);
 
     // Notify UI of new or updated transaction
     NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -1146,6 +1185,7 @@ bool CWallet::AbandonTransaction(const uint256& hashTx)
             wtx.nIndex = -1;
             wtx.setAbandoned();
             wtx.MarkDirty();
+            m_utxo_index_pending.insert(now);
             batch.WriteTx(wtx);
             NotifyTransactionChanged(this, wtx.GetHash(), CT_UPDATED);
             // Iterate over all its outputs, and mark transactions in the wallet that spend them abandoned too
@@ -1203,6 +1243,7 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
             wtx.nIndex = -1;
             wtx.hashBlock = hashBlock;
             wtx.MarkDirty();
+            m_utxo_index_pending.insert(now);
             batch.WriteTx(wtx);
             // Iterate over all its outputs, and mark transactions in the wallet that spend them conflicted too
             TxSpends::const_iterator iter = mapTxSpends.lower_bound(COutPoint(now, 0));
@@ -1219,6 +1260,90 @@ void CWallet::MarkConflicted(const uint256& hashBlock, const uint256& hashTx)
     }
 }
 
+/** The P2WPKH script the keystore learns along with a compressed key, and its P2SH wrapping. */
+static void AddRelatedKeyScripts(const CPubKey& pubkey, std::vector<CScript>& scripts)
+{
+    if (!pubkey.IsCompressed()) return;
+    CScript witness_script = GetScriptForDestination(WitnessV0KeyHash(pubkey.GetID()));
+    scripts.push_back(GetScriptForDestination(CScriptID(witness_script)));
+    scripts.push_back(std::move(witness_script));
+}
+
+void CWallet::AddScriptPubKeys(const std::vector<CScript>& scripts)
+{
+    LOCK(cs_KeyStore);
+    m_script_pubkeys.insert(scripts.begin(), scripts.end());
+    m_script_pubkeys_snapshot.reset();
+    ++m_keystore_generation;
+}
+
+void CWallet::AddScriptPubKeysForKey(const CPubKey& pubkey)
+{
+    std::vector<CScript> scripts{GetScriptForRawPubKey(pubkey), GetScriptForDestination(pubkey.GetID())};
+    AddRelatedKeyScripts(pubkey, scripts);
+    AddScriptPubKeys(scripts);
+}
+
+void CWallet::AddScriptPubKeysForWatchOnly(const CScript& dest)
+{
+    std::vector<CScript> scripts{dest};
+    txnouttype type;
+    std::vector<std::vector<unsigned char>> solutions;
+    if (Solver(dest, type, solutions) && type == TX_PUBKEY) {
+        AddRelatedKeyScripts(CPubKey(solutions[0]), scripts);
+    }
+    AddScriptPubKeys(scripts);
+}
+
+void CWallet::RebuildScriptPubKeys()
+{
+    LOCK(cs_KeyStore);
+    const std::set<CScript> scripts = GetScriptPubKeys();
+    m_script_pubkeys.clear();
+    m_script_pubkeys.insert(scripts.begin(), scripts.end());
+    m_script_pubkeys_snapshot.reset();
+    ++m_keystore_generation;
+}
+
+std::shared_ptr<const ScriptPubKeySet> CWallet::GetScriptPubKeySnapshot(uint64_t& generation_out) const
+{
+    LOCK(cs_KeyStore);
+    if (!m_script_pubkeys_snapshot) {
+        m_script_pubkeys_snapshot = std::make_shared<const ScriptPubKeySet>(m_script_pubkeys);
+    }
+    generation_out = m_keystore_generation;
+    return m_script_pubkeys_snapshot;
+}
+
+std::set<CScript> CWallet::GetScriptPubKeys() const
+{
+    LOCK(cs_KeyStore);
+    std::set<CScript> scripts(setWatchOnly.begin(), setWatchOnly.end());
+    for (const CKeyID& keyid : GetKeys()) {
+        CPubKey pubkey;
+        if (!GetPubKey(keyid, pubkey)) continue;
+        scripts.insert(GetScriptForRawPubKey(pubkey));
+        scripts.insert(GetScriptForDestination(keyid));
+    }
+    // Witness programs for our keys are learned as scripts as well, so this
+    // also covers P2WPKH, P2WSH and their P2SH-wrapped forms.
+    for (const auto& entry : mapScripts) {
+        scripts.insert(entry.second);
+        scripts.insert(GetScriptForDestination(entry.first));
+    }
+    return scripts;
+}
+
+bool CWallet::SpendsOrConflictsWithWallet(const CTransaction& tx) const
+{
+    AssertLockHeld(cs_wallet);
+    if (mapWallet.count(tx.GetHash())) return true;
+    for (const CTxIn& txin : tx.vin) {
+        if (mapWallet.count(txin.prevout.hash) || mapTxSpends.count(txin.prevout)) return true;
+    }
+    return false;
+}
+
 void CWallet::SyncTransaction(const CTransactionRef& ptx, const CBlockIndex *pindex, int posInBlock, bool update_tx) {
     if (!AddToWalletIfInvolvingMe(ptx, pindex, posInBlock, update_tx))
         return; // Not one of ours
@@ -1236,6 +1361,7 @@ void CWallet::TransactionAddedToMempool(const CTransactionRef& ptx) {
     auto it = mapWallet.find(ptx->GetHash());
     if (it != mapWallet.end()) {
         it->second.fInMempool = true;
+        m_utxo_index_pending.insert(it->first);
     }
 }
 
@@ -1244,9 +1370,16 @@ void CWallet::TransactionRemovedFromMempool(const CTransactionRef &ptx) {
     auto it = mapWallet.find(ptx->GetHash());
     if (it != mapWallet.end()) {
         it->second.fInMempool = false;
+        m_utxo_index_pending.insert(it->first);
     }
 }
 
+void CWallet::MarkUTXOIndexPending(const uint256& hash) const
+{
+    LOCK(cs_wallet);
+    m_utxo_index_pending.insert(hash);
+}
+
 void CWallet::BlockConnected(const std::shared_ptr<const CBlock>& pblock, const CBlockIndex *pindex, const std::vector<CTransactionRef>& vtxConflicted) {
     LOCK2(cs_main, cs_wallet);
     // TODO: Temporarily ensure that mempool removals are notified before
@@ -1275,6 +1408,37 @@ void CWallet::BlockDisconnected(const std::shared_ptr<const CBlock>& pblock) {
     for (const CTransactionRef& ptx : pblock->vtx) {
         SyncTransaction(ptx);
     }
+
+    // Transactions conflicted by this block, and their spends, are no longer
+    // conflicted without being notified. Queue them for the UTXO index by
+    // following the spends of the block's inputs.
+    const uint256 hashBlock = pblock->GetHash();
+    std::set<uint256> todo;
+    std::set<uint256> done;
+    for (const CTransactionRef& ptx : pblock->vtx) {
+        if (ptx->IsCoinBase())
+            continue;
+        for (const CTxIn& txin : ptx->vin) {
+            auto range = mapTxSpends.equal_range(txin.prevout);
+            for (auto spend = range.first; spend != range.second; ++spend) {
+                todo.insert(spend->second);
+            }
+        }
+    }
+    while (!todo.empty()) {
+        uint256 now = *todo.begin();
+        todo.erase(todo.begin());
+        done.insert(now);
+        auto it = mapWallet.find(now);
+        if (it == mapWallet.end() || it->second.hashBlock != hashBlock)
+            continue;
+        m_utxo_index_pending.insert(now);
+        for (auto spend = mapTxSpends.lower_bound(COutPoint(now, 0)); spend != mapTxSpends.end() && spend->first.hash == now; ++spend) {
+            if (!done.count(spend->second)) {
+                todo.insert(spend->second);
+            }
+        }
+    }
 }
 
 
@@ -1339,6 +1503,12 @@ CAmount CWallet::GetDebit(const CTxIn &txin, const isminefilter& filter) const
 
 isminetype CWallet::IsMine(const CTxOut& txout) const
 {
+    {
+        LOCK(cs_KeyStore);
+        if (!m_script_pubkeys.count(txout.scriptPubKey)) {
+            return ISMINE_NO;
+        }
+    }
     return ::IsMine(*this, txout.scriptPubKey);
 }
 
@@ -1700,6 +1870,165 @@ int64_t CWallet::RescanFromTime(int64_t startTime, const WalletRescanReserver& r
     return startTime;
 }
 
+namespace {
+
+/** A block read ahead by RescanReader, with the transactions paying to the wallet marked. */
+struct RescanBlock
+{
+    CBlockIndex* pindex;
+    CDiskBlockPos pos;
+    CBlock block;
+    bool fRead = false;
+    //! Not read because its block filter matches none of the wallet's scripts
+    bool fSkipped = false;
+    //! For each transaction, whether one of its outputs was IsMine when matched
+    std::vector<bool> vMatch;
+    //! Keystore generation of the script set the block was filtered and matched against
+    uint64_t nGeneration = 0;
+};
+
+/**
+ * Reads the blocks of a rescan ahead of the wallet on a separate thread,
+ * RESCAN_CHUNK_BLOCKS at a time, and matches each chunk's outputs against a
+ * snapshot of the wallet's scriptPubKeys on up to MAX_RESCAN_MATCH_THREADS
+ * threads. Chunks are handed out in chain order; the reader stays at most
+ * one chunk ahead of the consumer.
+ *
+ * The blocks to read, and where they are stored, are looked up by the caller,
+ * so the reader never takes cs_main: the consumer may be holding it while it
+ * waits for a chunk.
+ *
+ * With -blockfilterindex, blocks whose filter matches none of the wallet's
+ * scriptPubKeys are not read at all. Such a block can still conflict with a
+ * wallet transaction that spends outputs which are not ours; that conflict
+ * is left to be found once the block is reorganized or the wallet reloaded.
+ */
+class RescanReader
+{
+public:
+    RescanReader(const CWallet& wallet, std::vector<std::pair<CBlockIndex*, CDiskBlockPos>> blocks)
+        : m_wallet(wallet), m_filter_index(g_blockfilterindex.get()), m_blocks(std::move(blocks))
+    {
+        m_thread = std::thread(&RescanReader::ThreadRead, this);
+    }
+
+    ~RescanReader()
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_all();
+        m_thread.join();
+    }
+
+    /** Wait for the next chunk. Returns false once the last block has been handed out. */
+    bool NextChunk(std::vector<RescanBlock>& chunk)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this] { return m_done || !m_chunks.empty(); });
+        if (m_chunks.empty()) return false;
+        chunk = std::move(m_chunks.front());
+        m_chunks.pop_front();
+        m_cond.notify_all();
+        return true;
+    }
+
+private:
+    bool Stopping()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_stop;
+    }
+
+    /** Match against a snapshot of the wallet's scriptPubKeys, so the match threads take no locks. */
+    static void Match(const ScriptPubKeySet& scripts, std::vector<RescanBlock>::iterator begin, std::vector<RescanBlock>::iterator end)
+    {
+        for (auto it = begin; it != end; ++it) {
+            if (!it->fRead) continue;
+            it->vMatch.resize(it->block.vtx.size());
+            for (size_t i = 0; i < it->block.vtx.size(); i++) {
+                for (const CTxOut& txout : it->block.vtx[i]->vout) {
+                    if (scripts.count(txout.scriptPubKey)) {
+                        it->vMatch[i] = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    void ThreadRead()
+    {
+        RenameThread("xpchain-rescan");
+        const Consensus::Params& consensusParams = Params().GetConsensus();
+        const int nThreads = std::max(1, std::min(GetNumCores(), MAX_RESCAN_MATCH_THREADS));
+        for (size_t nNext = 0; nNext < m_blocks.size() && !Stopping();) {
+            std::vector<RescanBlock> chunk;
+            while (nNext < m_blocks.size() && chunk.size() < (size_t)RESCAN_CHUNK_BLOCKS) {
+                chunk.emplace_back();
+                chunk.back().pindex = m_blocks[nNext].first;
+                chunk.back().pos = m_blocks[nNext].second;
+                ++nNext;
+            }
+
+            // A block filtered or matched before keys were added (for instance by
+            // the keypool top-up of an earlier block) is rechecked in full when
+            // committed.
+            uint64_t nGeneration;
+            const std::shared_ptr<const ScriptPubKeySet> scripts = m_wallet.GetScriptPubKeySnapshot(nGeneration);
+            if (m_filter_index && m_filter_generation != nGeneration) {
+                m_filter_elements.clear();
+                for (const CScript& script : *scripts) {
+                    m_filter_elements.emplace(script.begin(), script.end());
+                }
+                m_filter_generation = nGeneration;
+            }
+            for (RescanBlock& item : chunk) {
+                if (Stopping()) return;
+                item.nGeneration = nGeneration;
+                BlockFilter filter;
+                if (m_filter_index && m_filter_index->LookupFilter(item.pindex, filter) && !filter.GetFilter().MatchAny(m_filter_elements)) {
+                    item.fSkipped = true;
+                    continue;
+                }
+                item.fRead = ReadBlockFromDisk(item.block, item.pos, consensusParams, IsPoSHeight(item.pindex->nHeight, consensusParams)) &&
+                             item.block.GetHash() == item.pindex->GetBlockHash();
+            }
+            const size_t nPerThread = (chunk.size() + nThreads - 1) / nThreads;
+            std::vector<std::future<void>> vMatching;
+            for (size_t i = nPerThread; i < chunk.size(); i += nPerThread) {
+                vMatching.push_back(std::async(std::launch::async, &RescanReader::Match, std::cref(*scripts), chunk.begin() + i, chunk.begin() + std::min(chunk.size(), i + nPerThread)));
+            }
+            Match(*scripts, chunk.begin(), chunk.begin() + std::min(chunk.size(), nPerThread));
+            for (std::future<void>& matching : vMatching) matching.get();
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this] { return m_stop || m_chunks.empty(); });
+            if (m_stop) return;
+            m_chunks.push_back(std::move(chunk));
+            m_cond.notify_all();
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done = true;
+        m_cond.notify_all();
+    }
+
+    const CWallet& m_wallet;
+    const BlockFilterIndex* const m_filter_index;
+    GCSFilter::ElementSet m_filter_elements;
+    uint64_t m_filter_generation = std::numeric_limits<uint64_t>::max();
+    const std::vector<std::pair<CBlockIndex*, CDiskBlockPos>> m_blocks;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<std::vector<RescanBlock>> m_chunks;
+    bool m_done = false;
+    bool m_stop = false;
+    std::thread m_thread;
+};
+
+} // namespace
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
@@ -1715,6 +2044,10 @@ int64_t CWallet::RescanFromTime(int64_t startTime, const WalletRescanReserver& r
  * Caller needs to make sure pindexStop (and the optional pindexStart) are on
  * the main chain after to the addition of any new keys you want to detect
  * transactions for.
+ *
+ * Blocks are read and matched ahead by a RescanReader and committed here in
+ * chain order, one chunk per cs_main/cs_wallet lock. Only transactions paying
+ * to us or for which SpendsOrConflictsWithWallet() holds reach SyncTransaction.
  */
 CBlockIndex* CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, CBlockIndex* pindexStop, const WalletRescanReserver &reserver, bool fUpdate)
 {
@@ -1748,44 +2081,71 @@ CBlockIndex* CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, CBlock
             }
         }
         double progress_current = progress_begin;
+        bool fReorganized = false;
         while (pindex && !fAbortRescan && !ShutdownRequested())
         {
-            if (pindex->nHeight % 100 == 0 && progress_end - progress_begin > 0.0) {
-                ShowProgress(strprintf("%s " + _("Rescanning..."), GetDisplayName()), std::max(1, std::min(99, (int)((progress_current - progress_begin) / (progress_end - progress_begin) * 100))));
-            }
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                WalletLogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, progress_current);
+            // The reader ends at the tip it sees; if the tip has moved on by
+            // the time its last block is committed, scan on with a new one.
+            std::vector<std::pair<CBlockIndex*, CDiskBlockPos>> blocks;
+            {
+                LOCK(cs_main);
+                for (CBlockIndex* pindexRead = pindex; pindexRead; pindexRead = pindexRead == pindexStop ? nullptr : chainActive.Next(pindexRead)) {
+                    blocks.emplace_back(pindexRead, pindexRead->GetBlockPos());
+                }
             }
+            RescanReader reader(*this, std::move(blocks));
+            std::vector<RescanBlock> chunk;
+            while (!fAbortRescan && !ShutdownRequested() && reader.NextChunk(chunk))
+            {
+                if (progress_end - progress_begin > 0.0) {
+                    ShowProgress(strprintf("%s " + _("Rescanning..."), GetDisplayName()), std::max(1, std::min(99, (int)((progress_current - progress_begin) / (progress_end - progress_begin) * 100))));
+                }
+                if (GetTime() >= nNow + 60) {
+                    nNow = GetTime();
+                    WalletLogPrintf("Still rescanning. At block %d. Progress=%f\n", chunk.front().pindex->nHeight, progress_current);
+                }
 
-            CBlock block;
-            if (ReadBlockFromDisk(block, pindex, Params().GetConsensus())) {
                 LOCK2(cs_main, cs_wallet);
-                if (pindex && !chainActive.Contains(pindex)) {
-                    // Abort scan if current block is no longer active, to prevent
-                    // marking transactions as coming from the wrong block.
-                    ret = pindex;
-                    break;
-                }
-                for (size_t posInBlock = 0; posInBlock < block.vtx.size(); ++posInBlock) {
-                    SyncTransaction(block.vtx[posInBlock], pindex, posInBlock, fUpdate);
+                for (RescanBlock& item : chunk) {
+                    pindex = item.pindex;
+                    if (!chainActive.Contains(pindex)) {
+                        // Abort scan if current block is no longer active, to prevent
+                        // marking transactions as coming from the wrong block.
+                        ret = pindex;
+                        fReorganized = true;
+                        break;
+                    }
+                    const bool fRecheck = item.nGeneration != m_keystore_generation;
+                    if (item.fSkipped) {
+                        if (!fRecheck) continue;
+                        item.fRead = ReadBlockFromDisk(item.block, pindex, chainParams.GetConsensus());
+                    }
+                    if (!item.fRead) {
+                        ret = pindex;
+                        continue;
+                    }
+                    for (size_t posInBlock = 0; posInBlock < item.block.vtx.size(); ++posInBlock) {
+                        const CTransactionRef& ptx = item.block.vtx[posInBlock];
+                        if (fRecheck || item.vMatch[posInBlock] || SpendsOrConflictsWithWallet(*ptx)) {
+                            SyncTransaction(ptx, pindex, posInBlock, fUpdate);
+                        }
+                    }
                 }
-            } else {
-                ret = pindex;
-            }
-            if (pindex == pindexStop) {
-                break;
-            }
-            {
-                LOCK(cs_main);
-                pindex = chainActive.Next(pindex);
                 progress_current = GuessVerificationProgress(chainParams.TxData(), pindex);
                 if (pindexStop == nullptr && tip != chainActive.Tip()) {
                     tip = chainActive.Tip();
                     // in case the tip has changed, update progress max
                     progress_end = GuessVerificationProgress(chainParams.TxData(), tip);
                 }
+                if (fReorganized) break;
             }
+            if (fReorganized || fAbortRescan || ShutdownRequested() || pindex == pindexStop) {
+                break;
+            }
+            LOCK(cs_main);
+            CBlockIndex* pindexNext = chainActive.Next(pindex);
+            if (!pindexNext) break;
+            pindex = pindexNext;
         }
         if (pindex && fAbortRescan) {
             WalletLogPrintf("Rescan aborted at block %d. Progress=%f\n", pindex->nHeight, progress_current);
@@ -2113,74 +2473,59 @@ void CWallet::ResendWalletTransactions(int64_t nBestBlockTime, CConnman* connman
 
 CAmount CWallet::GetBalance(const isminefilter& filter, const int min_depth) const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (const auto& entry : mapWallet)
-        {
-            const CWalletTx* pcoin = &entry.second;
-            if (pcoin->IsTrusted() && pcoin->GetDepthInMainChain() >= min_depth) {
-                nTotal += pcoin->GetAvailableCredit(true, filter);
-            }
-        }
-    }
+    LOCK2(cs_main, cs_wallet);
+    SyncUTXOIndex();
 
+    CAmount nTotal = m_balance_confirmed.Get(filter) - GetImmatureTotal(filter, min_depth);
+    if (min_depth <= 0) {
+        nTotal += m_balance_trusted_unconfirmed.Get(filter);
+    }
+    // Take out the outputs of the most recent blocks that are not deep enough
+    const int nTipHeight = chainActive.Height();
+    for (auto it = m_balance_by_height.rbegin(); it != m_balance_by_height.rend() && nTipHeight - it->first + 1 < min_depth; ++it) {
+        nTotal -= it->second.Get(filter);
+    }
     return nTotal;
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (const auto& entry : mapWallet)
-        {
-            const CWalletTx* pcoin = &entry.second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    SyncUTXOIndex();
+    return m_balance_untrusted_unconfirmed.Get(ISMINE_SPENDABLE);
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (const auto& entry : mapWallet)
-        {
-            const CWalletTx* pcoin = &entry.second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    SyncUTXOIndex();
+    return GetImmatureTotal(ISMINE_SPENDABLE, 0);
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (const auto& entry : mapWallet)
-        {
-            const CWalletTx* pcoin = &entry.second;
-            if (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0 && pcoin->InMempool())
-                nTotal += pcoin->GetAvailableCredit(true, ISMINE_WATCH_ONLY);
-        }
-    }
-    return nTotal;
+    LOCK2(cs_main, cs_wallet);
+    SyncUTXOIndex();
+    return m_balance_untrusted_unconfirmed.Get(ISMINE_WATCH_ONLY);
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
+    LOCK2(cs_main, cs_wallet);
+    SyncUTXOIndex();
+    return GetImmatureTotal(ISMINE_WATCH_ONLY, 0);
+}
+
+CAmount CWallet::GetImmatureTotal(const isminefilter& filter, int min_depth) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
     CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (const auto& entry : mapWallet)
-        {
-            const CWalletTx* pcoin = &entry.second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
+    const int nTipHeight = chainActive.Height();
+    for (auto it = m_coinbase_balance_by_height.rbegin(); it != m_coinbase_balance_by_height.rend() && nTipHeight - it->first + 1 <= COINBASE_MATURITY; ++it) {
+        if (nTipHeight - it->first + 1 >= min_depth) {
+            nTotal += it->second.Get(filter);
         }
     }
     return nTotal;
@@ -2244,112 +2589,269 @@ CAmount CWallet::GetAvailableBalance(const CCoinControl* coinControl) const
     return balance;
 }
 
-void CWallet::AvailableCoins(std::vector<COutput> &vCoins, bool fOnlySafe, const CCoinControl *coinControl, const CAmount &nMinimumAmount, const CAmount &nMaximumAmount, const CAmount &nMinimumSumAmount, const uint64_t nMaximumCount, const int nMinDepth, const int nMaxDepth) const
+void CWallet::IndexUTXO(const COutPoint& outpoint) const
 {
     AssertLockHeld(cs_main);
     AssertLockHeld(cs_wallet);
 
-    vCoins.clear();
-    CAmount nTotal = 0;
+    auto indexed = m_utxo_confirmed.find(outpoint);
+    if (indexed != m_utxo_confirmed.end()) {
+        AddToBalanceTotals(indexed->second, true, -1);
+        m_utxo_confirmed.erase(indexed);
+    }
+    indexed = m_utxo_unconfirmed.find(outpoint);
+    if (indexed != m_utxo_unconfirmed.end()) {
+        AddToBalanceTotals(indexed->second, false, -1);
+        m_utxo_unconfirmed.erase(indexed);
+    }
 
-    for (const auto& entry : mapWallet)
-    {
-        const uint256& wtxid = entry.first;
-        const CWalletTx* pcoin = &entry.second;
+    auto it = mapWallet.find(outpoint.hash);
+    if (it == mapWallet.end() || outpoint.n >= it->second.tx->vout.size())
+        return;
+    const CWalletTx& wtx = it->second;
 
-        if (!CheckFinalTx(*pcoin->tx))
-            continue;
+    int nDepth = wtx.GetDepthInMainChain();
+    if (nDepth < 0 || IsSpent(outpoint.hash, outpoint.n))
+        return;
 
-        if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-            continue;
+    const CTxOut& txout = wtx.tx->vout[outpoint.n];
+    WalletUTXO utxo;
+    utxo.mine = IsMine(txout);
+    if (utxo.mine == ISMINE_NO)
+        return;
+    utxo.solvable = IsSolvable(*this, txout.scriptPubKey);
+    utxo.nValue = txout.nValue;
+    utxo.fCoinBase = wtx.IsCoinBase();
+
+    if (nDepth == 0) {
+        utxo.fInMempool = wtx.InMempool();
+        utxo.fTrusted = wtx.IsTrusted();
+        m_utxo_unconfirmed.emplace(outpoint, utxo);
+    } else {
+        utxo.nHeight = chainActive.Height() - nDepth + 1;
+        m_utxo_confirmed.emplace(outpoint, utxo);
+    }
+    AddToBalanceTotals(utxo, nDepth > 0, 1);
+}
 
-        int nDepth = pcoin->GetDepthInMainChain();
-        if (nDepth < 0)
-            continue;
+void CWallet::AddToBalanceTotals(const WalletUTXO& utxo, bool fConfirmed, int sign) const
+{
+    AssertLockHeld(cs_wallet);
 
-        // We should not consider coins which aren't at least in our mempool
-        // It's possible for these to be conflicted via ancestors which we may never be able to detect
-        if (nDepth == 0 && !pcoin->InMempool())
-            continue;
+    auto add = [&utxo, sign](BalanceTotals& totals) {
+        totals.amount[utxo.mine] += sign * utxo.nValue;
+        totals.count += sign;
+    };
+    auto addAtHeight = [&add, &utxo](std::map<int, BalanceTotals>& byHeight) {
+        BalanceTotals& totals = byHeight[utxo.nHeight];
+        add(totals);
+        if (totals.count == 0) {
+            byHeight.erase(utxo.nHeight);
+        }
+    };
 
-        bool safeTx = pcoin->IsTrusted();
+    if (fConfirmed) {
+        add(m_balance_confirmed);
+        addAtHeight(m_balance_by_height);
+        if (utxo.fCoinBase) {
+            addAtHeight(m_coinbase_balance_by_height);
+        }
+    } else if (utxo.fTrusted) {
+        add(m_balance_trusted_unconfirmed);
+    } else if (utxo.fInMempool) {
+        add(m_balance_untrusted_unconfirmed);
+    }
+}
 
-        // We should not consider coins from transactions that are replacing
-        // other transactions.
-        //
-        // Example: There is a transaction A which is replaced by bumpfee
-        // transaction B. In this case, we want to prevent creation of
-        // a transaction B' which spends an output of B.
-        //
-        // Reason: If transaction A were initially confirmed, transactions B
-        // and B' would no longer be valid, so the user would have to create
-        // a new transaction C to replace B'. However, in the case of a
-        // one-block reorg, transactions B' and C might BOTH be accepted,
-        // when the user only wanted one of them. Specifically, there could
-        // be a 1-block reorg away from the chain where transactions A and C
-        // were accepted to another chain where B, B', and C were all
-        // accepted.
-        if (nDepth == 0 && pcoin->mapValue.count("replaces_txid")) {
-            safeTx = false;
-        }
-
-        // Similarly, we should not consider coins from transactions that
-        // have been replaced. In the example above, we would want to prevent
-        // creation of a transaction A' spending an output of A, because if
-        // transaction B were initially confirmed, conflicting with A and
-        // A', we wouldn't want to the user to create a transaction D
-        // intending to replace A', but potentially resulting in a scenario
-        // where A, A', and D could all be accepted (instead of just B and
-        // D, or just A and A' like the user would want).
-        if (nDepth == 0 && pcoin->mapValue.count("replaced_by_txid")) {
-            safeTx = false;
-        }
-
-        if (fOnlySafe && !safeTx) {
-            continue;
+void CWallet::SyncUTXOIndex() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (m_utxo_index_rebuild) {
+        m_utxo_confirmed.clear();
+        m_utxo_unconfirmed.clear();
+        m_utxo_index_pending.clear();
+        m_balance_confirmed = BalanceTotals();
+        m_balance_by_height.clear();
+        m_coinbase_balance_by_height.clear();
+        m_balance_trusted_unconfirmed = BalanceTotals();
+        m_balance_untrusted_unconfirmed = BalanceTotals();
+        for (const auto& entry : mapWallet) {
+            for (unsigned int i = 0; i < entry.second.tx->vout.size(); i++) {
+                IndexUTXO(COutPoint(entry.first, i));
+            }
+        }
+        m_utxo_index_rebuild = false;
+        m_utxo_index_tip = chainActive.Tip();
+        return;
+    }
+
+    // Whether a time-locked transaction is final depends on the tip
+    if (m_utxo_index_tip != chainActive.Tip()) {
+        for (const auto& entry : m_utxo_unconfirmed) {
+            auto it = mapWallet.find(entry.first.hash);
+            if (it != mapWallet.end() && it->second.tx->nLockTime != 0) {
+                m_utxo_index_pending.insert(entry.first.hash);
+            }
         }
+        m_utxo_index_tip = chainActive.Tip();
+    }
 
-        if (nDepth < nMinDepth || nDepth > nMaxDepth)
+    for (const uint256& hash : m_utxo_index_pending) {
+        auto it = mapWallet.find(hash);
+        if (it == mapWallet.end())
             continue;
+        const CWalletTx& wtx = it->second;
+        for (unsigned int i = 0; i < wtx.tx->vout.size(); i++) {
+            IndexUTXO(COutPoint(hash, i));
+        }
+        // The outputs it spends are spent, or released again if it was
+        // conflicted or abandoned
+        if (!wtx.IsCoinBase()) {
+            for (const CTxIn& txin : wtx.tx->vin) {
+                IndexUTXO(txin.prevout);
+            }
+        }
+        // Whether its unconfirmed spenders are trusted depends on it
+        for (auto spend = mapTxSpends.lower_bound(COutPoint(hash, 0)); spend != mapTxSpends.end() && spend->first.hash == hash; ++spend) {
+            auto spender = mapWallet.find(spend->second);
+            if (spender != mapWallet.end() && spender->second.GetDepthInMainChain() == 0) {
+                for (unsigned int i = 0; i < spender->second.tx->vout.size(); i++) {
+                    IndexUTXO(COutPoint(spend->second, i));
+                }
+            }
+        }
+    }
+    m_utxo_index_pending.clear();
+}
+
+void CWallet::AvailableCoins(std::vector<COutput> &vCoins, bool fOnlySafe, const CCoinControl *coinControl, const CAmount &nMinimumAmount, const CAmount &nMaximumAmount, const CAmount &nMinimumSumAmount, const uint64_t nMaximumCount, const int nMinDepth, const int nMaxDepth) const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    vCoins.clear();
+    CAmount nTotal = 0;
+
+    SyncUTXOIndex();
+    const int nTipHeight = chainActive.Height();
+
+    // Go through both buckets in outpoint order, which keeps the outputs of a
+    // transaction together and the order of a scan of mapWallet
+    auto itConfirmed = nMaxDepth >= 1 ? m_utxo_confirmed.cbegin() : m_utxo_confirmed.cend();
+    auto itUnconfirmed = nMinDepth <= 0 ? m_utxo_unconfirmed.cbegin() : m_utxo_unconfirmed.cend();
 
-        for (unsigned int i = 0; i < pcoin->tx->vout.size(); i++) {
-            if (pcoin->tx->vout[i].nValue < nMinimumAmount || pcoin->tx->vout[i].nValue > nMaximumAmount)
+    // Checks of the transaction of the previous output
+    const CWalletTx* pcoin = nullptr;
+    bool fSkipTx = false;
+    bool safeTx = false;
+
+    while (itConfirmed != m_utxo_confirmed.cend() || itUnconfirmed != m_utxo_unconfirmed.cend())
+    {
+        const bool fConfirmed = itUnconfirmed == m_utxo_unconfirmed.cend() || (itConfirmed != m_utxo_confirmed.cend() && itConfirmed->first < itUnconfirmed->first);
+        const COutPoint& outpoint = fConfirmed ? itConfirmed->first : itUnconfirmed->first;
+        const WalletUTXO& utxo = fConfirmed ? itConfirmed->second : itUnconfirmed->second;
+        if (fConfirmed) {
+            ++itConfirmed;
+        } else {
+            ++itUnconfirmed;
+        }
+
+        const int nDepth = fConfirmed ? nTipHeight - utxo.nHeight + 1 : 0;
+
+        if (pcoin == nullptr || pcoin->GetHash() != outpoint.hash) {
+            auto it = mapWallet.find(outpoint.hash);
+            if (it == mapWallet.end()) {
+                pcoin = nullptr;
                 continue;
+            }
+            pcoin = &it->second;
+            fSkipTx = true;
 
-            if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected(COutPoint(entry.first, i)))
+            if (!CheckFinalTx(*pcoin->tx))
                 continue;
 
-            if (IsLockedCoin(entry.first, i))
+            if (pcoin->IsCoinBase() && nDepth <= COINBASE_MATURITY)
                 continue;
 
-            if (IsSpent(wtxid, i))
+            // We should not consider coins which aren't at least in our mempool
+            // It's possible for these to be conflicted via ancestors which we may never be able to detect
+            if (nDepth == 0 && !pcoin->InMempool())
                 continue;
 
-            isminetype mine = IsMine(pcoin->tx->vout[i]);
+            safeTx = nDepth > 0 || pcoin->IsTrusted();
+
+            // We should not consider coins from transactions that are replacing
+            // other transactions.
+            //
+            // Example: There is a transaction A which is replaced by bumpfee
+            // transaction B. In this case, we want to prevent creation of
+            // a transaction B' which spends an output of B.
+            //
+            // Reason: If transaction A were initially confirmed, transactions B
+            // and B' would no longer be valid, so the user would have to create
+            // a new transaction C to replace B'. However, in the case of a
+            // one-block reorg, transactions B' and C might BOTH be accepted,
+            // when the user only wanted one of them. Specifically, there could
+            // be a 1-block reorg away from the chain where transactions A and C
+            // were accepted to another chain where B, B', and C were all
+            // accepted.
+            if (nDepth == 0 && pcoin->mapValue.count("replaces_txid")) {
+                safeTx = false;
+            }
+
+            // Similarly, we should not consider coins from transactions that
+            // have been replaced. In the example above, we would want to prevent
+            // creation of a transaction A' spending an output of A, because if
+            // transaction B were initially confirmed, conflicting with A and
+            // A', we wouldn't want to the user to create a transaction D
+            // intending to replace A', but potentially resulting in a scenario
+            // where A, A', and D could all be accepted (instead of just B and
+            // D, or just A and A' like the user would want).
+            if (nDepth == 0 && pcoin->mapValue.count("replaced_by_txid")) {
+                safeTx = false;
+            }
 
-            if (mine == ISMINE_NO) {
+            if (fOnlySafe && !safeTx) {
                 continue;
             }
 
-            bool solvable = IsSolvable(*this, pcoin->tx->vout[i].scriptPubKey);
-            bool spendable = ((mine & ISMINE_SPENDABLE) != ISMINE_NO) || (((mine & ISMINE_WATCH_ONLY) != ISMINE_NO) && (coinControl && coinControl->fAllowWatchOnly && solvable));
+            if (nDepth < nMinDepth || nDepth > nMaxDepth)
+                continue;
+
+            fSkipTx = false;
+        }
+        if (pcoin == nullptr || fSkipTx)
+            continue;
+
+        const CTxOut& txout = pcoin->tx->vout[outpoint.n];
+        if (txout.nValue < nMinimumAmount || txout.nValue > nMaximumAmount)
+            continue;
 
-            vCoins.push_back(COutput(pcoin, i, nDepth, spendable, solvable, safeTx, (coinControl && coinControl->fAllowWatchOnly)));
+        if (coinControl && coinControl->HasSelected() && !coinControl->fAllowOtherInputs && !coinControl->IsSelected(outpoint))
+            continue;
 
-            // Checks the sum amount of all UTXO's.
-            if (nMinimumSumAmount != MAX_MONEY) {
-                nTotal += pcoin->tx->vout[i].nValue;
+        if (IsLockedCoin(outpoint.hash, outpoint.n))
+            continue;
 
-                if (nTotal >= nMinimumSumAmount) {
-                    return;
-                }
-            }
+        bool spendable = ((utxo.mine & ISMINE_SPENDABLE) != ISMINE_NO) || (((utxo.mine & ISMINE_WATCH_ONLY) != ISMINE_NO) && (coinControl && coinControl->fAllowWatchOnly && utxo.solvable));
+
+        vCoins.push_back(COutput(pcoin, outpoint.n, nDepth, spendable, utxo.solvable, safeTx, (coinControl && coinControl->fAllowWatchOnly)));
 
-            // Checks the maximum number of UTXO's.
-            if (nMaximumCount > 0 && vCoins.size() >= nMaximumCount) {
+        // Checks the sum amount of all UTXO's.
+        if (nMinimumSumAmount != MAX_MONEY) {
+            nTotal += txout.nValue;
+
+            if (nTotal >= nMinimumSumAmount) {
                 return;
             }
         }
+
+        // Checks the maximum number of UTXO's.
+        if (nMaximumCount > 0 && vCoins.size() >= nMaximumCount) {
+            return;
+        }
     }
 }
 
@@ -2416,51 +2918,41 @@ const CTxOut& CWallet::FindNonChangeParentOutput(const CTransaction& tx, int out
     return ptx->vout[n];
 }
 
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const CoinEligibilityFilter& eligibility_filter, std::vector<OutputGroup> groups,
-                                 std::set<CInputCoin>& setCoinsRet, CAmount& nValueRet, const CoinSelectionParams& coin_selection_params, bool& bnb_used) const
+//! Fee rate expected for spending outputs in the long run, which the BnB waste metric compares against
+static CFeeRate GetLongTermFeeRate(const CWallet& wallet)
+{
+    FeeCalculation feeCalc;
+    CCoinControl temp;
+    temp.m_confirm_target = 1008;
+    return GetMinimumFeeRate(wallet, temp, ::mempool, ::feeEstimator, &feeCalc);
+}
+
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const CoinEligibilityFilter& eligibility_filter, const std::vector<OutputGroup>& groups,
+                                 std::set<CInputCoin>& setCoinsRet, CAmount& nValueRet, const CoinSelectionParams& coin_selection_params, bool& bnb_used,
+                                 const EffectiveValueIndex* bnb_index) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
 
-    std::vector<OutputGroup> utxo_pool;
     if (coin_selection_params.use_bnb) {
-        // Get long term estimate
-        FeeCalculation feeCalc;
-        CCoinControl temp;
-        temp.m_confirm_target = 1008;
-        CFeeRate long_term_feerate = GetMinimumFeeRate(*this, temp, ::mempool, ::feeEstimator, &feeCalc);
-
         // Calculate cost of change
         CAmount cost_of_change = GetDiscardRate(*this, ::feeEstimator).GetFee(coin_selection_params.change_spend_size) + coin_selection_params.effective_fee.GetFee(coin_selection_params.change_output_size);
 
-        // Filter by the min conf specs and add to utxo_pool and calculate effective value
-        for (OutputGroup& group : groups) {
-            if (!group.EligibleForSpending(eligibility_filter)) continue;
-
-            group.fee = 0;
-            group.long_term_fee = 0;
-            group.effective_value = 0;
-            for (auto it = group.m_outputs.begin(); it != group.m_outputs.end(); ) {
-                const CInputCoin& coin = *it;
-                CAmount effective_value = coin.txout.nValue - (coin.m_input_bytes < 0 ? 0 : coin_selection_params.effective_fee.GetFee(coin.m_input_bytes));
-                // Only include outputs that are positive effective value (i.e. not dust)
-                if (effective_value > 0) {
-                    group.fee += coin.m_input_bytes < 0 ? 0 : coin_selection_params.effective_fee.GetFee(coin.m_input_bytes);
-                    group.long_term_fee += coin.m_input_bytes < 0 ? 0 : long_term_feerate.GetFee(coin.m_input_bytes);
-                    group.effective_value += effective_value;
-                    ++it;
-                } else {
-                    it = group.Discard(coin);
-                }
-            }
-            if (group.effective_value > 0) utxo_pool.push_back(group);
+        // Calculate effective values and sort by them, unless the caller already did
+        std::unique_ptr<EffectiveValueIndex> own_index;
+        if (!bnb_index) {
+            own_index = MakeUnique<EffectiveValueIndex>(groups, coin_selection_params.effective_fee, GetLongTermFeeRate(*this));
+            bnb_index = own_index.get();
         }
+
         // Calculate the fees for things that aren't inputs
         CAmount not_input_fees = coin_selection_params.effective_fee.GetFee(coin_selection_params.tx_noinputs_size);
         bnb_used = true;
-        return SelectCoinsBnB(utxo_pool, nTargetValue, cost_of_change, setCoinsRet, nValueRet, not_input_fees);
+        // Filter by the min conf specs
+        return SelectCoinsBnB(bnb_index->GetEligible(eligibility_filter), nTargetValue, cost_of_change, setCoinsRet, nValueRet, not_input_fees);
     } else {
         // Filter by the min conf specs and add to utxo_pool
+        std::vector<OutputGroup> utxo_pool;
         for (const OutputGroup& group : groups) {
             if (!group.EligibleForSpending(eligibility_filter)) continue;
             utxo_pool.push_back(group);
@@ -2470,6 +2962,28 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, const CoinEligibil
     }
 }
 
+//! The eligibility filters coin selection tries in turn, from the most to the least conservative
+static std::vector<CoinEligibilityFilter> GetEligibilityFilters(bool spend_zero_conf_change)
+{
+    size_t max_ancestors = (size_t)std::max<int64_t>(1, gArgs.GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT));
+    size_t max_descendants = (size_t)std::max<int64_t>(1, gArgs.GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT));
+    bool fRejectLongChains = gArgs.GetBoolArg("-walletrejectlongchains", DEFAULT_WALLET_REJECT_LONG_CHAINS);
+
+    std::vector<CoinEligibilityFilter> filters;
+    filters.emplace_back(1, 6, 0);
+    filters.emplace_back(1, 1, 0);
+    if (spend_zero_conf_change) {
+        filters.emplace_back(0, 1, 2);
+        filters.emplace_back(0, 1, std::min((size_t)4, max_ancestors/3), std::min((size_t)4, max_descendants/3));
+        filters.emplace_back(0, 1, max_ancestors/2, max_descendants/2);
+        filters.emplace_back(0, 1, max_ancestors-1, max_descendants-1);
+        if (!fRejectLongChains) {
+            filters.emplace_back(0, 1, std::numeric_limits<uint64_t>::max());
+        }
+    }
+    return filters;
+}
+
 bool CWallet::SelectCoins(const std::vector<COutput>& vAvailableCoins, const CAmount& nTargetValue, std::set<CInputCoin>& setCoinsRet, CAmount& nValueRet, const CCoinControl& coin_control, CoinSelectionParams& coin_selection_params, bool& bnb_used) const
 {
     std::vector<COutput> vCoins(vAvailableCoins);
@@ -2535,18 +3049,17 @@ bool CWallet::SelectCoins(const std::vector<COutput>& vAvailableCoins, const CAm
     }
     std::vector<OutputGroup> groups = GroupOutputs(vCoins, !coin_control.m_avoid_partial_spends);
 
-    size_t max_ancestors = (size_t)std::max<int64_t>(1, gArgs.GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT));
-    size_t max_descendants = (size_t)std::max<int64_t>(1, gArgs.GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT));
-    bool fRejectLongChains = gArgs.GetBoolArg("-walletrejectlongchains", DEFAULT_WALLET_REJECT_LONG_CHAINS);
+    // Effective values only depend on the fee rates, so compute and sort them once for all the passes below
+    std::unique_ptr<EffectiveValueIndex> bnb_index;
+    if (coin_selection_params.use_bnb) {
+        bnb_index = MakeUnique<EffectiveValueIndex>(groups, coin_selection_params.effective_fee, GetLongTermFeeRate(*this));
+    }
 
-    bool res = nTargetValue <= nValueFromPresetInputs ||
-        SelectCoinsMinConf(nTargetValue - nValueFromPresetInputs, CoinEligibilityFilter(1, 6, 0), groups, setCoinsRet, nValueRet, coin_selection_params, bnb_used) ||
-        SelectCoinsMinConf(nTargetValue - nValueFromPresetInputs, CoinEligibilityFilter(1, 1, 0), groups, setCoinsRet, nValueRet, coin_selection_params, bnb_used) ||
-        (m_spend_zero_conf_change && SelectCoinsMinConf(nTargetValue - nValueFromPresetInputs, CoinEligibilityFilter(0, 1, 2), groups, setCoinsRet, nValueRet, coin_selection_params, bnb_used)) ||
-        (m_spend_zero_conf_change && SelectCoinsMinConf(nTargetValue - nValueFromPresetInputs, CoinEligibilityFilter(0, 1, std::min((size_t)4, max_ancestors/3), std::min((size_t)4, max_descendants/3)), groups, setCoinsRet, nValueRet, coin_selection_params, bnb_used)) ||
-        (m_spend_zero_conf_change && SelectCoinsMinConf(nTargetValue - nValueFromPresetInputs, CoinEligibilityFilter(0, 1, max_ancestors/2, max_descendants/2), groups, setCoinsRet, nValueRet, coin_selection_params, bnb_used)) ||
-        (m_spend_zero_conf_change && SelectCoinsMinConf(nTargetValue - nValueFromPresetInputs, CoinEligibilityFilter(0, 1, max_ancestors-1, max_descendants-1), groups, setCoinsRet, nValueRet, coin_selection_params, bnb_used)) ||
-        (m_spend_zero_conf_change && !fRejectLongChains && SelectCoinsMinConf(nTargetValue - nValueFromPresetInputs, CoinEligibilityFilter(0, 1, std::numeric_limits<uint64_t>::max()), groups, setCoinsRet, nValueRet, coin_selection_params, bnb_used));
+    bool res = nTargetValue <= nValueFromPresetInputs;
+    for (const CoinEligibilityFilter& eligibility_filter : GetEligibilityFilters(m_spend_zero_conf_change)) {
+        if (res) break;
+        res = SelectCoinsMinConf(nTargetValue - nValueFromPresetInputs, eligibility_filter, groups, setCoinsRet, nValueRet, coin_selection_params, bnb_used, bnb_index.get());
+    }
 
     // because SelectCoinsMinConf clears the setCoinsRet, we now add the possible inputs to the coinset
     util::insert(setCoinsRet, setPresetCoins);
@@ -2662,32 +3175,8 @@ OutputType CWallet::TransactionChangeType(OutputType change_type, const std::vec
     return m_default_address_type;
 }
 
-bool CWallet::CreateTransaction(const std::vector<CRecipient>& vecSend, CTransactionRef& tx, CReserveKey& reservekey, CAmount& nFeeRet,
-                         int& nChangePosInOut, std::string& strFailReason, const CCoinControl& coin_control, bool sign, bool fWriteLog)
+static uint32_t GetLocktimeForNewTransaction()
 {
-    CAmount nValue = 0;
-    int nChangePosRequest = nChangePosInOut;
-    unsigned int nSubtractFeeFromAmount = 0;
-    for (const auto& recipient : vecSend)
-    {
-        if (nValue < 0 || recipient.nAmount < 0)
-        {
-            strFailReason = _("Transaction amounts must not be negative");
-            return false;
-        }
-        nValue += recipient.nAmount;
-
-        if (recipient.fSubtractFeeFromAmount)
-            nSubtractFeeFromAmount++;
-    }
-    if (vecSend.empty())
-    {
-        strFailReason = _("Transaction must have at least one recipient");
-        return false;
-    }
-
-    CMutableTransaction txNew;
-
     // Discourage fee sniping.
     //
     // For a large miner the value of the transactions in the best block and
@@ -2708,17 +3197,60 @@ bool CWallet::CreateTransaction(const std::vector<CRecipient>& vecSend, CTransac
     // enough, that fee sniping isn't a problem yet, but by implementing a fix
     // now we ensure code won't be written that makes assumptions about
     // nLockTime that preclude a fix later.
-    txNew.nLockTime = chainActive.Height();
+    uint32_t locktime = chainActive.Height();
 
     // Secondly occasionally randomly pick a nLockTime even further back, so
     // that transactions that are delayed after signing for whatever reason,
     // e.g. high-latency mix networks and some CoinJoin implementations, have
     // better privacy.
     if (GetRandInt(10) == 0)
-        txNew.nLockTime = std::max(0, (int)txNew.nLockTime - GetRandInt(100));
+        locktime = std::max(0, (int)locktime - GetRandInt(100));
+
+    assert(locktime <= (unsigned int)chainActive.Height());
+    assert(locktime < LOCKTIME_THRESHOLD);
+    return locktime;
+}
+
+static bool IsWithinMempoolChainLimits(const CTransactionRef& tx)
+{
+    LockPoints lp;
+    CTxMemPoolEntry entry(tx, 0, 0, 0, false, 0, lp);
+    CTxMemPool::setEntries setAncestors;
+    size_t nLimitAncestors = gArgs.GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+    size_t nLimitAncestorSize = gArgs.GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+    size_t nLimitDescendants = gArgs.GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+    size_t nLimitDescendantSize = gArgs.GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+    std::string errString;
+    LOCK(::mempool.cs);
+    return ::mempool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString);
+}
+
+bool CWallet::CreateTransaction(const std::vector<CRecipient>& vecSend, CTransactionRef& tx, CReserveKey& reservekey, CAmount& nFeeRet,
+                         int& nChangePosInOut, std::string& strFailReason, const CCoinControl& coin_control, bool sign, bool fWriteLog)
+{
+    CAmount nValue = 0;
+    int nChangePosRequest = nChangePosInOut;
+    unsigned int nSubtractFeeFromAmount = 0;
+    for (const auto& recipient : vecSend)
+    {
+        if (nValue < 0 || recipient.nAmount < 0)
+        {
+            strFailReason = _("Transaction amounts must not be negative");
+            return false;
+        }
+        nValue += recipient.nAmount;
+
+        if (recipient.fSubtractFeeFromAmount)
+            nSubtractFeeFromAmount++;
+    }
+    if (vecSend.empty())
+    {
+        strFailReason = _("Transaction must have at least one recipient");
+        return false;
+    }
 
-    assert(txNew.nLockTime <= (unsigned int)chainActive.Height());
-    assert(txNew.nLockTime < LOCKTIME_THRESHOLD);
+    CMutableTransaction txNew;
+    txNew.nLockTime = GetLocktimeForNewTransaction();
     FeeCalculation feeCalc;
     CAmount nFeeNeeded;
     int nBytes;
@@ -3026,21 +3558,10 @@ bool CWallet::CreateTransaction(const std::vector<CRecipient>& vecSend, CTransac
         }
     }
 
-    if (gArgs.GetBoolArg("-walletrejectlongchains", DEFAULT_WALLET_REJECT_LONG_CHAINS)) {
-        // Lastly, ensure this tx will pass the mempool's chain limits
-        LockPoints lp;
-        CTxMemPoolEntry entry(tx, 0, 0, 0, false, 0, lp);
-        CTxMemPool::setEntries setAncestors;
-        size_t nLimitAncestors = gArgs.GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
-        size_t nLimitAncestorSize = gArgs.GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
-        size_t nLimitDescendants = gArgs.GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
-        size_t nLimitDescendantSize = gArgs.GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
-        std::string errString;
-        LOCK(::mempool.cs);
-        if (!::mempool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
-            strFailReason = _("Transaction has too long of a mempool chain");
-            return false;
-        }
+    // Lastly, ensure this tx will pass the mempool's chain limits
+    if (gArgs.GetBoolArg("-walletrejectlongchains", DEFAULT_WALLET_REJECT_LONG_CHAINS) && !IsWithinMempoolChainLimits(tx)) {
+        strFailReason = _("Transaction has too long of a mempool chain");
+        return false;
     }
     if(fWriteLog){
         WalletLogPrintf("Fee Calculation: Fee:%d Bytes:%u Needed:%d Tgt:%d (requested %d) Reason:\"%s\" Decay %.5f: Estimation: (%g - %g) %.2f%% %.1f/(%.1f %d mem %.1f out) Fail: (%g - %g) %.2f%% %.1f/(%.1f %d mem %.1f out)\n",
@@ -3055,6 +3576,232 @@ bool CWallet::CreateTransaction(const std::vector<CRecipient>& vecSend, CTransac
     return true;
 }
 
+bool CWallet::CreateBatchTransaction(const std::vector<CRecipient>& vecSend, CTransactionRef& tx, CReserveKey& reservekey, CAmount& nFeeRet,
+                                     std::string& strFailReason, const CCoinControl& coin_control)
+{
+    CAmount nValue = 0;
+    for (const auto& recipient : vecSend) {
+        if (nValue < 0 || recipient.nAmount < 0) {
+            strFailReason = _("Transaction amounts must not be negative");
+            return false;
+        }
+        if (recipient.fSubtractFeeFromAmount) {
+            strFailReason = _("Subtracting the fee from the amount is not supported for batched payouts");
+            return false;
+        }
+        nValue += recipient.nAmount;
+    }
+    if (vecSend.empty()) {
+        strFailReason = _("Transaction must have at least one recipient");
+        return false;
+    }
+    if (coin_control.HasSelected()) {
+        strFailReason = _("Selected inputs are not supported for batched payouts");
+        return false;
+    }
+
+    CMutableTransaction txNew;
+    txNew.nLockTime = GetLocktimeForNewTransaction();
+
+    FeeCalculation feeCalc;
+    std::vector<CInputCoin> selected_coins;
+    int nBytes;
+    LOCK2(cs_main, cs_wallet);
+    {
+        CScript scriptChange;
+        if (!boost::get<CNoDestination>(&coin_control.destChange)) {
+            scriptChange = GetScriptForDestination(coin_control.destChange);
+        } else {
+            if (IsWalletFlagSet(WALLET_FLAG_DISABLE_PRIVATE_KEYS)) {
+                strFailReason = _("Can't generate a change-address key. Private keys are disabled for this wallet.");
+                return false;
+            }
+            CPubKey vchPubKey;
+            if (!reservekey.GetReservedKey(vchPubKey, true)) {
+                strFailReason = _("Keypool ran out, please call keypoolrefill first");
+                return false;
+            }
+            const OutputType change_type = TransactionChangeType(coin_control.m_change_type ? *coin_control.m_change_type : m_default_change_type, vecSend);
+            LearnRelatedScripts(vchPubKey, change_type);
+            scriptChange = GetScriptForDestination(GetDestinationForKey(vchPubKey, change_type));
+        }
+        const CTxOut change_prototype_txout(0, scriptChange);
+        const int change_output_size = GetSerializeSize(change_prototype_txout, SER_DISK, 0);
+        const CFeeRate discard_rate = GetDiscardRate(*this, ::feeEstimator);
+
+        // Unlike CreateTransaction, which re-selects and re-sizes the whole
+        // transaction until the fee converges, the fee rate is looked up once
+        // and the size is kept up to date as outputs and inputs are added.
+        const CFeeRate fee_rate = GetMinimumFeeRate(*this, coin_control, ::mempool, ::feeEstimator, &feeCalc);
+        if (feeCalc.reason == FeeReason::FALLBACK && !m_allow_fallback_fee) {
+            strFailReason = _("Fee estimation failed. Fallbackfee is disabled. Wait a few blocks or enable -fallbackfee.");
+            return false;
+        }
+
+        // 4 nVersion, 4 nLockTime, 1 witness overhead (dummy, flag, stack size) and the output count
+        int nNoInputsBytes = 9 + GetSizeOfCompactSize(vecSend.size() + 1);
+        for (const auto& recipient : vecSend) {
+            CTxOut txout(recipient.nAmount, recipient.scriptPubKey);
+            if (IsDust(txout, ::dustRelayFee)) {
+                strFailReason = _("Transaction amount too small");
+                return false;
+            }
+            nNoInputsBytes += ::GetSerializeSize(txout, SER_NETWORK, PROTOCOL_VERSION);
+            txNew.vout.push_back(txout);
+        }
+
+        std::vector<COutput> vAvailableCoins;
+        AvailableCoins(vAvailableCoins, true, &coin_control);
+        std::vector<COutput> vCoins;
+        for (const COutput& out : vAvailableCoins) {
+            // The size of every input has to be known up front
+            if (out.fSpendable && out.nInputBytes >= 0) vCoins.push_back(out);
+        }
+        const EffectiveValueIndex index(GroupOutputs(vCoins, !coin_control.m_avoid_partial_spends), fee_rate, GetLongTermFeeRate(*this));
+        const CAmount cost_of_change = discard_rate.GetFee(CalculateMaximumSignedInputSize(change_prototype_txout, this)) + fee_rate.GetFee(change_output_size);
+
+        CAmount nValueIn = 0;
+        CAmount nChange = 0;
+        int nInputBytes = 0;
+        bool fChange = false;
+        bool fSelected = false;
+        for (const CoinEligibilityFilter& eligibility_filter : GetEligibilityFilters(m_spend_zero_conf_change)) {
+            const std::vector<const OutputGroup*> eligible = index.GetEligible(eligibility_filter);
+
+            // A changeless match first, as in CreateTransaction
+            std::set<CInputCoin> setCoins;
+            nValueIn = 0;
+            if (SelectCoinsBnB(eligible, nValue, cost_of_change, setCoins, nValueIn, fee_rate.GetFee(nNoInputsBytes + 1))) {
+                selected_coins.assign(setCoins.begin(), setCoins.end());
+                nInputBytes = 0;
+                for (const CInputCoin& coin : selected_coins) nInputBytes += coin.m_input_bytes;
+                nBytes = nNoInputsBytes + GetSizeOfCompactSize(selected_coins.size()) + nInputBytes;
+                if (nValueIn - nValue >= fee_rate.GetFee(nBytes)) {
+                    fChange = false;
+                    fSelected = true;
+                    break;
+                }
+            }
+
+            // Otherwise spend the largest coins until they pay for the
+            // outputs, the change and their own size
+            selected_coins.clear();
+            nValueIn = 0;
+            nInputBytes = 0;
+            for (const OutputGroup* group : eligible) {
+                for (const CInputCoin& coin : group->m_outputs) {
+                    selected_coins.push_back(coin);
+                    nValueIn += coin.txout.nValue;
+                    nInputBytes += coin.m_input_bytes;
+                }
+                nBytes = nNoInputsBytes + change_output_size + GetSizeOfCompactSize(selected_coins.size()) + nInputBytes;
+                if (nValueIn >= nValue + fee_rate.GetFee(nBytes)) {
+                    fSelected = true;
+                    break;
+                }
+            }
+            if (fSelected) {
+                nChange = nValueIn - nValue - fee_rate.GetFee(nBytes);
+                // Never create dust outputs; if we would, just add the dust to the fee.
+                fChange = !IsDust(CTxOut(nChange, scriptChange), discard_rate);
+                if (fChange) {
+                    txNew.vout.insert(txNew.vout.begin() + GetRandInt(txNew.vout.size() + 1), CTxOut(nChange, scriptChange));
+                } else {
+                    nChange = 0;
+                    nBytes -= change_output_size;
+                }
+                break;
+            }
+        }
+        if (!fSelected) {
+            strFailReason = _("Insufficient funds");
+            return false;
+        }
+        nFeeRet = nValueIn - nValue - nChange;
+
+        // Fail before signing anything. The size limit also bounds the
+        // hashing of non-witness inputs, which each hash the whole transaction.
+        if (nBytes * WITNESS_SCALE_FACTOR > (int)MAX_STANDARD_TX_WEIGHT) {
+            strFailReason = _("Transaction too large");
+            return false;
+        }
+        if (nFeeRet > maxTxFee) {
+            strFailReason = _("Fee exceeds maximum configured by -maxtxfee");
+            return false;
+        }
+
+        if (!fChange) reservekey.ReturnKey();
+
+        // Shuffle selected coins and fill in final vin
+        std::shuffle(selected_coins.begin(), selected_coins.end(), FastRandomContext());
+        const uint32_t nSequence = coin_control.m_signal_bip125_rbf.get_value_or(m_signal_rbf) ? MAX_BIP125_RBF_SEQUENCE : (CTxIn::SEQUENCE_FINAL - 1);
+        for (const auto& coin : selected_coins) {
+            txNew.vin.push_back(CTxIn(coin.outpoint, CScript(), nSequence));
+        }
+    }
+
+    // The inputs are signed in parallel. The keystore takes its own lock, and
+    // the transaction is only read until every signature is made. The hashes
+    // shared by the signatures of witness inputs are computed once instead of
+    // once per input.
+    const int64_t nStart = GetTimeMillis();
+    const PrecomputedTransactionData txdata(txNew, true /* force */);
+    std::vector<SignatureData> vSigData(selected_coins.size());
+    std::atomic<size_t> nSigned{0};
+    std::atomic<bool> fFailed{false};
+    auto sign_range = [&](size_t begin, size_t end) {
+        for (size_t nIn = begin; nIn < end && !fFailed; ++nIn) {
+            const CTxOut& txout = selected_coins[nIn].txout;
+            if (!ProduceSignature(*this, MutableTransactionSignatureCreator(&txNew, nIn, txout.nValue, SIGHASH_ALL, &txdata), txout.scriptPubKey, vSigData[nIn])) {
+                fFailed = true;
+            }
+            ++nSigned;
+        }
+    };
+
+    const std::string strProgress = strprintf("%s " + _("Signing transaction..."), GetDisplayName());
+    ShowProgress(strProgress, 0);
+    const size_t nThreads = std::max(1, std::min(GetNumCores(), MAX_BATCH_SIGNING_THREADS));
+    const size_t nPerThread = (selected_coins.size() + nThreads - 1) / nThreads;
+    std::vector<std::future<void>> vSigning;
+    for (size_t i = 0; i < selected_coins.size(); i += nPerThread) {
+        vSigning.push_back(std::async(std::launch::async, sign_range, i, std::min(selected_coins.size(), i + nPerThread)));
+    }
+    for (std::future<void>& signing : vSigning) {
+        while (signing.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready) {
+            ShowProgress(strProgress, std::max(1, std::min(99, (int)(nSigned * 100 / selected_coins.size()))));
+        }
+        signing.get();
+    }
+    ShowProgress(strProgress, 100);
+    if (fFailed) {
+        strFailReason = _("Signing transaction failed");
+        return false;
+    }
+    for (size_t nIn = 0; nIn < selected_coins.size(); ++nIn) {
+        UpdateInput(txNew.vin[nIn], vSigData[nIn]);
+    }
+
+    tx = MakeTransactionRef(std::move(txNew));
+
+    // The size was estimated for the largest signatures, so this only catches
+    // scripts whose size was misjudged
+    if (GetTransactionWeight(*tx) > MAX_STANDARD_TX_WEIGHT) {
+        strFailReason = _("Transaction too large");
+        return false;
+    }
+
+    if (gArgs.GetBoolArg("-walletrejectlongchains", DEFAULT_WALLET_REJECT_LONG_CHAINS) && !IsWithinMempoolChainLimits(tx)) {
+        strFailReason = _("Transaction has too long of a mempool chain");
+        return false;
+    }
+
+    WalletLogPrintf("CreateBatchTransaction: %u outputs, %u inputs signed in %dms on %u threads, Fee:%d Bytes:%u Tgt:%d (requested %d) Reason:\"%s\"\n",
+        tx->vout.size(), tx->vin.size(), GetTimeMillis() - nStart, vSigning.size(), nFeeRet, nBytes,
+        feeCalc.returnedTarget, feeCalc.desiredTarget, StringForFeeReason(feeCalc.reason));
+    return true;
+}
+
 /**
  * Call after CreateTransaction unless you want to abort
  */
@@ -4011,7 +4758,17 @@ bool CWallet::Verify(std::string wallet_file, bool salvage_wallet, std::string&
         }
     }
 
-    return WalletBatch::VerifyDatabaseFile(wallet_path, warning_string, error_string);
+    if (!WalletBatch::VerifyDatabaseFile(wallet_path, warning_string, error_string)) {
+        return false;
+    }
+
+    if (gArgs.GetBoolArg("-walletlogdb", DEFAULT_WALLET_LOGDB)) {
+        std::string backup_filename;
+        if (!WalletBatch::MigrateToLog(wallet_path, backup_filename, error_string)) {
+            return false;
+        }
+    }
+    return true;
 }
 
 std::shared_ptr<CWallet> CWallet::CreateWalletFromFile(const std::string& name, const fs::path& path, uint64_t wallet_creation_flags)
@@ -4517,7 +5274,10 @@ bool CWalletTx::AcceptToMemoryPool(const CAmount& nAbsurdFee, CValidationState&
     // unavailable as we're not yet aware that it is in the mempool.
     bool ret = ::AcceptToMemoryPool(mempool, state, tx, nullptr /* pfMissingInputs */,
                                 nullptr /* plTxnReplaced */, false /* bypass_limits */, nAbsurdFee);
-    fInMempool |= ret;
+    if (ret && !fInMempool) {
+        fInMempool = true;
+        pwallet->MarkUTXOIndexPending(GetHash());
+    }
     return ret;
 }
 
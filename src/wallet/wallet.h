@@ -30,6 +30,7 @@
 #include <stdexcept>
 #include <stdint.h>
 #include <string>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -61,6 +62,14 @@ static const bool DEFAULT_AVOIDPARTIALSPENDS = false;
 static const unsigned int DEFAULT_TX_CONFIRM_TARGET = 6;
 //! -walletrbf default
 static const bool DEFAULT_WALLET_RBF = false;
+//! Number of blocks a rescan reads and matches ahead of committing them to the wallet
+static const int RESCAN_CHUNK_BLOCKS = 32;
+//! Maximum number of threads matching prefetched blocks against the wallet during a rescan
+static const int MAX_RESCAN_MATCH_THREADS = 4;
+//! Maximum number of threads signing the inputs of a batched payout transaction
+static const int MAX_BATCH_SIGNING_THREADS = 4;
+//! Default maximum number of payouts in one transaction made by sendpayouts
+static const int DEFAULT_PAYOUT_BATCH_MAX_OUTPUTS = 1000;
 static const bool DEFAULT_WALLETBROADCAST = true;
 static const bool DEFAULT_DISABLE_WALLET = false;
 
@@ -75,6 +84,21 @@ class CWalletTx;
 struct FeeCalculation;
 enum class FeeEstimateMode;
 
+/** Hasher for the wallet's set of scriptPubKeys, salted so that outputs cannot be made to collide */
+class SaltedScriptHasher
+{
+private:
+    /** Salt */
+    const uint64_t k0, k1;
+
+public:
+    SaltedScriptHasher();
+
+    size_t operator()(const CScript& script) const;
+};
+
+typedef std::unordered_set<CScript, SaltedScriptHasher> ScriptPubKeySet;
+
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
 {
@@ -669,6 +693,24 @@ private:
     std::atomic<bool> fScanningWallet{false}; // controlled by WalletRescanReserver
     std::mutex mutexScanning;
     friend class WalletRescanReserver;
+    //! Bumped whenever keys, scripts or watch-only scripts are added or removed,
+    //! so that rescans can tell a block was matched against an older keystore.
+    std::atomic<uint64_t> m_keystore_generation{0};
+
+    //! GetScriptPubKeys(), extended as keys and scripts are added and rebuilt
+    //! when a watch-only script is removed. IsMine(const CTxOut&) rejects any
+    //! output not in it with a single lookup.
+    ScriptPubKeySet m_script_pubkeys GUARDED_BY(cs_KeyStore);
+    //! Copy of m_script_pubkeys handed out by GetScriptPubKeySnapshot(), dropped when it changes
+    mutable std::shared_ptr<const ScriptPubKeySet> m_script_pubkeys_snapshot GUARDED_BY(cs_KeyStore);
+
+    //! Add scripts to m_script_pubkeys and bump the keystore generation.
+    void AddScriptPubKeys(const std::vector<CScript>& scripts);
+    //! Add the scriptPubKeys of a key, and of the scripts the keystore learns along with it.
+    void AddScriptPubKeysForKey(const CPubKey& pubkey);
+    void AddScriptPubKeysForWatchOnly(const CScript& dest);
+    //! Rebuild m_script_pubkeys from scratch after something was removed from the keystore.
+    void RebuildScriptPubKeys();
 
     WalletBatch *encrypted_batch = nullptr;
 
@@ -692,6 +734,68 @@ private:
     void AddToSpends(const COutPoint& outpoint, const uint256& wtxid);
     void AddToSpends(const uint256& wtxid);
 
+    /** An output in the wallet UTXO index */
+    struct WalletUTXO
+    {
+        int nHeight = 0; //!< height of the block containing the transaction, if confirmed
+        CAmount nValue = 0;
+        isminetype mine = ISMINE_NO;
+        bool solvable = false;
+        bool fCoinBase = false;
+        bool fInMempool = false; //!< for unconfirmed outputs
+        bool fTrusted = false; //!< for unconfirmed outputs, whether IsTrusted
+    };
+
+    /** Sum of the values of outputs in the UTXO index, by isminetype */
+    struct BalanceTotals
+    {
+        CAmount amount[ISMINE_ALL + 1] = {};
+        int count = 0;
+
+        CAmount Get(const isminefilter& filter) const
+        {
+            return ((filter & ISMINE_WATCH_ONLY) ? amount[ISMINE_WATCH_ONLY] : 0) + ((filter & ISMINE_SPENDABLE) ? amount[ISMINE_SPENDABLE] : 0);
+        }
+    };
+
+    /**
+     * Outputs of wallet transactions that are mine, unspent and not
+     * conflicted, by whether their transaction is confirmed, so that
+     * AvailableCoins does not have to go through mapWallet. The depth of a
+     * confirmed output follows from the tip height.
+     *
+     * Transactions whose state changed are queued in m_utxo_index_pending
+     * and indexed again, with the outputs they spend, on the next use.
+     * Changes that can affect any transaction (new keys) set
+     * m_utxo_index_rebuild instead.
+     *
+     * The balances are running totals of the index: confirmed outputs in all
+     * and by block height, so that recent and immature ones can be taken out
+     * for the current tip, and unconfirmed outputs of trusted and of other
+     * transactions in the mempool. Whether an unconfirmed transaction is
+     * trusted also depends on CheckFinalTx, so time-locked ones are indexed
+     * again whenever the tip has moved since m_utxo_index_tip.
+     */
+    mutable std::map<COutPoint, WalletUTXO> m_utxo_confirmed;
+    mutable std::map<COutPoint, WalletUTXO> m_utxo_unconfirmed;
+    mutable std::set<uint256> m_utxo_index_pending;
+    mutable bool m_utxo_index_rebuild = true;
+    mutable const CBlockIndex* m_utxo_index_tip = nullptr;
+    mutable BalanceTotals m_balance_confirmed;
+    mutable std::map<int, BalanceTotals> m_balance_by_height;
+    mutable std::map<int, BalanceTotals> m_coinbase_balance_by_height;
+    mutable BalanceTotals m_balance_trusted_unconfirmed;
+    mutable BalanceTotals m_balance_untrusted_unconfirmed;
+
+    /** Update the UTXO index entry of an output */
+    void IndexUTXO(const COutPoint& outpoint) const EXCLUSIVE_LOCKS_REQUIRED(cs_main, cs_wallet);
+    /** Add (sign 1) or remove (sign -1) an indexed output from the balance totals */
+    void AddToBalanceTotals(const WalletUTXO& utxo, bool fConfirmed, int sign) const EXCLUSIVE_LOCKS_REQUIRED(cs_wallet);
+    /** Sum of immature coinbase outputs with at least min_depth confirmations */
+    CAmount GetImmatureTotal(const isminefilter& filter, int min_depth) const EXCLUSIVE_LOCKS_REQUIRED(cs_main, cs_wallet);
+    /** Bring the UTXO index up to date */
+    void SyncUTXOIndex() const EXCLUSIVE_LOCKS_REQUIRED(cs_main, cs_wallet);
+
     /**
      * Add a transaction to the wallet, or update it.  pIndex and posInBlock should
      * be set when the transaction was known to be included in a block.  When
@@ -719,6 +823,11 @@ private:
      * Should be called with pindexBlock and posInBlock if this is for a transaction that is included in a block. */
     void SyncTransaction(const CTransactionRef& tx, const CBlockIndex *pindex = nullptr, int posInBlock = 0, bool update_tx = true) EXCLUSIVE_LOCKS_REQUIRED(cs_wallet);
 
+    /* Whether a block transaction none of whose outputs are ours can still affect
+     * the wallet: it is already in the wallet, spends a wallet transaction or
+     * conflicts with one. Used by ScanForWalletTransactions to skip SyncTransaction. */
+    bool SpendsOrConflictsWithWallet(const CTransaction& tx) const EXCLUSIVE_LOCKS_REQUIRED(cs_wallet);
+
     /* the HD chain data model (external chain counters) */
     CHDChain hdChain;
 
@@ -857,10 +966,12 @@ public:
      * Shuffle and select coins until nTargetValue is reached while avoiding
      * small change; This method is stochastic for some inputs and upon
      * completion the coin set and corresponding actual target value is
-     * assembled
+     * assembled. Branch and Bound selects from bnb_index instead of groups
+     * when it is given.
      */
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, const CoinEligibilityFilter& eligibility_filter, std::vector<OutputGroup> groups,
-        std::set<CInputCoin>& setCoinsRet, CAmount& nValueRet, const CoinSelectionParams& coin_selection_params, bool& bnb_used) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, const CoinEligibilityFilter& eligibility_filter, const std::vector<OutputGroup>& groups,
+        std::set<CInputCoin>& setCoinsRet, CAmount& nValueRet, const CoinSelectionParams& coin_selection_params, bool& bnb_used,
+        const EffectiveValueIndex* bnb_index = nullptr) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
     std::vector<OutputGroup> GroupOutputs(const std::vector<COutput>& outputs, bool single_coin) const;
@@ -877,6 +988,22 @@ public:
     void AbortRescan() { fAbortRescan = true; }
     bool IsAbortingRescan() { return fAbortRescan; }
     bool IsScanning() { return fScanningWallet; }
+    uint64_t GetKeystoreGeneration() const { return m_keystore_generation; }
+
+    /**
+     * All scriptPubKeys IsMine can accept for the keys (keypool included),
+     * scripts and watch-only scripts in the keystore. This is a superset of
+     * the scripts IsMine accepts: it does not check what a P2SH or P2WSH
+     * script wraps.
+     */
+    std::set<CScript> GetScriptPubKeys() const;
+
+    /**
+     * The same scripts as of keystore generation generation_out, as a copy
+     * that can be matched against without taking cs_KeyStore. The copy is
+     * shared until the keystore changes.
+     */
+    std::shared_ptr<const ScriptPubKeySet> GetScriptPubKeySnapshot(uint64_t& generation_out) const;
 
     /**
      * keystore implementation
@@ -887,7 +1014,7 @@ public:
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey) override EXCLUSIVE_LOCKS_REQUIRED(cs_wallet);
     bool AddKeyPubKeyWithDB(WalletBatch &batch,const CKey& key, const CPubKey &pubkey) EXCLUSIVE_LOCKS_REQUIRED(cs_wallet);
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
+    bool LoadKey(const CKey& key, const CPubKey &pubkey);
     //! Load metadata (used by LoadWallet)
     void LoadKeyMetadata(const CKeyID& keyID, const CKeyMetadata &metadata) EXCLUSIVE_LOCKS_REQUIRED(cs_wallet);
     void LoadScriptMetadata(const CScriptID& script_id, const CKeyMetadata &metadata) EXCLUSIVE_LOCKS_REQUIRED(cs_wallet);
@@ -948,6 +1075,8 @@ public:
     CBlockIndex* ScanForWalletTransactions(CBlockIndex* pindexStart, CBlockIndex* pindexStop, const WalletRescanReserver& reserver, bool fUpdate = false);
     void TransactionRemovedFromMempool(const CTransactionRef &ptx) override;
     void ReacceptWalletTransactions();
+    /** Queue a transaction for the UTXO index after its mempool state was set other than by a notification */
+    void MarkUTXOIndexPending(const uint256& hash) const;
     void ResendWalletTransactions(int64_t nBestBlockTime, CConnman* connman) override;
     // ResendWalletTransactionsBefore may only be called if fBroadcastTransactions!
     std::vector<uint256> ResendWalletTransactionsBefore(int64_t nTime, CConnman* connman);
@@ -975,6 +1104,19 @@ public:
      */
     bool CreateTransaction(const std::vector<CRecipient>& vecSend, CTransactionRef& tx, CReserveKey& reservekey, CAmount& nFeeRet, int& nChangePosInOut,
                            std::string& strFailReason, const CCoinControl& coin_control, bool sign = true, bool fWriteLog = true);
+    /**
+     * Create a signed transaction paying many recipients in one pass: the fee
+     * rate is looked up and the coins are selected once, with the size added
+     * up as outputs and inputs are added, and the inputs are signed in
+     * parallel. The sender pays the fee, which is not subtracted from any
+     * recipient. Signing progress is shown through ShowProgress.
+     *
+     * Only witness inputs share the precomputed signature hashes; each
+     * non-witness input hashes the whole transaction, which the standard
+     * transaction size keeps to a bounded cost.
+     */
+    bool CreateBatchTransaction(const std::vector<CRecipient>& vecSend, CTransactionRef& tx, CReserveKey& reservekey, CAmount& nFeeRet,
+                                std::string& strFailReason, const CCoinControl& coin_control);
     bool CommitTransaction(CTransactionRef tx, mapValue_t mapValue, std::vector<std::pair<std::string, std::string>> orderForm, std::string fromAccount, CReserveKey& reservekey, CConnman* connman, CValidationState& state);
 
     void ListAccountCreditDebit(const std::string& strAccount, std::list<CAccountingEntry>& entries);
@@ -18,6 +18,8 @@
 #include <wallet/wallet.h>
 
 #include <atomic>
+#include <deque>
+#include <future>
 
 #include <boost/thread.hpp>
 
@@ -188,8 +190,7 @@ void WalletBatch::ListAccountCreditDebit(const std::string& strAccount, std::lis
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = m_batch.GetCursor();
-    if (!pcursor)
+    if (!m_batch.StartCursor())
         throw std::runtime_error(std::string(__func__) + ": cannot create DB cursor");
     bool setRange = true;
     while (true)
@@ -199,13 +200,13 @@ void WalletBatch::ListAccountCreditDebit(const std::string& strAccount, std::lis
         if (setRange)
             ssKey << std::make_pair(std::string("acentry"), std::make_pair((fAllAccounts ? std::string("") : strAccount), uint64_t(0)));
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        int ret = m_batch.ReadAtCursor(pcursor, ssKey, ssValue, setRange);
+        int ret = m_batch.ReadAtCursor(ssKey, ssValue, setRange);
         setRange = false;
         if (ret == DB_NOTFOUND)
             break;
         else if (ret != 0)
         {
-            pcursor->close();
+            m_batch.CloseCursor();
             throw std::runtime_error(std::string(__func__) + ": error scanning DB");
         }
 
@@ -224,7 +225,7 @@ void WalletBatch::ListAccountCreditDebit(const std::string& strAccount, std::lis
         entries.push_back(acentry);
     }
 
-    pcursor->close();
+    m_batch.CloseCursor();
 }
 
 class CWalletScanState {
@@ -247,6 +248,114 @@ public:
     }
 };
 
+/**
+ * Deserialize and check a "tx" record. This doesn't touch the wallet, so
+ * LoadWallet runs it on its decoding threads.
+ */
+static bool DecodeWalletTx(CDataStream& ssKey, CDataStream& ssValue, uint256& hash, CWalletTx& wtx, bool& fUpgraded, std::string& strErr)
+{
+    ssKey >> hash;
+    ssValue >> wtx;
+    CValidationState state;
+    if (!(CheckTransaction(*wtx.tx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+        return false;
+
+    // Undo serialize changes in 31600
+    if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
+    {
+        if (!ssValue.empty())
+        {
+            char fTmp;
+            char fUnused;
+            ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
+            strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                               wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = fTmp;
+        }
+        else
+        {
+            strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+            wtx.fTimeReceivedIsTxTime = 0;
+        }
+        fUpgraded = true;
+    }
+    return true;
+}
+
+static void LoadWalletTx(CWallet* pwallet, const uint256& hash, const CWalletTx& wtx, bool fUpgraded, CWalletScanState& wss) EXCLUSIVE_LOCKS_REQUIRED(pwallet->cs_wallet)
+{
+    if (fUpgraded)
+        wss.vWalletUpgrade.push_back(hash);
+
+    if (wtx.nOrderPos == -1)
+        wss.fAnyUnordered = true;
+
+    pwallet->LoadToWallet(wtx);
+}
+
+/**
+ * Deserialize and check a "key" or "wkey" record. Like DecodeWalletTx this
+ * runs on LoadWallet's decoding threads, as checking a key without a stored
+ * hash re-derives its public key.
+ */
+static bool DecodeKey(const std::string& strType, CDataStream& ssKey, CDataStream& ssValue, CPubKey& vchPubKey, CKey& key, std::string& strErr)
+{
+    ssKey >> vchPubKey;
+    if (!vchPubKey.IsValid())
+    {
+        strErr = "Error reading wallet database: CPubKey corrupt";
+        return false;
+    }
+    CPrivKey pkey;
+    uint256 hash;
+
+    if (strType == "key")
+    {
+        ssValue >> pkey;
+    } else {
+        CWalletKey wkey;
+        ssValue >> wkey;
+        pkey = wkey.vchPrivKey;
+    }
+
+    // Old wallets store keys as "key" [pubkey] => [privkey]
+    // ... which was slow for wallets with lots of keys, because the public key is re-derived from the private key
+    // using EC operations as a checksum.
+    // Newer wallets store keys as "key"[pubkey] => [privkey][hash(pubkey,privkey)], which is much faster while
+    // remaining backwards-compatible.
+    try
+    {
+        ssValue >> hash;
+    }
+    catch (...) {}
+
+    bool fSkipCheck = false;
+
+    if (!hash.IsNull())
+    {
+        // hash pubkey/privkey to accelerate wallet load
+        std::vector<unsigned char> vchKey;
+        vchKey.reserve(vchPubKey.size() + pkey.size());
+        vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
+        vchKey.insert(vchKey.end(), pkey.begin(), pkey.end());
+
+        if (Hash(vchKey.begin(), vchKey.end()) != hash)
+        {
+            strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
+            return false;
+        }
+
+        fSkipCheck = true;
+    }
+
+    if (!key.Load(pkey, vchPubKey, fSkipCheck))
+    {
+        strErr = "Error reading wallet database: CPrivKey corrupt";
+        return false;
+    }
+    return true;
+}
+
 static bool
 ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
              CWalletScanState &wss, std::string& strType, std::string& strErr) EXCLUSIVE_LOCKS_REQUIRED(pwallet->cs_wallet)
@@ -271,37 +380,11 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         else if (strType == "tx")
         {
             uint256 hash;
-            ssKey >> hash;
             CWalletTx wtx(nullptr /* pwallet */, MakeTransactionRef());
-            ssValue >> wtx;
-            CValidationState state;
-            if (!(CheckTransaction(*wtx.tx, state) && (wtx.GetHash() == hash) && state.IsValid()))
+            bool fUpgraded = false;
+            if (!DecodeWalletTx(ssKey, ssValue, hash, wtx, fUpgraded, strErr))
                 return false;
-
-            // Undo serialize changes in 31600
-            if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
-            {
-                if (!ssValue.empty())
-                {
-                    char fTmp;
-                    char fUnused;
-                    ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = fTmp;
-                }
-                else
-                {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
-                    wtx.fTimeReceivedIsTxTime = 0;
-                }
-                wss.vWalletUpgrade.push_back(hash);
-            }
-
-            if (wtx.nOrderPos == -1)
-                wss.fAnyUnordered = true;
-
-            pwallet->LoadToWallet(wtx);
+            LoadWalletTx(pwallet, hash, wtx, fUpgraded, wss);
         }
         else if (strType == "acentry")
         {
@@ -333,62 +416,12 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
         }
         else if (strType == "key" || strType == "wkey")
         {
-            CPubKey vchPubKey;
-            ssKey >> vchPubKey;
-            if (!vchPubKey.IsValid())
-            {
-                strErr = "Error reading wallet database: CPubKey corrupt";
-                return false;
-            }
-            CKey key;
-            CPrivKey pkey;
-            uint256 hash;
-
             if (strType == "key")
-            {
                 wss.nKeys++;
-                ssValue >> pkey;
-            } else {
-                CWalletKey wkey;
-                ssValue >> wkey;
-                pkey = wkey.vchPrivKey;
-            }
-
-            // Old wallets store keys as "key" [pubkey] => [privkey]
-            // ... which was slow for wallets with lots of keys, because the public key is re-derived from the private key
-            // using EC operations as a checksum.
-            // Newer wallets store keys as "key"[pubkey] => [privkey][hash(pubkey,privkey)], which is much faster while
-            // remaining backwards-compatible.
-            try
-            {
-                ssValue >> hash;
-            }
-            catch (...) {}
-
-            bool fSkipCheck = false;
-
-            if (!hash.IsNull())
-            {
-                // hash pubkey/privkey to accelerate wallet load
-                std::vector<unsigned char> vchKey;
-                vchKey.reserve(vchPubKey.size() + pkey.size());
-                vchKey.insert(vchKey.end(), vchPubKey.begin(), vchPubKey.end());
-                vchKey.insert(vchKey.end(), pkey.begin(), pkey.end());
-
-                if (Hash(vchKey.begin(), vchKey.end()) != hash)
-                {
-                    strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
-                    return false;
-                }
-
-                fSkipCheck = true;
-            }
-
-            if (!key.Load(pkey, vchPubKey, fSkipCheck))
-            {
-                strErr = "Error reading wallet database: CPrivKey corrupt";
+            CPubKey vchPubKey;
+            CKey key;
+            if (!DecodeKey(strType, ssKey, ssValue, vchPubKey, key, strErr))
                 return false;
-            }
             if (!pwallet->LoadKey(key, vchPubKey))
             {
                 strErr = "Error reading wallet database: LoadKey failed";
@@ -525,6 +558,60 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
     return true;
 }
 
+namespace {
+/**
+ * A record LoadWallet decodes on its decoding threads. Decoding fills in the
+ * transaction or key; the loading thread then adds it to the wallet.
+ */
+struct WalletLoadRecord
+{
+    CDataStream ssKey;
+    CDataStream ssValue;
+    std::string strType;
+    std::string strErr;
+    bool fDecoded = false;
+    // "tx"
+    uint256 hash;
+    CWalletTx wtx{nullptr /* pwallet */, MakeTransactionRef()};
+    bool fUpgraded = false;
+    // "key" and "wkey"
+    CPubKey vchPubKey;
+    CKey key;
+
+    WalletLoadRecord(CDataStream&& ssKeyIn, CDataStream&& ssValueIn) : ssKey(std::move(ssKeyIn)), ssValue(std::move(ssValueIn)) {}
+};
+
+//! Whether LoadWallet decodes the record with this key on its decoding threads
+bool IsDecodedInParallel(const CDataStream& ssKey)
+{
+    // Compare the serialized record type: a length byte and the type string
+    static const std::string types[] = {std::string("\x02tx"), std::string("\x03key"), std::string("\x04wkey")};
+    for (const std::string& type : types) {
+        if (ssKey.size() >= type.size() && memcmp(ssKey.data(), type.data(), type.size()) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DecodeLoadRecords(std::vector<WalletLoadRecord>::iterator begin, std::vector<WalletLoadRecord>::iterator end)
+{
+    for (auto it = begin; it != end; ++it) {
+        WalletLoadRecord& record = *it;
+        try {
+            record.ssKey >> record.strType;
+            if (record.strType == "tx") {
+                record.fDecoded = DecodeWalletTx(record.ssKey, record.ssValue, record.hash, record.wtx, record.fUpgraded, record.strErr);
+            } else {
+                record.fDecoded = DecodeKey(record.strType, record.ssKey, record.ssValue, record.vchPubKey, record.key, record.strErr);
+            }
+        } catch (...) {
+            record.fDecoded = false;
+        }
+    }
+}
+} // namespace
+
 bool WalletBatch::IsKeyType(const std::string& strType)
 {
     return (strType== "key" || strType == "wkey" ||
@@ -548,30 +635,15 @@ DBErrors WalletBatch::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = m_batch.GetCursor();
-        if (!pcursor)
+        if (!m_batch.StartCursor())
         {
             pwallet->WalletLogPrintf("Error getting wallet database cursor\n");
             return DBErrors::CORRUPT;
         }
 
-        while (true)
-        {
-            // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = m_batch.ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
-                break;
-            else if (ret != 0)
-            {
-                pwallet->WalletLogPrintf("Error reading next record from wallet database\n");
-                return DBErrors::CORRUPT;
-            }
-
+        auto check_record = [&](bool fRead, const std::string& strType, const std::string& strErr) {
             // Try to be tolerant of single corrupt records:
-            std::string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
+            if (!fRead)
             {
                 // losing keys is considered a catastrophic error, anything else
                 // we assume the user can live with:
@@ -590,8 +662,72 @@ DBErrors WalletBatch::LoadWallet(CWallet* pwallet)
             }
             if (!strErr.empty())
                 pwallet->WalletLogPrintf("%s\n", strErr);
+        };
+
+        // Transactions and keys are decoded in chunks on up to
+        // MAX_WALLET_LOAD_THREADS threads while the cursor reads on, and
+        // added to the wallet here in the order they were read. Other records
+        // are cheap to read and are applied as they come.
+        const int nThreads = std::max(1, std::min(GetNumCores(), MAX_WALLET_LOAD_THREADS));
+        std::vector<WalletLoadRecord> chunk;
+        std::deque<std::pair<std::vector<WalletLoadRecord>, std::vector<std::future<void>>>> decoding;
+        auto apply_oldest = [&]() {
+            for (std::future<void>& decoded : decoding.front().second) decoded.get();
+            for (WalletLoadRecord& record : decoding.front().first) {
+                bool fRead = record.fDecoded;
+                if (fRead && record.strType == "tx") {
+                    LoadWalletTx(pwallet, record.hash, record.wtx, record.fUpgraded, wss);
+                } else if (fRead) {
+                    if (record.strType == "key")
+                        wss.nKeys++;
+                    if (!pwallet->LoadKey(record.key, record.vchPubKey)) {
+                        record.strErr = "Error reading wallet database: LoadKey failed";
+                        fRead = false;
+                    }
+                }
+                check_record(fRead, record.strType, record.strErr);
+            }
+            decoding.pop_front();
+        };
+        auto decode_chunk = [&]() {
+            decoding.emplace_back(std::move(chunk), std::vector<std::future<void>>());
+            chunk.clear();
+            std::vector<WalletLoadRecord>& records = decoding.back().first;
+            const size_t nPerThread = (records.size() + nThreads - 1) / nThreads;
+            for (size_t i = 0; i < records.size(); i += nPerThread) {
+                decoding.back().second.push_back(std::async(std::launch::async, DecodeLoadRecords, records.begin() + i, records.begin() + std::min(records.size(), i + nPerThread)));
+            }
+            // Keep one chunk decoding while the next one is read
+            while (decoding.size() > 1) apply_oldest();
+        };
+
+        while (true)
+        {
+            // Read next record
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = m_batch.ReadAtCursor(ssKey, ssValue);
+            if (ret == DB_NOTFOUND)
+                break;
+            else if (ret != 0)
+            {
+                pwallet->WalletLogPrintf("Error reading next record from wallet database\n");
+                return DBErrors::CORRUPT;
+            }
+
+            if (IsDecodedInParallel(ssKey)) {
+                chunk.emplace_back(std::move(ssKey), std::move(ssValue));
+                if (chunk.size() >= (size_t)WALLET_LOAD_CHUNK_RECORDS) decode_chunk();
+                continue;
+            }
+
+            std::string strType, strErr;
+            bool fRead = ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr);
+            check_record(fRead, strType, strErr);
         }
-        pcursor->close();
+        m_batch.CloseCursor();
+        if (!chunk.empty()) decode_chunk();
+        while (!decoding.empty()) apply_oldest();
     }
     catch (const boost::thread_interrupted&) {
         throw;
@@ -652,8 +788,7 @@ DBErrors WalletBatch::FindWalletTx(std::vector<uint256>& vTxHash, std::vector<CW
         }
 
         // Get cursor
-        Dbc* pcursor = m_batch.GetCursor();
-        if (!pcursor)
+        if (!m_batch.StartCursor())
         {
             LogPrintf("Error getting wallet database cursor\n");
             return DBErrors::CORRUPT;
@@ -664,7 +799,7 @@ DBErrors WalletBatch::FindWalletTx(std::vector<uint256>& vTxHash, std::vector<CW
             // Read next record
             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
             CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = m_batch.ReadAtCursor(pcursor, ssKey, ssValue);
+            int ret = m_batch.ReadAtCursor(ssKey, ssValue);
             if (ret == DB_NOTFOUND)
                 break;
             else if (ret != 0)
@@ -686,7 +821,7 @@ DBErrors WalletBatch::FindWalletTx(std::vector<uint256>& vTxHash, std::vector<CW
                 vWtx.push_back(wtx);
             }
         }
-        pcursor->close();
+        m_batch.CloseCursor();
     }
     catch (const boost::thread_interrupted&) {
         throw;
@@ -831,6 +966,11 @@ bool WalletBatch::VerifyDatabaseFile(const fs::path& wallet_path, std::string& w
     return BerkeleyBatch::VerifyDatabaseFile(wallet_path, warningStr, errorStr, WalletBatch::Recover);
 }
 
+bool WalletBatch::MigrateToLog(const fs::path& wallet_path, std::string& out_backup_filename, std::string& errorStr)
+{
+    return BerkeleyBatch::MigrateToLog(wallet_path, out_backup_filename, errorStr);
+}
+
 bool WalletBatch::WriteDestData(const std::string &address, const std::string &key, const std::string &value)
 {
     return WriteIC(std::make_pair(std::string("destdata"), std::make_pair(address, key)), value);
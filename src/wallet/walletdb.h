@@ -31,6 +31,10 @@
  */
 
 static const bool DEFAULT_FLUSHWALLET = true;
+//! Number of transaction and key records WalletBatch::LoadWallet decodes as one chunk
+static const int WALLET_LOAD_CHUNK_RECORDS = 1024;
+//! Maximum number of threads decoding transaction and key records during WalletBatch::LoadWallet
+static const int MAX_WALLET_LOAD_THREADS = 4;
 
 class CAccount;
 class CAccountingEntry;
@@ -231,6 +235,8 @@ public:
     static bool VerifyEnvironment(const fs::path& wallet_path, std::string& errorStr);
     /* verifies the database file */
     static bool VerifyDatabaseFile(const fs::path& wallet_path, std::string& warningStr, std::string& errorStr);
+    /* replaces a BerkeleyDB wallet file with a log database (-walletlogdb) */
+    static bool MigrateToLog(const fs::path& wallet_path, std::string& out_backup_filename, std::string& errorStr);
 
     //! write the hdchain model (external chain child index counter)
     bool WriteHDChain(const CHDChain& chain);
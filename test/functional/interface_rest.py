@@ -274,6 +274,11 @@ class RESTTest (BitcoinTestFramework):
             assert_equal(json_obj[tx]['spentby'], txs[i + 1:i + 2])
             assert_equal(json_obj[tx]['depends'], txs[i - 1:i])
 
+        # The binary format starts with the number of entries, followed by the first txid
+        bin_response = self.test_rest_request("/mempool/contents", req_type=ReqType.BIN, ret_type=RetType.BYTES)
+        assert_equal(bin_response[0], len(txs))
+        assert bin_response[1:33][::-1].hex() in txs
+
         # Now mine the transactions
         newblockhash = self.nodes[1].generate(1)
         self.sync_all()
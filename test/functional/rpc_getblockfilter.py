@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+# Copyright (c) 2018 The Bitcoin Core developers
+# Copyright (c) 2018 The XPChain Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""Test the getblockfilter RPC and the /rest/blockfilter/ endpoint."""
+
+from test_framework.messages import ser_string
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import (
+    assert_equal, assert_is_hex_string, assert_raises_rpc_error,
+    connect_nodes, disconnect_nodes, sync_blocks
+)
+
+from http.client import HTTPConnection
+import json
+from urllib.parse import urlparse
+
+# Any regtest address will do: no wallet is needed to mine to it.
+MINING_ADDRESS = "ckdEqREjyiXYHvcNjhZgQdHHegAdXXtsx5"
+FILTER_TYPES = ["basic"]
+
+class GetBlockFilterTest(BitcoinTestFramework):
+    def set_test_params(self):
+        self.setup_clean_chain = True
+        self.num_nodes = 2
+        self.extra_args = [["-blockfilterindex", "-rest"], []]
+
+    def run_test(self):
+        # Create two chains by disconnecting nodes 0 & 1, mining, then reconnecting
+        disconnect_nodes(self.nodes[0], 1)
+
+        self.nodes[0].generatetoaddress(3, MINING_ADDRESS)
+        self.nodes[1].generatetoaddress(4, MINING_ADDRESS)
+
+        assert_equal(self.nodes[0].getblockcount(), 3)
+        chain0_hashes = [self.nodes[0].getblockhash(block_height) for block_height in range(4)]
+
+        # Reorg node 0 to a new chain
+        connect_nodes(self.nodes[0], 1)
+        sync_blocks(self.nodes)
+
+        assert_equal(self.nodes[0].getblockcount(), 4)
+        chain1_hashes = [self.nodes[0].getblockhash(block_height) for block_height in range(4)]
+
+        # Test getblockfilter returns a filter for all blocks and filter types on active chain
+        for block_hash in chain1_hashes:
+            for filter_type in FILTER_TYPES:
+                result = self.nodes[0].getblockfilter(block_hash, filter_type)
+                assert_is_hex_string(result['filter'])
+
+        # Test getblockfilter returns a filter for all blocks and filter types on stale chain
+        for block_hash in chain0_hashes:
+            for filter_type in FILTER_TYPES:
+                result = self.nodes[0].getblockfilter(block_hash, filter_type)
+                assert_is_hex_string(result['filter'])
+
+        # Test getblockfilter with unknown block
+        bad_block_hash = "0123456789abcdef" * 4
+        assert_raises_rpc_error(-5, "Block not found", self.nodes[0].getblockfilter, bad_block_hash, "basic")
+
+        # Test getblockfilter with undefined filter type
+        genesis_hash = self.nodes[0].getblockhash(0)
+        assert_raises_rpc_error(-5, "Unknown filtertype", self.nodes[0].getblockfilter, genesis_hash, "unknown")
+
+        # Test getblockfilter without the index
+        assert_raises_rpc_error(-1, "Index is not enabled for filtertype basic", self.nodes[1].getblockfilter, genesis_hash)
+
+        # Test that REST returns the same filter and header as the RPC in
+        # every format. The binary one is the cfilter payload followed by the
+        # filter header.
+        url = urlparse(self.nodes[0].url)
+        conn = HTTPConnection(url.hostname, url.port)
+        for block_hash in chain1_hashes:
+            result = self.nodes[0].getblockfilter(block_hash)
+            expected = (bytes([0]) + bytes.fromhex(block_hash)[::-1] + ser_string(bytes.fromhex(result['filter'])) +
+                        bytes.fromhex(result['header'])[::-1])
+
+            conn.request('GET', '/rest/blockfilter/basic/{}.json'.format(block_hash))
+            response = conn.getresponse()
+            assert_equal(response.status, 200)
+            assert_equal(json.loads(response.read().decode('utf-8')), result)
+
+            conn.request('GET', '/rest/blockfilter/basic/{}.bin'.format(block_hash))
+            response = conn.getresponse()
+            assert_equal(response.status, 200)
+            assert_equal(response.read(), expected)
+
+            conn.request('GET', '/rest/blockfilter/basic/{}.hex'.format(block_hash))
+            response = conn.getresponse()
+            assert_equal(response.status, 200)
+            assert_equal(response.read().decode('utf-8'), expected.hex() + "\n")
+        conn.close()
+
+if __name__ == '__main__':
+    GetBlockFilterTest().main()
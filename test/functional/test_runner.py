@@ -106,9 +106,12 @@ BASE_SCRIPTS = [
     'feature_proxy.py',
     'rpc_signrawtransaction.py',
     'wallet_groups.py',
+    'wallet_sendpayouts.py',
+    'wallet_planstakeoutputs.py',
     'p2p_disconnect_ban.py',
     'rpc_decodescript.py',
     'rpc_blockchain.py',
+    'rpc_getblockfilter.py',
     'rpc_deprecated.py',
     'wallet_disable.py',
     'rpc_net.py',
@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+# Copyright (c) 2018 The XPChain Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""Test the planstakeoutputs RPC."""
+
+from decimal import Decimal
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import (
+    assert_equal,
+    assert_raises_rpc_error,
+)
+
+# Height of the last proof-of-work block on regtest
+SWITCH_HEIGHT = 1680
+
+class PlanStakeOutputsTest(BitcoinTestFramework):
+    def set_test_params(self):
+        self.setup_clean_chain = True
+        self.num_nodes = 2
+
+    def run_test(self):
+        self.nodes[0].generate(101)
+        self.sync_all()
+        assert_raises_rpc_error(-1, "Proof-of-stake is not active for the next block", self.nodes[1].planstakeoutputs)
+
+        # One large output to split and small ones to merge, confirmed by the
+        # last proof-of-work blocks
+        address_split = self.nodes[1].getnewaddress()
+        address_merge = self.nodes[1].getnewaddress()
+        self.nodes[0].sendtoaddress(address_split, 23)
+        for i in range(10):
+            self.nodes[0].sendtoaddress(address_merge, 1)
+        self.nodes[0].generate(SWITCH_HEIGHT - 101)
+        self.sync_all()
+
+        options = {"targetAmount": 5, "minimumAmount": 2.5, "maximumAmount": 10}
+        plan = self.nodes[1].planstakeoutputs(False, options)
+        assert_equal(plan["targetamount"], Decimal("5"))
+        assert_equal(plan["outputs"], 11)
+        assert_equal(plan["plannedoutputs"], 7)
+        assert_equal(len(plan["transactions"]), 3)
+        assert all("txid" not in entry for entry in plan["transactions"])
+        assert_equal(self.nodes[1].getrawmempool(), [])
+
+        result = self.nodes[1].planstakeoutputs(True, options)
+        assert_equal(len(result["transactions"]), 3)
+        for entry in result["transactions"]:
+            assert "error" not in entry
+            tx = self.nodes[1].decoderawtransaction(self.nodes[1].gettransaction(entry["txid"])["hex"])
+            assert_equal(len(tx["vin"]), entry["inputs"])
+            assert_equal(len(tx["vout"]), entry["outputs"])
+            values = sorted(out["value"] for out in tx["vout"])
+            if entry["type"] == "split":
+                # Outputs of the target amount and one with the rest, less the fee
+                assert_equal(entry["address"], address_split)
+                assert_equal(entry["amount"], Decimal("23"))
+                assert_equal(values[1:], [Decimal("5")] * 4)
+                assert Decimal("2.99") < values[0] < Decimal("3")
+            else:
+                assert_equal(entry["address"], address_merge)
+                assert_equal(entry["amount"], Decimal("5"))
+                assert Decimal("4.99") < values[0] < Decimal("5")
+        assert_equal(sorted(self.nodes[1].getrawmempool()), sorted(entry["txid"] for entry in result["transactions"]))
+
+        # Only the reshaped outputs, still unconfirmed, are left
+        assert_equal(self.nodes[1].planstakeoutputs(False, options)["outputs"], 0)
+
+if __name__ == '__main__':
+    PlanStakeOutputsTest().main()
@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+# Copyright (c) 2018 The XPChain Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""Test the sendpayouts RPC."""
+
+from decimal import Decimal
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import (
+    assert_equal,
+    assert_raises_rpc_error,
+)
+
+class SendPayoutsTest(BitcoinTestFramework):
+    def set_test_params(self):
+        self.setup_clean_chain = True
+        self.num_nodes = 2
+
+    def payouts(self, node, count, amount):
+        return [{"address": node.getnewaddress(), "amount": amount} for i in range(count)]
+
+    def run_test(self):
+        self.nodes[0].generate(101)
+        self.sync_all()
+
+        assert_raises_rpc_error(-8, "payouts must not be empty", self.nodes[0].sendpayouts, [])
+        assert_raises_rpc_error(-8, "maximumOutputs must be at least 1", self.nodes[0].sendpayouts, self.payouts(self.nodes[1], 1, 100), {"maximumOutputs": 0})
+
+        # The payouts are split into transactions of at most maximumOutputs
+        # payouts, in order
+        payouts = self.payouts(self.nodes[1], 5, 100)
+        result = self.nodes[0].sendpayouts(payouts, {"maximumOutputs": 2})
+        assert_equal(result["paid"], 5)
+        assert "error" not in result
+        assert_equal(len(result["txids"]), 3)
+        paid = []
+        for txid, count in zip(result["txids"], [2, 2, 1]):
+            tx = self.nodes[0].getrawtransaction(txid, True)
+            addresses = [out["scriptPubKey"]["addresses"][0] for out in tx["vout"] if out["value"] == Decimal("100")]
+            assert_equal(len(addresses), count)
+            paid.append(sorted(addresses))
+        assert_equal(paid, [sorted(p["address"] for p in payouts[i:i + 2]) for i in range(0, 5, 2)])
+        fee = sum(self.nodes[0].gettransaction(txid)["fee"] for txid in result["txids"])
+        assert_equal(result["fee"], -fee)
+
+        self.nodes[0].generate(1)
+        self.sync_all()
+        assert_equal(self.nodes[1].getbalance(), 500)
+
+        # A wallet holding only non-witness coins pays them in one transaction
+        self.nodes[0].sendtoaddress(self.nodes[1].getnewaddress("", "legacy"), 100000)
+        self.nodes[0].generate(1)
+        self.sync_all()
+        self.nodes[1].sendtoaddress(self.nodes[1].getnewaddress("", "legacy"), self.nodes[1].getbalance(), "", "", True)
+        self.nodes[1].generate(1)
+        self.sync_all()
+        result = self.nodes[1].sendpayouts(self.payouts(self.nodes[0], 150, 10))
+        assert_equal(result["paid"], 150)
+        assert_equal(len(result["txids"]), 1)
+        assert_equal(len(self.nodes[1].getrawtransaction(result["txids"][0], True)["vout"]), 151)
+
+        # Payouts left unpaid after a transaction was sent are returned
+        balance = self.nodes[1].getbalance()
+        payouts = [{"address": self.nodes[0].getnewaddress(), "amount": 1},
+                   {"address": self.nodes[0].getnewaddress(), "amount": balance - 1}]
+        result = self.nodes[1].sendpayouts(payouts, {"maximumOutputs": 1})
+        assert_equal(result["paid"], 1)
+        assert_equal(len(result["txids"]), 1)
+        assert_equal(result["error"], "Insufficient funds")
+        assert_equal(result["unpaid"], payouts[1:])
+
+if __name__ == '__main__':
+    SendPayoutsTest().main()